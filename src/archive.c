@@ -0,0 +1,608 @@
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+
+#ifdef HAVE_ZLIB_H
+#include <zlib.h>
+#endif
+
+#include "archive.h"
+#include "log.h"
+#include "util.h"
+
+/* Zip archives end with a central directory listing every member, so their
+ * members can be searched independently of each other. Tar archives are a
+ * header before each member, and are read in order.
+ *
+ * https://pkware.cachefly.net/webdocs/casestudies/APPNOTE.TXT
+ * https://www.gnu.org/software/tar/manual/html_node/Standard.html */
+
+#define ZIP_LOCAL_HEADER_SIG 0x04034b50
+#define ZIP_CENTRAL_HEADER_SIG 0x02014b50
+#define ZIP_END_SIG 0x06054b50
+#define ZIP64_END_SIG 0x06064b50
+#define ZIP64_LOCATOR_SIG 0x07064b50
+#define ZIP_LOCAL_HEADER_SIZE 30
+#define ZIP_CENTRAL_HEADER_SIZE 46
+#define ZIP_END_SIZE 22
+#define ZIP64_END_SIZE 56
+#define ZIP64_LOCATOR_SIZE 20
+
+#define ZIP_METHOD_STORED 0
+#define ZIP_METHOD_DEFLATED 8
+
+/* Members are read into memory whole, so bigger ones are skipped */
+#define ZIP_MAX_MEMBER_SIZE (1024 * 1024 * 1024)
+/* Deflate can't shrink anything more than this */
+#define ZIP_MAX_DEFLATE_RATIO 1032
+
+/* GNU long names and pax headers bigger than this are skipped */
+#define TAR_MAX_HEADER_DATA (1024 * 1024)
+
+static const char *archive_extensions[] = {
+    ".zip",
+    ".jar",
+    ".war",
+    ".ear",
+    ".tar",
+    ".tgz",
+    ".tbz",
+    ".tbz2",
+    ".txz",
+    ".tzst",
+    ".tar.gz",
+    ".tar.xz",
+    ".tar.bz2",
+    ".tar.zst",
+    NULL
+};
+
+static uint16_t le16(const unsigned char *p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t le32(const unsigned char *p) {
+    return (uint32_t)le16(p) | ((uint32_t)le16(p + 2) << 16);
+}
+
+static uint64_t le64(const unsigned char *p) {
+    return (uint64_t)le32(p) | ((uint64_t)le32(p + 4) << 32);
+}
+
+int is_archive_name(const char *path) {
+    size_t path_len = strlen(path);
+    const char *ext;
+    size_t ext_len;
+    size_t i, j;
+
+    for (i = 0; archive_extensions[i] != NULL; i++) {
+        ext = archive_extensions[i];
+        ext_len = strlen(ext);
+        if (path_len <= ext_len) {
+            continue;
+        }
+        for (j = 0; j < ext_len && tolower((unsigned char)path[path_len - ext_len + j]) == ext[j]; j++) {
+        }
+        if (j == ext_len) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/* Finds the end of central directory record, which is followed by a
+ * comment of up to 64KB */
+static int zip_find_end(const unsigned char *buf, const size_t buf_len, size_t *end) {
+    size_t pos;
+
+    if (buf_len < ZIP_END_SIZE) {
+        return FALSE;
+    }
+    for (pos = buf_len - ZIP_END_SIZE; buf_len - pos <= ZIP_END_SIZE + 0xFFFF; pos--) {
+        if (le32(buf + pos) == ZIP_END_SIG && pos + ZIP_END_SIZE + le16(buf + pos + 20) <= buf_len) {
+            *end = pos;
+            return TRUE;
+        }
+        if (pos == 0) {
+            break;
+        }
+    }
+    return FALSE;
+}
+
+zip_member_t **zip_members(const char *buf_, const size_t buf_len, const char *path, size_t *members_len) {
+    const unsigned char *buf = (const unsigned char *)buf_;
+    const unsigned char *entry;
+    const unsigned char *extra;
+    zip_member_t **members;
+    zip_member_t *member;
+    size_t end;
+    size_t pos;
+    size_t cd_end;
+    size_t entry_len;
+    size_t name_len;
+    size_t extra_len;
+    size_t field_len;
+    size_t i;
+    uint64_t entries;
+    uint64_t cd_size;
+    uint64_t cd_offset;
+    uint64_t end64;
+    uint64_t compressed_size;
+    uint64_t size;
+    uint64_t header_offset;
+    uint64_t n;
+    int flags;
+    int method;
+
+    *members_len = 0;
+    if (!zip_find_end(buf, buf_len, &end)) {
+        log_err("Skipping %s: Can't find the zip central directory", path);
+        return NULL;
+    }
+    entries = le16(buf + end + 10);
+    cd_size = le32(buf + end + 12);
+    cd_offset = le32(buf + end + 16);
+
+    /* Fields that don't fit are in the zip64 end record */
+    if ((entries == 0xFFFF || cd_size == 0xFFFFFFFF || cd_offset == 0xFFFFFFFF) &&
+        end >= ZIP64_LOCATOR_SIZE && le32(buf + end - ZIP64_LOCATOR_SIZE) == ZIP64_LOCATOR_SIG) {
+        end64 = le64(buf + end - ZIP64_LOCATOR_SIZE + 8);
+        if (buf_len >= ZIP64_END_SIZE && end64 <= buf_len - ZIP64_END_SIZE && le32(buf + end64) == ZIP64_END_SIG) {
+            entries = le64(buf + end64 + 32);
+            cd_size = le64(buf + end64 + 40);
+            cd_offset = le64(buf + end64 + 48);
+        }
+    }
+    if (cd_offset > buf_len || cd_size > buf_len - cd_offset) {
+        log_err("Skipping %s: Bad zip central directory", path);
+        return NULL;
+    }
+
+    members = ag_malloc(sizeof(zip_member_t *));
+    pos = cd_offset;
+    cd_end = cd_offset + cd_size;
+    for (n = 0; n < entries; n++) {
+        entry = buf + pos;
+        if (cd_end - pos < ZIP_CENTRAL_HEADER_SIZE || le32(entry) != ZIP_CENTRAL_HEADER_SIG) {
+            log_err("Skipping the rest of %s: Bad zip central directory", path);
+            break;
+        }
+        flags = le16(entry + 8);
+        method = le16(entry + 10);
+        compressed_size = le32(entry + 20);
+        size = le32(entry + 24);
+        name_len = le16(entry + 28);
+        extra_len = le16(entry + 30);
+        header_offset = le32(entry + 42);
+        entry_len = ZIP_CENTRAL_HEADER_SIZE + name_len + extra_len + le16(entry + 32);
+        if (entry_len > cd_end - pos) {
+            log_err("Skipping the rest of %s: Bad zip central directory", path);
+            break;
+        }
+        pos += entry_len;
+
+        /* The zip64 extra field has whichever of these didn't fit, in
+         * this order */
+        extra = entry + ZIP_CENTRAL_HEADER_SIZE + name_len;
+        for (i = 0; i + 4 <= extra_len; i += 4 + field_len) {
+            field_len = le16(extra + i + 2);
+            if (i + 4 + field_len > extra_len) {
+                break;
+            }
+            if (le16(extra + i) == 0x0001) {
+                const unsigned char *field = extra + i + 4;
+                const unsigned char *field_end = field + field_len;
+                if (size == 0xFFFFFFFF && field + 8 <= field_end) {
+                    size = le64(field);
+                    field += 8;
+                }
+                if (compressed_size == 0xFFFFFFFF && field + 8 <= field_end) {
+                    compressed_size = le64(field);
+                    field += 8;
+                }
+                if (header_offset == 0xFFFFFFFF && field + 8 <= field_end) {
+                    header_offset = le64(field);
+                }
+            }
+        }
+
+        if (name_len == 0 || entry[ZIP_CENTRAL_HEADER_SIZE + name_len - 1] == '/' || size == 0) {
+            /* Directories and empty files */
+            continue;
+        }
+        if (flags & 0x01) {
+            log_debug("Skipping %s:%.*s: It's encrypted", path, (int)name_len, entry + ZIP_CENTRAL_HEADER_SIZE);
+            continue;
+        }
+#ifdef HAVE_ZLIB_H
+        if (method != ZIP_METHOD_STORED && method != ZIP_METHOD_DEFLATED) {
+#else
+        if (method != ZIP_METHOD_STORED) {
+#endif
+            log_debug("Skipping %s:%.*s: Compression method %i isn't supported", path, (int)name_len,
+                      entry + ZIP_CENTRAL_HEADER_SIZE, method);
+            continue;
+        }
+        /* The sizes come from the archive, so check them before anything
+         * is allocated for them */
+        if (header_offset > buf_len || compressed_size > buf_len - header_offset ||
+            (method == ZIP_METHOD_STORED && size != compressed_size) ||
+            (method == ZIP_METHOD_DEFLATED && size / ZIP_MAX_DEFLATE_RATIO > compressed_size)) {
+            log_err("Skipping %s:%.*s: Bad zip member size", path, (int)name_len, entry + ZIP_CENTRAL_HEADER_SIZE);
+            continue;
+        }
+        if (size > ZIP_MAX_MEMBER_SIZE) {
+            log_err("Skipping %s:%.*s: It's too big", path, (int)name_len, entry + ZIP_CENTRAL_HEADER_SIZE);
+            continue;
+        }
+
+        member = ag_malloc(sizeof(zip_member_t));
+        member->archive_path = ag_strdup(path);
+        member->name = ag_strndup((const char *)entry + ZIP_CENTRAL_HEADER_SIZE, name_len);
+        member->header_offset = header_offset;
+        member->compressed_size = compressed_size;
+        member->size = size;
+        member->method = method;
+        members = ag_realloc(members, (*members_len + 1) * sizeof(zip_member_t *));
+        members[(*members_len)++] = member;
+    }
+
+    log_debug("%s has %lu zip members to search", path, (unsigned long)*members_len);
+    return members;
+}
+
+void zip_member_free(zip_member_t *member) {
+    free(member->archive_path);
+    free(member->name);
+    free(member);
+}
+
+static int pread_all(int fd, void *buf, size_t len, uint64_t offset) {
+    ssize_t bytes_read;
+
+    while (len > 0) {
+        bytes_read = pread(fd, buf, len, (off_t)offset);
+        if (bytes_read <= 0) {
+            return FALSE;
+        }
+        buf = (char *)buf + bytes_read;
+        len -= bytes_read;
+        offset += bytes_read;
+    }
+    return TRUE;
+}
+
+#ifdef HAVE_ZLIB_H
+static int zip_inflate(unsigned char *in, const size_t in_len, char *out, const size_t out_len) {
+    z_stream stream;
+    size_t in_pos = 0;
+    size_t out_pos = 0;
+    int ret;
+
+    memset(&stream, 0, sizeof(stream));
+    /* Raw deflate, without a zlib or gzip wrapper */
+    if (inflateInit2(&stream, -MAX_WBITS) != Z_OK) {
+        return FALSE;
+    }
+    do {
+        stream.next_in = in + in_pos;
+        stream.avail_in = (uInt)ag_min(in_len - in_pos, UINT_MAX);
+        stream.next_out = (Bytef *)out + out_pos;
+        stream.avail_out = (uInt)ag_min(out_len - out_pos, UINT_MAX);
+        ret = inflate(&stream, Z_NO_FLUSH);
+        in_pos = stream.next_in - in;
+        out_pos = (char *)stream.next_out - out;
+    } while (ret == Z_OK && out_pos < out_len && in_pos < in_len);
+    inflateEnd(&stream);
+
+    return ret == Z_STREAM_END && out_pos == out_len;
+}
+#endif
+
+char *zip_member_read(const zip_member_t *member, size_t *len) {
+    unsigned char header[ZIP_LOCAL_HEADER_SIZE];
+    unsigned char *in = NULL;
+    char *out = NULL;
+    uint64_t data_offset;
+    int fd;
+    int ok = FALSE;
+
+    fd = open(member->archive_path, O_RDONLY);
+    if (fd < 0) {
+        log_err("Skipping %s:%s: Error opening file: %s", member->archive_path, member->name, strerror(errno));
+        return NULL;
+    }
+    /* The local header's name and extra field can differ from the central
+     * directory's */
+    if (!pread_all(fd, header, sizeof(header), member->header_offset) || le32(header) != ZIP_LOCAL_HEADER_SIG) {
+        log_err("Skipping %s:%s: Bad zip local header", member->archive_path, member->name);
+        goto cleanup;
+    }
+    if (member->size >= SIZE_MAX || member->compressed_size >= SIZE_MAX) {
+        log_err("Skipping %s:%s: It's too big", member->archive_path, member->name);
+        goto cleanup;
+    }
+    data_offset = member->header_offset + ZIP_LOCAL_HEADER_SIZE + le16(header + 26) + le16(header + 28);
+
+    out = ag_malloc(member->size + 1);
+    if (member->method == ZIP_METHOD_STORED) {
+        ok = member->compressed_size == member->size && pread_all(fd, out, member->size, data_offset);
+    }
+#ifdef HAVE_ZLIB_H
+    else {
+        in = ag_malloc(member->compressed_size + 1);
+        ok = pread_all(fd, in, member->compressed_size, data_offset) &&
+             zip_inflate(in, member->compressed_size, out, member->size);
+    }
+#endif
+    if (!ok) {
+        log_err("Skipping %s:%s: Error reading zip member", member->archive_path, member->name);
+        free(out);
+        out = NULL;
+    }
+    *len = member->size;
+
+cleanup:
+    free(in);
+    close(fd);
+    return out;
+}
+
+static int tar_number(const unsigned char *field, const size_t len, uint64_t *value) {
+    size_t i = 0;
+
+    *value = 0;
+    /* GNU tar writes big numbers in base 256, flagged by the high bit */
+    if (field[0] & 0x80) {
+        *value = field[0] & 0x7F;
+        for (i = 1; i < len; i++) {
+            if (*value >> 56) {
+                return FALSE;
+            }
+            *value = (*value << 8) | field[i];
+        }
+        return TRUE;
+    }
+    while (i < len && field[i] == ' ') {
+        i++;
+    }
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; i++) {
+        *value = *value * 8 + (field[i] - '0');
+    }
+    return TRUE;
+}
+
+int is_tar_header(const void *block_, const size_t len) {
+    const unsigned char *block = block_;
+    uint64_t checksum;
+    uint64_t sum = 0;
+    size_t i;
+
+    if (len < TAR_BLOCK_SIZE || memcmp(block + 257, "ustar", 5) != 0) {
+        return FALSE;
+    }
+    /* The checksum counts its own field as spaces */
+    for (i = 0; i < TAR_BLOCK_SIZE; i++) {
+        sum += (i >= 148 && i < 156) ? ' ' : block[i];
+    }
+    return tar_number(block + 148, 8, &checksum) && checksum == sum;
+}
+
+#if HAVE_FOPENCOOKIE
+struct tar_reader {
+    FILE *stream;
+    const char *path;
+    unsigned char head[TAR_BLOCK_SIZE];
+    int head_unread;
+    char *name;
+    char *long_name; /* For the next entry, from a GNU long name or pax header */
+    uint64_t left;   /* Of the current member */
+    uint64_t padding;
+};
+
+static cookie_read_function_t tar_member_read;
+static cookie_close_function_t tar_member_close;
+
+static const cookie_io_functions_t tar_member_io = {
+    .read = tar_member_read,
+    .write = NULL,
+    .seek = NULL,
+    .close = tar_member_close,
+};
+
+tar_reader_t *tar_open(FILE *stream, const char *path, const void *head) {
+    tar_reader_t *tar = ag_calloc(1, sizeof(tar_reader_t));
+    tar->stream = stream;
+    tar->path = path;
+    memcpy(tar->head, head, TAR_BLOCK_SIZE);
+    tar->head_unread = TRUE;
+    return tar;
+}
+
+static int tar_skip(tar_reader_t *tar, uint64_t len) {
+    char scratch[16 * 1024];
+    size_t n;
+
+    while (len > 0) {
+        n = len < sizeof(scratch) ? (size_t)len : sizeof(scratch);
+        if (fread(scratch, 1, n, tar->stream) != n) {
+            return FALSE;
+        }
+        len -= n;
+    }
+    return TRUE;
+}
+
+/* Reads the data of a GNU long name or pax header entry */
+static char *tar_read_header_data(tar_reader_t *tar, const uint64_t size, const uint64_t padding) {
+    char *data;
+
+    if (size > TAR_MAX_HEADER_DATA) {
+        return tar_skip(tar, size + padding) ? ag_strdup("") : NULL;
+    }
+    data = ag_malloc(size + 1);
+    if (fread(data, 1, size, tar->stream) != size || !tar_skip(tar, padding)) {
+        free(data);
+        return NULL;
+    }
+    data[size] = '\0';
+    return data;
+}
+
+/* Pax records are "<length> <key>=<value>\n" */
+static char *pax_path(const char *data, const size_t len) {
+    size_t pos = 0;
+    size_t record_len;
+    const char *key;
+    char *end;
+
+    while (pos < len) {
+        record_len = strtoul(data + pos, &end, 10);
+        if (end == data + pos || *end != ' ' || record_len == 0 || record_len > len - pos) {
+            break;
+        }
+        key = end + 1;
+        if (strncmp(key, "path=", 5) == 0 && data[pos + record_len - 1] == '\n') {
+            return ag_strndup(key + 5, data + pos + record_len - 1 - (key + 5));
+        }
+        pos += record_len;
+    }
+    return NULL;
+}
+
+const char *tar_next(tar_reader_t *tar) {
+    unsigned char block[TAR_BLOCK_SIZE];
+    char *data;
+    uint64_t size;
+    uint64_t padding;
+    size_t n;
+
+    free(tar->name);
+    tar->name = NULL;
+    if (!tar_skip(tar, tar->left + tar->padding)) {
+        goto truncated;
+    }
+    tar->left = 0;
+    tar->padding = 0;
+
+    for (;;) {
+        if (tar->head_unread) {
+            memcpy(block, tar->head, TAR_BLOCK_SIZE);
+            tar->head_unread = FALSE;
+        } else {
+            n = fread(block, 1, TAR_BLOCK_SIZE, tar->stream);
+            if (n == 0 && feof(tar->stream)) {
+                /* Missing the end of archive blocks, but nothing's cut off */
+                return NULL;
+            }
+            if (n != TAR_BLOCK_SIZE) {
+                goto truncated;
+            }
+        }
+        for (n = 0; n < TAR_BLOCK_SIZE && block[n] == 0; n++) {
+        }
+        if (n == TAR_BLOCK_SIZE) {
+            return NULL;
+        }
+        if (!is_tar_header(block, TAR_BLOCK_SIZE) || !tar_number(block + 124, 12, &size)) {
+            log_err("Skipping the rest of %s: Bad tar header", tar->path);
+            return NULL;
+        }
+        padding = (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+
+        switch (block[156]) {
+            case 'L':
+                /* GNU long name */
+                data = tar_read_header_data(tar, size, padding);
+                if (data == NULL) {
+                    goto truncated;
+                }
+                free(tar->long_name);
+                tar->long_name = data;
+                break;
+            case 'x':
+                data = tar_read_header_data(tar, size, padding);
+                if (data == NULL) {
+                    goto truncated;
+                }
+                free(tar->long_name);
+                tar->long_name = pax_path(data, strlen(data));
+                free(data);
+                break;
+            case '0':
+            case '\0':
+            case '7':
+                if (tar->long_name && tar->long_name[0] != '\0') {
+                    tar->name = tar->long_name;
+                    tar->long_name = NULL;
+                } else if (block[345] != '\0') {
+                    /* ustar splits long names into a prefix and a name */
+                    ag_asprintf(&tar->name, "%.155s/%.100s", (const char *)block + 345, (const char *)block);
+                } else {
+                    tar->name = ag_strndup((const char *)block, 100);
+                }
+                free(tar->long_name);
+                tar->long_name = NULL;
+                tar->left = size;
+                tar->padding = padding;
+                return tar->name;
+            default:
+                /* Directories, links, devices, global pax headers... */
+                free(tar->long_name);
+                tar->long_name = NULL;
+                if (!tar_skip(tar, size + padding)) {
+                    goto truncated;
+                }
+                break;
+        }
+    }
+
+truncated:
+    log_err("Skipping the rest of %s: Truncated tar archive", tar->path);
+    return NULL;
+}
+
+static ssize_t tar_member_read(void *cookie, char *buf, size_t size) {
+    tar_reader_t *tar = cookie;
+    size_t bytes_read;
+
+    if (size > tar->left) {
+        size = (size_t)tar->left;
+    }
+    if (size == 0) {
+        return 0;
+    }
+    bytes_read = fread(buf, 1, size, tar->stream);
+    tar->left -= bytes_read;
+    if (bytes_read == 0 && ferror(tar->stream)) {
+        errno = EIO;
+        return -1;
+    }
+    return bytes_read;
+}
+
+static int tar_member_close(void *cookie) {
+    /* The archive's stream stays open for the next member */
+    (void)cookie;
+    return 0;
+}
+
+FILE *tar_member_open(tar_reader_t *tar) {
+    return fopencookie(tar, "r", tar_member_io);
+}
+
+void tar_close(tar_reader_t *tar) {
+    free(tar->name);
+    free(tar->long_name);
+    free(tar);
+}
+#endif
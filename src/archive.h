@@ -0,0 +1,48 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "config.h"
+
+#define TAR_BLOCK_SIZE 512
+
+/* A file in a zip archive, as its central directory lists it */
+typedef struct {
+    char *archive_path;
+    char *name;
+    uint64_t header_offset; /* Of its local header */
+    uint64_t compressed_size;
+    uint64_t size;
+    int method;
+} zip_member_t;
+
+/* Whether a path names a zip or tar archive, compressed or not. Used to
+ * print member names even when a single file is searched. */
+int is_archive_name(const char *path);
+
+/* Lists the files in the zip archive in buf, leaving out directories and
+ * members it can't read. Returns NULL if buf isn't a zip archive. */
+zip_member_t **zip_members(const char *buf, const size_t buf_len, const char *path, size_t *members_len);
+void zip_member_free(zip_member_t *member);
+/* Reads a member from the archive and inflates it. Returns NULL after
+ * logging what went wrong. */
+char *zip_member_read(const zip_member_t *member, size_t *len);
+
+int is_tar_header(const void *block, const size_t len);
+
+#if HAVE_FOPENCOOKIE
+typedef struct tar_reader tar_reader_t;
+
+/* head is the first header, already read from the stream */
+tar_reader_t *tar_open(FILE *stream, const char *path, const void *head);
+/* Moves on to the next regular file. Returns its name, or NULL at the end. */
+const char *tar_next(tar_reader_t *tar);
+/* Opens the current member as a stream of its own. Close it before calling
+ * tar_next() again. */
+FILE *tar_member_open(tar_reader_t *tar);
+void tar_close(tar_reader_t *tar);
+#endif
+
+#endif
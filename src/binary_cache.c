@@ -0,0 +1,175 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include "binary_cache.h"
+#include "cache_file.h"
+#include "log.h"
+#include "options.h"
+#include "uthash.h"
+#include "util.h"
+
+/* A persistent set of files known to be binary, so later searches can skip
+ * them without opening them. Files are identified by device and inode, and
+ * the mtime and size make sure they haven't changed since. */
+
+#define BINARY_CACHE_MAGIC "agbin01"
+
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime;
+    int64_t mtime_nsec;
+    int64_t size;
+} binary_cache_key_t;
+
+typedef struct {
+    char magic[8];
+    uint64_t binary_sample; /* Verdicts depend on --binary-sample */
+    uint64_t entries_len;
+} binary_cache_header_t;
+
+typedef struct {
+    binary_cache_key_t key;
+    int used; /* Looked up or added in this run */
+    UT_hash_handle hh;
+} binary_cache_entry_t;
+
+static binary_cache_entry_t *binary_cache = NULL;
+static size_t binary_cache_len = 0;
+static int binary_cache_dirty = FALSE;
+static char *binary_cache_path = NULL;
+static pthread_mutex_t binary_cache_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static void make_key(binary_cache_key_t *key, const struct stat *statbuf) {
+    memset(key, 0, sizeof(*key));
+    key->dev = (uint64_t)statbuf->st_dev;
+    key->ino = (uint64_t)statbuf->st_ino;
+    key->mtime = (int64_t)statbuf->st_mtime;
+#ifdef HAVE_STAT_MTIM
+    key->mtime_nsec = (int64_t)statbuf->st_mtim.tv_nsec;
+#endif
+    key->size = (int64_t)statbuf->st_size;
+}
+
+static binary_cache_entry_t *add_entry(const binary_cache_key_t *key, int used) {
+    binary_cache_entry_t *entry = NULL;
+
+    HASH_FIND(hh, binary_cache, key, sizeof(binary_cache_key_t), entry);
+    if (entry) {
+        entry->used |= used;
+        return entry;
+    }
+    entry = ag_malloc(sizeof(binary_cache_entry_t));
+    memcpy(&entry->key, key, sizeof(binary_cache_key_t));
+    entry->used = used;
+    HASH_ADD(hh, binary_cache, key, sizeof(binary_cache_key_t), entry);
+    binary_cache_len++;
+    return entry;
+}
+
+void binary_cache_load(const char *path) {
+    cache_file_t cf;
+    binary_cache_header_t header;
+    binary_cache_key_t key;
+    uint64_t i;
+
+    binary_cache_path = ag_strdup(path);
+
+    if (!cache_file_open(&cf, "binary cache", path, BINARY_CACHE_MAGIC, &header, sizeof(header))) {
+        return;
+    }
+    if (header.binary_sample != opts.binary_sample) {
+        log_debug("Ignoring binary cache %s: it was made with --binary-sample %lu", path, (unsigned long)header.binary_sample);
+        cache_file_close(&cf);
+        return;
+    }
+    for (i = 0; i < header.entries_len; i++) {
+        if (!cache_file_read(&cf, &key, sizeof(key))) {
+            log_debug("Binary cache %s is truncated", path);
+            break;
+        }
+        add_entry(&key, FALSE);
+    }
+    cache_file_close(&cf);
+    log_debug("Loaded %lu entries from binary cache %s", (unsigned long)binary_cache_len, path);
+}
+
+void binary_cache_save(void) {
+    cache_file_t cf;
+    binary_cache_header_t header;
+    binary_cache_entry_t *entry;
+    int keep_unused;
+
+    if (binary_cache_path == NULL || !binary_cache_dirty) {
+        return;
+    }
+    if (!cache_file_create(&cf, "binary cache", binary_cache_path)) {
+        return;
+    }
+    keep_unused = cache_keep_unused(binary_cache_len, BINARY_CACHE_MAX_ENTRIES);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BINARY_CACHE_MAGIC, sizeof(header.magic));
+    header.binary_sample = opts.binary_sample;
+    for (entry = binary_cache; entry != NULL; entry = entry->hh.next) {
+        if (keep_unused || entry->used) {
+            header.entries_len++;
+        }
+    }
+    fwrite(&header, sizeof(header), 1, cf.fp);
+    for (entry = binary_cache; entry != NULL; entry = entry->hh.next) {
+        if (keep_unused || entry->used) {
+            fwrite(&entry->key, sizeof(entry->key), 1, cf.fp);
+        }
+    }
+
+    if (cache_file_commit(&cf)) {
+        log_debug("Saved %lu entries to binary cache %s", (unsigned long)header.entries_len, binary_cache_path);
+    }
+}
+
+void binary_cache_cleanup(void) {
+    binary_cache_entry_t *entry;
+    binary_cache_entry_t *tmp;
+
+    HASH_ITER(hh, binary_cache, entry, tmp) {
+        HASH_DELETE(hh, binary_cache, entry);
+        free(entry);
+    }
+    binary_cache_len = 0;
+    free(binary_cache_path);
+    binary_cache_path = NULL;
+}
+
+/* Returns 1 if the file was binary the last time we looked */
+int binary_cache_lookup(const struct stat *statbuf) {
+    binary_cache_key_t key;
+    binary_cache_entry_t *entry = NULL;
+
+    make_key(&key, statbuf);
+    pthread_mutex_lock(&binary_cache_mtx);
+    HASH_FIND(hh, binary_cache, &key, sizeof(binary_cache_key_t), entry);
+    if (entry) {
+        entry->used = TRUE;
+    }
+    pthread_mutex_unlock(&binary_cache_mtx);
+    return entry != NULL;
+}
+
+void binary_cache_add(const struct stat *statbuf) {
+    binary_cache_key_t key;
+
+    make_key(&key, statbuf);
+    pthread_mutex_lock(&binary_cache_mtx);
+    add_entry(&key, TRUE);
+    binary_cache_dirty = TRUE;
+    pthread_mutex_unlock(&binary_cache_mtx);
+}
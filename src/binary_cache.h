@@ -0,0 +1,17 @@
+#ifndef BINARY_CACHE_H
+#define BINARY_CACHE_H
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/* See cache_keep_unused() */
+#define BINARY_CACHE_MAX_ENTRIES (256 * 1024)
+
+void binary_cache_load(const char *path);
+void binary_cache_save(void);
+void binary_cache_cleanup(void);
+
+int binary_cache_lookup(const struct stat *statbuf);
+void binary_cache_add(const struct stat *statbuf);
+
+#endif
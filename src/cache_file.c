@@ -0,0 +1,111 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cache_file.h"
+#include "log.h"
+#include "util.h"
+
+int cache_file_open(cache_file_t *cf, const char *name, const char *path, const char *magic,
+                    void *header, const size_t header_len) {
+    memset(cf, 0, sizeof(cache_file_t));
+    cf->name = name;
+    cf->path = path;
+
+    cf->fp = fopen(path, "rb");
+    if (cf->fp == NULL) {
+        log_debug("No %s at %s", name, path);
+        return FALSE;
+    }
+    if (fstat(fileno(cf->fp), &cf->statbuf) != 0 || cf->statbuf.st_size < (off_t)header_len) {
+        log_debug("Ignoring %s %s: bad header", name, path);
+        cache_file_close(cf);
+        return FALSE;
+    }
+    cf->left = (uint64_t)cf->statbuf.st_size;
+    if (!cache_file_read(cf, header, header_len) || memcmp(header, magic, 8) != 0) {
+        log_debug("Ignoring %s %s: bad header", name, path);
+        cache_file_close(cf);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+int cache_file_read(cache_file_t *cf, void *buf, const size_t len) {
+    if (len > cf->left || fread(buf, 1, len, cf->fp) != len) {
+        cf->left = 0;
+        return FALSE;
+    }
+    cf->left -= len;
+    return TRUE;
+}
+
+char *cache_file_read_data(cache_file_t *cf, const uint64_t len) {
+    char *data;
+
+    if (len > cf->left) {
+        cf->left = 0;
+        return NULL;
+    }
+    data = ag_malloc(len + 1);
+    if (!cache_file_read(cf, data, len)) {
+        free(data);
+        return NULL;
+    }
+    data[len] = '\0';
+    return data;
+}
+
+void cache_file_close(cache_file_t *cf) {
+    if (cf->fp) {
+        fclose(cf->fp);
+        cf->fp = NULL;
+    }
+}
+
+int cache_file_create(cache_file_t *cf, const char *name, const char *path) {
+    char *dir;
+
+    memset(cf, 0, sizeof(cache_file_t));
+    cf->name = name;
+    cf->path = path;
+
+    dir = ag_strdup(path);
+    if (strrchr(dir, '/') != NULL && strrchr(dir, '/') != dir) {
+        *strrchr(dir, '/') = '\0';
+        ag_mkdir_p(dir);
+    }
+    free(dir);
+
+    ag_asprintf(&cf->tmp_path, "%s.%lu", path, (unsigned long)getpid());
+    cf->fp = fopen(cf->tmp_path, "wb");
+    if (cf->fp == NULL) {
+        log_debug("Couldn't write %s %s: %s", name, cf->tmp_path, strerror(errno));
+        free(cf->tmp_path);
+        cf->tmp_path = NULL;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+int cache_file_commit(cache_file_t *cf) {
+    int ok = !ferror(cf->fp);
+
+    if (fclose(cf->fp) != 0) {
+        ok = FALSE;
+    }
+    cf->fp = NULL;
+    if (!ok || rename(cf->tmp_path, cf->path) != 0) {
+        log_debug("Couldn't write %s %s: %s", cf->name, cf->path, strerror(errno));
+        unlink(cf->tmp_path);
+        ok = FALSE;
+    }
+    free(cf->tmp_path);
+    cf->tmp_path = NULL;
+    return ok;
+}
+
+int cache_keep_unused(const size_t entries_len, const size_t max_entries) {
+    return entries_len <= max_entries;
+}
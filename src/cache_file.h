@@ -0,0 +1,42 @@
+#ifndef CACHE_FILE_H
+#define CACHE_FILE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/* A file in the --cache-dir: a header that starts with an 8-byte magic
+ * string, then records. Reads are bounded by what's left of the file, so a
+ * corrupt one can't make us allocate more than it holds. Writes go to a
+ * temporary file that's renamed over the old one once it's complete, so
+ * other runs never see half of one. */
+typedef struct {
+    FILE *fp;
+    const char *name; /* For messages, like "walk cache" */
+    const char *path;
+    char *tmp_path;
+    struct stat statbuf; /* Of the file being read */
+    uint64_t left;       /* Bytes not read yet */
+} cache_file_t;
+
+/* Returns FALSE if there's no file at path or its header is wrong */
+int cache_file_open(cache_file_t *cf, const char *name, const char *path, const char *magic,
+                    void *header, const size_t header_len);
+/* Returns FALSE if the file ends first */
+int cache_file_read(cache_file_t *cf, void *buf, const size_t len);
+/* Reads len bytes into a new NUL-terminated buffer. Returns NULL if the
+ * file ends first. */
+char *cache_file_read_data(cache_file_t *cf, const uint64_t len);
+void cache_file_close(cache_file_t *cf);
+
+/* Makes the directory path goes in if it has to */
+int cache_file_create(cache_file_t *cf, const char *name, const char *path);
+/* Puts the file in place. Returns FALSE if it couldn't be written. */
+int cache_file_commit(cache_file_t *cf);
+
+/* Entries for files that were deleted or changed pile up, so caches drop
+ * everything a run didn't use once they have more than max_entries. */
+int cache_keep_unused(const size_t entries_len, const size_t max_entries);
+
+#endif
@@ -1,3 +1,4 @@
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -11,6 +12,23 @@ const uint8_t XZ_HEADER_MAGIC[6] = { 0xFD, '7', 'z', 'X', 'Z', 0x00 };
 const uint8_t LZMA_HEADER_SOMETIMES[3] = { 0x5D, 0x00, 0x00 };
 #endif
 
+#ifdef HAVE_ZSTD_H
+#include <zstd.h>
+
+/* https://github.com/facebook/zstd/blob/dev/doc/zstd_compression_format.md */
+const uint8_t ZSTD_HEADER_MAGIC[4] = { 0x28, 0xB5, 0x2F, 0xFD };
+#endif
+
+#ifdef HAVE_BZLIB_H
+#include <bzlib.h>
+
+/* "BZh", then the block size from '1' to '9', then the magic that starts
+ * the first block (pi) or the end of the stream (sqrt(pi)) */
+const uint8_t BZIP2_HEADER_MAGIC[3] = { 'B', 'Z', 'h' };
+const uint8_t BZIP2_BLOCK_MAGIC[6] = { 0x31, 0x41, 0x59, 0x26, 0x53, 0x59 };
+const uint8_t BZIP2_EOS_MAGIC[6] = { 0x17, 0x72, 0x45, 0x38, 0x50, 0x90 };
+#endif
+
 
 #ifdef HAVE_ZLIB_H
 #define ZLIB_CONST 1
@@ -70,6 +88,13 @@ static void *decompress_zlib(const void *buf, const int buf_len,
             stream.next_out = &result[stream.total_out];
             ret = inflate(&stream, Z_SYNC_FLUSH);
             log_debug("inflate ret = %d", ret);
+            if (ret == Z_STREAM_END && stream.avail_in > 0 && stream.next_in[0] == 0x1F) {
+                /* Another member follows. inflateReset() clears total_out. */
+                uLong total_out = stream.total_out;
+                inflateReset(&stream);
+                stream.total_out = total_out;
+                ret = Z_OK;
+            }
             switch (ret) {
                 case Z_STREAM_ERROR: {
                     log_err("Found stream error while decompressing zlib stream: %s", stream.msg);
@@ -122,8 +147,33 @@ static void *decompress_zip(const void *buf, const int buf_len,
 
 
 #ifdef HAVE_LZMA_H
+/* .xz files made of several blocks, like xz -T0 writes, are decoded by up
+ * to threads threads. .lzma files, and liblzmas older than 5.4, get one. */
+lzma_ret decompress_lzma_init(lzma_stream *stream, const void *buf, const size_t buf_len, int threads) {
+#if LZMA_VERSION >= UINT32_C(50040002)
+    lzma_mt mt;
+    uint64_t memlimit;
+
+    if (threads > 1 && buf_len >= sizeof(XZ_HEADER_MAGIC) && memcmp(buf, XZ_HEADER_MAGIC, sizeof(XZ_HEADER_MAGIC)) == 0) {
+        memset(&mt, 0, sizeof(mt));
+        mt.threads = (uint32_t)threads;
+        /* Like xz, go back to one thread rather than use more than a
+         * quarter of the memory */
+        memlimit = lzma_physmem() / 4;
+        mt.memlimit_threading = memlimit > 0 ? memlimit : UINT64_MAX;
+        mt.memlimit_stop = UINT64_MAX;
+        return lzma_stream_decoder_mt(stream, &mt);
+    }
+#else
+    (void)buf;
+    (void)buf_len;
+    (void)threads;
+#endif
+    return lzma_auto_decoder(stream, -1, 0);
+}
+
 static void *decompress_lzma(const void *buf, const int buf_len,
-                             const char *dir_full_path, int *new_buf_len) {
+                             const char *dir_full_path, int *new_buf_len, int threads) {
     lzma_stream stream = LZMA_STREAM_INIT;
     lzma_ret lzrt;
     unsigned char *result = NULL;
@@ -133,10 +183,10 @@ static void *decompress_lzma(const void *buf, const int buf_len,
     stream.avail_in = buf_len;
     stream.next_in = buf;
 
-    lzrt = lzma_auto_decoder(&stream, -1, 0);
+    lzrt = decompress_lzma_init(&stream, buf, buf_len, threads);
 
     if (lzrt != LZMA_OK) {
-        log_err("Unable to initialize lzma_auto_decoder: %d", lzrt);
+        log_err("Unable to initialize lzma decoder: %d", lzrt);
         goto error_out;
     }
 
@@ -188,9 +238,157 @@ error_out:
 #endif
 
 
+#ifdef HAVE_ZSTD_H
+static void *decompress_zstd(const void *buf, const int buf_len,
+                             const char *dir_full_path, int *new_buf_len) {
+    ZSTD_DStream *stream;
+    ZSTD_inBuffer in;
+    ZSTD_outBuffer out;
+    size_t ret;
+    unsigned char *result = NULL;
+    size_t result_size = 0;
+    size_t pagesize = 0;
+
+    log_debug("Decompressing zstd file %s", dir_full_path);
+
+    stream = ZSTD_createDStream();
+    if (stream == NULL) {
+        log_err("Unable to initialize zstd");
+        goto error_out;
+    }
+
+    in.src = buf;
+    in.size = buf_len;
+    in.pos = 0;
+    out.dst = NULL;
+    out.size = 0;
+    out.pos = 0;
+
+    pagesize = getpagesize();
+    result_size = ((buf_len + pagesize - 1) & ~(pagesize - 1));
+    /* Several frames can follow each other. The last one has to end. */
+    do {
+        if (out.pos == out.size) {
+            unsigned char *tmp_result = result;
+            /* Double the buffer size and realloc */
+            result_size *= 2;
+            result = (unsigned char *)realloc(result, result_size * sizeof(unsigned char));
+            if (result == NULL) {
+                free(tmp_result);
+                log_err("Unable to allocate %d bytes to decompress file %s", result_size * sizeof(unsigned char), dir_full_path);
+                goto error_out;
+            }
+            out.dst = result;
+            out.size = result_size;
+        }
+        ret = ZSTD_decompressStream(stream, &out, &in);
+        log_debug("ZSTD_decompressStream ret = %lu", (unsigned long)ret);
+        if (ZSTD_isError(ret)) {
+            log_err("Found data error while decompressing zstd stream: %s", ZSTD_getErrorName(ret));
+            goto error_out;
+        }
+        if (ret != 0 && in.pos == in.size && out.pos < out.size) {
+            log_err("Truncated zstd stream in %s", dir_full_path);
+            goto error_out;
+        }
+    } while (in.pos < in.size || ret != 0);
+
+    ZSTD_freeDStream(stream);
+    *new_buf_len = out.pos;
+    return result;
+
+error_out:
+    ZSTD_freeDStream(stream);
+    free(result);
+    *new_buf_len = 0;
+    return NULL;
+}
+#endif
+
+
+#ifdef HAVE_BZLIB_H
+static void *decompress_bzip2(const void *buf, const int buf_len,
+                              const char *dir_full_path, int *new_buf_len) {
+    bz_stream stream;
+    int ret = BZ_OK;
+    unsigned char *result = NULL;
+    size_t result_size = 0;
+    size_t result_len = 0;
+    size_t pagesize = 0;
+
+    log_debug("Decompressing bzip2 file %s", dir_full_path);
+
+    memset(&stream, 0, sizeof(stream));
+    if (BZ2_bzDecompressInit(&stream, 0, 0) != BZ_OK) {
+        log_err("Unable to initialize bzip2");
+        *new_buf_len = 0;
+        return NULL;
+    }
+    /* Explicitly cast away the const-ness of buf */
+    stream.next_in = (char *)buf;
+    stream.avail_in = buf_len;
+
+    pagesize = getpagesize();
+    result_size = ((buf_len + pagesize - 1) & ~(pagesize - 1));
+    do {
+        if (result_len == result_size || result == NULL) {
+            unsigned char *tmp_result = result;
+            /* Double the buffer size and realloc */
+            result_size *= 2;
+            result = (unsigned char *)realloc(result, result_size * sizeof(unsigned char));
+            if (result == NULL) {
+                free(tmp_result);
+                log_err("Unable to allocate %d bytes to decompress file %s", result_size * sizeof(unsigned char), dir_full_path);
+                goto error_out;
+            }
+        }
+        stream.next_out = (char *)&result[result_len];
+        stream.avail_out = result_size - result_len;
+        ret = BZ2_bzDecompress(&stream);
+        result_len = result_size - stream.avail_out;
+        if (ret == BZ_STREAM_END && stream.avail_in > 0) {
+            /* Another stream follows */
+            char *next_in = stream.next_in;
+            unsigned int avail_in = stream.avail_in;
+            BZ2_bzDecompressEnd(&stream);
+            memset(&stream, 0, sizeof(stream));
+            if (BZ2_bzDecompressInit(&stream, 0, 0) != BZ_OK) {
+                log_err("Unable to initialize bzip2");
+                free(result);
+                *new_buf_len = 0;
+                return NULL;
+            }
+            stream.next_in = next_in;
+            stream.avail_in = avail_in;
+            ret = BZ_OK;
+        } else if (ret != BZ_OK && ret != BZ_STREAM_END) {
+            log_err("Found data error while decompressing bzip2 stream: %d", ret);
+            goto error_out;
+        } else if (ret == BZ_OK && stream.avail_in == 0 && stream.avail_out > 0) {
+            log_err("Truncated bzip2 stream in %s", dir_full_path);
+            goto error_out;
+        }
+    } while (ret == BZ_OK);
+
+    BZ2_bzDecompressEnd(&stream);
+    *new_buf_len = result_len;
+    return result;
+
+error_out:
+    BZ2_bzDecompressEnd(&stream);
+    free(result);
+    *new_buf_len = 0;
+    return NULL;
+}
+#endif
+
+
 /* This function is very hot. It's called on every file when zip is enabled. */
 void *decompress(const ag_compression_type zip_type, const void *buf, const int buf_len,
-                 const char *dir_full_path, int *new_buf_len) {
+                 const char *dir_full_path, int *new_buf_len, int threads) {
+#ifndef HAVE_LZMA_H
+    (void)threads;
+#endif
     switch (zip_type) {
 #ifdef HAVE_ZLIB_H
         case AG_GZIP:
@@ -202,7 +400,15 @@ void *decompress(const ag_compression_type zip_type, const void *buf, const int
             return decompress_zip(buf, buf_len, dir_full_path, new_buf_len);
 #ifdef HAVE_LZMA_H
         case AG_XZ:
-            return decompress_lzma(buf, buf_len, dir_full_path, new_buf_len);
+            return decompress_lzma(buf, buf_len, dir_full_path, new_buf_len, threads);
+#endif
+#ifdef HAVE_ZSTD_H
+        case AG_ZSTD:
+            return decompress_zstd(buf, buf_len, dir_full_path, new_buf_len);
+#endif
+#ifdef HAVE_BZLIB_H
+        case AG_BZIP2:
+            return decompress_bzip2(buf, buf_len, dir_full_path, new_buf_len);
 #endif
         case AG_NO_COMPRESSION:
             log_err("File %s is not compressed", dir_full_path);
@@ -227,6 +433,9 @@ ag_compression_type is_zipped(const void *buf, const int buf_len) {
      *
      * zip file:        { 0x50, 0x4B, 0x03, 0x04 }
      * http://www.pkware.com/documents/casestudies/APPNOTE.TXT (Section 4.3)
+     *
+     * zstd file:       { 0x28, 0xB5, 0x2F, 0xFD }
+     * bzip2 file:      { 'B', 'Z', 'h', '1'-'9' }
      */
 
     const unsigned char *buf_c = buf;
@@ -274,5 +483,24 @@ ag_compression_type is_zipped(const void *buf, const int buf_len) {
     }
 #endif
 
+#ifdef HAVE_ZSTD_H
+    if (buf_len >= 4) {
+        if (memcmp(ZSTD_HEADER_MAGIC, buf_c, 4) == 0) {
+            log_debug("Found zstd-based stream");
+            return AG_ZSTD;
+        }
+    }
+#endif
+
+#ifdef HAVE_BZLIB_H
+    /* Text can start with "BZh1" too, so check the block magic if we have it */
+    if (buf_len >= 4 && memcmp(BZIP2_HEADER_MAGIC, buf_c, 3) == 0 && buf_c[3] >= '1' && buf_c[3] <= '9') {
+        if (buf_len < 10 || memcmp(BZIP2_BLOCK_MAGIC, buf_c + 4, 6) == 0 || memcmp(BZIP2_EOS_MAGIC, buf_c + 4, 6) == 0) {
+            log_debug("Found bzip2-based stream");
+            return AG_BZIP2;
+        }
+    }
+#endif
+
     return AG_NO_COMPRESSION;
 }
@@ -1,26 +1,79 @@
 #ifndef DECOMPRESS_H
 #define DECOMPRESS_H
 
+#include <stdint.h>
 #include <stdio.h>
+#include <sys/stat.h>
 
 #include "config.h"
 #include "log.h"
 #include "options.h"
 
+#ifdef HAVE_LZMA_H
+#include <lzma.h>
+#endif
+#ifdef HAVE_ZLIB_H
+#define ZLIB_CONST 1
+#include <zlib.h>
+#endif
+
+/* The most threads one .xz file is decoded with */
+#define XZ_MAX_THREADS 8
+
 typedef enum {
     AG_NO_COMPRESSION,
     AG_GZIP,
     AG_COMPRESS,
     AG_ZIP,
     AG_XZ,
+    AG_ZSTD,
+    AG_BZIP2,
 } ag_compression_type;
 
 ag_compression_type is_zipped(const void *buf, const int buf_len);
 
-void *decompress(const ag_compression_type zip_type, const void *buf, const int buf_len, const char *dir_full_path, int *new_buf_len);
+/* threads is how many threads an .xz file can be decoded with. Other
+ * formats use one. */
+void *decompress(const ag_compression_type zip_type, const void *buf, const int buf_len, const char *dir_full_path, int *new_buf_len, int threads);
+
+#ifdef HAVE_LZMA_H
+lzma_ret decompress_lzma_init(lzma_stream *stream, const void *buf, const size_t buf_len, int threads);
+#endif
+
+#if HAVE_FOPENCOOKIE && defined(HAVE_ZLIB_H)
+/* A gzip file is only indexed if it's at least this big */
+#define GZIP_INDEX_MIN_SIZE (1024 * 1024)
+/* How much inflated data there is between checkpoints */
+#define GZIP_INDEX_SPAN (4 * 1024 * 1024)
+#define GZIP_WINDOW_SIZE (1 << MAX_WBITS)
+
+/* A place in a single-member gzip file where inflating can start over,
+ * given the window of output before it */
+typedef struct {
+    uint64_t out;  /* Offset in the inflated data */
+    uint64_t in;   /* Offset of the first whole byte of input in the file */
+    uint32_t bits; /* How many bits of the byte before in are still to come */
+    uint32_t window_len;
+    unsigned char window[GZIP_WINDOW_SIZE];
+} gzip_checkpoint_t;
+
+typedef struct {
+    gzip_checkpoint_t *checkpoints;
+    size_t checkpoints_len;
+    uint64_t out_len; /* Of the whole file */
+} gzip_index_t;
+
+/* Loads the index of the file statbuf describes from the --cache-dir.
+ * Returns NULL if there isn't one, or if the file changed since. */
+gzip_index_t *gzip_index_load(const struct stat *statbuf);
+void gzip_index_free(gzip_index_t *index);
+#endif
 
 #if HAVE_FOPENCOOKIE
-FILE *decompress_open(int fd, const char *mode, ag_compression_type ctype);
+/* If index_statbuf isn't NULL and the file is a single gzip member, the
+ * file is indexed as it's read, and the index is saved once all of it has
+ * been. */
+FILE *decompress_open(int fd, const char *mode, ag_compression_type ctype, int threads, const struct stat *index_statbuf);
 #endif
 
 #endif
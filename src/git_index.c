@@ -0,0 +1,327 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+
+#include "git_index.h"
+#include "log.h"
+#include "util.h"
+
+/* Reads the file list out of a git index, versions 2 to 4. See
+ * Documentation/gitformat-index.txt in git. Extensions are skipped, except
+ * that a split index ("link") can't be read without its shared index, so
+ * loading fails and the caller falls back to walking. */
+
+#define GIT_INDEX_HEADER_LEN 12
+#define GIT_INDEX_STAT_LEN 40 /* Ten 32-bit fields before the object name */
+
+static uint32_t get_be32(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static uint16_t get_be16(const unsigned char *p) {
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+/* Version 4 compresses each path against the previous one. The number of
+ * bytes to drop from the end of it is stored as git's offset varint. */
+static int get_varint(const unsigned char **p, const unsigned char *end, size_t *val) {
+    const unsigned char *q = *p;
+    size_t v;
+
+    if (q >= end) {
+        return -1;
+    }
+    v = *q & 0x7f;
+    while (*q++ & 0x80) {
+        if (q >= end || v > (SIZE_MAX >> 8)) {
+            return -1;
+        }
+        v = ((v + 1) << 7) | (*q & 0x7f);
+    }
+    *p = q;
+    *val = v;
+    return 0;
+}
+
+/* Returns -1 if the entries don't parse with this object name length */
+static int parse_entries(git_index_t *index, const unsigned char *buf, size_t buf_len, size_t hash_len, uint32_t entries_len) {
+    const unsigned char *p = buf + GIT_INDEX_HEADER_LEN;
+    /* The index ends with a checksum */
+    const unsigned char *end = buf + buf_len - hash_len;
+    size_t paths_len = 0;
+    size_t paths_cap = 4096;
+    size_t prev_len = 0;
+    size_t header_len;
+    uint32_t i;
+
+    index->entries = ag_malloc(entries_len * sizeof(git_index_entry_t) + 1);
+    index->paths = ag_malloc(paths_cap);
+    index->entries_len = 0;
+
+    for (i = 0; i < entries_len; i++) {
+        git_index_entry_t *entry = &index->entries[i];
+        const unsigned char *start = p;
+        const unsigned char *name;
+        size_t name_len;
+        size_t strip = 0;
+
+        header_len = GIT_INDEX_STAT_LEN + hash_len + 2;
+        if ((size_t)(end - p) < header_len) {
+            return -1;
+        }
+        entry->ctime_sec = get_be32(p);
+        entry->ctime_nsec = get_be32(p + 4);
+        entry->mtime_sec = get_be32(p + 8);
+        entry->mtime_nsec = get_be32(p + 12);
+        /* p + 16 is the device, which git doesn't compare either */
+        entry->ino = get_be32(p + 20);
+        entry->mode = get_be32(p + 24);
+        entry->uid = get_be32(p + 28);
+        entry->gid = get_be32(p + 32);
+        entry->size = get_be32(p + 36);
+        entry->flags = get_be16(p + GIT_INDEX_STAT_LEN + hash_len);
+        entry->extended_flags = 0;
+        p += header_len;
+        if (entry->flags & GIT_INDEX_EXTENDED) {
+            if (index->version < 3 || end - p < 2) {
+                return -1;
+            }
+            entry->extended_flags = get_be16(p);
+            p += 2;
+            header_len += 2;
+        }
+
+        if (index->version == 4 && get_varint(&p, end, &strip) != 0) {
+            return -1;
+        }
+        name = p;
+        name_len = strnlen((const char *)name, end - p);
+        if (name_len == (size_t)(end - p)) {
+            return -1;
+        }
+        if (index->version == 4) {
+            if (strip > prev_len) {
+                return -1;
+            }
+            p += name_len + 1;
+        } else {
+            /* Entries are padded with 1-8 NULs to a multiple of 8 bytes */
+            p = start + ((header_len + name_len + 8) & ~(size_t)7);
+            if (p > end) {
+                return -1;
+            }
+        }
+
+        /* Paths are stored one after the other, so version 4 can copy the
+         * start of the previous one */
+        if (index->version == 4) {
+            size_t keep = prev_len - strip;
+            while (paths_len + keep + name_len + 1 > paths_cap) {
+                paths_cap *= 2;
+            }
+            index->paths = ag_realloc(index->paths, paths_cap);
+            memmove(index->paths + paths_len, index->paths + paths_len - prev_len - (i ? 1 : 0), keep);
+            memcpy(index->paths + paths_len + keep, name, name_len);
+            name_len += keep;
+        } else {
+            while (paths_len + name_len + 1 > paths_cap) {
+                paths_cap *= 2;
+            }
+            index->paths = ag_realloc(index->paths, paths_cap);
+            memcpy(index->paths + paths_len, name, name_len);
+        }
+        if ((entry->flags & GIT_INDEX_NAME_MASK) != GIT_INDEX_NAME_MASK &&
+            (entry->flags & GIT_INDEX_NAME_MASK) != name_len) {
+            return -1;
+        }
+        index->paths[paths_len + name_len] = '\0';
+        /* Offsets for now, since paths can still move */
+        entry->path = (const char *)(uintptr_t)paths_len;
+        entry->path_len = name_len;
+        paths_len += name_len + 1;
+        prev_len = name_len;
+        index->entries_len++;
+    }
+
+    /* Extensions */
+    while ((size_t)(end - p) >= 8) {
+        uint32_t ext_len = get_be32(p + 4);
+        if (memcmp(p, "link", 4) == 0) {
+            log_debug("Split indexes aren't supported");
+            return -2;
+        }
+        if ((size_t)(end - p - 8) < ext_len) {
+            return -1;
+        }
+        p += 8 + ext_len;
+    }
+    if (p != end) {
+        return -1;
+    }
+
+    for (i = 0; i < index->entries_len; i++) {
+        index->entries[i].path = index->paths + (uintptr_t)index->entries[i].path;
+    }
+    return 0;
+}
+
+git_index_t *git_index_load(const char *path) {
+    FILE *fp;
+    git_index_t *index;
+    unsigned char *buf;
+    size_t buf_len;
+    uint32_t entries_len;
+    int rc = -1;
+
+    fp = fopen(path, "rb");
+    if (fp == NULL) {
+        log_debug("Couldn't open git index %s", path);
+        return NULL;
+    }
+    index = ag_calloc(1, sizeof(git_index_t));
+    if (fstat(fileno(fp), &index->statbuf) != 0 || index->statbuf.st_size < GIT_INDEX_HEADER_LEN + 20) {
+        fclose(fp);
+        free(index);
+        return NULL;
+    }
+    buf_len = index->statbuf.st_size;
+    buf = ag_malloc(buf_len);
+    if (fread(buf, 1, buf_len, fp) != buf_len) {
+        log_debug("Couldn't read git index %s", path);
+        fclose(fp);
+        free(buf);
+        free(index);
+        return NULL;
+    }
+    fclose(fp);
+
+    index->version = get_be32(buf + 4);
+    entries_len = get_be32(buf + 8);
+    if (memcmp(buf, "DIRC", 4) != 0 || index->version < 2 || index->version > 4 ||
+        entries_len > buf_len / 8) {
+        log_debug("%s isn't a git index we can read", path);
+    } else {
+        /* SHA-1 or SHA-256. Only the right one makes the path lengths add up. */
+        rc = parse_entries(index, buf, buf_len, 20, entries_len);
+        if (rc == -1 && buf_len >= GIT_INDEX_HEADER_LEN + 32) {
+            free(index->entries);
+            free(index->paths);
+            rc = parse_entries(index, buf, buf_len, 32, entries_len);
+        }
+        if (rc == -1) {
+            log_debug("Couldn't parse git index %s", path);
+        }
+    }
+    free(buf);
+
+    if (rc != 0) {
+        free(index->entries);
+        free(index->paths);
+        free(index);
+        return NULL;
+    }
+    log_debug("Read %lu entries from git index %s (version %u)", (unsigned long)index->entries_len, path, index->version);
+    return index;
+}
+
+void git_index_free(git_index_t *index) {
+    if (index == NULL) {
+        return;
+    }
+    free(index->entries);
+    free(index->paths);
+    free(index);
+}
+
+void git_index_find_prefix(const git_index_t *index, const char *prefix, size_t prefix_len, size_t *start, size_t *end) {
+    size_t lo = 0;
+    size_t hi = index->entries_len;
+
+    /* First entry >= prefix */
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strncmp(index->entries[mid].path, prefix, prefix_len) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    *start = lo;
+
+    /* First entry after the ones starting with prefix */
+    hi = index->entries_len;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strncmp(index->entries[mid].path, prefix, prefix_len) <= 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    *end = lo;
+}
+
+int git_index_in_work_tree(const git_index_entry_t *entry) {
+    if (entry->extended_flags & GIT_INDEX_SKIP_WORKTREE) {
+        return FALSE;
+    }
+    /* Sparse indexes list whole directories that aren't checked out */
+    return (entry->mode & S_IFMT) != GIT_INDEX_MODE_DIR;
+}
+
+int git_index_entry_changed(const git_index_t *index, const git_index_entry_t *entry, const struct stat *statbuf) {
+    if (entry->flags & GIT_INDEX_ASSUME_VALID) {
+        return FALSE;
+    }
+    if ((entry->extended_flags & GIT_INDEX_INTENT_TO_ADD) || (entry->flags & GIT_INDEX_STAGE_MASK)) {
+        return TRUE;
+    }
+
+    switch (entry->mode & S_IFMT) {
+        case S_IFREG:
+            if (!S_ISREG(statbuf->st_mode) || ((entry->mode ^ statbuf->st_mode) & S_IXUSR)) {
+                return TRUE;
+            }
+            break;
+#ifdef S_IFLNK
+        case S_IFLNK:
+            if (!S_ISLNK(statbuf->st_mode)) {
+                return TRUE;
+            }
+            break;
+#endif
+        default:
+            return TRUE;
+    }
+
+    if (entry->mtime_sec != (uint32_t)statbuf->st_mtime || entry->ctime_sec != (uint32_t)statbuf->st_ctime ||
+        entry->size != (uint32_t)statbuf->st_size) {
+        return TRUE;
+    }
+#ifdef HAVE_STAT_MTIM
+    /* git leaves these 0 if it was built without nanosecond timestamps */
+    if ((entry->mtime_nsec && entry->mtime_nsec != (uint32_t)statbuf->st_mtim.tv_nsec) ||
+        (entry->ctime_nsec && entry->ctime_nsec != (uint32_t)statbuf->st_ctim.tv_nsec)) {
+        return TRUE;
+    }
+#endif
+#ifndef _WIN32
+    if (entry->ino != (uint32_t)statbuf->st_ino || entry->uid != (uint32_t)statbuf->st_uid ||
+        entry->gid != (uint32_t)statbuf->st_gid) {
+        return TRUE;
+    }
+#endif
+
+    /* Modified no earlier than the index was written, so it could have
+     * changed again right after git looked at it */
+    if ((uint32_t)index->statbuf.st_mtime != entry->mtime_sec) {
+        return (uint32_t)index->statbuf.st_mtime < entry->mtime_sec;
+    }
+#ifdef HAVE_STAT_MTIM
+    return (uint32_t)index->statbuf.st_mtim.tv_nsec <= entry->mtime_nsec;
+#else
+    return TRUE;
+#endif
+}
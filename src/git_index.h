@@ -0,0 +1,59 @@
+#ifndef GIT_INDEX_H
+#define GIT_INDEX_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define GIT_INDEX_ASSUME_VALID 0x8000
+#define GIT_INDEX_EXTENDED 0x4000
+#define GIT_INDEX_STAGE_MASK 0x3000
+#define GIT_INDEX_NAME_MASK 0x0fff
+
+/* Extended flags, version 3 and up */
+#define GIT_INDEX_SKIP_WORKTREE 0x4000
+#define GIT_INDEX_INTENT_TO_ADD 0x2000
+
+#define GIT_INDEX_MODE_DIR 0040000 /* Sparse directory */
+#define GIT_INDEX_MODE_GITLINK 0160000 /* Submodule */
+
+/* A file in .git/index. The stat data is truncated to 32 bits, like git does. */
+typedef struct {
+    const char *path; /* Relative to the work tree */
+    size_t path_len;
+    uint32_t ctime_sec;
+    uint32_t ctime_nsec;
+    uint32_t mtime_sec;
+    uint32_t mtime_nsec;
+    uint32_t ino;
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t size;
+    uint16_t flags;
+    uint16_t extended_flags;
+} git_index_entry_t;
+
+/* Entries are sorted by path, and by stage for conflicted paths */
+typedef struct {
+    git_index_entry_t *entries;
+    size_t entries_len;
+    char *paths;
+    uint32_t version;
+    struct stat statbuf; /* Of the index file, to spot racily clean entries */
+} git_index_t;
+
+git_index_t *git_index_load(const char *path);
+void git_index_free(git_index_t *index);
+
+/* Entries with a path starting with prefix are [*start, *end) */
+void git_index_find_prefix(const git_index_t *index, const char *prefix, size_t prefix_len, size_t *start, size_t *end);
+
+/* Is the entry for a file that's in the work tree? */
+int git_index_in_work_tree(const git_index_entry_t *entry);
+
+/* Does the file look modified, going by its stat data? Racily clean entries
+ * count as modified, since we don't compare contents like git does. */
+int git_index_entry_changed(const git_index_t *index, const git_index_entry_t *entry, const struct stat *statbuf);
+
+#endif
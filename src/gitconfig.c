@@ -0,0 +1,724 @@
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "config.h"
+
+#ifndef _WIN32
+#include <pwd.h>
+#endif
+
+#include "cache_file.h"
+#include "gitconfig.h"
+#include "log.h"
+#include "util.h"
+
+/* Just enough of git's config format to find core.excludesfile: sections,
+ * quoting, escapes, line continuations and [include] paths. [includeIf]
+ * sections are skipped. Like git, a malformed file means there's no answer at
+ * all. */
+
+#define GITCONFIG_CACHE_MAGIC "aggit01"
+#define GITCONFIG_MAX_INCLUDE_DEPTH 10
+#define GITCONFIG_UNSET UINT64_MAX
+/* Entries reading more files than this can't be from a sane config */
+#define GITCONFIG_MAX_STAMPS 1024
+
+typedef struct {
+    char magic[8];
+    uint64_t entries_len;
+} gitconfig_cache_header_t;
+
+/* On disk, each entry is this followed by the key, the value and the stamps */
+typedef struct {
+    uint64_t key_len;
+    uint64_t value_len; /* GITCONFIG_UNSET if core.excludesfile isn't set */
+    uint64_t stamps_len;
+} gitconfig_record_t;
+
+/* A config file as it was when it was read. Each is followed by its path.
+ * size is -1 if the file didn't exist. */
+typedef struct {
+    int64_t mtime;
+    int64_t mtime_nsec;
+    int64_t size;
+    uint64_t path_len;
+} gitconfig_stamp_t;
+
+typedef struct {
+    char *key; /* The top-level config files, one per line */
+    char *value;
+    gitconfig_stamp_t *stamps; /* Every file read, includes too */
+    char **stamp_paths;
+    size_t stamps_len;
+} gitconfig_entry_t;
+
+static void set_stamp(gitconfig_stamp_t *stamp, const struct stat *statbuf) {
+    if (statbuf == NULL) {
+        stamp->mtime = 0;
+        stamp->mtime_nsec = 0;
+        stamp->size = -1;
+        return;
+    }
+    stamp->mtime = (int64_t)statbuf->st_mtime;
+#ifdef HAVE_STAT_MTIM
+    stamp->mtime_nsec = (int64_t)statbuf->st_mtim.tv_nsec;
+#else
+    stamp->mtime_nsec = 0;
+#endif
+    stamp->size = (int64_t)statbuf->st_size;
+}
+
+static void add_stamp(gitconfig_entry_t *entry, const char *path, const struct stat *statbuf) {
+    entry->stamps = ag_realloc(entry->stamps, (entry->stamps_len + 1) * sizeof(gitconfig_stamp_t));
+    entry->stamp_paths = ag_realloc(entry->stamp_paths, (entry->stamps_len + 1) * sizeof(char *));
+    set_stamp(&entry->stamps[entry->stamps_len], statbuf);
+    entry->stamps[entry->stamps_len].path_len = strlen(path);
+    entry->stamp_paths[entry->stamps_len] = ag_strdup(path);
+    entry->stamps_len++;
+}
+
+static void free_entry(gitconfig_entry_t *entry) {
+    free(entry->key);
+    free(entry->value);
+    free(entry->stamps);
+    free_strings(entry->stamp_paths, entry->stamps_len);
+}
+
+/* Returns the contents of path, NUL-terminated, or NULL if it can't be read */
+static char *read_file(const char *path, gitconfig_entry_t *entry) {
+    FILE *fp;
+    struct stat statbuf;
+    char *buf;
+    size_t buf_len = 0;
+    size_t buf_cap = 1024;
+
+    fp = fopen(path, "r");
+    if (fp == NULL || fstat(fileno(fp), &statbuf) != 0) {
+        if (fp) {
+            fclose(fp);
+        }
+        add_stamp(entry, path, NULL);
+        return NULL;
+    }
+    add_stamp(entry, path, &statbuf);
+    log_debug("Reading git config %s", path);
+
+    buf = ag_malloc(buf_cap);
+    while (!feof(fp) && !ferror(fp)) {
+        if (buf_len + 1 >= buf_cap) {
+            buf_cap *= 2;
+            buf = ag_realloc(buf, buf_cap);
+        }
+        buf_len += fread(buf + buf_len, 1, buf_cap - buf_len - 1, fp);
+    }
+    buf[buf_len] = '\0';
+    fclose(fp);
+    return buf;
+}
+
+/* Returns the first line of path, or NULL */
+static char *read_line(const char *path) {
+    FILE *fp;
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t line_len;
+
+    fp = fopen(path, "r");
+    if (fp == NULL) {
+        return NULL;
+    }
+    line_len = getline(&line, &line_cap, fp);
+    fclose(fp);
+    if (line_len <= 0) {
+        free(line);
+        return NULL;
+    }
+    while (line_len > 0 && isspace((unsigned char)line[line_len - 1])) {
+        line[--line_len] = '\0';
+    }
+    return line;
+}
+
+static int is_absolute(const char *path) {
+#ifdef _WIN32
+    if (isalpha((unsigned char)path[0]) && path[1] == ':') {
+        return TRUE;
+    }
+#endif
+    return path[0] == '/';
+}
+
+static char *dir_of(const char *path) {
+    const char *slash = strrchr(path, '/');
+    if (slash == NULL) {
+        return ag_strdup(".");
+    }
+    if (slash == path) {
+        return ag_strdup("/");
+    }
+    return ag_strndup(path, slash - path);
+}
+
+/* Expands ~ and ~user like git's --path does. Relative paths are taken
+ * relative to base_dir if it isn't NULL. Returns NULL if ~ can't be expanded. */
+static char *expand_path(const char *path, const char *base_dir) {
+    char *expanded;
+
+    if (path[0] == '~') {
+        const char *rest = path + 1 + strcspn(path + 1, "/");
+        const char *home = NULL;
+        if (rest == path + 1) {
+            home = getenv("HOME");
+        } else {
+#ifndef _WIN32
+            char *user = ag_strndup(path + 1, rest - path - 1);
+            struct passwd *pw = getpwnam(user);
+            free(user);
+            if (pw) {
+                home = pw->pw_dir;
+            }
+#endif
+        }
+        if (home == NULL) {
+            log_debug("Couldn't expand %s", path);
+            return NULL;
+        }
+        ag_asprintf(&expanded, "%s%s", home, rest);
+    } else if (base_dir && !is_absolute(path)) {
+        ag_asprintf(&expanded, "%s/%s", base_dir, path);
+    } else {
+        expanded = ag_strdup(path);
+    }
+    return expanded;
+}
+
+/* Parses a section header after the '['. Returns the position after the ']',
+ * or NULL if it's malformed. */
+static const char *parse_section(const char *p, char *section, size_t section_size, int *has_subsection) {
+    size_t len = 0;
+
+    *has_subsection = FALSE;
+    while (isalnum((unsigned char)*p) || *p == '-' || *p == '.') {
+        if (*p == '.') {
+            /* [section.subsection] is the old syntax for subsections */
+            *has_subsection = TRUE;
+        } else if (!*has_subsection && len < section_size - 1) {
+            section[len++] = tolower((unsigned char)*p);
+        }
+        p++;
+    }
+    section[len] = '\0';
+
+    if (*p == ' ' || *p == '\t') {
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+        if (*p != '"') {
+            return NULL;
+        }
+        for (p++; *p != '"'; p++) {
+            if (*p == '\0' || *p == '\n') {
+                return NULL;
+            }
+            if (*p == '\\' && p[1] != '\0' && p[1] != '\n') {
+                p++;
+            }
+        }
+        p++;
+        *has_subsection = TRUE;
+    }
+    if (*p != ']') {
+        return NULL;
+    }
+    return p + 1;
+}
+
+/* Parses a value after the '='. Leaves p at the end of the line, or returns
+ * NULL if it's malformed. */
+static const char *parse_value(const char *p, char **value) {
+    size_t len = 0;
+    size_t trimmed_len = 0;
+    size_t cap = 64;
+    int quoted = FALSE;
+    int seen_quote = FALSE;
+    char *out = ag_malloc(cap);
+    char c;
+
+    while ((c = *p) != '\0' && c != '\n') {
+        p++;
+        if (!quoted && (c == '#' || c == ';')) {
+            while (*p != '\0' && *p != '\n') {
+                p++;
+            }
+            break;
+        }
+        if (c == '"') {
+            quoted = !quoted;
+            seen_quote = TRUE;
+            trimmed_len = len;
+            continue;
+        }
+        if (!quoted && isspace((unsigned char)c)) {
+            /* Leading and trailing whitespace is dropped, inner whitespace kept */
+            if (len == 0 && !seen_quote) {
+                continue;
+            }
+        } else if (c == '\\') {
+            c = *p++;
+            switch (c) {
+                case '\n':
+                    continue;
+                case 't':
+                    c = '\t';
+                    break;
+                case 'b':
+                    c = '\b';
+                    break;
+                case 'n':
+                    c = '\n';
+                    break;
+                case '\\':
+                case '"':
+                    break;
+                default:
+                    free(out);
+                    return NULL;
+            }
+        }
+        if (len + 1 >= cap) {
+            cap *= 2;
+            out = ag_realloc(out, cap);
+        }
+        out[len++] = c;
+        if (quoted || !isspace((unsigned char)c)) {
+            trimmed_len = len;
+        }
+    }
+    if (quoted) {
+        free(out);
+        return NULL;
+    }
+    out[trimmed_len] = '\0';
+    *value = out;
+    return p;
+}
+
+/* Reads one config file into entry. Returns -1 if it's malformed. */
+static int parse_config(const char *path, gitconfig_entry_t *entry, int depth) {
+    char section[32] = "";
+    int has_subsection = FALSE;
+    char *buf;
+    const char *p;
+    int rc = 0;
+
+    buf = read_file(path, entry);
+    if (buf == NULL) {
+        return 0;
+    }
+
+    p = buf;
+    while (*p != '\0') {
+        char key[32];
+        size_t key_len = 0;
+        char *value = NULL;
+
+        if (isspace((unsigned char)*p)) {
+            p++;
+            continue;
+        }
+        if (*p == '#' || *p == ';') {
+            while (*p != '\0' && *p != '\n') {
+                p++;
+            }
+            continue;
+        }
+        if (*p == '[') {
+            p = parse_section(p + 1, section, sizeof(section), &has_subsection);
+            if (p == NULL) {
+                rc = -1;
+                break;
+            }
+            continue;
+        }
+        if (!isalpha((unsigned char)*p)) {
+            rc = -1;
+            break;
+        }
+
+        while (isalnum((unsigned char)*p) || *p == '-') {
+            if (key_len < sizeof(key) - 1) {
+                key[key_len++] = tolower((unsigned char)*p);
+            }
+            p++;
+        }
+        key[key_len] = '\0';
+        while (*p == ' ' || *p == '\t' || *p == '\r') {
+            p++;
+        }
+        if (*p == '=') {
+            p = parse_value(p + 1, &value);
+            if (p == NULL) {
+                rc = -1;
+                break;
+            }
+        } else if (*p != '\0' && *p != '\n' && *p != '#' && *p != ';') {
+            rc = -1;
+            break;
+        }
+
+        if (has_subsection) {
+            /* Nothing we want is in a subsection */
+        } else if (strcmp(section, "core") == 0 && strcmp(key, "excludesfile") == 0) {
+            /* git --path gives up if any value is a boolean or can't be
+             * expanded, even one that's overridden later */
+            char *expanded = value ? expand_path(value, NULL) : NULL;
+            free(entry->value);
+            entry->value = expanded;
+            if (expanded == NULL) {
+                rc = -1;
+            }
+        } else if (strcmp(section, "include") == 0 && strcmp(key, "path") == 0 && value) {
+            char *base_dir = dir_of(path);
+            char *include_path = expand_path(value, base_dir);
+            free(base_dir);
+            if (include_path && depth >= GITCONFIG_MAX_INCLUDE_DEPTH) {
+                /* Probably a loop. git gives up too. */
+                log_debug("Too many nested includes in %s", path);
+                rc = -1;
+            } else if (include_path) {
+                rc = parse_config(include_path, entry, depth + 1);
+            }
+            free(include_path);
+        }
+        free(value);
+        if (rc != 0) {
+            break;
+        }
+    }
+
+    if (rc != 0) {
+        log_debug("Bad git config %s", path);
+    }
+    free(buf);
+    return rc;
+}
+
+/* Returns the config file of the repository git_dir belongs to */
+static char *repo_config(const char *git_dir) {
+    char *path;
+    char *common_dir;
+
+    /* Worktrees keep their config in the main repository */
+    ag_asprintf(&path, "%s/commondir", git_dir);
+    common_dir = read_line(path);
+    free(path);
+    if (common_dir) {
+        if (is_absolute(common_dir)) {
+            ag_asprintf(&path, "%s/config", common_dir);
+        } else {
+            ag_asprintf(&path, "%s/%s/config", git_dir, common_dir);
+        }
+        free(common_dir);
+    } else {
+        ag_asprintf(&path, "%s/config", git_dir);
+    }
+    return path;
+}
+
+char *git_find_dir(const char *start, char **work_tree) {
+    char dir[PATH_MAX];
+    char *dot_git;
+    char *git_dir = NULL;
+    struct stat statbuf;
+    size_t len;
+
+    len = strlen(start);
+    if (len >= sizeof(dir)) {
+        return NULL;
+    }
+    strcpy(dir, start);
+    while (len > 1 && dir[len - 1] == '/') {
+        dir[--len] = '\0';
+    }
+
+    for (;;) {
+        ag_asprintf(&dot_git, "%s/.git", strcmp(dir, "/") == 0 ? "" : dir);
+        if (stat(dot_git, &statbuf) == 0) {
+            if (S_ISDIR(statbuf.st_mode)) {
+                git_dir = dot_git;
+                dot_git = NULL;
+            } else {
+                /* Submodules and worktrees have a "gitdir: path" file instead */
+                char *line = read_line(dot_git);
+                if (line && strncmp(line, "gitdir: ", 8) == 0) {
+                    git_dir = expand_path(line + 8, dir);
+                }
+                free(line);
+            }
+        }
+        free(dot_git);
+        if (git_dir || strcmp(dir, "/") == 0 || strchr(dir, '/') == NULL) {
+            break;
+        }
+        len = strrchr(dir, '/') - dir;
+        dir[len == 0 ? 1 : len] = '\0';
+    }
+
+    if (git_dir && work_tree) {
+        *work_tree = ag_strdup(dir);
+    }
+    return git_dir;
+}
+
+/* Returns NULL if we're not in a repository */
+static char *find_repo_config(void) {
+    char cwd[PATH_MAX];
+    char *git_dir;
+    char *config;
+
+    if (getenv("GIT_DIR")) {
+        return repo_config(getenv("GIT_DIR"));
+    }
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        return NULL;
+    }
+    git_dir = git_find_dir(cwd, NULL);
+    if (git_dir == NULL) {
+        return NULL;
+    }
+    config = repo_config(git_dir);
+    free(git_dir);
+    return config;
+}
+
+/* The config files git reads, lowest priority first, one per line */
+static char *config_files(void) {
+    const char *home = getenv("HOME");
+    char *files = ag_strdup("");
+    char *tmp;
+    char *repo;
+
+    if (!getenv("GIT_CONFIG_NOSYSTEM")) {
+        tmp = files;
+#ifdef _WIN32
+        /* Git for Windows keeps it next to git.exe, which we can't find */
+        if (getenv("GIT_CONFIG_SYSTEM")) {
+            ag_asprintf(&files, "%s%s\n", tmp, getenv("GIT_CONFIG_SYSTEM"));
+        } else {
+            files = ag_strdup(tmp);
+        }
+#else
+        ag_asprintf(&files, "%s%s\n", tmp, getenv("GIT_CONFIG_SYSTEM") ? getenv("GIT_CONFIG_SYSTEM") : "/etc/gitconfig");
+#endif
+        free(tmp);
+    }
+
+    tmp = files;
+    if (getenv("GIT_CONFIG_GLOBAL")) {
+        ag_asprintf(&files, "%s%s\n", tmp, getenv("GIT_CONFIG_GLOBAL"));
+    } else if (getenv("XDG_CONFIG_HOME") && home) {
+        ag_asprintf(&files, "%s%s/git/config\n%s/.gitconfig\n", tmp, getenv("XDG_CONFIG_HOME"), home);
+    } else if (getenv("XDG_CONFIG_HOME")) {
+        ag_asprintf(&files, "%s%s/git/config\n", tmp, getenv("XDG_CONFIG_HOME"));
+    } else if (home) {
+        ag_asprintf(&files, "%s%s/.config/git/config\n%s/.gitconfig\n", tmp, home, home);
+    } else {
+        files = ag_strdup(tmp);
+    }
+    free(tmp);
+
+    repo = find_repo_config();
+    if (repo) {
+        tmp = files;
+        ag_asprintf(&files, "%s%s\n", tmp, repo);
+        free(tmp);
+        free(repo);
+    }
+    return files;
+}
+
+static int stamps_match(const gitconfig_entry_t *entry) {
+    gitconfig_stamp_t stamp;
+    struct stat statbuf;
+    size_t i;
+
+    for (i = 0; i < entry->stamps_len; i++) {
+        set_stamp(&stamp, stat(entry->stamp_paths[i], &statbuf) == 0 ? &statbuf : NULL);
+        if (stamp.size != entry->stamps[i].size || stamp.mtime != entry->stamps[i].mtime ||
+            stamp.mtime_nsec != entry->stamps[i].mtime_nsec) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static int read_string(cache_file_t *cf, uint64_t len, char **str) {
+    if (len > PATH_MAX * 64) {
+        return -1;
+    }
+    *str = cache_file_read_data(cf, len);
+    return *str ? 0 : -1;
+}
+
+static size_t load_cache(const char *path, gitconfig_entry_t **entries_p) {
+    cache_file_t cf;
+    gitconfig_cache_header_t header;
+    gitconfig_record_t record;
+    gitconfig_entry_t *entries = NULL;
+    size_t entries_len = 0;
+    uint64_t i, j;
+
+    *entries_p = NULL;
+    if (!cache_file_open(&cf, "git config cache", path, GITCONFIG_CACHE_MAGIC, &header, sizeof(header))) {
+        return 0;
+    }
+    if (header.entries_len > GITCONFIG_CACHE_MAX_ENTRIES) {
+        log_debug("Ignoring git config cache %s: bad header", path);
+        cache_file_close(&cf);
+        return 0;
+    }
+
+    entries = ag_calloc(header.entries_len + 1, sizeof(gitconfig_entry_t));
+    for (i = 0; i < header.entries_len; i++) {
+        gitconfig_entry_t *entry = &entries[entries_len];
+        if (!cache_file_read(&cf, &record, sizeof(record)) || record.stamps_len > GITCONFIG_MAX_STAMPS ||
+            read_string(&cf, record.key_len, &entry->key) != 0 ||
+            (record.value_len != GITCONFIG_UNSET && read_string(&cf, record.value_len, &entry->value) != 0)) {
+            free_entry(entry);
+            break;
+        }
+        entries_len++;
+        for (j = 0; j < record.stamps_len; j++) {
+            gitconfig_stamp_t stamp;
+            char *stamp_path = NULL;
+            if (!cache_file_read(&cf, &stamp, sizeof(stamp)) || read_string(&cf, stamp.path_len, &stamp_path) != 0) {
+                break;
+            }
+            entry->stamps = ag_realloc(entry->stamps, (entry->stamps_len + 1) * sizeof(gitconfig_stamp_t));
+            entry->stamp_paths = ag_realloc(entry->stamp_paths, (entry->stamps_len + 1) * sizeof(char *));
+            entry->stamps[entry->stamps_len] = stamp;
+            entry->stamp_paths[entry->stamps_len] = stamp_path;
+            entry->stamps_len++;
+        }
+        if (entry->stamps_len != record.stamps_len) {
+            /* Truncated. Make sure it can't match. */
+            free(entry->key);
+            entry->key = ag_strdup("");
+            break;
+        }
+    }
+    cache_file_close(&cf);
+    *entries_p = entries;
+    return entries_len;
+}
+
+static void save_cache(const char *path, const gitconfig_entry_t *entries, size_t entries_len) {
+    cache_file_t cf;
+    gitconfig_cache_header_t header;
+    gitconfig_record_t record;
+    size_t i, j;
+
+    if (!cache_file_create(&cf, "git config cache", path)) {
+        return;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, GITCONFIG_CACHE_MAGIC, sizeof(header.magic));
+    header.entries_len = entries_len;
+    fwrite(&header, sizeof(header), 1, cf.fp);
+    for (i = 0; i < entries_len; i++) {
+        record.key_len = strlen(entries[i].key);
+        record.value_len = entries[i].value ? strlen(entries[i].value) : GITCONFIG_UNSET;
+        record.stamps_len = entries[i].stamps_len;
+        fwrite(&record, sizeof(record), 1, cf.fp);
+        fwrite(entries[i].key, 1, record.key_len, cf.fp);
+        if (entries[i].value) {
+            fwrite(entries[i].value, 1, record.value_len, cf.fp);
+        }
+        for (j = 0; j < entries[i].stamps_len; j++) {
+            fwrite(&entries[i].stamps[j], sizeof(gitconfig_stamp_t), 1, cf.fp);
+            fwrite(entries[i].stamp_paths[j], 1, entries[i].stamps[j].path_len, cf.fp);
+        }
+    }
+
+    cache_file_commit(&cf);
+}
+
+char *git_excludes_file(const char *cache_path) {
+    gitconfig_entry_t *entries = NULL;
+    size_t entries_len = 0;
+    gitconfig_entry_t *entry = NULL;
+    char *files;
+    char *file;
+    char *value = NULL;
+    size_t i;
+
+    files = config_files();
+    if (cache_path) {
+        entries_len = load_cache(cache_path, &entries);
+        for (i = 0; i < entries_len; i++) {
+            if (strcmp(entries[i].key, files) == 0) {
+                entry = &entries[i];
+                break;
+            }
+        }
+        if (entry && stamps_match(entry)) {
+            log_debug("Using cached git config from %s", cache_path);
+            value = entry->value ? ag_strdup(entry->value) : NULL;
+            free(files);
+            for (i = 0; i < entries_len; i++) {
+                free_entry(&entries[i]);
+            }
+            free(entries);
+            return value;
+        }
+        if (entry == NULL) {
+            if (entries_len >= GITCONFIG_CACHE_MAX_ENTRIES) {
+                for (i = 0; i < entries_len; i++) {
+                    free_entry(&entries[i]);
+                }
+                entries_len = 0;
+            }
+            if (entries == NULL) {
+                entries = ag_calloc(1, sizeof(gitconfig_entry_t));
+            }
+            entry = &entries[entries_len++];
+        } else {
+            free_entry(entry);
+        }
+    } else {
+        entries = ag_calloc(1, sizeof(gitconfig_entry_t));
+        entries_len = 1;
+        entry = &entries[0];
+    }
+
+    memset(entry, 0, sizeof(gitconfig_entry_t));
+    entry->key = files;
+    for (file = files; *file != '\0'; file = strchr(file, '\n') + 1) {
+        char *path = ag_strndup(file, strchr(file, '\n') - file);
+        int rc = parse_config(path, entry, 0);
+        free(path);
+        if (rc != 0) {
+            free(entry->value);
+            entry->value = NULL;
+            break;
+        }
+    }
+    if (entry->value) {
+        value = ag_strdup(entry->value);
+    }
+
+    if (cache_path) {
+        save_cache(cache_path, entries, entries_len);
+    }
+    for (i = 0; i < entries_len; i++) {
+        free_entry(&entries[i]);
+    }
+    free(entries);
+    return value;
+}
@@ -0,0 +1,18 @@
+#ifndef GITCONFIG_H
+#define GITCONFIG_H
+
+/* Stop saving other repos' entries after this many */
+#define GITCONFIG_CACHE_MAX_ENTRIES 256
+
+/* Reads core.excludesfile from the git config files that apply in the current
+ * directory, the way `git config --path --get core.excludesfile` would.
+ * Returns NULL if it isn't set. If cache_path isn't NULL, the answer is kept
+ * there and reused until one of the config files changes. */
+char *git_excludes_file(const char *cache_path);
+
+/* Looks for .git from start up, like git does. Returns the git directory and
+ * sets *work_tree (if work_tree isn't NULL) to the directory holding it, or
+ * returns NULL if start isn't in a repository. */
+char *git_find_dir(const char *start, char **work_tree);
+
+#endif
@@ -0,0 +1,379 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "globset.h"
+#include "uthash.h"
+#include "util.h"
+
+#ifdef _WIN32
+#include <shlwapi.h>
+#else
+#include <infnmatch.h>
+#endif
+
+/* Each compiled pattern becomes a run of positions: one per element, then
+ * one that accepts. The NFA state is the set of positions
+ * we could be at, plus the parent's DFA state for child sets, and each
+ * distinct one becomes a DFA state. */
+
+enum glob_pos_type {
+    GLOB_POS_CHAR,
+    GLOB_POS_STAR,
+    GLOB_POS_ACCEPT
+};
+
+typedef struct {
+    enum glob_pos_type type;
+    int pattern;
+    unsigned char set[32]; /* Bytes a GLOB_POS_CHAR matches */
+} glob_pos_t;
+
+#define GLOB_STATE_UNKNOWN 0xFFFF
+
+typedef struct {
+    int index; /* In globset.states */
+    /* key[0] is the parent's state, or 0 if there's no parent. The rest is
+     * the set of positions. */
+    uint64_t *key;
+    int accept; /* First pattern accepted here, or -1 */
+    int dead;   /* Nothing can match from here */
+    uint16_t next[256];
+    UT_hash_handle hh;
+} glob_state_t;
+
+struct globset {
+    int flags;
+    char **patterns;
+#ifndef _WIN32
+    ag_glob_t **globs; /* patterns, compiled */
+#endif
+    size_t patterns_len;
+
+    globset_t *parent;
+    size_t parent_len;     /* globset_len(parent) */
+    int parent_generation; /* parent->generation our states were built with */
+
+    /* Built by globset_compile() */
+    int compiled;
+    glob_pos_t *pos;
+    size_t pos_len;
+    size_t words; /* uint64_t's in a state key */
+    uint64_t *scratch;
+
+    glob_state_t **states;
+    size_t states_len;
+    glob_state_t *states_hash;
+    int start;
+    int generation; /* Bumped whenever the states are thrown away */
+};
+
+#define BIT_SET(bits, i) ((bits)[(i) >> 6] |= (uint64_t)1 << ((i)&63))
+#define BIT_TEST(bits, i) ((bits)[(i) >> 6] & ((uint64_t)1 << ((i)&63)))
+#define SET_TEST(set, c) ((set)[(c) >> 3] & (1 << ((c)&7)))
+
+globset_t *globset_new(const int flags) {
+    globset_t *gs = ag_calloc(1, sizeof(globset_t));
+    gs->flags = flags;
+    gs->start = -1;
+    return gs;
+}
+
+globset_t *globset_new_child(globset_t *parent) {
+    globset_t *gs = globset_new(parent->flags);
+    if (globset_len(parent) > 0) {
+        gs->parent = parent;
+        gs->parent_len = globset_len(parent);
+    }
+    return gs;
+}
+
+static void globset_flush_states(globset_t *gs) {
+    size_t i;
+    HASH_CLEAR(hh, gs->states_hash);
+    for (i = 0; i < gs->states_len; i++) {
+        free(gs->states[i]->key);
+        free(gs->states[i]);
+    }
+    free(gs->states);
+    gs->states = NULL;
+    gs->states_len = 0;
+    gs->start = -1;
+    gs->generation++;
+}
+
+static void globset_uncompile(globset_t *gs) {
+    globset_flush_states(gs);
+    free(gs->pos);
+    gs->pos = NULL;
+    gs->pos_len = 0;
+    free(gs->scratch);
+    gs->scratch = NULL;
+    gs->compiled = FALSE;
+}
+
+void globset_free(globset_t *gs) {
+    size_t i;
+    if (gs == NULL) {
+        return;
+    }
+    globset_uncompile(gs);
+    for (i = 0; i < gs->patterns_len; i++) {
+        free(gs->patterns[i]);
+#ifndef _WIN32
+        ag_glob_free(gs->globs[i]);
+#endif
+    }
+    free(gs->patterns);
+#ifndef _WIN32
+    free(gs->globs);
+#endif
+    free(gs);
+}
+
+void globset_add(globset_t *gs, const char *pattern) {
+#ifndef _WIN32
+    ag_glob_t *glob = ag_glob_compile(pattern, gs->flags);
+    if (glob == NULL) {
+        die("Couldn't compile glob %s", pattern);
+    }
+    gs->globs = ag_realloc(gs->globs, (gs->patterns_len + 1) * sizeof(ag_glob_t *));
+    gs->globs[gs->patterns_len] = glob;
+#endif
+    gs->patterns = ag_realloc(gs->patterns, (gs->patterns_len + 1) * sizeof(char *));
+    gs->patterns[gs->patterns_len++] = ag_strdup(pattern);
+    if (gs->compiled) {
+        globset_uncompile(gs);
+    }
+}
+
+size_t globset_len(const globset_t *gs) {
+    return gs->parent_len + gs->patterns_len;
+}
+
+const char *globset_pattern(const globset_t *gs, const size_t i) {
+    if (i < gs->parent_len) {
+        return globset_pattern(gs->parent, i);
+    }
+    return gs->patterns[i - gs->parent_len];
+}
+
+#ifndef _WIN32
+static glob_pos_t *add_pos(globset_t *gs, enum glob_pos_type type, int pattern) {
+    glob_pos_t *pos;
+    gs->pos = ag_realloc(gs->pos, (gs->pos_len + 1) * sizeof(glob_pos_t));
+    pos = &gs->pos[gs->pos_len++];
+    memset(pos, 0, sizeof(glob_pos_t));
+    pos->type = type;
+    pos->pattern = pattern;
+    return pos;
+}
+
+static void globset_compile(globset_t *gs) {
+    size_t i;
+
+    for (i = 0; i < gs->patterns_len; i++) {
+        const ag_glob_t *glob = gs->globs[i];
+        int pattern = gs->parent_len + i;
+        size_t j;
+        for (j = 0; j < glob->elems_len; j++) {
+            if (glob->elems[j].type == AG_GLOB_STAR) {
+                add_pos(gs, GLOB_POS_STAR, pattern);
+            } else {
+                glob_pos_t *pos = add_pos(gs, GLOB_POS_CHAR, pattern);
+                memcpy(pos->set, glob->elems[j].set, sizeof(pos->set));
+            }
+        }
+        add_pos(gs, GLOB_POS_ACCEPT, pattern);
+    }
+    gs->words = 1 + (gs->pos_len + 63) / 64;
+    gs->scratch = ag_malloc(gs->words * sizeof(uint64_t));
+    gs->compiled = TRUE;
+}
+
+/* A star can match nothing, so being at one means being after it too */
+static void closure(const globset_t *gs, uint64_t *bits) {
+    size_t i;
+    for (i = 0; i < gs->pos_len; i++) {
+        if (gs->pos[i].type == GLOB_POS_STAR && BIT_TEST(bits, i)) {
+            BIT_SET(bits, i + 1);
+        }
+    }
+}
+
+static int add_state(globset_t *gs, const uint64_t *key) {
+    glob_state_t *state = NULL;
+    const uint64_t *bits = key + 1;
+    size_t len = gs->words * sizeof(uint64_t);
+    size_t i;
+
+    HASH_FIND(hh, gs->states_hash, key, len, state);
+    if (state) {
+        return state->index;
+    }
+
+    if (gs->states_len >= GLOBSET_MAX_STATES) {
+        globset_flush_states(gs);
+    }
+
+    state = ag_malloc(sizeof(glob_state_t));
+    state->index = gs->states_len;
+    state->key = ag_malloc(len);
+    memcpy(state->key, key, len);
+    state->accept = -1;
+    state->dead = TRUE;
+    if (gs->parent) {
+        glob_state_t *parent_state = gs->parent->states[key[0]];
+        state->accept = parent_state->accept;
+        state->dead = parent_state->dead;
+    }
+    for (i = 0; i < gs->pos_len && state->accept < 0; i++) {
+        if (!BIT_TEST(bits, i)) {
+            continue;
+        }
+        state->dead = FALSE;
+        if (gs->pos[i].type == GLOB_POS_ACCEPT) {
+            state->accept = gs->pos[i].pattern;
+        }
+    }
+    if (state->accept >= 0) {
+        state->dead = FALSE;
+    }
+    memset(state->next, 0xFF, sizeof(state->next));
+    HASH_ADD_KEYPTR(hh, gs->states_hash, state->key, len, state);
+
+    gs->states = ag_realloc(gs->states, (gs->states_len + 1) * sizeof(glob_state_t *));
+    gs->states[gs->states_len] = state;
+    return gs->states_len++;
+}
+
+/* Our states hold the parent's state numbers, so they're no good once the
+ * parent throws its states away. */
+static void check_parent(globset_t *gs) {
+    if (gs->parent == NULL) {
+        return;
+    }
+    check_parent(gs->parent);
+    if (gs->parent->generation != gs->parent_generation) {
+        globset_flush_states(gs);
+        gs->parent_generation = gs->parent->generation;
+    }
+}
+
+static int start_state(globset_t *gs) {
+    size_t i;
+    int pattern = -1;
+    uint64_t parent_start = 0;
+
+    if (!gs->compiled) {
+        globset_compile(gs);
+    }
+    check_parent(gs);
+    if (gs->start >= 0) {
+        return gs->start;
+    }
+    if (gs->parent) {
+        parent_start = start_state(gs->parent);
+        check_parent(gs);
+    }
+    memset(gs->scratch, 0, gs->words * sizeof(uint64_t));
+    gs->scratch[0] = parent_start;
+    for (i = 0; i < gs->pos_len; i++) {
+        if (gs->pos[i].pattern != pattern) {
+            pattern = gs->pos[i].pattern;
+            BIT_SET(gs->scratch + 1, i);
+        }
+    }
+    closure(gs, gs->scratch + 1);
+    gs->start = add_state(gs, gs->scratch);
+    return gs->start;
+}
+
+static int next_state(globset_t *gs, int cur, unsigned char c) {
+    glob_state_t *state = gs->states[cur];
+    const int slash = !!(gs->flags & FNM_PATHNAME);
+    int generation = gs->generation;
+    uint64_t *bits;
+    size_t i;
+    int next;
+
+    if (state->next[c] != GLOB_STATE_UNKNOWN) {
+        return state->next[c];
+    }
+
+    memset(gs->scratch, 0, gs->words * sizeof(uint64_t));
+    bits = gs->scratch + 1;
+    for (i = 0; i < gs->pos_len; i++) {
+        if (!BIT_TEST(state->key + 1, i)) {
+            continue;
+        }
+        switch (gs->pos[i].type) {
+            case GLOB_POS_STAR:
+                if (!(slash && c == '/')) {
+                    BIT_SET(bits, i);
+                }
+                break;
+            case GLOB_POS_CHAR:
+                if (SET_TEST(gs->pos[i].set, c)) {
+                    BIT_SET(bits, i + 1);
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    closure(gs, bits);
+
+    if (gs->parent) {
+        gs->scratch[0] = next_state(gs->parent, state->key[0], c);
+        /* If the parent started over, so do we. That frees state, but the
+         * key in scratch uses the parent's new numbering and is still good. */
+        check_parent(gs);
+    }
+
+    next = add_state(gs, gs->scratch);
+    /* If add_state() made room by throwing states away, state is gone */
+    if (gs->generation == generation) {
+        state->next[c] = next;
+    }
+    return next;
+}
+#endif
+
+int globset_match(globset_t *gs, const char *str) {
+#ifdef _WIN32
+    size_t i;
+    for (i = 0; i < globset_len(gs); i++) {
+        if (PathMatchSpec(str, globset_pattern(gs, i))) {
+            return i;
+        }
+    }
+    return -1;
+#else
+    const unsigned char *s = (const unsigned char *)str;
+    size_t i;
+    int cur;
+
+    if (globset_len(gs) == 0) {
+        return -1;
+    }
+    /* Building DFA states costs more than it saves for a few patterns */
+    if (gs->parent == NULL && gs->patterns_len <= GLOBSET_MAX_SCAN) {
+        for (i = 0; i < gs->patterns_len; i++) {
+            if (ag_glob_match(gs->globs[i], str) == 0) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    cur = start_state(gs);
+    for (; *s; s++) {
+        cur = next_state(gs, cur, *s);
+        if (gs->states[cur]->dead) {
+            return -1;
+        }
+    }
+    return gs->states[cur]->accept;
+#endif
+}
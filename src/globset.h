@@ -0,0 +1,36 @@
+#ifndef GLOBSET_H
+#define GLOBSET_H
+
+#include <stddef.h>
+
+/* Matches a string against many glob patterns at once. The patterns are
+ * combined into one automaton that's turned into a DFA as strings come in,
+ * so the cost per string doesn't grow with the number of patterns.
+ * Same results as ag_fnmatch() with the same flags. Not thread-safe.
+ *
+ * A child set matches its parent's patterns plus its own. It reuses the
+ * parent's DFA instead of compiling the parent's patterns again, so adding a
+ * few patterns to a big set is cheap. The parent has to outlive the child
+ * and can't get new patterns while the child is around. */
+typedef struct globset globset_t;
+
+/* Most DFA states to keep around before starting over */
+#define GLOBSET_MAX_STATES 4096
+
+/* Sets with no parent and this many patterns or fewer match them one at a
+ * time instead of building a DFA */
+#define GLOBSET_MAX_SCAN 2
+
+globset_t *globset_new(const int flags);
+globset_t *globset_new_child(globset_t *parent);
+void globset_free(globset_t *gs);
+
+void globset_add(globset_t *gs, const char *pattern);
+size_t globset_len(const globset_t *gs);
+const char *globset_pattern(const globset_t *gs, const size_t i);
+
+/* Patterns are numbered parent's first. Returns the index of the first
+ * pattern that matches str, or -1 */
+int globset_match(globset_t *gs, const char *str);
+
+#endif
@@ -0,0 +1,561 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+#ifdef HAVE_ZLIB_H
+#define ZLIB_CONST 1
+#include <zlib.h>
+#endif
+
+#include "gzip_members.h"
+#include "log.h"
+#include "util.h"
+
+#if HAVE_FOPENCOOKIE && defined(HAVE_ZLIB_H)
+
+/* Big gzip files are often members one after the other: BGZF files are
+ * blocks of up to 64KB, and cat or pigz --independent make them too. Each
+ * member can be inflated on its own, so the file is cut into segments where
+ * members start, and threads inflate segments ahead of the reader.
+ *
+ * BGZF blocks say how long they are. Other members can only be found by
+ * looking for their headers, which can also turn up by chance inside a
+ * member. A segment's output is only used if the member before it ended
+ * exactly where the segment starts. Otherwise the reader carries on
+ * inflating that member itself, past the segments it runs over.
+ *
+ * A single member can be cut up the same way once it's been indexed. Each
+ * segment then starts at a checkpoint, and ends where the next one does. */
+
+#define SERIAL_OUT_SIZE (256 * 1024)
+
+enum segment_state {
+    SEGMENT_WAITING,
+    SEGMENT_DECODING,
+    SEGMENT_DONE
+};
+
+enum segment_end {
+    SEGMENT_ENDED,    /* The last member ended where the segment does */
+    SEGMENT_OPEN,     /* Stopped inside a member. stream can carry on. */
+    SEGMENT_DATA_END, /* What followed a member wasn't another one */
+    SEGMENT_ERROR
+};
+
+typedef struct {
+    enum segment_state state;
+    enum segment_end end;
+    unsigned char *out;
+    size_t out_len;
+    size_t in_pos; /* Where inflating stopped */
+    z_stream stream;
+    int stream_live;
+    int out_read;
+} segment_t;
+
+typedef struct {
+    const unsigned char *buf;
+    size_t buf_len;
+    const char *path;
+    gzip_index_t *index; /* If it's a single member */
+    size_t *starts;      /* starts[segments_len] is buf_len */
+    segment_t *segments;
+    size_t segments_len;
+    size_t window; /* How many segments threads inflate ahead of the reader */
+    pthread_t *threads;
+    int threads_len;
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;
+    size_t next_segment; /* Next one for a thread to take */
+    size_t reading;      /* First segment the reader hasn't finished with */
+    int stop;
+
+    /* The reader */
+    const unsigned char *pending; /* Output it hasn't returned yet */
+    size_t pending_len;
+    int serial;            /* Inflating serial_segment's stream itself */
+    size_t serial_segment;
+    size_t in_pos;
+    unsigned char *serial_out;
+    int eof;
+    int error;
+} gzip_members_t;
+
+static cookie_read_function_t gzip_members_read;
+static cookie_close_function_t gzip_members_close;
+
+static const cookie_io_functions_t gzip_members_io = {
+    .read = gzip_members_read,
+    .write = NULL,
+    .seek = NULL,
+    .close = gzip_members_close,
+};
+
+/* A header with the deflate method, no reserved flags, and extra flags and
+ * an OS that gzip would write */
+static int is_member_header(const unsigned char *p, const size_t len) {
+    return len >= 10 && p[0] == 0x1F && p[1] == 0x8B && p[2] == 8 && (p[3] & 0xE0) == 0 &&
+           (p[8] == 0 || p[8] == 2 || p[8] == 4) && (p[9] <= 13 || p[9] == 255);
+}
+
+/* Returns the length of the BGZF block at p, or 0 if it isn't one */
+static size_t bgzf_block_len(const unsigned char *p, const size_t len) {
+    size_t xlen;
+    size_t i;
+
+    if (!is_member_header(p, len) || !(p[3] & 0x04) || len < 12) {
+        return 0;
+    }
+    xlen = p[10] | (p[11] << 8);
+    if (12 + xlen > len) {
+        return 0;
+    }
+    for (i = 12; i + 4 <= 12 + xlen;) {
+        size_t slen = p[i + 2] | (p[i + 3] << 8);
+        if (p[i] == 'B' && p[i + 1] == 'C' && slen == 2 && i + 6 <= 12 + xlen) {
+            return (p[i + 4] | (p[i + 5] << 8)) + 1;
+        }
+        i += 4 + slen;
+    }
+    return 0;
+}
+
+static void add_start(gzip_members_t *gz, const size_t start) {
+    gz->starts = ag_realloc(gz->starts, (gz->segments_len + 2) * sizeof(size_t));
+    gz->starts[gz->segments_len++] = start;
+}
+
+/* Cuts the file into segments of about GZIP_SEGMENT_SIZE */
+static void find_segments(gzip_members_t *gz) {
+    size_t last = 0;
+    size_t pos = 0;
+    size_t block_len;
+    const unsigned char *p;
+
+    add_start(gz, 0);
+
+    /* BGZF blocks all say how long they are */
+    while (pos < gz->buf_len && (block_len = bgzf_block_len(gz->buf + pos, gz->buf_len - pos)) > 0) {
+        if (pos - last >= GZIP_SEGMENT_SIZE) {
+            add_start(gz, pos);
+            last = pos;
+        }
+        pos += block_len;
+    }
+
+    /* Anything else has to be searched for */
+    pos = ag_max(pos, last + GZIP_SEGMENT_SIZE);
+    while (pos < gz->buf_len) {
+        p = memchr(gz->buf + pos, 0x1F, gz->buf_len - pos);
+        if (p == NULL) {
+            break;
+        }
+        pos = p - gz->buf;
+        if (is_member_header(p, gz->buf_len - pos)) {
+            add_start(gz, pos);
+            pos += GZIP_SEGMENT_SIZE;
+        } else {
+            pos++;
+        }
+    }
+    gz->starts[gz->segments_len] = gz->buf_len;
+}
+
+/* Cuts an indexed member at its checkpoints */
+static void index_segments(gzip_members_t *gz) {
+    size_t i;
+
+    add_start(gz, 0);
+    for (i = 0; i < gz->index->checkpoints_len; i++) {
+        add_start(gz, gz->index->checkpoints[i].in);
+    }
+    gz->starts[gz->segments_len] = gz->buf_len;
+}
+
+static void inflate_segment(gzip_members_t *gz, segment_t *seg, size_t pos, const size_t end) {
+    size_t out_size = 0;
+    int ret;
+
+    seg->end = SEGMENT_ERROR;
+    memset(&seg->stream, 0, sizeof(seg->stream));
+    /* Gzip members only */
+    if (inflateInit2(&seg->stream, 16 + MAX_WBITS) != Z_OK) {
+        seg->in_pos = pos;
+        return;
+    }
+    seg->stream_live = TRUE;
+
+    for (;;) {
+        if (seg->out_len == out_size) {
+            out_size = out_size ? out_size * 2 : ag_max((end - pos) * 4, 64 * 1024);
+            seg->out = ag_realloc(seg->out, out_size);
+        }
+        seg->stream.next_in = gz->buf + pos;
+        seg->stream.avail_in = ag_min(end - pos, UINT_MAX);
+        seg->stream.next_out = seg->out + seg->out_len;
+        seg->stream.avail_out = ag_min(out_size - seg->out_len, UINT_MAX);
+        ret = inflate(&seg->stream, Z_NO_FLUSH);
+        pos = (const unsigned char *)seg->stream.next_in - gz->buf;
+        seg->out_len = seg->stream.next_out - seg->out;
+
+        if (ret == Z_STREAM_END) {
+            if (pos == end) {
+                seg->end = SEGMENT_ENDED;
+                break;
+            }
+            if (!is_member_header(gz->buf + pos, gz->buf_len - pos)) {
+                seg->end = SEGMENT_DATA_END;
+                break;
+            }
+            inflateReset(&seg->stream);
+        } else if (ret == Z_OK || ret == Z_BUF_ERROR) {
+            if ((pos == end && seg->stream.avail_out > 0) || seg->out_len >= GZIP_SEGMENT_MAX_OUTPUT) {
+                seg->end = SEGMENT_OPEN;
+                break;
+            }
+        } else {
+            break;
+        }
+    }
+
+    seg->in_pos = pos;
+    if (seg->end != SEGMENT_OPEN) {
+        inflateEnd(&seg->stream);
+        seg->stream_live = FALSE;
+    }
+}
+
+/* Inflates the part of an indexed member from checkpoint i - 1 to
+ * checkpoint i. Segment 0 starts with the gzip header instead. */
+static void inflate_checkpoint_segment(gzip_members_t *gz, segment_t *seg, const size_t i) {
+    const gzip_checkpoint_t *cp = i > 0 ? &gz->index->checkpoints[i - 1] : NULL;
+    uint64_t out_start = cp ? cp->out : 0;
+    uint64_t out_end = i < gz->index->checkpoints_len ? gz->index->checkpoints[i].out : gz->index->out_len;
+    size_t pos = gz->starts[i];
+    int ret;
+
+    seg->end = SEGMENT_ERROR;
+    seg->in_pos = pos;
+    memset(&seg->stream, 0, sizeof(seg->stream));
+    if (inflateInit2(&seg->stream, cp ? -MAX_WBITS : 16 + MAX_WBITS) != Z_OK) {
+        return;
+    }
+    /* A checkpoint can fall in the middle of a byte */
+    if (cp && cp->bits > 0) {
+        inflatePrime(&seg->stream, cp->bits, gz->buf[pos - 1] >> (8 - cp->bits));
+    }
+    if (cp) {
+        inflateSetDictionary(&seg->stream, cp->window, cp->window_len);
+    }
+
+    seg->out_len = out_end - out_start;
+    seg->out = ag_malloc(seg->out_len);
+    seg->stream.next_out = seg->out;
+    seg->stream.avail_out = seg->out_len;
+    do {
+        seg->stream.next_in = gz->buf + pos;
+        seg->stream.avail_in = ag_min(gz->buf_len - pos, UINT_MAX);
+        ret = inflate(&seg->stream, Z_NO_FLUSH);
+        pos = (const unsigned char *)seg->stream.next_in - gz->buf;
+    } while (ret == Z_OK && seg->stream.avail_out > 0 && pos < gz->buf_len);
+
+    /* The index says how much there is, so anything else is an error */
+    if (seg->stream.avail_out == 0 && (ret == Z_OK || ret == Z_STREAM_END || ret == Z_BUF_ERROR)) {
+        seg->end = SEGMENT_ENDED;
+    }
+    seg->in_pos = pos;
+    inflateEnd(&seg->stream);
+}
+
+static void *inflate_thread(void *arg) {
+    gzip_members_t *gz = arg;
+    size_t i;
+
+    for (;;) {
+        pthread_mutex_lock(&gz->mtx);
+        for (;;) {
+            /* The reader may have gone past some without them */
+            if (gz->next_segment < gz->reading) {
+                gz->next_segment = gz->reading;
+            }
+            if (gz->stop || gz->next_segment == gz->segments_len || gz->next_segment < gz->reading + gz->window) {
+                break;
+            }
+            pthread_cond_wait(&gz->cond, &gz->mtx);
+        }
+        if (gz->stop || gz->next_segment == gz->segments_len) {
+            pthread_mutex_unlock(&gz->mtx);
+            break;
+        }
+        i = gz->next_segment++;
+        gz->segments[i].state = SEGMENT_DECODING;
+        pthread_mutex_unlock(&gz->mtx);
+
+        if (gz->index) {
+            inflate_checkpoint_segment(gz, &gz->segments[i], i);
+        } else {
+            inflate_segment(gz, &gz->segments[i], gz->starts[i], gz->starts[i + 1]);
+        }
+
+        pthread_mutex_lock(&gz->mtx);
+        gz->segments[i].state = SEGMENT_DONE;
+        pthread_cond_broadcast(&gz->cond);
+        pthread_mutex_unlock(&gz->mtx);
+    }
+
+    return NULL;
+}
+
+static segment_t *wait_segment(gzip_members_t *gz, const size_t i) {
+    pthread_mutex_lock(&gz->mtx);
+    while (gz->segments[i].state != SEGMENT_DONE) {
+        pthread_cond_wait(&gz->cond, &gz->mtx);
+    }
+    pthread_mutex_unlock(&gz->mtx);
+    return &gz->segments[i];
+}
+
+/* Frees a segment the reader is done with */
+static void release_segment(gzip_members_t *gz, const size_t i) {
+    segment_t *seg = &gz->segments[i];
+
+    pthread_mutex_lock(&gz->mtx);
+    while (seg->state == SEGMENT_DECODING) {
+        pthread_cond_wait(&gz->cond, &gz->mtx);
+    }
+    seg->state = SEGMENT_DONE;
+    pthread_mutex_unlock(&gz->mtx);
+
+    free(seg->out);
+    seg->out = NULL;
+    seg->out_len = 0;
+    if (seg->stream_live) {
+        inflateEnd(&seg->stream);
+        seg->stream_live = FALSE;
+    }
+}
+
+/* Moves the reader on to segment i, letting threads take more */
+static void set_reading(gzip_members_t *gz, const size_t i) {
+    pthread_mutex_lock(&gz->mtx);
+    gz->reading = i;
+    pthread_cond_broadcast(&gz->cond);
+    pthread_mutex_unlock(&gz->mtx);
+}
+
+/* Inflates a bit more of the member the reader carries on with itself */
+static void inflate_serial(gzip_members_t *gz) {
+    z_stream *stream = &gz->segments[gz->serial_segment].stream;
+    size_t i = gz->reading;
+    int ret;
+
+    stream->next_in = gz->buf + gz->in_pos;
+    stream->avail_in = ag_min(gz->buf_len - gz->in_pos, UINT_MAX);
+    stream->next_out = gz->serial_out;
+    stream->avail_out = SERIAL_OUT_SIZE;
+    ret = inflate(stream, Z_NO_FLUSH);
+    gz->in_pos = (const unsigned char *)stream->next_in - gz->buf;
+    gz->pending = gz->serial_out;
+    gz->pending_len = stream->next_out - gz->serial_out;
+
+    /* Segments it went past didn't start with a member */
+    while (i < gz->segments_len && gz->starts[i] < gz->in_pos) {
+        release_segment(gz, i++);
+    }
+    if (i != gz->reading) {
+        set_reading(gz, i);
+    }
+
+    if (ret == Z_STREAM_END) {
+        if (gz->in_pos == gz->buf_len) {
+            gz->eof = TRUE;
+        } else if (i < gz->segments_len && gz->starts[i] == gz->in_pos) {
+            /* Back in step with the threads */
+            release_segment(gz, gz->serial_segment);
+            gz->serial = FALSE;
+        } else if (is_member_header(gz->buf + gz->in_pos, gz->buf_len - gz->in_pos)) {
+            inflateReset(stream);
+        } else {
+            gz->eof = TRUE;
+        }
+    } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+        log_err("Found mem/data error while decompressing zlib stream in %s: %s", gz->path, zError(ret));
+        gz->error = TRUE;
+        gz->eof = TRUE;
+    } else if (gz->in_pos == gz->buf_len && stream->avail_out > 0) {
+        log_err("Truncated gzip stream in %s", gz->path);
+        gz->error = TRUE;
+        gz->eof = TRUE;
+    }
+}
+
+/* Points gz->pending at the next output. Returns FALSE at the end. */
+static int next_output(gzip_members_t *gz) {
+    segment_t *seg;
+
+    for (;;) {
+        if (gz->pending_len > 0) {
+            return TRUE;
+        }
+        if (gz->eof) {
+            return FALSE;
+        }
+        if (gz->serial) {
+            inflate_serial(gz);
+            continue;
+        }
+        if (gz->reading == gz->segments_len) {
+            gz->eof = TRUE;
+            continue;
+        }
+
+        seg = wait_segment(gz, gz->reading);
+        if (!seg->out_read) {
+            seg->out_read = TRUE;
+            gz->pending = seg->out;
+            gz->pending_len = seg->out_len;
+            continue;
+        }
+        switch (seg->end) {
+            case SEGMENT_ENDED:
+                release_segment(gz, gz->reading);
+                set_reading(gz, gz->reading + 1);
+                break;
+            case SEGMENT_OPEN:
+                /* Its stream stays with it, so it's kept until the member ends */
+                gz->serial = TRUE;
+                gz->serial_segment = gz->reading;
+                gz->in_pos = seg->in_pos;
+                free(seg->out);
+                seg->out = NULL;
+                if (gz->serial_out == NULL) {
+                    gz->serial_out = ag_malloc(SERIAL_OUT_SIZE);
+                }
+                set_reading(gz, gz->reading + 1);
+                break;
+            case SEGMENT_DATA_END:
+                gz->eof = TRUE;
+                break;
+            default:
+                log_err("Found mem/data error while decompressing zlib stream in %s", gz->path);
+                gz->error = TRUE;
+                gz->eof = TRUE;
+                break;
+        }
+    }
+}
+
+static ssize_t gzip_members_read(void *cookie, char *buf, size_t size) {
+    gzip_members_t *gz = cookie;
+    size_t total = 0;
+    size_t len;
+
+    while (total < size && next_output(gz)) {
+        len = ag_min(gz->pending_len, size - total);
+        memcpy(buf + total, gz->pending, len);
+        gz->pending += len;
+        gz->pending_len -= len;
+        total += len;
+    }
+    if (total == 0 && gz->error) {
+        errno = EIO;
+        return -1;
+    }
+    return total;
+}
+
+static void gzip_members_free(gzip_members_t *gz) {
+    size_t i;
+
+    for (i = 0; gz->segments != NULL && i < gz->segments_len; i++) {
+        free(gz->segments[i].out);
+        if (gz->segments[i].stream_live) {
+            inflateEnd(&gz->segments[i].stream);
+        }
+    }
+    pthread_mutex_destroy(&gz->mtx);
+    pthread_cond_destroy(&gz->cond);
+    free(gz->serial_out);
+    free(gz->threads);
+    free(gz->segments);
+    free(gz->starts);
+    gzip_index_free(gz->index);
+    free(gz);
+}
+
+static int gzip_members_close(void *cookie) {
+    gzip_members_t *gz = cookie;
+    int i;
+
+    pthread_mutex_lock(&gz->mtx);
+    gz->stop = TRUE;
+    pthread_cond_broadcast(&gz->cond);
+    pthread_mutex_unlock(&gz->mtx);
+    for (i = 0; i < gz->threads_len; i++) {
+        pthread_join(gz->threads[i], NULL);
+    }
+    gzip_members_free(gz);
+    return 0;
+}
+
+FILE *gzip_members_open(const void *buf, const size_t buf_len, const char *path, int threads, gzip_index_t *index) {
+    gzip_members_t *gz;
+    FILE *fp;
+    int i;
+
+    if (threads < 1 || !is_member_header(buf, buf_len)) {
+        gzip_index_free(index);
+        return NULL;
+    }
+
+    gz = ag_calloc(1, sizeof(gzip_members_t));
+    gz->buf = buf;
+    gz->buf_len = buf_len;
+    gz->path = path;
+    gz->index = index;
+    if (index) {
+        index_segments(gz);
+    } else {
+        find_segments(gz);
+    }
+    /* One member is inflated the usual way, so there's nothing else to set up */
+    if (gz->segments_len < 2) {
+        free(gz->starts);
+        gzip_index_free(index);
+        free(gz);
+        return NULL;
+    }
+    log_debug("%s has %lu segments of gzip %s", path, (unsigned long)gz->segments_len, index ? "checkpoints" : "members");
+
+    pthread_mutex_init(&gz->mtx, NULL);
+    pthread_cond_init(&gz->cond, NULL);
+    gz->segments = ag_calloc(gz->segments_len, sizeof(segment_t));
+    gz->window = 2 * threads;
+    gz->threads = ag_calloc(threads, sizeof(pthread_t));
+    for (i = 0; i < threads; i++) {
+        if (pthread_create(&gz->threads[i], NULL, &inflate_thread, gz) != 0) {
+            break;
+        }
+        gz->threads_len++;
+    }
+    if (gz->threads_len == 0) {
+        gzip_members_free(gz);
+        return NULL;
+    }
+
+    fp = fopencookie(gz, "r", gzip_members_io);
+    if (fp == NULL) {
+        gzip_members_close(gz);
+    }
+    return fp;
+}
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef GZIP_MEMBERS_H
+#define GZIP_MEMBERS_H
+
+#include <stdio.h>
+
+#include "config.h"
+#include "decompress.h"
+
+/* Threads inflate the file this much at a time, cut where a member starts */
+#define GZIP_SEGMENT_SIZE (1024 * 1024)
+/* A segment that would inflate to more than this is left to the reader */
+#define GZIP_SEGMENT_MAX_OUTPUT (32 * 1024 * 1024)
+#define GZIP_MAX_THREADS 8
+
+#if HAVE_FOPENCOOKIE && defined(HAVE_ZLIB_H)
+/* Opens a gzip file made of several members for reading, with threads
+ * inflating the members ahead of the reader. buf has to stay mapped until
+ * the stream is closed. Returns NULL if buf is a single member.
+ *
+ * With an index, a single member is inflated from its checkpoints instead.
+ * The stream frees the index when it's closed, or right away if it returns
+ * NULL. */
+FILE *gzip_members_open(const void *buf, const size_t buf_len, const char *path, int threads, gzip_index_t *index);
+#endif
+
+#endif
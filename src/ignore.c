@@ -6,15 +6,19 @@
 #include <string.h>
 #include <sys/stat.h>
 
+#include "globset.h"
 #include "ignore.h"
+#include "ignore_cache.h"
+#include "lang.h"
 #include "log.h"
 #include "options.h"
 #include "scandir.h"
+#include "uthash.h"
 #include "util.h"
 
 #ifdef _WIN32
-#include <shlwapi.h>
-#define ag_fnmatch(x, y, z) (!PathMatchSpec(y, x))
+/* globset uses PathMatchSpec() on Windows */
+const int fnmatch_flags = 0;
 #else
 #include <infnmatch.h>
 const int fnmatch_flags = FNM_PATHNAME;
@@ -30,6 +34,42 @@ const char *evil_hardcoded_ignore_files[] = {
     NULL
 };
 
+/* Files with these extensions are binary virtually every time, so they're
+ * skipped without being opened. --binary-ext and --text-ext change the list.
+ * Keep it lowercase. */
+const char *default_binary_extensions[] = {
+    "7z", "a", "avi", "bin", "bmp", "bz2", "class", "db", "dll", "dmg",
+    "doc", "docx", "dylib", "eot", "exe", "flac", "gif", "gz", "ico",
+    "iso", "jar", "jpeg", "jpg", "lib", "mkv", "mov", "mp3", "mp4", "o", "obj",
+    "ogg", "otf", "pdb", "pdf", "png", "psd", "pyc", "pyd", "pyo", "so",
+    "sqlite", "tar", "tgz", "tif", "tiff", "ttf", "wasm", "wav", "webm",
+    "webp", "whl", "woff", "woff2", "xls", "xlsx", "xz", "zip", "zst",
+    NULL
+};
+
+/* Compressed files --search-zip can look inside. These don't count as
+ * binary when it's on. */
+const char *zip_extensions[] = {
+    "bz2",
+    "ear",
+    "gz",
+    "jar",
+    "tar",
+    "tbz",
+    "tbz2",
+    "tgz",
+    "txz",
+    "tzst",
+    "war",
+    "xz",
+    "zip",
+    "zst",
+    NULL
+};
+
+static char **binary_extensions = NULL;
+static size_t binary_extensions_len = 0;
+
 /* Warning: changing the first two strings will break skip_vcs_ignores. */
 const char *ignore_pattern_files[] = {
     ".ignore",
@@ -39,6 +79,377 @@ const char *ignore_pattern_files[] = {
     NULL
 };
 
+/* A set of strings that can be looked up without copying them out of a path */
+typedef struct {
+    const char *key;
+    size_t key_len;
+    const char *pattern; /* For debug messages */
+    UT_hash_handle hh;
+} str_set_t;
+
+/* Literal prefixes of "foo*" patterns, or suffixes of "*foo" patterns. One
+ * lookup per distinct length. */
+typedef struct {
+    str_set_t *set;
+    size_t *lens;
+    size_t lens_len;
+} affix_set_t;
+
+/* Names with a slash in them, like "foo/bar". They match a run of whole path
+ * components that ends at the file, so they're looked up by every suffix of
+ * the path that starts a component. */
+typedef struct {
+    const char *key;
+    size_t key_len;
+    const char *pattern;
+    /* Where the ignore file was. The run has to start below it. */
+    const char *dir;
+    size_t dir_len;
+    UT_hash_handle hh;
+} name_tail_t;
+
+/* Globs from a directory with "!" patterns. They only count for files that
+ * none of that directory's "!" patterns match. */
+struct ignore_group {
+    affix_set_t invert_prefixes;
+    affix_set_t invert_suffixes;
+    globset_t *invert_regexes;
+
+    affix_set_t prefixes;
+    affix_set_t suffixes;
+    globset_t *regexes;
+};
+
+/* Everything that applies to the files in one directory. The hash sets only
+ * hold the directory's own patterns, and lookups go on to the parent's, so
+ * compiling a directory doesn't cost more the more its parents have. The
+ * glob sets are children of the parent's and match its patterns too.
+ * Patterns that only match below their ignore file are rebased onto paths
+ * relative to the search path. */
+struct ignore_matcher {
+    const ignores *owner;
+    const struct ignore_matcher *parent;
+
+    str_set_t *extensions;
+    str_set_t *names;     /* Matched against the filename */
+    str_set_t *top_names; /* Names from ignore files at the top of the search */
+    name_tail_t *tails;
+    str_set_t *paths;        /* Slash names */
+    globset_t *path_regexes; /* Slash regexes */
+
+    affix_set_t prefixes;
+    affix_set_t suffixes;
+    globset_t *regexes;
+
+    struct ignore_group **groups;
+    size_t groups_len;
+    struct ignore_group *group; /* This directory's, if it has "!" patterns */
+    /* Some directory has no "!" patterns, so the ackmate filter applies
+     * whatever the file is called */
+    int ackmate;
+
+    char **strings; /* Rebased patterns */
+    size_t strings_len;
+};
+
+static void str_set_add(str_set_t **set, const char *key, const size_t key_len, const char *pattern) {
+    str_set_t *entry = NULL;
+    HASH_FIND(hh, *set, key, key_len, entry);
+    if (entry) {
+        return;
+    }
+    entry = ag_malloc(sizeof(str_set_t));
+    entry->key = key;
+    entry->key_len = key_len;
+    entry->pattern = pattern;
+    HASH_ADD_KEYPTR(hh, *set, entry->key, entry->key_len, entry);
+}
+
+static const char *str_set_find(const str_set_t *set, const char *key, const size_t key_len) {
+    const str_set_t *entry = NULL;
+    if (set == NULL) {
+        return NULL;
+    }
+    HASH_FIND(hh, set, key, key_len, entry);
+    return entry ? entry->pattern : NULL;
+}
+
+static void str_set_free(str_set_t **set) {
+    str_set_t *entry;
+    str_set_t *tmp;
+    HASH_ITER(hh, *set, entry, tmp) {
+        HASH_DELETE(hh, *set, entry);
+        free(entry);
+    }
+}
+
+static void affix_set_add(affix_set_t *affixes, const char *key, const size_t key_len, const char *pattern) {
+    size_t i;
+    str_set_add(&affixes->set, key, key_len, pattern);
+    for (i = 0; i < affixes->lens_len; i++) {
+        if (affixes->lens[i] == key_len) {
+            return;
+        }
+    }
+    affixes->lens = ag_realloc(affixes->lens, (affixes->lens_len + 1) * sizeof(size_t));
+    affixes->lens[affixes->lens_len++] = key_len;
+}
+
+static void affix_set_free(affix_set_t *affixes) {
+    str_set_free(&affixes->set);
+    free(affixes->lens);
+}
+
+/* Returns the "foo*" pattern that matches str, or NULL. Like ag_fnmatch()
+ * with FNM_PATHNAME, the rest of str can't have a slash in it. */
+static const char *affix_set_find_prefix(const affix_set_t *affixes, const char *str, const size_t str_len) {
+    size_t i;
+    for (i = 0; i < affixes->lens_len; i++) {
+        size_t len = affixes->lens[i];
+        const char *pattern;
+        if (len > str_len) {
+            continue;
+        }
+        pattern = str_set_find(affixes->set, str, len);
+        if (pattern && memchr(str + len, '/', str_len - len) == NULL) {
+            return pattern;
+        }
+    }
+    return NULL;
+}
+
+/* Same for "*foo" patterns */
+static const char *affix_set_find_suffix(const affix_set_t *affixes, const char *str, const size_t str_len) {
+    size_t i;
+    for (i = 0; i < affixes->lens_len; i++) {
+        size_t len = affixes->lens[i];
+        const char *pattern;
+        if (len > str_len) {
+            continue;
+        }
+        pattern = str_set_find(affixes->set, str + str_len - len, len);
+        if (pattern && memchr(str, '/', str_len - len) == NULL) {
+            return pattern;
+        }
+    }
+    return NULL;
+}
+
+/* Literal text that can go in a prefix or suffix bucket */
+static int is_plain_literal(const char *s, const size_t len) {
+    size_t i;
+    for (i = 0; i < len; i++) {
+        if (strchr("*?[]\\/", s[i])) {
+            return FALSE;
+        }
+    }
+    return len > 0;
+}
+
+/* Puts "foo*" and "*foo" patterns in buckets and everything else in the glob set */
+static void add_glob(affix_set_t *prefixes, affix_set_t *suffixes, globset_t *globs, const char *pattern) {
+    size_t len = strlen(pattern);
+    if (len > 1 && pattern[0] == '*' && is_plain_literal(pattern + 1, len - 1)) {
+        affix_set_add(suffixes, pattern + 1, len - 1, pattern);
+    } else if (len > 1 && pattern[len - 1] == '*' && is_plain_literal(pattern, len - 1)) {
+        affix_set_add(prefixes, pattern, len - 1, pattern);
+    } else {
+        globset_add(globs, pattern);
+    }
+}
+
+static void name_tail_add(name_tail_t **tails, const char *key, const size_t key_len, const char *pattern, const char *dir, const size_t dir_len) {
+    name_tail_t *entry = NULL;
+    HASH_FIND(hh, *tails, key, key_len, entry);
+    if (entry) {
+        return;
+    }
+    entry = ag_malloc(sizeof(name_tail_t));
+    entry->key = key;
+    entry->key_len = key_len;
+    entry->pattern = pattern;
+    entry->dir = dir;
+    entry->dir_len = dir_len;
+    HASH_ADD_KEYPTR(hh, *tails, entry->key, entry->key_len, entry);
+}
+
+static void name_tail_free(name_tail_t **tails) {
+    name_tail_t *entry;
+    name_tail_t *tmp;
+    HASH_ITER(hh, *tails, entry, tmp) {
+        HASH_DELETE(hh, *tails, entry);
+        free(entry);
+    }
+}
+
+/* Returns dir + "/" + pattern, with any glob characters in dir escaped */
+static char *rebase_pattern(const char *dir, const size_t dir_len, const char *pattern, const int escape) {
+    char *rebased = ag_malloc(dir_len * 2 + strlen(pattern) + 2);
+    char *p = rebased;
+    size_t i;
+
+    for (i = 0; i < dir_len; i++) {
+#ifndef _WIN32
+        if (escape && strchr("*?[]\\", dir[i])) {
+            *p++ = '\\';
+        }
+#endif
+        *p++ = dir[i];
+    }
+    if (dir_len > 0) {
+        *p++ = '/';
+    }
+    strcpy(p, pattern);
+    return rebased;
+}
+
+static const char *add_string(struct ignore_matcher *m, char *str) {
+    m->strings = ag_realloc(m->strings, (m->strings_len + 1) * sizeof(char *));
+    m->strings[m->strings_len++] = str;
+    return str;
+}
+
+/* A child set if there's a parent set to build on */
+static globset_t *new_globset(globset_t *parent) {
+    return parent ? globset_new_child(parent) : globset_new(fnmatch_flags);
+}
+
+static struct ignore_group *compile_group(const ignores *ig) {
+    struct ignore_group *group = ag_calloc(1, sizeof(struct ignore_group));
+    size_t i;
+
+    group->invert_regexes = globset_new(fnmatch_flags);
+    for (i = 0; i < ig->invert_regexes_len; i++) {
+        add_glob(&group->invert_prefixes, &group->invert_suffixes, group->invert_regexes, ig->invert_regexes[i]);
+    }
+    group->regexes = globset_new(fnmatch_flags);
+    for (i = 0; i < ig->regexes_len; i++) {
+        add_glob(&group->prefixes, &group->suffixes, group->regexes, ig->regexes[i]);
+    }
+    return group;
+}
+
+static void free_group(struct ignore_group *group) {
+    if (group == NULL) {
+        return;
+    }
+    affix_set_free(&group->invert_prefixes);
+    affix_set_free(&group->invert_suffixes);
+    globset_free(group->invert_regexes);
+    affix_set_free(&group->prefixes);
+    affix_set_free(&group->suffixes);
+    globset_free(group->regexes);
+    free(group);
+}
+
+static struct ignore_matcher *compile_ignores(const ignores *ig, const struct ignore_matcher *parent) {
+    struct ignore_matcher *m = ag_calloc(1, sizeof(struct ignore_matcher));
+    size_t i;
+
+    m->owner = ig;
+    m->parent = parent;
+    if (parent) {
+        m->ackmate = parent->ackmate;
+    }
+
+    for (i = 0; i < ig->extensions_len; i++) {
+        str_set_add(&m->extensions, ig->extensions[i], strlen(ig->extensions[i]), ig->extensions[i]);
+    }
+    for (i = 0; i < ig->names_len; i++) {
+        const char *name = ig->names[i];
+        size_t name_len = strlen(name);
+        str_set_add(&m->names, name, name_len, name);
+        if (ig->abs_path_len == 0) {
+            str_set_add(&m->top_names, name, name_len, name);
+        }
+        if (strchr(name, '/')) {
+            name_tail_add(&m->tails, name, name_len, name, ig->abs_path, ig->abs_path_len);
+        }
+    }
+    for (i = 0; i < ig->slash_names_len; i++) {
+        const char *path = add_string(m, rebase_pattern(ig->abs_path, ig->abs_path_len, ig->slash_names[i], FALSE));
+        str_set_add(&m->paths, path, strlen(path), ig->slash_names[i]);
+    }
+
+    m->path_regexes = new_globset(parent ? parent->path_regexes : NULL);
+    for (i = 0; i < ig->slash_regexes_len; i++) {
+        globset_add(m->path_regexes, add_string(m, rebase_pattern(ig->abs_path, ig->abs_path_len, ig->slash_regexes[i], TRUE)));
+    }
+
+    m->regexes = new_globset(parent ? parent->regexes : NULL);
+    if (ig->invert_regexes_len > 0) {
+        m->group = compile_group(ig);
+    } else {
+        for (i = 0; i < ig->regexes_len; i++) {
+            add_glob(&m->prefixes, &m->suffixes, m->regexes, ig->regexes[i]);
+        }
+        m->ackmate = TRUE;
+    }
+
+    /* Nothing new here, so use the parent's sets as they are */
+    if (parent && globset_len(m->path_regexes) == globset_len(parent->path_regexes)) {
+        globset_free(m->path_regexes);
+        m->path_regexes = parent->path_regexes;
+    }
+    if (parent && globset_len(m->regexes) == globset_len(parent->regexes)) {
+        globset_free(m->regexes);
+        m->regexes = parent->regexes;
+    }
+
+    m->groups_len = (parent ? parent->groups_len : 0) + (m->group ? 1 : 0);
+    if (m->groups_len > 0) {
+        m->groups = ag_malloc(m->groups_len * sizeof(struct ignore_group *));
+        if (parent && parent->groups_len > 0) {
+            memcpy(m->groups, parent->groups, parent->groups_len * sizeof(struct ignore_group *));
+        }
+        if (m->group) {
+            m->groups[m->groups_len - 1] = m->group;
+        }
+    }
+    return m;
+}
+
+static void free_matcher(struct ignore_matcher *m) {
+    size_t i;
+    if (m == NULL) {
+        return;
+    }
+    str_set_free(&m->extensions);
+    str_set_free(&m->names);
+    str_set_free(&m->top_names);
+    name_tail_free(&m->tails);
+    str_set_free(&m->paths);
+    if (m->parent == NULL || m->path_regexes != m->parent->path_regexes) {
+        globset_free(m->path_regexes);
+    }
+    affix_set_free(&m->prefixes);
+    affix_set_free(&m->suffixes);
+    if (m->parent == NULL || m->regexes != m->parent->regexes) {
+        globset_free(m->regexes);
+    }
+    free(m->groups);
+    free_group(m->group);
+    for (i = 0; i < m->strings_len; i++) {
+        free(m->strings[i]);
+    }
+    free(m->strings);
+    free(m);
+}
+
+static struct ignore_matcher *get_matcher(ignores *ig) {
+    struct ignore_matcher *parent;
+    if (ig->matcher != NULL) {
+        return ig->matcher;
+    }
+    parent = ig->parent ? get_matcher(ig->parent) : NULL;
+    if (parent && is_empty(ig) && ig->invert_regexes_len == 0) {
+        ig->matcher = parent;
+    } else {
+        ig->matcher = compile_ignores(ig, parent);
+    }
+    return ig->matcher;
+}
+
 int is_empty(ignores *ig) {
     return (ig->extensions_len + ig->names_len + ig->slash_names_len + ig->regexes_len + ig->slash_regexes_len == 0);
 }
@@ -57,6 +468,8 @@ ignores *init_ignore(ignores *parent, const char *dirname, const size_t dirname_
     ig->invert_regexes_len = 0;
     ig->slash_regexes = NULL;
     ig->slash_regexes_len = 0;
+    ig->matcher = NULL;
+    ig->walk_context = parent ? parent->walk_context : 0;
     ig->dirname = dirname;
     ig->dirname_len = dirname_len;
 
@@ -90,15 +503,55 @@ void cleanup_ignore(ignores *ig) {
     free_strings(ig->regexes, ig->regexes_len);
     free_strings(ig->invert_regexes, ig->invert_regexes_len);
     free_strings(ig->slash_regexes, ig->slash_regexes_len);
+    if (ig->matcher && ig->matcher->owner == ig) {
+        free_matcher(ig->matcher);
+    }
     if (ig->abs_path) {
         free(ig->abs_path);
     }
     free(ig);
 }
 
-void add_ignore_pattern(ignores *ig, const char *pattern) {
-    int i;
-    int pattern_len;
+/* Which list of struct ignores a pattern goes in. Also the order of the lists
+ * in the ignore cache. */
+enum {
+    IGNORE_EXTENSIONS,
+    IGNORE_NAMES,
+    IGNORE_SLASH_NAMES,
+    IGNORE_REGEXES,
+    IGNORE_INVERT_REGEXES,
+    IGNORE_SLASH_REGEXES
+};
+
+static char ***ignore_list(ignores *ig, int kind, size_t **len_p) {
+    switch (kind) {
+        case IGNORE_EXTENSIONS:
+            *len_p = &(ig->extensions_len);
+            return &(ig->extensions);
+        case IGNORE_NAMES:
+            *len_p = &(ig->names_len);
+            return &(ig->names);
+        case IGNORE_SLASH_NAMES:
+            *len_p = &(ig->slash_names_len);
+            return &(ig->slash_names);
+        case IGNORE_REGEXES:
+            *len_p = &(ig->regexes_len);
+            return &(ig->regexes);
+        case IGNORE_INVERT_REGEXES:
+            *len_p = &(ig->invert_regexes_len);
+            return &(ig->invert_regexes);
+        default:
+            *len_p = &(ig->slash_regexes_len);
+            return &(ig->slash_regexes);
+    }
+}
+
+/* Strips the pattern down to what gets stored and returns which list it goes
+ * in, or -1 if there's nothing left. */
+static int classify_pattern(const char **pattern_p, size_t *pattern_len_p) {
+    const char *pattern = *pattern_p;
+    size_t pattern_len;
+    int kind;
 
     /* Strip off the leading dot so that matches are more likely. */
     if (strncmp(pattern, "./", 2) == 0) {
@@ -113,65 +566,184 @@ void add_ignore_pattern(ignores *ig, const char *pattern) {
     }
 
     if (pattern_len == 0) {
-        log_debug("Pattern is empty. Not adding any ignores.");
-        return;
+        return -1;
     }
 
-    char ***patterns_p;
-    size_t *patterns_len;
     if (is_fnmatch(pattern)) {
         if (pattern[0] == '*' && pattern[1] == '.' && strchr(pattern + 2, '.') && !is_fnmatch(pattern + 2)) {
-            patterns_p = &(ig->extensions);
-            patterns_len = &(ig->extensions_len);
+            kind = IGNORE_EXTENSIONS;
             pattern += 2;
             pattern_len -= 2;
         } else if (pattern[0] == '/') {
-            patterns_p = &(ig->slash_regexes);
-            patterns_len = &(ig->slash_regexes_len);
+            kind = IGNORE_SLASH_REGEXES;
             pattern++;
             pattern_len--;
         } else if (pattern[0] == '!') {
-            patterns_p = &(ig->invert_regexes);
-            patterns_len = &(ig->invert_regexes_len);
+            kind = IGNORE_INVERT_REGEXES;
             pattern++;
             pattern_len--;
         } else {
-            patterns_p = &(ig->regexes);
-            patterns_len = &(ig->regexes_len);
+            kind = IGNORE_REGEXES;
         }
     } else {
         if (pattern[0] == '/') {
-            patterns_p = &(ig->slash_names);
-            patterns_len = &(ig->slash_names_len);
+            kind = IGNORE_SLASH_NAMES;
             pattern++;
             pattern_len--;
         } else {
-            patterns_p = &(ig->names);
-            patterns_len = &(ig->names_len);
+            kind = IGNORE_NAMES;
         }
     }
 
-    ++*patterns_len;
+    *pattern_p = pattern;
+    *pattern_len_p = pattern_len;
+    return kind;
+}
+
+static void invalidate_matcher(ignores *ig) {
+    if (ig->matcher) {
+        if (ig->matcher->owner == ig) {
+            free_matcher(ig->matcher);
+        }
+        ig->matcher = NULL;
+    }
+}
+
+static int cmp_patterns(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Sorts patterns and frees duplicates. Returns the new length. */
+static size_t sort_patterns(char **patterns, size_t patterns_len) {
+    size_t i;
+    size_t len = 0;
+
+    qsort(patterns, patterns_len, sizeof(char *), cmp_patterns);
+    for (i = 0; i < patterns_len; i++) {
+        if (len > 0 && strcmp(patterns[len - 1], patterns[i]) == 0) {
+            free(patterns[i]);
+            continue;
+        }
+        patterns[len++] = patterns[i];
+    }
+    return len;
+}
 
+/* Merges sorted, de-duped patterns into one of ig's lists and takes ownership
+ * of the strings. */
+static void add_sorted_patterns(ignores *ig, int kind, char **patterns, size_t patterns_len) {
+    char ***list_p;
+    size_t *list_len_p;
+    char **merged;
+    size_t i = 0, j = 0, len = 0;
+
+    if (patterns_len == 0) {
+        return;
+    }
+    invalidate_matcher(ig);
+    list_p = ignore_list(ig, kind, &list_len_p);
+
+    merged = ag_malloc((*list_len_p + patterns_len) * sizeof(char *));
+    while (i < *list_len_p || j < patterns_len) {
+        int rc;
+        if (i == *list_len_p) {
+            rc = 1;
+        } else if (j == patterns_len) {
+            rc = -1;
+        } else {
+            rc = strcmp((*list_p)[i], patterns[j]);
+        }
+        if (rc <= 0) {
+            merged[len++] = (*list_p)[i++];
+            if (rc == 0) {
+                free(patterns[j++]);
+            }
+        } else {
+            log_debug("added ignore pattern %s to %s", patterns[j],
+                      ig == root_ignores ? "root ignores" : ig->abs_path);
+            merged[len++] = patterns[j++];
+        }
+    }
+    free(*list_p);
+    *list_p = merged;
+    *list_len_p = len;
+}
+
+void add_ignore_pattern(ignores *ig, const char *pattern) {
+    int i;
+    int kind;
+    size_t pattern_len;
+    char ***patterns_p;
+    size_t *patterns_len;
     char **patterns;
+    char *stored;
 
-    /* a balanced binary tree is best for performance, but I'm lazy */
+    kind = classify_pattern(&pattern, &pattern_len);
+    if (kind < 0) {
+        log_debug("Pattern is empty. Not adding any ignores.");
+        return;
+    }
+    patterns_p = ignore_list(ig, kind, &patterns_len);
+
+    stored = ag_strndup(pattern, pattern_len);
+    if (binary_search(stored, *patterns_p, 0, *patterns_len) >= 0) {
+        free(stored);
+        return;
+    }
+    invalidate_matcher(ig);
+
+    ++*patterns_len;
     *patterns_p = patterns = ag_realloc(*patterns_p, (*patterns_len) * sizeof(char *));
-    /* TODO: de-dupe these patterns */
     for (i = *patterns_len - 1; i > 0; i--) {
-        if (strcmp(pattern, patterns[i - 1]) > 0) {
+        if (strcmp(stored, patterns[i - 1]) > 0) {
             break;
         }
         patterns[i] = patterns[i - 1];
     }
-    patterns[i] = ag_strndup(pattern, pattern_len);
-    log_debug("added ignore pattern %s to %s", pattern,
+    patterns[i] = stored;
+    log_debug("added ignore pattern %s to %s", stored,
               ig == root_ignores ? "root ignores" : ig->abs_path);
 }
 
-/* For loading git/hg ignore patterns */
+/* Adds patterns from the ignore cache: NUL-terminated strings, list after list */
+static void add_cached_patterns(ignores *ig, const char *data, const size_t lens[IGNORE_CACHE_LISTS]) {
+    int kind;
+    size_t i;
+
+    for (kind = 0; kind < IGNORE_CACHE_LISTS; kind++) {
+        char **patterns;
+        if (lens[kind] == 0) {
+            continue;
+        }
+        patterns = ag_malloc(lens[kind] * sizeof(char *));
+        for (i = 0; i < lens[kind]; i++) {
+            size_t len = strlen(data);
+            patterns[i] = ag_strndup(data, len);
+            data += len + 1;
+        }
+        add_sorted_patterns(ig, kind, patterns, lens[kind]);
+        free(patterns);
+    }
+}
+
+/* For loading git/hg ignore patterns. The whole file is collected, sorted and
+ * de-duped before anything is added to ig. */
 void load_ignore_patterns(ignores *ig, const char *path) {
     FILE *fp = NULL;
+    struct stat statbuf;
+    const char *cached;
+    char **lists[IGNORE_CACHE_LISTS] = { NULL };
+    size_t lens[IGNORE_CACHE_LISTS] = { 0 };
+    size_t caps[IGNORE_CACHE_LISTS] = { 0 };
+    int kind;
+
+    if (opts.ignore_cache && stat(path, &statbuf) == 0 &&
+        ignore_cache_lookup(path, &statbuf, &cached, lens)) {
+        log_debug("Loading ignore file %s from the ignore cache.", path);
+        add_cached_patterns(ig, cached, lens);
+        return;
+    }
+
     fp = fopen(path, "r");
     if (fp == NULL) {
         log_debug("Skipping ignore file %s: not readable", path);
@@ -184,17 +756,225 @@ void load_ignore_patterns(ignores *ig, const char *path) {
     size_t line_cap = 0;
 
     while ((line_len = getline(&line, &line_cap, fp)) > 0) {
+        const char *pattern = line;
+        size_t pattern_len;
         if (line_len == 0 || line[0] == '\n' || line[0] == '#') {
             continue;
         }
         if (line[line_len - 1] == '\n') {
             line[line_len - 1] = '\0'; /* kill the \n */
         }
-        add_ignore_pattern(ig, line);
+        kind = classify_pattern(&pattern, &pattern_len);
+        if (kind < 0) {
+            continue;
+        }
+        if (lens[kind] == caps[kind]) {
+            caps[kind] = caps[kind] ? caps[kind] * 2 : 16;
+            lists[kind] = ag_realloc(lists[kind], caps[kind] * sizeof(char *));
+        }
+        lists[kind][lens[kind]++] = ag_strndup(pattern, pattern_len);
     }
-
     free(line);
+
+    for (kind = 0; kind < IGNORE_CACHE_LISTS; kind++) {
+        lens[kind] = sort_patterns(lists[kind], lens[kind]);
+    }
+
+    if (opts.ignore_cache && fstat(fileno(fp), &statbuf) == 0 && S_ISREG(statbuf.st_mode)) {
+        ignore_cache_add(path, &statbuf, lists, lens);
+    }
     fclose(fp);
+
+    for (kind = 0; kind < IGNORE_CACHE_LISTS; kind++) {
+        add_sorted_patterns(ig, kind, lists[kind], lens[kind]);
+        free(lists[kind]);
+    }
+}
+
+/* Which of ignore_pattern_files are in dir_list, the listing of path, as
+ * bits in ignore_pattern_files order. Directories without any don't cost a
+ * failed open each. Files in a subdirectory, like .git/info/exclude, count if
+ * the listing has the subdirectory. */
+unsigned int listed_ignore_files(struct dirent **dir_list, int dir_list_len) {
+    unsigned int listed = 0;
+    int files_len;
+    int i, j;
+
+    /* --skip-vcs-ignores only leaves .ignore */
+    files_len = opts.skip_vcs_ignores ? 1 : (int)(sizeof(ignore_pattern_files) / sizeof(ignore_pattern_files[0])) - 1;
+
+    for (i = 0; i < dir_list_len; i++) {
+        const char *name = dir_list[i]->d_name;
+        if (name[0] != '.') {
+            continue;
+        }
+        for (j = 0; j < files_len; j++) {
+            size_t len = strcspn(ignore_pattern_files[j], "/");
+            if (strncmp(name, ignore_pattern_files[j], len) == 0 && name[len] == '\0') {
+                listed |= 1u << j;
+            }
+        }
+    }
+    return listed;
+}
+
+void load_ignore_files(ignores *ig, const char *path, unsigned int files) {
+    char *file_path;
+    int j;
+
+    for (j = 0; ignore_pattern_files[j] != NULL; j++) {
+        if (!(files & (1u << j))) {
+            continue;
+        }
+        ag_asprintf(&file_path, "%s/%s", path, ignore_pattern_files[j]);
+        load_ignore_patterns(ig, file_path);
+        free(file_path);
+    }
+}
+
+void load_listed_ignore_files(ignores *ig, const char *path, struct dirent **dir_list, int dir_list_len) {
+    load_ignore_files(ig, path, listed_ignore_files(dir_list, dir_list_len));
+}
+
+static void add_binary_extension(const char *ext, const size_t ext_len) {
+    size_t i;
+    char *lower = ag_strndup(ext, ext_len);
+
+    for (i = 0; i < ext_len; i++) {
+        lower[i] = tolower((unsigned char)lower[i]);
+    }
+    if (binary_search(lower, binary_extensions, 0, binary_extensions_len) >= 0) {
+        free(lower);
+        return;
+    }
+
+    binary_extensions = ag_realloc(binary_extensions, (binary_extensions_len + 1) * sizeof(char *));
+    for (i = binary_extensions_len; i > 0; i--) {
+        if (strcmp(lower, binary_extensions[i - 1]) > 0) {
+            break;
+        }
+        binary_extensions[i] = binary_extensions[i - 1];
+    }
+    binary_extensions[i] = lower;
+    binary_extensions_len++;
+}
+
+static void remove_binary_extension(const char *ext, const size_t ext_len) {
+    char *lower = ag_strndup(ext, ext_len);
+    size_t i;
+    int pos;
+
+    for (i = 0; i < ext_len; i++) {
+        lower[i] = tolower((unsigned char)lower[i]);
+    }
+    pos = binary_search(lower, binary_extensions, 0, binary_extensions_len);
+    free(lower);
+    if (pos < 0) {
+        return;
+    }
+    free(binary_extensions[pos]);
+    binary_extensions_len--;
+    memmove(binary_extensions + pos, binary_extensions + pos + 1, (binary_extensions_len - pos) * sizeof(char *));
+}
+
+/* Calls fn for each extension in a list like "png,.jpg, o" */
+static void for_each_extension(const char *list, void (*fn)(const char *, const size_t)) {
+    const char *ext = list;
+    while (*ext) {
+        size_t len;
+        while (*ext == ',' || *ext == '.' || isspace((unsigned char)*ext)) {
+            ext++;
+        }
+        len = strcspn(ext, ", \t");
+        if (len > 0) {
+            fn(ext, len);
+        }
+        ext += len;
+    }
+}
+
+void init_binary_extensions(const char *add, const char *remove) {
+    size_t i;
+    for (i = 0; default_binary_extensions[i] != NULL; i++) {
+        add_binary_extension(default_binary_extensions[i], strlen(default_binary_extensions[i]));
+    }
+    if (add) {
+        for_each_extension(add, add_binary_extension);
+    }
+    if (remove) {
+        for_each_extension(remove, remove_binary_extension);
+    }
+}
+
+void cleanup_binary_extensions(void) {
+    size_t i;
+    for (i = 0; i < binary_extensions_len; i++) {
+        free(binary_extensions[i]);
+    }
+    free(binary_extensions);
+    binary_extensions = NULL;
+    binary_extensions_len = 0;
+}
+
+/* Returns 1 if filename has an extension from the binary extension table */
+int is_binary_extension(const char *filename) {
+    char ext[16];
+    const char *dot = strrchr(filename, '.');
+    size_t i;
+
+    if (dot == NULL || dot == filename || dot[1] == '\0') {
+        return 0;
+    }
+    dot++;
+    for (i = 0; dot[i] != '\0'; i++) {
+        if (i == sizeof(ext) - 1) {
+            return 0;
+        }
+        ext[i] = tolower((unsigned char)dot[i]);
+    }
+    ext[i] = '\0';
+
+    if (binary_search(ext, binary_extensions, 0, binary_extensions_len) < 0) {
+        return 0;
+    }
+    if (opts.search_zip_files) {
+        for (i = 0; zip_extensions[i] != NULL; i++) {
+            if (strcmp(ext, zip_extensions[i]) == 0) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/* Each string ends in a newline, which patterns can't contain, and each
+ * list in a \x01 */
+static void append_key_strings(char **key, size_t *key_len, char **const strs, size_t strs_len) {
+    size_t i;
+    for (i = 0; i < strs_len; i++) {
+        size_t len = strlen(strs[i]);
+        *key = ag_realloc(*key, *key_len + len + 2);
+        memcpy(*key + *key_len, strs[i], len);
+        (*key)[*key_len + len] = '\n';
+        *key_len += len + 1;
+    }
+    *key = ag_realloc(*key, *key_len + 2);
+    (*key)[(*key_len)++] = '\x01';
+    (*key)[*key_len] = '\0';
+}
+
+char *ignore_state_key(const ignores *ig) {
+    char *key = NULL;
+    size_t key_len = 0;
+
+    append_key_strings(&key, &key_len, ig->extensions, ig->extensions_len);
+    append_key_strings(&key, &key_len, ig->names, ig->names_len);
+    append_key_strings(&key, &key_len, ig->slash_names, ig->slash_names_len);
+    append_key_strings(&key, &key_len, ig->regexes, ig->regexes_len);
+    append_key_strings(&key, &key_len, ig->invert_regexes, ig->invert_regexes_len);
+    append_key_strings(&key, &key_len, ig->slash_regexes, ig->slash_regexes_len);
+    append_key_strings(&key, &key_len, binary_extensions, binary_extensions_len);
+    return key;
 }
 
 static int ackmate_dir_match(const char *dir_name) {
@@ -207,91 +987,160 @@ static int ackmate_dir_match(const char *dir_name) {
     return tre_regnexec(opts.ackmate_dir_filter, dir_name, strlen(dir_name), 1, pmatch, 0);
 }
 
-/* This is the hottest code in Ag. 10-15% of all execution time is spent here */
-static int path_ignore_search(const ignores *ig, const char *path, const char *filename) {
-    char *temp;
-    int temp_start_pos;
-    size_t i;
-    int match_pos;
+/* Returns the name in names that matches a run of whole path components in
+ * the first len bytes of path, or NULL */
+static const char *match_name_components(const str_set_t *names, const char *path, const size_t len) {
+    size_t start;
+    size_t end;
+    size_t run_end;
+    const char *name;
 
-    match_pos = binary_search(filename, ig->names, 0, ig->names_len);
-    if (match_pos >= 0) {
-        log_debug("file %s ignored because name matches static pattern %s", filename, ig->names[match_pos]);
-        return 1;
+    for (start = 0; start < len; start = end + 1) {
+        for (end = start; end < len && path[end] != '/'; end++) {
+        }
+        /* Names like "foo/bar" can span components */
+        for (run_end = end; run_end > start;) {
+            name = str_set_find(names, path + start, run_end - start);
+            if (name) {
+                return name;
+            }
+            if (run_end >= len) {
+                break;
+            }
+            for (run_end++; run_end < len && path[run_end] != '/'; run_end++) {
+            }
+        }
     }
+    return NULL;
+}
 
-    ag_asprintf(&temp, "%s/%s", path[0] == '.' ? path + 1 : path, filename);
-    //ig->abs_path has its leading slash stripped, so we have to strip the leading slash
-    //of temp as well
-    temp_start_pos = (temp[0] == '/') ? 1 : 0;
+/* Returns the name in m->tails that matches a run of whole path components
+ * ending at the end of path, or NULL */
+static const char *match_name_tails(const struct ignore_matcher *m, const char *path, const size_t path_len) {
+    const name_tail_t *tail = NULL;
+    size_t start = path_len;
 
-    if (strncmp(temp + temp_start_pos, ig->abs_path, ig->abs_path_len) == 0) {
-        char *slash_filename = temp + temp_start_pos + ig->abs_path_len;
-        if (slash_filename[0] == '/') {
-            slash_filename++;
+    while (start > 0) {
+        /* A trailing slash belongs to the last component */
+        for (start--; start > 0 && path[start - 1] != '/'; start--) {
+        }
+        HASH_FIND(hh, m->tails, path + start, path_len - start, tail);
+        if (tail == NULL) {
+            continue;
         }
-        match_pos = binary_search(slash_filename, ig->names, 0, ig->names_len);
-        if (match_pos >= 0) {
-            log_debug("file %s ignored because name matches static pattern %s", temp, ig->names[match_pos]);
-            free(temp);
+        if (tail->dir_len == 0) {
+            return tail->pattern;
+        }
+        if (start > tail->dir_len && path[tail->dir_len] == '/' && strncmp(path, tail->dir, tail->dir_len) == 0) {
+            return tail->pattern;
+        }
+    }
+    return NULL;
+}
+
+/* Returns the group pattern that matches filename, or NULL */
+static const char *group_find(const affix_set_t *prefixes, const affix_set_t *suffixes, globset_t *globs,
+                              const char *filename, const size_t filename_len) {
+    const char *pattern;
+    int match_pos;
+
+    pattern = affix_set_find_prefix(prefixes, filename, filename_len);
+    if (pattern == NULL) {
+        pattern = affix_set_find_suffix(suffixes, filename, filename_len);
+    }
+    if (pattern == NULL && (match_pos = globset_match(globs, filename)) >= 0) {
+        pattern = globset_pattern(globs, match_pos);
+    }
+    return pattern;
+}
+
+/* This is the hottest code in Ag. 10-15% of all execution time is spent here.
+ * temp is the file's path relative to the search path, with a leading slash
+ * if it's at the top. The last filename_len bytes are its name. The first
+ * prefix_len bytes of the path (after the leading slash) are directories we
+ * were given rather than walked into, so they weren't checked on the way down. */
+static int path_ignore_search(const struct ignore_matcher *m, int ackmate, const char *temp, const size_t temp_len,
+                              const size_t filename_len, const size_t prefix_len) {
+    const char *filename = temp + temp_len - filename_len;
+    const char *path = temp[0] == '/' ? temp + 1 : temp;
+    size_t path_len = temp_len - (path - temp);
+    const struct ignore_matcher *level;
+    const char *pattern;
+    size_t i;
+    int match_pos;
+
+    for (level = m; level != NULL; level = level->parent) {
+        pattern = str_set_find(level->names, filename, filename_len);
+        if (pattern) {
+            log_debug("file %s ignored because name matches static pattern %s", filename, pattern);
             return 1;
         }
 
-        match_pos = binary_search(slash_filename, ig->slash_names, 0, ig->slash_names_len);
-        if (match_pos >= 0) {
-            log_debug("file %s ignored because name matches slash static pattern %s", slash_filename, ig->slash_names[match_pos]);
-            free(temp);
+        pattern = str_set_find(level->paths, path, path_len);
+        if (pattern) {
+            log_debug("file %s ignored because name matches slash static pattern %s", path, pattern);
             return 1;
         }
 
-        for (i = 0; i < ig->names_len; i++) {
-            char *pos = strstr(slash_filename, ig->names[i]);
-            if (pos == slash_filename || (pos && *(pos - 1) == '/')) {
-                pos += strlen(ig->names[i]);
-                if (*pos == '\0' || *pos == '/') {
-                    log_debug("file %s ignored because path somewhere matches name %s", slash_filename, ig->names[i]);
-                    free(temp);
-                    return 1;
-                }
+        if (level->tails) {
+            pattern = match_name_tails(level, path, path_len);
+            if (pattern) {
+                log_debug("file %s ignored because path somewhere matches name %s", path, pattern);
+                return 1;
             }
-            log_debug("pattern %s doesn't match path %s", ig->names[i], slash_filename);
         }
 
-        for (i = 0; i < ig->slash_regexes_len; i++) {
-            if (ag_fnmatch(ig->slash_regexes[i], slash_filename, fnmatch_flags) == 0) {
-                log_debug("file %s ignored because name matches slash regex pattern %s", slash_filename, ig->slash_regexes[i]);
-                free(temp);
+        if (prefix_len > 0 && level->top_names) {
+            pattern = match_name_components(level->top_names, path, prefix_len);
+            if (pattern) {
+                log_debug("file %s ignored because path somewhere matches name %s", path, pattern);
                 return 1;
             }
-            log_debug("pattern %s doesn't match slash file %s", ig->slash_regexes[i], slash_filename);
         }
-    }
 
-    for (i = 0; i < ig->invert_regexes_len; i++) {
-        if (ag_fnmatch(ig->invert_regexes[i], filename, fnmatch_flags) == 0) {
-            log_debug("file %s not ignored because name matches regex pattern !%s", filename, ig->invert_regexes[i]);
-            free(temp);
-            return 0;
+        pattern = affix_set_find_prefix(&level->prefixes, filename, filename_len);
+        if (pattern == NULL) {
+            pattern = affix_set_find_suffix(&level->suffixes, filename, filename_len);
+        }
+        if (pattern) {
+            log_debug("file %s ignored because name matches regex pattern %s", filename, pattern);
+            return 1;
         }
-        log_debug("pattern !%s doesn't match file %s", ig->invert_regexes[i], filename);
     }
 
-    for (i = 0; i < ig->regexes_len; i++) {
-        if (ag_fnmatch(ig->regexes[i], filename, fnmatch_flags) == 0) {
-            log_debug("file %s ignored because name matches regex pattern %s", filename, ig->regexes[i]);
-            free(temp);
+    /* The glob sets have the parents' patterns already */
+    match_pos = globset_match(m->path_regexes, path);
+    if (match_pos >= 0) {
+        log_debug("file %s ignored because name matches slash regex pattern %s", path, globset_pattern(m->path_regexes, match_pos));
+        return 1;
+    }
+
+    match_pos = globset_match(m->regexes, filename);
+    if (match_pos >= 0) {
+        log_debug("file %s ignored because name matches regex pattern %s", filename, globset_pattern(m->regexes, match_pos));
+        return 1;
+    }
+
+    for (i = 0; i < m->groups_len; i++) {
+        const struct ignore_group *group = m->groups[i];
+        pattern = group_find(&group->invert_prefixes, &group->invert_suffixes, group->invert_regexes, filename, filename_len);
+        if (pattern) {
+            log_debug("file %s not ignored because name matches regex pattern !%s", filename, pattern);
+            continue;
+        }
+        pattern = group_find(&group->prefixes, &group->suffixes, group->regexes, filename, filename_len);
+        if (pattern) {
+            log_debug("file %s ignored because name matches regex pattern %s", filename, pattern);
             return 1;
         }
-        log_debug("pattern %s doesn't match file %s", ig->regexes[i], filename);
+        ackmate = TRUE;
     }
 
-    int rv = ackmate_dir_match(temp);
-    free(temp);
-    return rv;
+    return ackmate ? ackmate_dir_match(temp) : 0;
 }
 
 /* This function is REALLY HOT. It gets called for every file */
-int filename_filter(const char *path, const struct dirent *dir, void *baton) {
+int filename_filter_basic(const char *path, const struct dirent *dir) {
     const char *filename = dir->d_name;
     if (!opts.search_hidden_files && filename[0] == '.') {
         return 0;
@@ -314,12 +1163,33 @@ int filename_filter(const char *path, const struct dirent *dir, void *baton) {
         return 0;
     }
 
+    if (!opts.search_binary_files && is_binary_extension(filename) && !is_directory(path, dir)) {
+        log_debug("%s ignored because its extension is binary", filename);
+        return 0;
+    }
+
+    if (opts.file_type_extensions && !has_lang_extension(filename, opts.file_type_extensions, opts.file_type_extensions_len) && !is_directory(path, dir)) {
+        log_debug("%s ignored because it isn't one of the file types searched", filename);
+        return 0;
+    }
+    return 1;
+}
+
+int filename_filter(const char *path, const struct dirent *dir, void *baton) {
+    const char *filename = dir->d_name;
+
+    if (!filename_filter_basic(path, dir)) {
+        return 0;
+    }
+
     if (opts.search_all_files && !opts.path_to_ignore) {
         return 1;
     }
 
     scandir_baton_t *scandir_baton = (scandir_baton_t *)baton;
     const char *path_start = scandir_baton->path_start;
+    ignores *ig = scandir_baton->ig;
+    const struct ignore_matcher *m = get_matcher(ig);
 
     const char *extension = strchr(filename, '.');
     if (extension) {
@@ -335,51 +1205,73 @@ int filename_filter(const char *path, const struct dirent *dir, void *baton) {
 #ifdef HAVE_DIRENT_DNAMLEN
     size_t filename_len = dir->d_namlen;
 #else
-    size_t filename_len = 0;
+    size_t filename_len = strlen(filename);
 #endif
 
     if (strncmp(filename, "./", 2) == 0) {
-#ifndef HAVE_DIRENT_DNAMLEN
-        filename_len = strlen(filename);
-#endif
         filename++;
         filename_len--;
     }
 
-    const ignores *ig = scandir_baton->ig;
-
-    while (ig != NULL) {
-        if (extension) {
-            int match_pos = binary_search(extension, ig->extensions, 0, ig->extensions_len);
-            if (match_pos >= 0) {
-                log_debug("file %s ignored because name matches extension %s", filename, ig->extensions[match_pos]);
+    if (extension) {
+        size_t extension_len = strlen(extension);
+        const struct ignore_matcher *level;
+        for (level = m; level != NULL; level = level->parent) {
+            const char *ext_pattern = str_set_find(level->extensions, extension, extension_len);
+            if (ext_pattern) {
+                log_debug("file %s ignored because name matches extension %s", filename, ext_pattern);
                 return 0;
             }
         }
+    }
 
-        if (path_ignore_search(ig, path_start, filename)) {
-            return 0;
+    /* Room for a trailing slash to check directories with */
+    char temp_buf[PATH_MAX + 1];
+    char *temp = temp_buf;
+    size_t temp_len;
+    size_t prefix_len = 0;
+    int rv = 1;
+
+    if (path_start[0] == '.') {
+        path_start++;
+    }
+    temp_len = strlen(path_start) + 1 + filename_len;
+    if (temp_len + 2 > sizeof(temp_buf)) {
+        temp = ag_malloc(temp_len + 2);
+    }
+    sprintf(temp, "%s/%s", path_start, filename);
+
+    /* ig->abs_path is relative to the search path. Anything before it in
+     * temp is a path we were given and not one we walked into. */
+    {
+        size_t rel_len = filename_len + (ig->abs_path_len ? ig->abs_path_len + 1 : 0);
+        size_t path_len = temp_len - (temp[0] == '/' ? 1 : 0);
+        if (path_len > rel_len && temp[temp_len - rel_len - 1] == '/' &&
+            strncmp(temp + temp_len - rel_len, ig->abs_path, ig->abs_path_len) == 0) {
+            /* Not counting the slash after it */
+            prefix_len = path_len - rel_len - 1;
         }
+    }
 
-        if (is_directory(path, dir)) {
-#ifndef HAVE_DIRENT_DNAMLEN
-            if (!filename_len) {
-                filename_len = strlen(filename);
-            }
-#endif
-            if (filename[filename_len - 1] != '/') {
-                char *temp;
-                ag_asprintf(&temp, "%s/", filename);
-                int rv = path_ignore_search(ig, path_start, temp);
-                free(temp);
-                if (rv) {
-                    return 0;
-                }
-            }
+    /* A directory without patterns of its own shares its parent's matcher,
+     * but still has no "!" patterns to stop the ackmate filter. */
+    int ackmate = m->ackmate || m->owner != ig;
+
+    if (path_ignore_search(m, ackmate, temp, temp_len, filename_len, prefix_len)) {
+        rv = 0;
+    } else if (filename[filename_len - 1] != '/' && is_directory(path, dir)) {
+        temp[temp_len] = '/';
+        temp[temp_len + 1] = '\0';
+        if (path_ignore_search(m, ackmate, temp, temp_len + 1, filename_len + 1, prefix_len)) {
+            rv = 0;
         }
-        ig = ig->parent;
     }
 
-    log_debug("%s not ignored", filename);
-    return 1;
+    if (temp != temp_buf) {
+        free(temp);
+    }
+    if (rv) {
+        log_debug("%s not ignored", filename);
+    }
+    return rv;
 }
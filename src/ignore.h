@@ -2,6 +2,7 @@
 #define IGNORE_H
 
 #include <dirent.h>
+#include <stdint.h>
 #include <sys/types.h>
 
 struct ignores {
@@ -26,6 +27,15 @@ struct ignores {
     size_t abs_path_len;
 
     struct ignores *parent;
+
+    /* The patterns above, compiled the first time they're needed, on top of
+     * the parent's matcher. Shared with the parent if there are no patterns
+     * here. Patterns can't be added once a child has compiled its matcher. */
+    struct ignore_matcher *matcher;
+
+    /* --walk-cache: a hash of everything that decides how this directory's
+     * listing is filtered. Starts out as the parent's. 0 if unknown. */
+    uint64_t walk_context;
 };
 typedef struct ignores ignores;
 
@@ -33,6 +43,7 @@ extern ignores *root_ignores;
 
 extern const char *evil_hardcoded_ignore_files[];
 extern const char *ignore_pattern_files[];
+extern const char *default_binary_extensions[];
 
 ignores *init_ignore(ignores *parent, const char *dirname, const size_t dirname_len);
 void cleanup_ignore(ignores *ig);
@@ -40,8 +51,22 @@ void cleanup_ignore(ignores *ig);
 void add_ignore_pattern(ignores *ig, const char *pattern);
 
 void load_ignore_patterns(ignores *ig, const char *path);
+/* files is a bitmask of ignore_pattern_files */
+unsigned int listed_ignore_files(struct dirent **dir_list, int dir_list_len);
+void load_ignore_files(ignores *ig, const char *path, unsigned int files);
+void load_listed_ignore_files(ignores *ig, const char *path, struct dirent **dir_list, int dir_list_len);
+
+void init_binary_extensions(const char *add, const char *remove);
+void cleanup_binary_extensions(void);
+int is_binary_extension(const char *filename);
+
+/* ig's own patterns and the binary extensions, as one string. Walks with the
+ * same key and options filter files the same way. */
+char *ignore_state_key(const ignores *ig);
 
 int filename_filter(const char *path, const struct dirent *dir, void *baton);
+/* Everything filename_filter checks except the ignore patterns */
+int filename_filter_basic(const char *path, const struct dirent *dir);
 
 int is_empty(ignores *ig);
 
@@ -0,0 +1,277 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+
+#include "cache_file.h"
+#include "ignore_cache.h"
+#include "log.h"
+#include "uthash.h"
+#include "util.h"
+
+/* Ignore files already split into patterns, so unchanged ones don't have to
+ * be parsed again. Files are identified by absolute path, and the mtime and
+ * size make sure they haven't changed since. */
+
+#define IGNORE_CACHE_MAGIC "agign01"
+
+typedef struct {
+    char magic[8];
+    uint64_t entries_len;
+} ignore_cache_header_t;
+
+/* On disk, each entry is this followed by the path and the patterns */
+typedef struct {
+    int64_t mtime;
+    int64_t mtime_nsec;
+    int64_t size;
+    uint64_t path_len;
+    uint64_t data_len;
+    uint64_t lens[IGNORE_CACHE_LISTS];
+} ignore_cache_record_t;
+
+typedef struct {
+    char *path;
+    ignore_cache_record_t record;
+    char *data;
+    int used; /* Looked up or added in this run */
+    UT_hash_handle hh;
+} ignore_cache_entry_t;
+
+static ignore_cache_entry_t *ignore_cache = NULL;
+static size_t ignore_cache_len = 0;
+static int ignore_cache_dirty = FALSE;
+static char *ignore_cache_path = NULL;
+static char *ignore_cache_cwd = NULL;
+
+static char *absolute_path(const char *path) {
+    char *abs_path;
+    if (path[0] == '/' || ignore_cache_cwd == NULL) {
+        return ag_strdup(path);
+    }
+    ag_asprintf(&abs_path, "%s/%s", ignore_cache_cwd, path);
+    return abs_path;
+}
+
+static void free_entry(ignore_cache_entry_t *entry) {
+    free(entry->path);
+    free(entry->data);
+    free(entry);
+}
+
+/* Takes ownership of entry->path and entry->data */
+static void add_entry(ignore_cache_entry_t *entry) {
+    ignore_cache_entry_t *old = NULL;
+
+    HASH_FIND_STR(ignore_cache, entry->path, old);
+    if (old) {
+        HASH_DELETE(hh, ignore_cache, old);
+        free_entry(old);
+        ignore_cache_len--;
+    }
+    HASH_ADD_KEYPTR(hh, ignore_cache, entry->path, strlen(entry->path), entry);
+    ignore_cache_len++;
+}
+
+static void set_stat(ignore_cache_record_t *record, const struct stat *statbuf) {
+    record->mtime = (int64_t)statbuf->st_mtime;
+#ifdef HAVE_STAT_MTIM
+    record->mtime_nsec = (int64_t)statbuf->st_mtim.tv_nsec;
+#else
+    record->mtime_nsec = 0;
+#endif
+    record->size = (int64_t)statbuf->st_size;
+}
+
+/* The patterns are used as they are, so they have to be what
+ * ignore_cache_add() would have written: lens[0] sorted, distinct strings,
+ * then lens[1]..., with nothing after them. */
+static int entry_is_valid(const ignore_cache_entry_t *entry) {
+    const char *p = entry->data;
+    const char *end = entry->data + entry->record.data_len;
+    int kind;
+    uint64_t i;
+
+    for (kind = 0; kind < IGNORE_CACHE_LISTS; kind++) {
+        const char *prev = NULL;
+        if (entry->record.lens[kind] > entry->record.data_len) {
+            return FALSE;
+        }
+        for (i = 0; i < entry->record.lens[kind]; i++) {
+            size_t len;
+            if (p >= end) {
+                return FALSE;
+            }
+            len = strnlen(p, end - p);
+            if (p + len == end || (prev && strcmp(prev, p) >= 0)) {
+                return FALSE;
+            }
+            prev = p;
+            p += len + 1;
+        }
+    }
+    return p == end;
+}
+
+void ignore_cache_load(const char *path) {
+    cache_file_t cf;
+    ignore_cache_header_t header;
+    ignore_cache_record_t record;
+    ignore_cache_entry_t *entry;
+    char cwd[PATH_MAX];
+    uint64_t i;
+
+    ignore_cache_path = ag_strdup(path);
+    if (getcwd(cwd, sizeof(cwd)) != NULL) {
+        ignore_cache_cwd = ag_strdup(cwd);
+    }
+
+    if (!cache_file_open(&cf, "ignore cache", path, IGNORE_CACHE_MAGIC, &header, sizeof(header))) {
+        return;
+    }
+    for (i = 0; i < header.entries_len; i++) {
+        if (!cache_file_read(&cf, &record, sizeof(record)) || record.path_len > PATH_MAX) {
+            log_debug("Ignore cache %s is truncated", path);
+            break;
+        }
+        entry = ag_calloc(1, sizeof(ignore_cache_entry_t));
+        entry->record = record;
+        entry->used = FALSE;
+        entry->path = cache_file_read_data(&cf, record.path_len);
+        entry->data = entry->path ? cache_file_read_data(&cf, record.data_len) : NULL;
+        if (entry->data == NULL) {
+            log_debug("Ignore cache %s is truncated", path);
+            free_entry(entry);
+            break;
+        }
+        if (!entry_is_valid(entry)) {
+            log_debug("Ignore cache %s has a bad entry for %s", path, entry->path);
+            free_entry(entry);
+            continue;
+        }
+        add_entry(entry);
+    }
+    cache_file_close(&cf);
+    log_debug("Loaded %lu entries from ignore cache %s", (unsigned long)ignore_cache_len, path);
+}
+
+void ignore_cache_save(void) {
+    cache_file_t cf;
+    ignore_cache_header_t header;
+    ignore_cache_entry_t *entry;
+    int keep_unused;
+
+    if (ignore_cache_path == NULL || !ignore_cache_dirty) {
+        return;
+    }
+    if (!cache_file_create(&cf, "ignore cache", ignore_cache_path)) {
+        return;
+    }
+    keep_unused = cache_keep_unused(ignore_cache_len, IGNORE_CACHE_MAX_ENTRIES);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, IGNORE_CACHE_MAGIC, sizeof(header.magic));
+    for (entry = ignore_cache; entry != NULL; entry = entry->hh.next) {
+        if (keep_unused || entry->used) {
+            header.entries_len++;
+        }
+    }
+    fwrite(&header, sizeof(header), 1, cf.fp);
+    for (entry = ignore_cache; entry != NULL; entry = entry->hh.next) {
+        if (keep_unused || entry->used) {
+            fwrite(&entry->record, sizeof(entry->record), 1, cf.fp);
+            fwrite(entry->path, 1, entry->record.path_len, cf.fp);
+            fwrite(entry->data, 1, entry->record.data_len, cf.fp);
+        }
+    }
+
+    if (cache_file_commit(&cf)) {
+        log_debug("Saved %lu entries to ignore cache %s", (unsigned long)header.entries_len, ignore_cache_path);
+    }
+}
+
+void ignore_cache_cleanup(void) {
+    ignore_cache_entry_t *entry;
+    ignore_cache_entry_t *tmp;
+
+    HASH_ITER(hh, ignore_cache, entry, tmp) {
+        HASH_DELETE(hh, ignore_cache, entry);
+        free_entry(entry);
+    }
+    ignore_cache_len = 0;
+    free(ignore_cache_path);
+    ignore_cache_path = NULL;
+    free(ignore_cache_cwd);
+    ignore_cache_cwd = NULL;
+}
+
+int ignore_cache_lookup(const char *path, const struct stat *statbuf, const char **data, size_t lens[IGNORE_CACHE_LISTS]) {
+    ignore_cache_record_t record;
+    ignore_cache_entry_t *entry = NULL;
+    char *abs_path;
+    size_t i;
+
+    if (ignore_cache_path == NULL) {
+        return 0;
+    }
+    abs_path = absolute_path(path);
+    HASH_FIND_STR(ignore_cache, abs_path, entry);
+    free(abs_path);
+    if (entry == NULL) {
+        return 0;
+    }
+
+    set_stat(&record, statbuf);
+    if (record.mtime != entry->record.mtime || record.mtime_nsec != entry->record.mtime_nsec ||
+        record.size != entry->record.size) {
+        return 0;
+    }
+    entry->used = TRUE;
+    *data = entry->data;
+    for (i = 0; i < IGNORE_CACHE_LISTS; i++) {
+        lens[i] = entry->record.lens[i];
+    }
+    return 1;
+}
+
+void ignore_cache_add(const char *path, const struct stat *statbuf, char **const lists[IGNORE_CACHE_LISTS], const size_t lens[IGNORE_CACHE_LISTS]) {
+    ignore_cache_entry_t *entry;
+    size_t data_len = 0;
+    char *p;
+    size_t i, j;
+
+    if (ignore_cache_path == NULL) {
+        return;
+    }
+
+    for (i = 0; i < IGNORE_CACHE_LISTS; i++) {
+        for (j = 0; j < lens[i]; j++) {
+            data_len += strlen(lists[i][j]) + 1;
+        }
+    }
+
+    entry = ag_calloc(1, sizeof(ignore_cache_entry_t));
+    entry->path = absolute_path(path);
+    entry->data = ag_malloc(data_len + 1);
+    entry->used = TRUE;
+    set_stat(&entry->record, statbuf);
+    entry->record.path_len = strlen(entry->path);
+    entry->record.data_len = data_len;
+
+    p = entry->data;
+    for (i = 0; i < IGNORE_CACHE_LISTS; i++) {
+        entry->record.lens[i] = lens[i];
+        for (j = 0; j < lens[i]; j++) {
+            size_t len = strlen(lists[i][j]) + 1;
+            memcpy(p, lists[i][j], len);
+            p += len;
+        }
+    }
+    *p = '\0';
+
+    add_entry(entry);
+    ignore_cache_dirty = TRUE;
+}
@@ -0,0 +1,23 @@
+#ifndef IGNORE_CACHE_H
+#define IGNORE_CACHE_H
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/* Kinds of pattern an ignore file is split into. See add_ignore_pattern(). */
+#define IGNORE_CACHE_LISTS 6
+
+/* See cache_keep_unused() */
+#define IGNORE_CACHE_MAX_ENTRIES 4096
+
+void ignore_cache_load(const char *path);
+void ignore_cache_save(void);
+void ignore_cache_cleanup(void);
+
+/* If the ignore file at path hasn't changed, points *data at its patterns
+ * (NUL-terminated, lens[0] of the first kind, then lens[1] of the next...)
+ * and returns 1. Not thread-safe. */
+int ignore_cache_lookup(const char *path, const struct stat *statbuf, const char **data, size_t lens[IGNORE_CACHE_LISTS]);
+void ignore_cache_add(const char *path, const struct stat *statbuf, char **const lists[IGNORE_CACHE_LISTS], const size_t lens[IGNORE_CACHE_LISTS]);
+
+#endif
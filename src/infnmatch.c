@@ -86,6 +86,7 @@
  */
 
 #include <infnmatch.h>
+#include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 
@@ -512,3 +513,196 @@ firstsegment:
 	/* Pattern didn't match to the end of string. */
 	return FNM_NOMATCH;
 }
+
+
+/* Compiles the one-character pattern element at the start of pattern (a
+ * literal, an escape, '?' or a bracket expression) into a bitmap of the bytes
+ * it matches. Returns the number of pattern bytes the element takes up. */
+static size_t ag_fnmatch_ch_set(const char *pattern, int flags, unsigned char set[32])
+{
+	const int escape = !(flags & FNM_NOESCAPE);
+	const int slash = !!(flags & FNM_PATHNAME);
+	const char *p;
+	const char *s;
+	char string[2];
+	int c;
+
+	memset(set, 0, 32);
+
+	/* fnmatch_ch() won't advance over slashes; ag_fnmatch() matches them
+	 * itself, and nothing else matches a slash in the string. */
+	if (slash && (pattern[0] == '/' ||
+	    (escape && pattern[0] == '\\' && pattern[1] == '/'))) {
+		set['/' >> 3] |= 1 << ('/' & 7);
+		return pattern[0] == '/' ? 1 : 2;
+	}
+
+	string[1] = '\0';
+	for (c = 1; c < 256; c++) {
+		if (slash && c == '/')
+			continue;
+		p = pattern;
+		string[0] = (char)c;
+		s = string;
+		if (fnmatch_ch(&p, &s, flags) == 0)
+			set[c >> 3] |= 1 << (c & 7);
+	}
+
+	/* How far fnmatch_ch() gets doesn't depend on the string's char */
+	p = pattern;
+	string[0] = 'x';
+	s = string;
+	fnmatch_ch(&p, &s, flags);
+	return (size_t)(p - pattern);
+}
+
+
+#define	SET_TEST(set, c)	((set)[(c) >> 3] & (1 << ((c) & 7)))
+
+/* Returns the only byte in set, or -1 */
+static int
+set_single(const unsigned char set[32])
+{
+	int c, found = -1;
+
+	for (c = 0; c < 256; c++) {
+		if (!SET_TEST(set, c))
+			continue;
+		if (found >= 0)
+			return -1;
+		found = c;
+	}
+	return found;
+}
+
+ag_glob_t *
+ag_glob_compile(const char *pattern, int flags)
+{
+	const int escape = !(flags & FNM_NOESCAPE);
+	ag_glob_t *glob;
+	ag_glob_elem_t *elem;
+	const char *p;
+	size_t len, i;
+	int c;
+
+	if (flags & FNM_LEADING_DIR)
+		return NULL;
+	if ((glob = calloc(1, sizeof(*glob))) == NULL)
+		return NULL;
+	glob->flags = flags;
+	len = strlen(pattern);
+	glob->elems = malloc((len + 1) * sizeof(ag_glob_elem_t));
+	glob->prefix = malloc(len + 1);
+	glob->suffix = malloc(len + 1);
+	if (glob->elems == NULL || glob->prefix == NULL || glob->suffix == NULL) {
+		ag_glob_free(glob);
+		return NULL;
+	}
+
+	for (p = pattern; *p; ) {
+		if (*p == '*') {
+			/* "**" is the same as "*" */
+			if (!glob->has_star || glob->elems[glob->elems_len - 1].type != AG_GLOB_STAR) {
+				elem = &glob->elems[glob->elems_len++];
+				memset(elem, 0, sizeof(*elem));
+				elem->type = AG_GLOB_STAR;
+			}
+			glob->has_star = 1;
+			++p;
+			continue;
+		}
+		elem = &glob->elems[glob->elems_len++];
+		elem->type = AG_GLOB_CHAR;
+		len = ag_fnmatch_ch_set(p, flags, elem->set);
+		/* A '[' that doesn't start a bracket expression is just a '[' */
+		elem->literal = (escape && *p == '\\') ||
+		    (*p != '?' && *p != '[') || (*p == '[' && len == 1);
+		p += len;
+		glob->min_len++;
+	}
+
+	for (i = 0; i < glob->elems_len && glob->elems[i].type == AG_GLOB_CHAR; i++) {
+		if ((c = set_single(glob->elems[i].set)) < 0)
+			break;
+		glob->prefix[glob->prefix_len++] = (char)c;
+	}
+	if (glob->has_star) {
+		for (i = glob->elems_len; i > 0 && glob->elems[i - 1].type == AG_GLOB_CHAR; i--) {
+			if ((c = set_single(glob->elems[i - 1].set)) < 0)
+				break;
+			glob->suffix_len++;
+		}
+		for (len = 0; len < glob->suffix_len; len++)
+			glob->suffix[len] = (char)set_single(glob->elems[i + len].set);
+	}
+	return glob;
+}
+
+int
+ag_glob_match(const ag_glob_t *glob, const char *string)
+{
+	const int slash = !!(glob->flags & FNM_PATHNAME);
+	const int period = !!(glob->flags & FNM_PERIOD);
+	const unsigned char *s = (const unsigned char *)string;
+	const ag_glob_elem_t *elems = glob->elems;
+	const size_t n = glob->elems_len;
+	size_t len = strlen(string);
+	size_t p = 0, i = 0;
+	size_t star_p = 0, star_i = 0;
+	int wild = 0;
+
+	if (len < glob->min_len || (!glob->has_star && len != glob->min_len))
+		return FNM_NOMATCH;
+	if (memcmp(string, glob->prefix, glob->prefix_len) != 0 ||
+	    memcmp(string + len - glob->suffix_len, glob->suffix, glob->suffix_len) != 0)
+		return FNM_NOMATCH;
+
+	while (i < len) {
+		/*
+		 * A leading period has to be matched by a period in the
+		 * pattern. Stars can't get here over a slash, so there's
+		 * nothing to backtrack to.
+		 */
+		if (period && s[i] == '.' && (i == 0 || (slash && s[i - 1] == '/'))) {
+			if (p < n && elems[p].type == AG_GLOB_CHAR &&
+			    elems[p].literal && SET_TEST(elems[p].set, '.')) {
+				++p;
+				++i;
+				continue;
+			}
+			return FNM_NOMATCH;
+		}
+		if (p < n && elems[p].type == AG_GLOB_STAR) {
+			star_p = ++p;
+			star_i = i;
+			wild = 1;
+			continue;
+		}
+		if (p < n && SET_TEST(elems[p].set, s[i])) {
+			++p;
+			++i;
+			continue;
+		}
+		/* Let the last star take one more char, unless it's a slash */
+		if (wild && !(slash && s[star_i] == '/')) {
+			i = ++star_i;
+			p = star_p;
+			continue;
+		}
+		return FNM_NOMATCH;
+	}
+	while (p < n && elems[p].type == AG_GLOB_STAR)
+		++p;
+	return p == n ? 0 : FNM_NOMATCH;
+}
+
+void
+ag_glob_free(ag_glob_t *glob)
+{
+	if (glob == NULL)
+		return;
+	free(glob->elems);
+	free(glob->prefix);
+	free(glob->suffix);
+	free(glob);
+}
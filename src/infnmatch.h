@@ -35,6 +35,8 @@
 #ifndef	_INFNMATCH_H_
 #define	_INFNMATCH_H_
 
+#include <stddef.h>
+
 #define	FNM_NOMATCH	1	/* Match failed. */
 #define	FNM_NOSYS	2	/* Function not supported (unused). */
 
@@ -48,4 +50,36 @@
 
 int	 ag_fnmatch(const char *, const char *, int);
 
+/* A pattern compiled once for matching many strings. Every element but '*'
+ * matches one byte, so it's a bitmap of the bytes it takes; bracket
+ * expressions and escapes are never looked at again. */
+#define	AG_GLOB_CHAR	0
+#define	AG_GLOB_STAR	1
+
+typedef struct {
+	unsigned char type;
+	unsigned char literal;	/* Not '?' or [...]; FNM_PERIOD needs these */
+	unsigned char set[32];
+} ag_glob_elem_t;
+
+typedef struct {
+	int flags;
+	ag_glob_elem_t *elems;
+	size_t elems_len;
+	int has_star;
+	size_t min_len;		/* Shortest string that can match */
+	/* Bytes every match starts with, and ends with if there's a star */
+	char *prefix;
+	size_t prefix_len;
+	char *suffix;
+	size_t suffix_len;
+} ag_glob_t;
+
+/* Same flags as ag_fnmatch() except FNM_LEADING_DIR. Returns NULL if it
+ * can't allocate memory or gets FNM_LEADING_DIR. */
+ag_glob_t	*ag_glob_compile(const char *, int);
+/* Same result as ag_fnmatch() with the pattern and flags it was compiled with */
+int	 ag_glob_match(const ag_glob_t *, const char *);
+void	 ag_glob_free(ag_glob_t *);
+
 #endif /* !_INFNMATCH_H_ */
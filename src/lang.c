@@ -149,36 +149,41 @@ size_t get_lang_count() {
     return sizeof(langs) / sizeof(lang_spec_t);
 }
 
-char *make_lang_regex(char *ext_array, size_t num_exts) {
-    int regex_capacity = 100;
-    char *regex = ag_malloc(regex_capacity);
-    int regex_length = 3;
-    int subsequent = 0;
-    char *extension;
-    size_t i;
+static int cmp_extensions(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
 
-    strcpy(regex, "\\.(");
+char **make_lang_extensions(char *ext_array, size_t num_exts, size_t *set_len) {
+    char **set = ag_malloc((num_exts + 1) * sizeof(char *));
+    size_t len = 0;
+    size_t i;
 
     for (i = 0; i < num_exts; ++i) {
-        extension = ext_array + i * SINGLE_EXT_LEN;
-        int extension_length = strlen(extension);
-        while (regex_length + extension_length + 3 + subsequent > regex_capacity) {
-            regex_capacity *= 2;
-            regex = ag_realloc(regex, regex_capacity);
-        }
-        if (subsequent) {
-            regex[regex_length++] = '|';
+        set[i] = ag_strdup(ext_array + i * SINGLE_EXT_LEN);
+    }
+    qsort(set, num_exts, sizeof(char *), cmp_extensions);
+    for (i = 0; i < num_exts; ++i) {
+        if (len > 0 && strcmp(set[len - 1], set[i]) == 0) {
+            free(set[i]);
         } else {
-            subsequent = 1;
+            set[len++] = set[i];
         }
-        strcpy(regex + regex_length, extension);
-        regex_length += extension_length;
     }
+    set[len] = NULL;
+    *set_len = len;
+    return set;
+}
+
+int has_lang_extension(const char *path, char **exts, size_t exts_len) {
+    const char *dot = strrchr(path, '/');
 
-    regex[regex_length++] = ')';
-    regex[regex_length++] = '$';
-    regex[regex_length++] = 0;
-    return regex;
+    /* Extensions like "d.ts" have dots in them, so try every dot in the basename */
+    for (dot = strchr(dot ? dot : path, '.'); dot != NULL; dot = strchr(dot + 1, '.')) {
+        if (binary_search(dot + 1, exts, 0, exts_len) >= 0) {
+            return 1;
+        }
+    }
+    return 0;
 }
 
 size_t combine_file_extensions(size_t *extension_index, size_t len, char **exts) {
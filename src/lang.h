@@ -17,12 +17,18 @@ extern lang_spec_t langs[];
 size_t get_lang_count(void);
 
 /**
-Convert a NULL-terminated array of language extensions
-into a regular expression of the form \.(extension1|extension2...)$
+Sort and de-dupe the extensions from combine_file_extensions() into a
+NULL-terminated set for has_lang_extension(). The set's length goes in
+*set_len*.
 
-Caller is responsible for freeing the returned string.
+Caller is responsible for freeing the returned array and its strings.
 */
-char *make_lang_regex(char *ext_array, size_t num_exts);
+char **make_lang_extensions(char *ext_array, size_t num_exts, size_t *set_len);
+
+/**
+Return 1 if path ends with a dot and one of the extensions in *exts*.
+*/
+int has_lang_extension(const char *path, char **exts, size_t exts_len);
 
 
 /**
@@ -22,28 +22,41 @@
 #include <pthread_np.h>
 #endif
 
+#include "binary_cache.h"
+#include "ignore_cache.h"
 #include "log.h"
 #include "options.h"
+#include "result_cache.h"
 #include "search.h"
+#include "server.h"
+#include "trigram_index.h"
 #include "util.h"
+#include "walk_cache.h"
 
 typedef struct {
     pthread_t thread;
     int id;
 } worker_t;
 
-int main(int argc, char **argv) {
+static int run(int argc, char **argv) {
     char **base_paths = NULL;
     char **paths = NULL;
+    trigram_scope_t **index_scopes = NULL;
+    size_t paths_len = 0;
+    int index_failed = FALSE;
     int i;
     int pcre_opts = REG_EXTENDED;
     int study_opts = 0;
     worker_t *workers = NULL;
     int workers_len;
     int num_cores;
+    pthread_mutexattr_t print_mtx_attr;
 
 #ifdef HAVE_PLEDGE
-    if (pledge("stdio rpath proc exec", NULL) == -1) {
+    /* wpath and cpath are for --binary-cache, --ignore-cache and
+     * --build-index. They're dropped once the options are parsed if they're
+     * all off. */
+    if (pledge("stdio rpath wpath cpath proc exec", NULL) == -1) {
         die("pledge: %s", strerror(errno));
     }
 #endif
@@ -56,6 +69,22 @@ int main(int argc, char **argv) {
     out_fd = stdout;
 
     parse_options(argc, argv, &base_paths, &paths);
+    if (opts.walk_cache) {
+        if (opts.ackmate_dir_filter) {
+            log_debug("Not using the walk cache with --ackmate-dir-filter.");
+        } else if (opts.cache_dir) {
+            char *walk_cache_path;
+            ag_asprintf(&walk_cache_path, "%s/walk", opts.cache_dir);
+            walk_cache_load(walk_cache_path);
+            free(walk_cache_path);
+        } else {
+            log_debug("No cache dir. Not using the walk cache.");
+        }
+    }
+    if (opts.server) {
+        /* Only returns if it couldn't start. Searches run in children. */
+        return server_run(base_paths, paths, run);
+    }
     if (opts.stats) {
         memset(&stats, 0, sizeof(stats));
         gettimeofday(&(stats.time_start), NULL);
@@ -88,9 +117,14 @@ int main(int argc, char **argv) {
     if (pthread_cond_init(&files_ready, NULL)) {
         die("pthread_cond_init failed!");
     }
-    if (pthread_mutex_init(&print_mtx, NULL)) {
+    /* Recursive, since a worker holds it while it prints a file a chunk at a
+     * time, and may log in between */
+    pthread_mutexattr_init(&print_mtx_attr);
+    pthread_mutexattr_settype(&print_mtx_attr, PTHREAD_MUTEX_RECURSIVE);
+    if (pthread_mutex_init(&print_mtx, &print_mtx_attr)) {
         die("pthread_mutex_init failed!");
     }
+    pthread_mutexattr_destroy(&print_mtx_attr);
     if (opts.stats && pthread_mutex_init(&stats_mtx, NULL)) {
         die("pthread_mutex_init failed!");
     }
@@ -137,6 +171,42 @@ int main(int argc, char **argv) {
         compile_study(&opts.re, opts.query, pcre_opts);
     }
 
+    if (opts.background) {
+        throttle_background();
+    }
+
+    trigram_query_init();
+
+    if (opts.binary_cache && !opts.search_binary_files) {
+        if (opts.cache_dir) {
+            char *binary_cache_path;
+            ag_asprintf(&binary_cache_path, "%s/binary", opts.cache_dir);
+            binary_cache_load(binary_cache_path);
+            free(binary_cache_path);
+        } else {
+            log_debug("No cache dir. Not using the binary cache.");
+        }
+    }
+
+    if (opts.result_cache) {
+        if (opts.cache_dir) {
+            char *result_cache_path;
+            char *result_cache_key;
+            ag_asprintf(&result_cache_path, "%s/results", opts.cache_dir);
+            /* Everything that changes what matches, but not how it's printed */
+            ag_asprintf(&result_cache_key, "%d %d %d %d %d %d %lu %d %d %d %lu %s",
+                        (int)opts.literal, (int)opts.casing, (int)opts.word_regexp, (int)opts.multiline,
+                        (int)opts.invert_match, (int)opts.search_binary_files, (unsigned long)opts.max_matches_per_file,
+                        (int)opts.mmap, (int)opts.search_zip_files, (int)opts.low_cache,
+                        (unsigned long)opts.binary_sample, opts.query);
+            result_cache_load(result_cache_path, result_cache_key);
+            free(result_cache_key);
+            free(result_cache_path);
+        } else {
+            log_debug("No cache dir. Not using the result cache.");
+        }
+    }
+
     if (opts.search_stream) {
         search_stream(stdin, "");
     } else {
@@ -171,12 +241,26 @@ int main(int argc, char **argv) {
         }
 
 #ifdef HAVE_PLEDGE
-        if (pledge("stdio rpath", NULL) == -1) {
+        if (pledge((opts.binary_cache || opts.ignore_cache || opts.walk_cache || opts.result_cache || opts.gzip_index || opts.build_index) ? "stdio rpath wpath cpath" : "stdio rpath", NULL) == -1) {
             die("pledge: %s", strerror(errno));
         }
 #endif
+        while (paths[paths_len] != NULL) {
+            paths_len++;
+        }
+        index_scopes = ag_calloc(paths_len + 1, sizeof(trigram_scope_t *));
         for (i = 0; paths[i] != NULL; i++) {
             log_debug("searching path %s for %s", paths[i], opts.query);
+            if (opts.build_index) {
+                index_scopes[i] = trigram_index_build_start(paths[i], base_paths[i]);
+                if (index_scopes[i] == NULL) {
+                    index_failed = TRUE;
+                    continue;
+                }
+            } else {
+                index_scopes[i] = trigram_index_open(paths[i], base_paths[i]);
+            }
+            index_scope = index_scopes[i];
             symhash = NULL;
             ignores *ig = init_ignore(root_ignores, "", 0);
             struct stat s = { .st_dev = 0 };
@@ -188,9 +272,14 @@ int main(int argc, char **argv) {
                 log_err("Failed to get device information for path %s. Skipping...", paths[i]);
             }
 #endif
-            search_dir(ig, base_paths[i], paths[i], 0, s.st_dev);
+            if (server_search_tree(base_paths[i], paths[i])) {
+                /* The server already had the files */
+            } else if (!opts.git_index || !search_git_index(ig, base_paths[i], paths[i], s.st_dev)) {
+                search_dir(ig, base_paths[i], paths[i], 0, s.st_dev);
+            }
             cleanup_ignore(ig);
         }
+        flush_queued_files();
         pthread_mutex_lock(&work_queue_mtx);
         done_adding_files = TRUE;
         pthread_cond_broadcast(&files_ready);
@@ -200,15 +289,37 @@ int main(int argc, char **argv) {
                 die("pthread_join failed!");
             }
         }
+        for (i = 0; paths[i] != NULL; i++) {
+            if (opts.build_index && index_scopes[i] && trigram_index_build_finish(index_scopes[i]) != 0) {
+                index_failed = TRUE;
+            }
+            trigram_index_close(index_scopes[i]);
+        }
+        free(index_scopes);
     }
+    trigram_query_cleanup();
+
+    binary_cache_save();
+    binary_cache_cleanup();
+    ignore_cache_save();
+    ignore_cache_cleanup();
+    walk_cache_save();
+    walk_cache_cleanup();
+    result_cache_save();
+    result_cache_cleanup();
 
     if (opts.stats) {
         gettimeofday(&(stats.time_end), NULL);
         double time_diff = ((long)stats.time_end.tv_sec * 1000000 + stats.time_end.tv_usec) -
                            ((long)stats.time_start.tv_sec * 1000000 + stats.time_start.tv_usec);
         time_diff /= 1000000;
-        printf("%" SIZE_FMT " matches\n%" SIZE_FMT " files contained matches\n%" SIZE_FMT " files searched\n%" SIZE_FMT " bytes searched\n%f seconds\n",
-               stats.total_matches, stats.total_file_matches, stats.total_files, stats.total_bytes, time_diff);
+        printf("%" SIZE_FMT " matches\n%" SIZE_FMT " files contained matches\n%" SIZE_FMT " files searched\n%" SIZE_FMT " bytes searched\n",
+               stats.total_matches, stats.total_file_matches, stats.total_files, stats.total_bytes);
+        if (stats.total_decompressed_files > 0) {
+            printf("%" SIZE_FMT " compressed files: %f seconds decompressing, %f seconds searching\n",
+                   stats.total_decompressed_files, stats.decompress_time, stats.decompressed_search_time);
+        }
+        printf("%f seconds\n", time_diff);
         pthread_mutex_destroy(&stats_mtx);
     }
 
@@ -230,5 +341,16 @@ int main(int argc, char **argv) {
     if (find_skip_lookup) {
         free(find_skip_lookup);
     }
+    if (opts.build_index) {
+        return index_failed;
+    }
     return !opts.match_found;
 }
+
+int main(int argc, char **argv) {
+    int rc = server_query(argc, argv);
+    if (rc >= 0) {
+        return rc;
+    }
+    return run(argc, argv);
+}
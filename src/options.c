@@ -10,7 +10,9 @@
 
 #include "config.h"
 #include "dropt.h"
+#include "gitconfig.h"
 #include "ignore.h"
+#include "ignore_cache.h"
 #include "lang.h"
 #include "log.h"
 #include "options.h"
@@ -85,31 +87,71 @@ Output Options:\n\
 Search Options:\n\
   -a --all-types          Search all files (doesn't include hidden files\n\
                           or patterns from ignore files)\n\
+     --background         Run at idle CPU and I/O priority\n\
+     --binary-cache       Remember which files are binary between searches\n\
+     --binary-ext EXTS    Treat files with these extensions (comma separated)\n\
+                          as binary without opening them\n\
+     --binary-sample BYTES\n\
+                          Check the first BYTES of each file to decide if it's\n\
+                          binary (Default: 512)\n\
+     --build-index        Index the files in PATH so later searches only read\n\
+                          files that could match\n\
+     --cache-dir DIR      Keep caches in DIR (Default: ~/.cache/ag)\n\
+     --client             Have a running ag --server do the search. Searches\n\
+                          here if there isn't one\n\
   -D --debug              Ridiculous debugging (probably not useful)\n\
      --depth NUM          Search up to NUM directories deep (Default: 25)\n\
   -f --follow             Follow symlinks\n\
   -F --fixed-strings      Alias for --literal for compatibility with grep\n\
   -G --file-search-regex  PATTERN Limit search to filenames matching PATTERN\n\
+     --git-changed        Only search files git sees as modified (implies\n\
+                          --git-index)\n\
+     --git-index          Take the files git tracks from its index instead of\n\
+                          walking and matching .gitignore patterns\n\
+     --gzip-index         With -z, index big gzip files so later searches can\n\
+                          inflate them with several threads\n\
+     --direct-io          With --low-cache, read big files with O_DIRECT\n\
      --hidden             Search hidden files (obeys .*ignore files)\n\
+     --layout-order ORDER Sort queued files by on-disk location before searching.\n\
+                          ORDER is inode or extent (Default: none)\n\
+     --layout-window NUM  Sort up to NUM queued files at a time (Default: 1024)\n\
   -i --ignore-case        Match case insensitively\n\
      --ignore PATTERN     Ignore files/directories matching PATTERN\n\
                           (literal file/directory names also allowed)\n\
      --ignore-dir NAME    Alias for --ignore for compatibility with ack.\n\
+     --ignore-cache       Remember parsed ignore files between searches\n\
+     --[no]index          Use the index built by --build-index, if there is one\n\
+                          (Enabled by default)\n\
+     --low-cache          Search big files in windows and drop them from the\n\
+                          page cache behind the scan\n\
   -m --max-count NUM      Skip the rest of a file after NUM matches (Default: 10,000)\n\
+     --max-active-workers NUM\n\
+                          Let at most NUM workers search at the same time\n\
+     --max-read-rate RATE Read at most RATE bytes per second. RATE can end\n\
+                          in K, M or G (Default: unlimited)\n\
      --one-device         Don't follow links to other devices.\n\
   -p --path-to-ignore STRING\n\
                           Use .ignore file at STRING\n\
   -Q --literal            Don't parse PATTERN as a regular expression\n\
+     --result-cache       Remember the matches in each file between searches\n\
+                          for the same PATTERN\n\
   -s --case-sensitive     Match case sensitively\n\
   -S --smart-case         Match case insensitively unless PATTERN contains\n\
                           uppercase characters (Enabled by default)\n\
      --search-binary      Search binary files for matches\n\
+     --server             Keep the files in PATH in memory, watching them for\n\
+                          changes, and run searches from ag --client\n\
+     --socket PATH        Where --server listens and --client connects\n\
+                          (Default: ~/.cache/ag/server.sock)\n\
   -t --all-text           Search all text files (doesn't include hidden files)\n\
+     --text-ext EXTS      Don't treat these extensions as binary\n\
   -u --unrestricted       Search all files (ignore .ignore, .gitignore, etc.;\n\
                           searches binary and hidden files as well)\n\
   -U --skip-vcs-ignores   Ignore VCS ignore files\n\
                           (.gitignore, .hgignore; still obey .ignore)\n\
   -v --invert-match\n\
+     --walk-cache         Remember directory listings between searches, and\n\
+                          only list the directories that changed\n\
   -w --word-regexp        Only match whole words\n\
   -W --width NUM          Truncate match lines after NUM characters\n\
   -z --search-zip         Search contents of compressed (e.g., gzip) files\n\
@@ -129,6 +171,16 @@ void print_version(void) {
     printf("ag version (tre regexes) 0.1\n\n");
 }
 
+char *default_cache_dir(void) {
+    char *cache_dir = NULL;
+    if (getenv("XDG_CACHE_HOME")) {
+        ag_asprintf(&cache_dir, "%s/ag", getenv("XDG_CACHE_HOME"));
+    } else if (getenv("HOME")) {
+        ag_asprintf(&cache_dir, "%s/.cache/ag", getenv("HOME"));
+    }
+    return cache_dir;
+}
+
 void init_options(void) {
     char *term = getenv("TERM");
 
@@ -141,6 +193,9 @@ void init_options(void) {
     opts.color_win_ansi = FALSE;
     opts.max_matches_per_file = 0;
     opts.max_search_depth = DEFAULT_MAX_SEARCH_DEPTH;
+    opts.binary_sample = DEFAULT_BINARY_SAMPLE;
+    opts.layout_order = LAYOUT_ORDER_NONE;
+    opts.layout_window = DEFAULT_LAYOUT_WINDOW;
 #if defined(__APPLE__) || defined(__MACH__)
     /* mamp() is slower than normal read() on macos. default to off */
     opts.mmap = FALSE;
@@ -159,6 +214,7 @@ void init_options(void) {
     opts.color_match = ag_strdup(color_match);
     opts.color_line_number = ag_strdup(color_line_number);
     opts.use_thread_affinity = TRUE;
+    opts.use_index = TRUE;
 }
 
 void cleanup_options(void) {
@@ -179,6 +235,12 @@ void cleanup_options(void) {
     if (opts.file_search_regex) {
         free(opts.file_search_regex);
     }
+
+    free_strings(opts.file_type_extensions, opts.file_type_extensions_len);
+
+    free(opts.cache_dir);
+    free(opts.socket_path);
+    cleanup_binary_extensions();
 }
 
 void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
@@ -204,7 +266,6 @@ void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
 
     size_t baseopts_len, full_len;
     dropt_option *all_options;
-    char *lang_regex = NULL;
     size_t *ext_index = NULL;
     char *extensions = NULL;
     size_t num_exts = 0;
@@ -219,6 +280,12 @@ void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
     char *ignore_dir_str = NULL;
     char *ignore_str = NULL;
     char *path_ignore_str = NULL;
+    char *layout_order_str = NULL;
+    char *max_read_rate_str = NULL;
+    char *binary_ext_str = NULL;
+    char *text_ext_str = NULL;
+    char *cache_dir_str = NULL;
+    char *socket_str = NULL;
 
     char *file_search_regex = NULL;
     char *file_search_regex_g = NULL;
@@ -258,6 +325,13 @@ void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
         { '\0', "passthru", "", NULL, dropt_handle_const, &opts.passthrough, 0, 1 },
 
         { '\0', "column", "", NULL, dropt_handle_const, &opts.column, 0, 1 },
+        { '\0', "git-changed", "", NULL, dropt_handle_const, &opts.git_changed, 0, TRUE },
+        { '\0', "git-index", "", NULL, dropt_handle_const, &opts.git_index, 0, TRUE },
+        { '\0', "gzip-index", "", NULL, dropt_handle_const, &opts.gzip_index, 0, TRUE },
+        { '\0', "build-index", "", NULL, dropt_handle_const, &opts.build_index, 0, TRUE },
+        { '\0', "index", "", NULL, dropt_handle_const, &opts.use_index, 0, TRUE },
+        { '\0', "no-index", "", NULL, dropt_handle_const, &opts.use_index, 0, FALSE },
+        { '\0', "noindex", "", NULL, dropt_handle_const, &opts.use_index, 0, FALSE },
         { '\0', "hidden", "", NULL, dropt_handle_const, &opts.search_hidden_files, 0, 1 },
         { '\0', "list-file-types", "", NULL, dropt_handle_const, &list_file_types, 0, 1 },
 
@@ -282,6 +356,14 @@ void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
         { '\0', "no-group", "", NULL, dropt_handle_const, &group, 0, 0 },
         { '\0', "nogroup", "", NULL, dropt_handle_const, &group, 0, 0 },
 
+        { '\0', "low-cache", "", NULL, dropt_handle_const, &opts.low_cache, 0, TRUE },
+        { '\0', "direct-io", "", NULL, dropt_handle_const, &opts.direct_io, 0, TRUE },
+        { '\0', "background", "", NULL, dropt_handle_const, &opts.background, 0, TRUE },
+        { '\0', "binary-cache", "", NULL, dropt_handle_const, &opts.binary_cache, 0, TRUE },
+        { '\0', "server", "", NULL, dropt_handle_const, &opts.server, 0, TRUE },
+        /* Handled before parsing. Only seen here when there's no server. */
+        { '\0', "client", "", NULL, dropt_handle_bool, &useless },
+
         { '\0', "mmap", "", NULL, dropt_handle_const, &opts.mmap, 0, TRUE },
         { '\0', "no-mmap", "", NULL, dropt_handle_const, &opts.mmap, 0, FALSE },
         { '\0', "nommap", "", NULL, dropt_handle_const, &opts.mmap, 0, FALSE },
@@ -332,12 +414,24 @@ void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
 
         { '\0', "ackmate-dir-filter", "", "", dropt_handle_string, &ackmate_dir_filter_str },
         { '\0', "depth", "", "", dropt_handle_int, &opts.max_search_depth },
+        { '\0', "binary-sample", "", "", dropt_handle_int, &opts.binary_sample },
+        { '\0', "binary-ext", "", "", dropt_handle_string, &binary_ext_str },
+        { '\0', "text-ext", "", "", dropt_handle_string, &text_ext_str },
+        { '\0', "cache-dir", "", "", dropt_handle_string, &cache_dir_str },
+        { '\0', "socket", "", "", dropt_handle_string, &socket_str },
+        { '\0', "layout-order", "", "", dropt_handle_string, &layout_order_str },
+        { '\0', "layout-window", "", "", dropt_handle_int, &opts.layout_window },
         { '\0', "workers", "", "", dropt_handle_int, &opts.workers },
+        { '\0', "max-active-workers", "", "", dropt_handle_int, &opts.max_active_workers },
+        { '\0', "max-read-rate", "", "", dropt_handle_string, &max_read_rate_str },
         { 'W', "width", "", "", dropt_handle_int, &opts.width },
         { 'm', "max-count", "", "", dropt_handle_int, &opts.max_matches_per_file },
 
         { '\0', "ignore-dir", "", "", dropt_handle_string, &ignore_dir_str },
         { '\0', "ignore", "", "", dropt_handle_string, &ignore_str },
+        { '\0', "ignore-cache", "", NULL, dropt_handle_const, &opts.ignore_cache, 0, TRUE },
+        { '\0', "walk-cache", "", NULL, dropt_handle_const, &opts.walk_cache, 0, TRUE },
+        { '\0', "result-cache", "", NULL, dropt_handle_const, &opts.result_cache, 0, TRUE },
         { 'p', "path-to-ignore", "", "", dropt_handle_string, &path_ignore_str },
 
         { '\0', "pager", "", "", dropt_handle_string, &opts.pager },
@@ -359,7 +453,7 @@ void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
     ext_index = (size_t *)ag_malloc(sizeof(size_t) * lang_count);
     memset(ext_index, 0, sizeof(size_t) * lang_count);
 
-    dropt_bool *opt_langs = (dropt_bool *)ag_malloc(lang_count * sizeof(dropt_bool));
+    dropt_bool *opt_langs = (dropt_bool *)ag_calloc(lang_count, sizeof(dropt_bool));
 
     for (i = 0; i < lang_count; i++) {
         dropt_option opt = { '\0', langs[i].name, "", NULL, dropt_handle_bool, &opt_langs[i] };
@@ -456,6 +550,30 @@ void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
         opts.print_line_numbers = TRUE;
     }
 
+    if (cache_dir_str) {
+        opts.cache_dir = ag_strdup(cache_dir_str);
+    } else {
+        opts.cache_dir = default_cache_dir();
+    }
+
+    if (socket_str) {
+        opts.socket_path = ag_strdup(socket_str);
+    } else if (opts.cache_dir) {
+        ag_asprintf(&opts.socket_path, "%s/server.sock", opts.cache_dir);
+    }
+
+    /* Before any ignore files are loaded */
+    if (opts.ignore_cache) {
+        if (opts.cache_dir) {
+            char *ignore_cache_path;
+            ag_asprintf(&ignore_cache_path, "%s/ignore", opts.cache_dir);
+            ignore_cache_load(ignore_cache_path);
+            free(ignore_cache_path);
+        } else {
+            log_debug("No cache dir. Not using the ignore cache.");
+        }
+    }
+
     if (ignore_dir_str) {
         add_ignore_pattern(root_ignores, ignore_dir_str);
     }
@@ -468,6 +586,75 @@ void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
         load_ignore_patterns(root_ignores, path_ignore_str);
     }
 
+    if (layout_order_str) {
+        if (strcmp(layout_order_str, "inode") == 0) {
+            opts.layout_order = LAYOUT_ORDER_INODE;
+        } else if (strcmp(layout_order_str, "extent") == 0) {
+            opts.layout_order = LAYOUT_ORDER_EXTENT;
+        } else if (strcmp(layout_order_str, "none") == 0) {
+            opts.layout_order = LAYOUT_ORDER_NONE;
+        } else {
+            log_err("Unknown layout order %s. Use inode, extent or none.", layout_order_str);
+            exit(1);
+        }
+    }
+
+    if (opts.direct_io) {
+        opts.low_cache = TRUE;
+    }
+
+    if (max_read_rate_str) {
+        char *end = NULL;
+        double rate = strtod(max_read_rate_str, &end);
+        if (end == max_read_rate_str || rate < 0) {
+            log_err("Invalid read rate %s.", max_read_rate_str);
+            exit(1);
+        }
+        switch (*end) {
+            case 'k':
+            case 'K':
+                rate *= 1024;
+                end++;
+                break;
+            case 'm':
+            case 'M':
+                rate *= 1024 * 1024;
+                end++;
+                break;
+            case 'g':
+            case 'G':
+                rate *= 1024 * 1024 * 1024;
+                end++;
+                break;
+        }
+        if (*end != '\0') {
+            log_err("Invalid read rate %s. Use a number of bytes, optionally ending in K, M or G.", max_read_rate_str);
+            exit(1);
+        }
+        opts.max_read_rate = (size_t)rate;
+        if (opts.max_read_rate == 0 && rate > 0) {
+            opts.max_read_rate = 1;
+        }
+    }
+
+    if (opts.max_active_workers < 0) {
+        opts.max_active_workers = 0;
+    }
+
+    if (opts.binary_sample == 0) {
+        opts.binary_sample = DEFAULT_BINARY_SAMPLE;
+    }
+
+    init_binary_extensions(binary_ext_str, text_ext_str);
+
+    if (opts.git_changed) {
+        opts.git_index = TRUE;
+    }
+
+    if (opts.layout_window == 0) {
+        opts.layout_window = 1;
+    }
+
     if (opt_nofilename) {
         opts.print_path = PATH_PRINT_NOTHING;
         opts.print_line_numbers = FALSE;
@@ -510,6 +697,11 @@ void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
         opts.print_path = PATH_PRINT_TOP;
     }
 
+    if (opts.build_index || opts.server) {
+        /* Every argument is a path */
+        needs_query = accepts_query = 0;
+    }
+
     if (file_search_regex_g) {
         needs_query = accepts_query = 0;
         opts.match_files = 1;
@@ -574,17 +766,13 @@ void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
 
     if (has_filetype) {
         num_exts = combine_file_extensions(ext_index, lang_num, &extensions);
-        lang_regex = make_lang_regex(extensions, num_exts);
-        compile_study(&opts.file_search_regex, lang_regex, REG_EXTENDED);
+        opts.file_type_extensions = make_lang_extensions(extensions, num_exts, &opts.file_type_extensions_len);
     }
 
     if (extensions) {
         free(extensions);
     }
     free(ext_index);
-    if (lang_regex) {
-        free(lang_regex);
-    }
     free(all_options);
     free(opt_langs);
 
@@ -596,14 +784,6 @@ void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
         }
     }
 
-#ifdef HAVE_PLEDGE
-    if (opts.skip_vcs_ignores) {
-        if (pledge("stdio rpath proc", NULL) == -1) {
-            die("pledge: %s", strerror(errno));
-        }
-    }
-#endif
-
     if (list_file_types) {
         size_t lang_index;
         printf("The following file types are supported:\n");
@@ -631,41 +811,32 @@ void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
     }
 
     if (!opts.skip_vcs_ignores) {
-        FILE *gitconfig_file = NULL;
-        size_t buf_len = 0;
         char *gitconfig_res = NULL;
+        char *gitconfig_cache_path = NULL;
 
-#ifdef _WIN32
-        gitconfig_file = popen("git config -z --path --get core.excludesfile 2>NUL", "r");
-#else
-        gitconfig_file = popen("git config -z --path --get core.excludesfile 2>/dev/null", "r");
-#endif
-        if (gitconfig_file != NULL) {
-            do {
-                gitconfig_res = ag_realloc(gitconfig_res, buf_len + 65);
-                buf_len += fread(gitconfig_res + buf_len, 1, 64, gitconfig_file);
-            } while (!feof(gitconfig_file) && buf_len > 0 && buf_len % 64 == 0);
-            gitconfig_res[buf_len] = '\0';
-            if (buf_len == 0) {
-                free(gitconfig_res);
-                const char *config_home = getenv("XDG_CONFIG_HOME");
-                if (config_home) {
-                    ag_asprintf(&gitconfig_res, "%s/%s", config_home, "git/ignore");
-                } else if (home_dir) {
-                    ag_asprintf(&gitconfig_res, "%s/%s", home_dir, ".config/git/ignore");
-                } else {
-                    gitconfig_res = ag_strdup("");
-                }
+        if (opts.ignore_cache && opts.cache_dir) {
+            ag_asprintf(&gitconfig_cache_path, "%s/gitconfig", opts.cache_dir);
+        }
+        gitconfig_res = git_excludes_file(gitconfig_cache_path);
+        free(gitconfig_cache_path);
+        if (gitconfig_res == NULL) {
+            /* git's default */
+            const char *config_home = getenv("XDG_CONFIG_HOME");
+            if (config_home) {
+                ag_asprintf(&gitconfig_res, "%s/%s", config_home, "git/ignore");
+            } else if (home_dir) {
+                ag_asprintf(&gitconfig_res, "%s/%s", home_dir, ".config/git/ignore");
+            } else {
+                gitconfig_res = ag_strdup("");
             }
-            log_debug("global core.excludesfile: %s", gitconfig_res);
-            load_ignore_patterns(root_ignores, gitconfig_res);
-            free(gitconfig_res);
-            pclose(gitconfig_file);
         }
+        log_debug("global core.excludesfile: %s", gitconfig_res);
+        load_ignore_patterns(root_ignores, gitconfig_res);
+        free(gitconfig_res);
     }
 
 #ifdef HAVE_PLEDGE
-    if (pledge("stdio rpath proc", NULL) == -1) {
+    if (pledge((opts.binary_cache || opts.ignore_cache || opts.walk_cache || opts.result_cache || opts.gzip_index || opts.build_index) ? "stdio rpath wpath cpath proc" : "stdio rpath proc", NULL) == -1) {
         die("pledge: %s", strerror(errno));
     }
 #endif
@@ -690,7 +861,7 @@ void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
         opts.print_path = PATH_PRINT_NOTHING;
     }
 
-    if (opts.parallel) {
+    if (opts.parallel || opts.build_index || opts.server) {
         opts.search_stream = 0;
     }
 
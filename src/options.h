@@ -11,6 +11,7 @@
 #define DEFAULT_BEFORE_LEN 2
 #define DEFAULT_CONTEXT_LEN 2
 #define DEFAULT_MAX_SEARCH_DEPTH 25
+#define DEFAULT_BINARY_SAMPLE 512
 enum case_behavior {
     CASE_DEFAULT, /* Changes to CASE_SMART at the end of option parsing */
     CASE_SENSITIVE,
@@ -27,15 +28,30 @@ enum path_print_behavior {
     PATH_PRINT_NOTHING
 };
 
+enum layout_order {
+    LAYOUT_ORDER_NONE,  /* Queue files in readdir order */
+    LAYOUT_ORDER_INODE, /* Sort queued files by inode number */
+    LAYOUT_ORDER_EXTENT /* Sort queued files by first physical extent (FIEMAP) */
+};
+
+#define DEFAULT_LAYOUT_WINDOW 1024
+
 typedef struct {
     dropt_uintptr ackmate;
+    dropt_uintptr background;
+    dropt_uintptr binary_cache;
     regex_t *ackmate_dir_filter;
     size_t after;
     size_t before;
+    size_t binary_sample;
+    dropt_uintptr build_index;
+    char *cache_dir; /* NULL if there's nowhere to put caches */
     enum case_behavior casing;
     const char *file_search_string;
     dropt_uintptr match_files;
     regex_t *file_search_regex;
+    char **file_type_extensions; /* From --cpp, --python, etc. Sorted. */
+    size_t file_type_extensions_len;
     dropt_uintptr color;
     char *color_line_number;
     char *color_match;
@@ -44,12 +60,22 @@ typedef struct {
     dropt_uintptr column;
     size_t context;
     dropt_uintptr follow_symlinks;
+    dropt_uintptr git_changed;
+    dropt_uintptr git_index;
+    dropt_uintptr gzip_index;
+    dropt_uintptr ignore_cache;
     dropt_uintptr invert_match;
     dropt_uintptr literal;
+    dropt_uintptr low_cache;
+    dropt_uintptr direct_io;
     dropt_uintptr literal_starts_wordchar;
     dropt_uintptr literal_ends_wordchar;
     size_t max_matches_per_file;
+    size_t max_read_rate; /* bytes per second. 0 means unlimited */
+    int max_active_workers;
     int max_search_depth;
+    enum layout_order layout_order;
+    size_t layout_window;
     dropt_uintptr mmap;
     dropt_uintptr multiline;
     dropt_uintptr one_dev;
@@ -67,22 +93,26 @@ typedef struct {
     dropt_uintptr passthrough;
     regex_t *re;
     dropt_uintptr recurse_dirs;
+    dropt_uintptr result_cache;
     dropt_uintptr search_all_files;
     dropt_uintptr skip_vcs_ignores;
     dropt_uintptr search_binary_files;
     dropt_uintptr search_zip_files;
     dropt_uintptr search_hidden_files;
     dropt_uintptr search_stream; /* true if tail -F blah | ag */
+    dropt_uintptr server;
+    char *socket_path; /* For --server. NULL if there's nowhere to put it. */
     dropt_uintptr stats;
-    size_t stream_line_num;    /* This should totally not be in here */
     dropt_uintptr match_found; /* This should totally not be in here */
     char *query;
     dropt_uintptr query_len;
     char *pager;
     dropt_uintptr paths_len;
     dropt_uintptr parallel;
+    dropt_uintptr use_index;
     dropt_uintptr use_thread_affinity;
     dropt_uintptr vimgrep;
+    dropt_uintptr walk_cache;
     size_t width;
     dropt_uintptr word_regexp;
     int workers;
@@ -99,6 +129,9 @@ typedef struct option option_t;
 void usage(dropt_context *);
 void print_version(void);
 
+/* ~/.cache/ag, or under XDG_CACHE_HOME if that's set. NULL without either. */
+char *default_cache_dir(void);
+
 void init_options(void);
 void parse_options(int argc, char **argv, char **base_paths[], char **paths[]);
 void cleanup_options(void);
@@ -33,6 +33,9 @@ print_context_t *print_init_context(void) {
     ctx->last_printed_match = 0;
     ctx->in_a_match = FALSE;
     ctx->printing_a_match = FALSE;
+    ctx->printed_heading = FALSE;
+    ctx->printed_a_match = FALSE;
+    ctx->more_to_come = FALSE;
 
     return ctx;
 }
@@ -145,27 +148,30 @@ void print_file_matches(print_context_t *ctx, const char *path, const char *buf,
         sep = ':';
     }
 
-    print_file_separator();
+    if (!ctx->printed_heading) {
+        print_file_separator();
 
-    if (opts.print_path == PATH_PRINT_DEFAULT) {
-        opts.print_path = PATH_PRINT_TOP;
-    } else if (opts.print_path == PATH_PRINT_DEFAULT_EACH_LINE) {
-        opts.print_path = PATH_PRINT_EACH_LINE;
-    }
+        if (opts.print_path == PATH_PRINT_DEFAULT) {
+            opts.print_path = PATH_PRINT_TOP;
+        } else if (opts.print_path == PATH_PRINT_DEFAULT_EACH_LINE) {
+            opts.print_path = PATH_PRINT_EACH_LINE;
+        }
 
-    if (opts.print_path == PATH_PRINT_TOP) {
-        if (opts.print_count) {
-            print_path_count(path, opts.path_sep, matches_len);
-        } else {
-            print_path(path, opts.path_sep);
+        if (opts.print_path == PATH_PRINT_TOP) {
+            if (opts.print_count) {
+                print_path_count(path, opts.path_sep, matches_len);
+            } else {
+                print_path(path, opts.path_sep);
+            }
         }
+        ctx->printed_heading = TRUE;
     }
 
-    for (i = 0; i <= buf_len && (cur_match < matches_len || ctx->lines_since_last_match <= opts.after); i++) {
+    for (i = 0; (i < buf_len || (i == buf_len && !ctx->more_to_come)) && (cur_match < matches_len || ctx->lines_since_last_match <= opts.after); i++) {
         if (cur_match < matches_len && i == matches[cur_match].start) {
             ctx->in_a_match = TRUE;
             /* We found the start of a match */
-            if (cur_match > 0 && blanks_between_matches && ctx->lines_since_last_match > (opts.before + opts.after + 1)) {
+            if (ctx->printed_a_match && blanks_between_matches && ctx->lines_since_last_match > (opts.before + opts.after + 1)) {
                 fprintf(out_fd, "--\n");
             }
 
@@ -191,6 +197,7 @@ void print_file_matches(print_context_t *ctx, const char *path, const char *buf,
                 }
             }
             ctx->lines_since_last_match = 0;
+            ctx->printed_a_match = TRUE;
         }
 
         if (cur_match < matches_len && i == matches[cur_match].end) {
@@ -295,11 +302,6 @@ void print_file_matches(print_context_t *ctx, const char *path, const char *buf,
                 }
             }
 
-            if (opts.search_stream) {
-                ctx->last_printed_match = 0;
-                break;
-            }
-
             /* print context after matching line */
             print_trailing_context(ctx, path, &buf[ctx->prev_line_offset], i - ctx->prev_line_offset);
 
@@ -349,6 +351,34 @@ void print_file_separator(void) {
     first_file_match = 0;
 }
 
+/* Output for a file can be held back in a stream of its own while other
+ * files are printed, then printed in one piece with print_held(). The
+ * caller holds print_mtx throughout. */
+static FILE *held_out_fd = NULL;
+static int held_first_file_match;
+
+void print_hold_start(FILE *held) {
+    held_out_fd = out_fd;
+    held_first_file_match = first_file_match;
+    out_fd = held;
+    /* The separator is printed when the output is */
+    first_file_match = 1;
+}
+
+void print_hold_end(void) {
+    out_fd = held_out_fd;
+    first_file_match = held_first_file_match;
+    held_out_fd = NULL;
+}
+
+void print_held(const char *buf, const size_t buf_len) {
+    if (buf_len == 0) {
+        return;
+    }
+    print_file_separator();
+    fwrite(buf, 1, buf_len, out_fd);
+}
+
 const char *normalize_path(const char *path) {
     if (strlen(path) < 3) {
         return path;
@@ -14,6 +14,9 @@ typedef struct print_context {
     size_t last_printed_match;
     int in_a_match;
     int printing_a_match;
+    int printed_heading; /* The file may be printed in several calls */
+    int printed_a_match;
+    int more_to_come; /* The buffer ends with a newline and the file goes on after it */
 } print_context_t;
 
 print_context_t *print_init_context(void);
@@ -29,6 +32,9 @@ void print_line_number(size_t line, const char sep);
 void print_column_number(const match_t matches[], size_t last_printed_match,
                          size_t prev_line_offset, const char sep);
 void print_file_separator(void);
+void print_hold_start(FILE *held);
+void print_hold_end(void);
+void print_held(const char *buf, const size_t buf_len);
 const char *normalize_path(const char *path);
 
 #ifdef _WIN32
@@ -0,0 +1,314 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "config.h"
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include "cache_file.h"
+#include "log.h"
+#include "result_cache.h"
+#include "uthash.h"
+#include "util.h"
+
+/* The matches found in each file, per query, so a file that hasn't changed
+ * doesn't have to be searched again. Files are identified by device and
+ * inode, and the size, mtime and ctime make sure they haven't changed since.
+ *
+ * Each query (with the options that change what matches) is stored once and
+ * entries refer to it by index. Entries are kept in least recently used
+ * order, oldest first, and dropped from the front when the cache gets too
+ * big. */
+
+#define RESULT_CACHE_MAGIC "agres01"
+
+typedef struct {
+    char magic[8];
+    uint64_t queries_len;
+    uint64_t entries_len;
+} result_cache_header_t;
+
+typedef struct {
+    uint64_t query;
+    uint64_t dev;
+    uint64_t ino;
+} result_cache_key_t;
+
+/* On disk, each entry is this followed by the start and end of each match */
+typedef struct {
+    result_cache_key_t key;
+    int64_t size;
+    int64_t mtime;
+    int64_t mtime_nsec;
+    int64_t ctime;
+    int64_t ctime_nsec;
+    uint64_t state;
+    uint64_t matches_len;
+} result_cache_record_t;
+
+typedef struct {
+    result_cache_record_t record;
+    match_t *matches;
+    UT_hash_handle hh;
+} result_cache_entry_t;
+
+static result_cache_entry_t *result_cache = NULL;
+static size_t result_cache_bytes = 0;
+static int result_cache_dirty = FALSE;
+static char *result_cache_path = NULL;
+static char **queries = NULL;
+static size_t queries_len = 0;
+/* The index of this run's query */
+static uint64_t current_query = 0;
+static pthread_mutex_t result_cache_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t entry_bytes(const result_cache_entry_t *entry) {
+    return sizeof(result_cache_record_t) + entry->record.matches_len * 2 * sizeof(uint64_t);
+}
+
+static void set_record(result_cache_record_t *record, const struct stat *statbuf) {
+    memset(record, 0, sizeof(*record));
+    record->key.query = current_query;
+    record->key.dev = (uint64_t)statbuf->st_dev;
+    record->key.ino = (uint64_t)statbuf->st_ino;
+    record->size = (int64_t)statbuf->st_size;
+    record->mtime = (int64_t)statbuf->st_mtime;
+    record->ctime = (int64_t)statbuf->st_ctime;
+#ifdef HAVE_STAT_MTIM
+    record->mtime_nsec = (int64_t)statbuf->st_mtim.tv_nsec;
+    record->ctime_nsec = (int64_t)statbuf->st_ctim.tv_nsec;
+#endif
+}
+
+static void free_entry(result_cache_entry_t *entry) {
+    free(entry->matches);
+    free(entry);
+}
+
+static void delete_entry(result_cache_entry_t *entry) {
+    HASH_DELETE(hh, result_cache, entry);
+    result_cache_bytes -= entry_bytes(entry);
+    free_entry(entry);
+}
+
+/* Adds entry as the most recently used. Takes ownership of it. */
+static void add_entry(result_cache_entry_t *entry) {
+    result_cache_entry_t *old = NULL;
+
+    HASH_FIND(hh, result_cache, &entry->record.key, sizeof(result_cache_key_t), old);
+    if (old) {
+        delete_entry(old);
+    }
+    HASH_ADD(hh, result_cache, record.key, sizeof(result_cache_key_t), entry);
+    result_cache_bytes += entry_bytes(entry);
+
+    while (result_cache_bytes > RESULT_CACHE_MAX_BYTES && result_cache != entry) {
+        delete_entry(result_cache);
+    }
+}
+
+void result_cache_load(const char *path, const char *key) {
+    cache_file_t cf;
+    char *query;
+    result_cache_header_t header;
+    result_cache_record_t record;
+    result_cache_entry_t *entry;
+    uint64_t len;
+    uint64_t pair[2];
+    uint64_t i, j;
+
+    result_cache_path = ag_strdup(path);
+
+    if (cache_file_open(&cf, "result cache", path, RESULT_CACHE_MAGIC, &header, sizeof(header))) {
+        for (i = 0; i < header.queries_len; i++) {
+            if (!cache_file_read(&cf, &len, sizeof(len)) || (query = cache_file_read_data(&cf, len)) == NULL) {
+                break;
+            }
+            queries = ag_realloc(queries, (queries_len + 1) * sizeof(char *));
+            queries[queries_len++] = query;
+        }
+        for (i = 0; queries_len == header.queries_len && i < header.entries_len; i++) {
+            if (!cache_file_read(&cf, &record, sizeof(record)) || record.key.query >= queries_len ||
+                record.state > RESULT_CACHE_SKIPPED || record.matches_len > cf.left / sizeof(pair)) {
+                break;
+            }
+            entry = ag_malloc(sizeof(result_cache_entry_t));
+            entry->record = record;
+            entry->matches = ag_malloc((record.matches_len + 1) * sizeof(match_t));
+            for (j = 0; j < record.matches_len; j++) {
+                /* Matches are printed straight from the file, so they have
+                 * to be in order and inside it */
+                if (!cache_file_read(&cf, pair, sizeof(pair)) || pair[0] > pair[1] || pair[1] > (uint64_t)record.size ||
+                    (j > 0 && pair[0] < entry->matches[j - 1].end)) {
+                    break;
+                }
+                entry->matches[j].start = (size_t)pair[0];
+                entry->matches[j].end = (size_t)pair[1];
+            }
+            if (j < record.matches_len) {
+                free_entry(entry);
+                break;
+            }
+            add_entry(entry);
+        }
+        if (queries_len != header.queries_len || i != header.entries_len) {
+            log_debug("Result cache %s is truncated", path);
+        }
+        log_debug("Loaded %lu entries from result cache %s", (unsigned long)HASH_COUNT(result_cache), path);
+        cache_file_close(&cf);
+    }
+
+    for (current_query = 0; current_query < queries_len; current_query++) {
+        if (strcmp(queries[current_query], key) == 0) {
+            break;
+        }
+    }
+    if (current_query == queries_len) {
+        queries = ag_realloc(queries, (queries_len + 1) * sizeof(char *));
+        queries[queries_len++] = ag_strdup(key);
+    }
+}
+
+void result_cache_save(void) {
+    cache_file_t cf;
+    result_cache_header_t header;
+    result_cache_entry_t *entry;
+    result_cache_record_t record;
+    uint64_t *query_ids;
+    uint64_t len;
+    uint64_t pair[2];
+    size_t i;
+
+    if (result_cache_path == NULL || !result_cache_dirty) {
+        return;
+    }
+
+    if (!cache_file_create(&cf, "result cache", result_cache_path)) {
+        return;
+    }
+
+    /* Queries without entries left are dropped, so the rest are numbered
+     * again. 0 means dropped. */
+    query_ids = ag_calloc(queries_len, sizeof(uint64_t));
+    for (entry = result_cache; entry != NULL; entry = entry->hh.next) {
+        query_ids[entry->record.key.query] = 1;
+    }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, RESULT_CACHE_MAGIC, sizeof(header.magic));
+    for (i = 0; i < queries_len; i++) {
+        if (query_ids[i]) {
+            query_ids[i] = ++header.queries_len;
+        }
+    }
+    header.entries_len = HASH_COUNT(result_cache);
+    fwrite(&header, sizeof(header), 1, cf.fp);
+    for (i = 0; i < queries_len; i++) {
+        if (query_ids[i]) {
+            len = strlen(queries[i]);
+            fwrite(&len, sizeof(len), 1, cf.fp);
+            fwrite(queries[i], 1, len, cf.fp);
+        }
+    }
+    for (entry = result_cache; entry != NULL; entry = entry->hh.next) {
+        record = entry->record;
+        record.key.query = query_ids[record.key.query] - 1;
+        fwrite(&record, sizeof(record), 1, cf.fp);
+        for (i = 0; i < record.matches_len; i++) {
+            pair[0] = (uint64_t)entry->matches[i].start;
+            pair[1] = (uint64_t)entry->matches[i].end;
+            fwrite(pair, sizeof(pair), 1, cf.fp);
+        }
+    }
+    free(query_ids);
+
+    if (cache_file_commit(&cf)) {
+        log_debug("Saved %lu entries to result cache %s", (unsigned long)header.entries_len, result_cache_path);
+    }
+}
+
+void result_cache_cleanup(void) {
+    result_cache_entry_t *entry;
+    result_cache_entry_t *tmp;
+    size_t i;
+
+    HASH_ITER(hh, result_cache, entry, tmp) {
+        delete_entry(entry);
+    }
+    for (i = 0; i < queries_len; i++) {
+        free(queries[i]);
+    }
+    free(queries);
+    queries = NULL;
+    queries_len = 0;
+    result_cache_dirty = FALSE;
+    free(result_cache_path);
+    result_cache_path = NULL;
+}
+
+result_cache_hit_t *result_cache_lookup(const struct stat *statbuf) {
+    result_cache_record_t record;
+    result_cache_entry_t *entry = NULL;
+    result_cache_hit_t *hit = NULL;
+
+    if (result_cache_path == NULL) {
+        return NULL;
+    }
+    set_record(&record, statbuf);
+    pthread_mutex_lock(&result_cache_mtx);
+    HASH_FIND(hh, result_cache, &record.key, sizeof(result_cache_key_t), entry);
+    if (entry && entry->record.size == record.size && entry->record.mtime == record.mtime &&
+        entry->record.mtime_nsec == record.mtime_nsec && entry->record.ctime == record.ctime &&
+        entry->record.ctime_nsec == record.ctime_nsec) {
+        hit = ag_malloc(sizeof(result_cache_hit_t));
+        hit->state = (enum result_cache_state)entry->record.state;
+        hit->matches_len = entry->record.matches_len;
+        hit->matches = ag_malloc((hit->matches_len + 1) * sizeof(match_t));
+        memcpy(hit->matches, entry->matches, hit->matches_len * sizeof(match_t));
+        /* Now the most recently used */
+        HASH_DELETE(hh, result_cache, entry);
+        HASH_ADD(hh, result_cache, record.key, sizeof(result_cache_key_t), entry);
+        result_cache_dirty = TRUE;
+    }
+    pthread_mutex_unlock(&result_cache_mtx);
+    return hit;
+}
+
+void result_cache_free_hit(result_cache_hit_t *hit) {
+    if (hit) {
+        free(hit->matches);
+        free(hit);
+    }
+}
+
+void result_cache_add(const struct stat *statbuf, enum result_cache_state state, const match_t *matches, size_t matches_len) {
+    result_cache_entry_t *entry;
+
+    if (result_cache_path == NULL) {
+        return;
+    }
+    /* A file written in the last second could be written again without its
+     * mtime changing */
+    if ((int64_t)statbuf->st_mtime >= (int64_t)time(NULL) - 1) {
+        return;
+    }
+    if (matches_len * 2 * sizeof(uint64_t) > RESULT_CACHE_MAX_BYTES / 16) {
+        return;
+    }
+
+    entry = ag_malloc(sizeof(result_cache_entry_t));
+    set_record(&entry->record, statbuf);
+    entry->record.state = state;
+    entry->record.matches_len = matches_len;
+    entry->matches = ag_malloc((matches_len + 1) * sizeof(match_t));
+    memcpy(entry->matches, matches, matches_len * sizeof(match_t));
+
+    pthread_mutex_lock(&result_cache_mtx);
+    add_entry(entry);
+    result_cache_dirty = TRUE;
+    pthread_mutex_unlock(&result_cache_mtx);
+}
@@ -0,0 +1,37 @@
+#ifndef RESULT_CACHE_H
+#define RESULT_CACHE_H
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "util.h"
+
+/* The least recently used entries are dropped past this many bytes */
+#define RESULT_CACHE_MAX_BYTES (32 * 1024 * 1024)
+
+/* What search_buf made of a file */
+enum result_cache_state {
+    RESULT_CACHE_TEXT,
+    RESULT_CACHE_BINARY, /* Searched anyway, and printed as "Binary file matches" */
+    RESULT_CACHE_SKIPPED /* Skipped for being binary */
+};
+
+typedef struct {
+    enum result_cache_state state;
+    match_t *matches;
+    size_t matches_len;
+} result_cache_hit_t;
+
+/* Entries for other queries are kept, but only the ones made with the same
+ * key are used. Call once the query is final. */
+void result_cache_load(const char *path, const char *key);
+void result_cache_save(void);
+void result_cache_cleanup(void);
+
+/* If the file hasn't changed since it was searched for this query, returns
+ * a copy of what was found. Free it with result_cache_free_hit(). */
+result_cache_hit_t *result_cache_lookup(const struct stat *statbuf);
+void result_cache_free_hit(result_cache_hit_t *hit);
+void result_cache_add(const struct stat *statbuf, enum result_cache_state state, const match_t *matches, size_t matches_len);
+
+#endif
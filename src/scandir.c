@@ -25,7 +25,7 @@ int ag_scandir(const char *dirname,
     }
 
     while ((entry = readdir(dirp)) != NULL) {
-        if ((*filter)(dirname, entry, baton) == FALSE) {
+        if (filter && (*filter)(dirname, entry, baton) == FALSE) {
             continue;
         }
         if (results_len >= names_len) {
@@ -4,7 +4,7 @@
 #include "ignore.h"
 
 typedef struct {
-    const ignores *ig;
+    ignores *ig;
     const char *base_path;
     size_t base_path_len;
     const char *path_start;
@@ -12,6 +12,7 @@ typedef struct {
 
 typedef int (*filter_fp)(const char *path, const struct dirent *, void *);
 
+/* filter may be NULL to keep every entry */
 int ag_scandir(const char *dirname,
                struct dirent ***namelist,
                filter_fp filter,
@@ -1,6 +1,20 @@
 #include "search.h"
+#include "archive.h"
+#include "binary_cache.h"
+#include "git_index.h"
+#include "gitconfig.h"
+#include "gzip_members.h"
+#include "lang.h"
 #include "print.h"
+#include "result_cache.h"
 #include "scandir.h"
+#include "walk_cache.h"
+
+#ifdef HAVE_LINUX_FIEMAP_H
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
 
 size_t alpha_skip_lookup[256];
 size_t *find_skip_lookup;
@@ -17,25 +31,36 @@ int done_adding_files = 0;
 pthread_cond_t files_ready = PTHREAD_COND_INITIALIZER;
 pthread_mutex_t stats_mtx = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t work_queue_mtx = PTHREAD_MUTEX_INITIALIZER;
+trigram_scope_t *index_scope = NULL;
+
+/* Workers searching a file, and extra threads decompressing one. Both are
+ * protected by work_queue_mtx. */
+static int busy_workers = 0;
+static int decoder_threads = 0;
 
 symdir_t *symhash = NULL;
+void (*walk_dir_hook)(const char *path) = NULL;
+void (*walk_file_hook)(char *path, ino_t ino) = NULL;
+
+/* Files waiting to be sorted by on-disk location before they're queued */
+typedef struct {
+    uint64_t key;
+    char *path;
+    trigram_scope_t *index_scope;
+} layout_entry_t;
+
+static layout_entry_t *layout_batch = NULL;
+static size_t layout_batch_len = 0;
+#ifdef HAVE_LINUX_FIEMAP_H
+static int fiemap_unsupported = FALSE;
+#endif
 
-/* Returns: -1 if skipped, otherwise # of matches */
-ssize_t search_buf(print_context_t *ctx, char *buf, const size_t buf_len,
-                   const char *dir_full_path) {
-    int binary = -1; /* 1 = yes, 0 = no, -1 = don't know */
+/* Finds the matches in buf. Gives up after max_matches if it's nonzero.
+ * *matches_p is allocated here and must be freed by the caller if *matches_size_p > 0.
+ * Returns the number of matches. */
+static size_t find_matches(char *buf, const size_t buf_len, const char *dir_full_path,
+                           match_t **matches_p, size_t *matches_size_p, const size_t max_matches) {
     size_t buf_offset = 0;
-
-    if (opts.search_stream) {
-        binary = 0;
-    } else if (!opts.search_binary_files && opts.mmap) { /* if not using mmap, binary files have already been skipped */
-        binary = is_binary((const void *)buf, buf_len);
-        if (binary) {
-            log_debug("File %s is binary. Skipping...", dir_full_path);
-            return -1;
-        }
-    }
-
     size_t matches_len = 0;
     match_t *matches;
     size_t matches_size;
@@ -111,13 +136,12 @@ ssize_t search_buf(print_context_t *ctx, char *buf, const size_t buf_len,
             matches_len++;
             match_ptr += opts.query_len;
 
-            if (opts.max_matches_per_file > 0 && matches_len >= opts.max_matches_per_file) {
+            if (max_matches > 0 && matches_len >= max_matches) {
                 log_err("Too many matches in %s. Skipping the rest of this file.", dir_full_path);
                 break;
             }
         }
     } else {
-        int offset_vector[3];
         if (opts.multiline) {
             regmatch_t pmatch[1];
 
@@ -139,7 +163,7 @@ ssize_t search_buf(print_context_t *ctx, char *buf, const size_t buf_len,
                 matches[matches_len].end = end;
                 matches_len++;
 
-                if (opts.max_matches_per_file > 0 && matches_len >= opts.max_matches_per_file) {
+                if (max_matches > 0 && matches_len >= max_matches) {
                     log_err("Too many matches in %s. Skipping the rest of this file.", dir_full_path);
                     break;
                 }
@@ -176,7 +200,7 @@ ssize_t search_buf(print_context_t *ctx, char *buf, const size_t buf_len,
                     matches[matches_len].end = end + line_to_buf;
                     matches_len++;
 
-                    if (opts.max_matches_per_file > 0 && matches_len >= opts.max_matches_per_file) {
+                    if (max_matches > 0 && matches_len >= max_matches) {
                         log_err("Too many matches in %s. Skipping the rest of this file.", dir_full_path);
                         goto multiline_done;
                     }
@@ -192,6 +216,15 @@ multiline_done:
         matches_len = invert_matches(buf, buf_len, matches, matches_len);
     }
 
+    *matches_p = matches;
+    *matches_size_p = matches_size;
+    return matches_len;
+}
+
+/* Counts and prints what was found in a file. binary is 1, 0, or -1 to
+ * work it out from buf if it matters. */
+static void report_matches(print_context_t *ctx, const char *dir_full_path, const char *buf, const size_t buf_len,
+                           const match_t *matches, const size_t matches_len, int binary) {
     if (opts.stats) {
         pthread_mutex_lock(&stats_mtx);
         stats.total_bytes += buf_len;
@@ -221,16 +254,45 @@ multiline_done:
         }
         pthread_mutex_unlock(&print_mtx);
         opts.match_found = 1;
-    } else if (opts.search_stream && opts.passthrough) {
-        fprintf(out_fd, "%s", buf);
     } else {
         log_debug("No match in %s", dir_full_path);
     }
+}
+
+/* If statbuf isn't NULL, what's found goes in the result cache */
+static ssize_t search_file_buf(print_context_t *ctx, char *buf, const size_t buf_len,
+                               const char *dir_full_path, const struct stat *statbuf) {
+    int binary = -1; /* 1 = yes, 0 = no, -1 = don't know */
+
+    if (!opts.search_binary_files && (opts.mmap || opts.search_zip_files)) {
+        /* Without mmap, binary files have already been skipped, unless -z left them to be opened up */
+        binary = is_binary((const void *)buf, buf_len);
+        if (binary) {
+            log_debug("File %s is binary. Skipping...", dir_full_path);
+            if (statbuf) {
+                result_cache_add(statbuf, RESULT_CACHE_SKIPPED, NULL, 0);
+            }
+            return -1;
+        }
+    }
+
+    size_t matches_len;
+    match_t *matches;
+    size_t matches_size;
 
-    if (matches_len == 0 && opts.search_stream) {
-        print_context_append(ctx, buf, buf_len - 1);
+    matches_len = find_matches(buf, buf_len, dir_full_path, &matches, &matches_size, opts.max_matches_per_file);
+
+    /* Files cut short by --max-count aren't cached, so the error about it is
+     * printed every time */
+    if (statbuf && (opts.max_matches_per_file == 0 || (matches_len < opts.max_matches_per_file && !opts.invert_match))) {
+        if (binary == -1 && matches_len > 0) {
+            binary = is_binary((const void *)buf, buf_len);
+        }
+        result_cache_add(statbuf, binary == 1 ? RESULT_CACHE_BINARY : RESULT_CACHE_TEXT, matches, matches_len);
     }
 
+    report_matches(ctx, dir_full_path, buf, buf_len, matches, matches_len, binary);
+
     if (matches_size > 0) {
         free(matches);
     }
@@ -239,234 +301,1229 @@ multiline_done:
     return (ssize_t)matches_len;
 }
 
-/* Return value: -1 if skipped, otherwise # of matches */
-/* TODO: this will only match single lines. multi-line regexes silently don't match */
-ssize_t search_stream(FILE *stream, const char *path) {
-    char *line = NULL;
-    ssize_t matches_count = 0;
-    ssize_t line_len = 0;
-    size_t line_cap = 0;
-    size_t i;
+/* Returns: -1 if skipped, otherwise # of matches */
+ssize_t search_buf(print_context_t *ctx, char *buf, const size_t buf_len,
+                   const char *dir_full_path) {
+    return search_file_buf(ctx, buf, buf_len, dir_full_path, NULL);
+}
 
-    print_context_t *ctx = print_init_context();
+/* How much of the end of each chunk has to be searched again with the next
+ * one, so multiline matches can cross chunks */
+static size_t chunk_overlap(void) {
+    if (opts.multiline && (!opts.literal || memchr(opts.query, '\n', opts.query_len))) {
+        return LOW_CACHE_OVERLAP;
+    }
+    return 0;
+}
 
-    for (i = 1; (line_len = getline(&line, &line_cap, stream)) > 0; i++) {
-        ssize_t result;
-        opts.stream_line_num = i;
-        result = search_buf(ctx, line, line_len, path);
-        if (result > 0) {
-            if (matches_count == -1) {
-                matches_count = 0;
-            }
-            matches_count += result;
-        } else if (matches_count <= 0 && result == -1) {
-            matches_count = -1;
+void chunk_search_init(chunk_search_t *cs, print_context_t *ctx, const char *path) {
+    cs->ctx = ctx;
+    cs->path = path;
+    cs->line = 1;
+    cs->matches_len = 0;
+    cs->bytes = 0;
+    cs->binary = opts.search_stream ? 0 : -1;
+    cs->holding_print_mtx = FALSE;
+    cs->inverted_match_open = FALSE;
+    cs->overlap = 0;
+    cs->out = NULL;
+    cs->out_buf = NULL;
+    cs->out_len = 0;
+}
+
+/* Takes print_mtx to print a chunk. Other workers' output mustn't end up
+ * between our chunks, so the output is held back until the file is done
+ * rather than keeping print_mtx for the whole file. */
+static void chunk_print_start(chunk_search_t *cs) {
+    if (cs->holding_print_mtx) {
+        return;
+    }
+    pthread_mutex_lock(&print_mtx);
+#if HAVE_OPEN_MEMSTREAM
+    /* Nothing else is searched alongside a stream, and its output can't wait */
+    if (!opts.search_stream) {
+        if (!cs->out) {
+            cs->out = open_memstream(&cs->out_buf, &cs->out_len);
         }
-        if (line[line_len - 1] == '\n') {
-            line_len--;
+        if (cs->out) {
+            print_hold_start(cs->out);
+            return;
         }
-        print_trailing_context(ctx, path, line, line_len);
     }
-
-    free(line);
-    print_cleanup_context(ctx);
-    return matches_count;
+#endif
+    cs->holding_print_mtx = TRUE;
 }
 
-void search_file(const char *file_full_path) {
-    int fd = -1;
-    off_t f_len = 0;
-    char *buf = NULL;
-    struct stat statbuf;
-    int rv = 0;
-    int matches_count = -1;
-    FILE *fp = NULL;
-    print_context_t *ctx = NULL;
-
-    rv = stat(file_full_path, &statbuf);
-    if (rv != 0) {
-        log_err("Skipping %s: Error fstat()ing file.", file_full_path);
-        goto cleanup;
+/* Prints the output held back so far. print_mtx has to be held. */
+static void chunk_print_held(chunk_search_t *cs) {
+    if (!cs->out) {
+        return;
     }
+    fclose(cs->out);
+    print_held(cs->out_buf, cs->out_len);
+    free(cs->out_buf);
+    cs->out = NULL;
+    cs->out_buf = NULL;
+    cs->out_len = 0;
+}
 
-#ifdef __unix__
-    if (opts.stdout_inode != 0 && opts.stdout_inode == statbuf.st_ino) {
-        log_debug("Skipping %s: stdout is redirected to it", file_full_path);
-        goto cleanup;
+static void chunk_print_end(chunk_search_t *cs) {
+    if (cs->holding_print_mtx) {
+        return;
     }
-#endif
-
-    // handling only regular files and FIFOs
-    if (!S_ISREG(statbuf.st_mode) && !S_ISFIFO(statbuf.st_mode)) {
-        log_err("Skipping %s: Mode %u is not a file.", file_full_path, statbuf.st_mode);
-        goto cleanup;
+    print_hold_end();
+    fflush(cs->out);
+    if (cs->out_len > CHUNK_OUTPUT_MAX) {
+        /* Too much to hold back. Print the rest as it comes. */
+        chunk_print_held(cs);
+        cs->holding_print_mtx = TRUE;
+        return;
     }
+    pthread_mutex_unlock(&print_mtx);
+}
 
-    fd = open(file_full_path, O_RDONLY);
-    if (fd < 0) {
-        /* XXXX: strerror is not thread-safe */
-        log_err("Skipping %s: Error opening file: %s", file_full_path, strerror(errno));
-        goto cleanup;
+/* Put the last lines of a chunk that print_file_matches() didn't get to into
+ * the before-context ring, so the next chunk can print them. */
+static void chunk_context_append(print_context_t *ctx, const char *buf, size_t buf_len, size_t lines) {
+    size_t *line_starts;
+    size_t start = buf_len;
+    size_t end;
+    size_t found = 0;
+    size_t i;
+
+    if (opts.before == 0 || lines == 0) {
+        return;
+    }
+    if (lines > opts.before) {
+        lines = opts.before;
     }
+    line_starts = ag_malloc(lines * sizeof(size_t));
 
-    // repeating stat check with file handle to prevent TOCTOU issue
-    rv = fstat(fd, &statbuf);
-    if (rv != 0) {
-        log_err("Skipping %s: Error fstat()ing file.", file_full_path);
-        goto cleanup;
+    /* Walk backwards to find where each of the last lines starts */
+    while (found < lines) {
+        while (start > 0 && buf[start - 1] != '\n') {
+            start--;
+        }
+        line_starts[lines - 1 - found] = start;
+        found++;
+        if (start == 0) {
+            break;
+        }
+        start--;
     }
 
-#ifdef __unix__
-    if (opts.stdout_inode != 0 && opts.stdout_inode == statbuf.st_ino) {
-        log_debug("Skipping %s: stdout is redirected to it", file_full_path);
-        goto cleanup;
+    for (i = lines - found; i < lines; i++) {
+        start = line_starts[i];
+        for (end = start; end < buf_len && buf[end] != '\n'; end++) {
+        }
+        print_context_append(ctx, buf + start, end - start);
     }
-#endif
+    free(line_starts);
+}
 
-    // handling only regular files and FIFOs
-    if (!S_ISREG(statbuf.st_mode) && !S_ISFIFO(statbuf.st_mode)) {
-        log_err("Skipping %s: Mode %u is not a file.", file_full_path, statbuf.st_mode);
-        goto cleanup;
+/* --passthrough: prints the lines with matches the usual way, and the
+ * lines between them as they are */
+static void chunk_print_passthrough(chunk_search_t *cs, const char *buf, const size_t buf_len,
+                                    const match_t *matches, const size_t matches_len) {
+    print_context_t *ctx = cs->ctx;
+    match_t *line_matches = NULL;
+    size_t line = cs->line;
+    size_t printed = 0; /* Where the lines not printed yet start */
+    size_t start;
+    size_t end;
+    size_t i = 0;
+    size_t j;
+
+    if (matches_len > 0) {
+        line_matches = ag_malloc(matches_len * sizeof(match_t));
+    }
+    while (i < matches_len) {
+        /* The lines the match is on, and the other matches on them */
+        for (start = matches[i].start; start > 0 && buf[start - 1] != '\n'; start--) {
+        }
+        end = start;
+        j = i;
+        do {
+            end = ag_max(end, matches[j].end > matches[j].start ? matches[j].end - 1 : matches[j].start);
+            while (end < buf_len && buf[end] != '\n') {
+                end++;
+            }
+            line_matches[j - i].start = matches[j].start - start;
+            line_matches[j - i].end = matches[j].end - start;
+            j++;
+        } while (j < matches_len && matches[j].start <= end);
+
+        fwrite(buf + printed, 1, start - printed, out_fd);
+        line += count_newlines(buf + printed, start - printed);
+        ctx->line = line;
+        ctx->prev_line_offset = 0;
+        ctx->line_preceding_current_match_offset = 0;
+        ctx->last_printed_match = 0;
+        /* The last line of the input needn't end with a newline */
+        ctx->more_to_come = end < buf_len;
+        print_file_matches(ctx, cs->path, buf + start, end - start + (end < buf_len), line_matches, j - i);
+        line = ctx->line;
+        printed = ag_min(end + 1, buf_len);
+        i = j;
     }
+    fwrite(buf + printed, 1, buf_len - printed, out_fd);
+    free(line_matches);
+}
 
-    ctx = print_init_context();
+/* Searches the complete lines at the start of buf. Everything up to and
+ * including the last newline is consumed. If eof is set, the rest of buf is
+ * consumed too. Returns the number of bytes consumed, or -1 if the rest of the
+ * file should be skipped (it's binary or has too many matches). */
+ssize_t chunk_search_feed(chunk_search_t *cs, char *buf, const size_t buf_len, const int eof) {
+    print_context_t *ctx = cs->ctx;
+    size_t chunk_len = buf_len;
+    size_t consumed = buf_len;
+    size_t lines = 1; /* The last line of the file needn't end with a newline */
+    size_t lines_printed = 0;
+    size_t max_matches = 0;
+    size_t matches_len;
+    size_t matches_size;
+    match_t *matches;
+    int passthrough = opts.search_stream && opts.passthrough;
 
-    if (statbuf.st_mode & S_IFIFO) {
-        log_debug("%s is a named pipe. stream searching", file_full_path);
-        fp = fdopen(fd, "r");
-        matches_count = search_stream(fp, file_full_path);
-        fclose(fp);
-        goto cleanup;
+    if (buf_len == 0) {
+        return 0;
     }
 
-    f_len = statbuf.st_size;
-
-    if (f_len == 0) {
-        if (opts.query[0] == '.' && opts.query_len == 1 && !opts.literal && opts.search_all_files) {
-            matches_count = search_buf(ctx, buf, f_len, file_full_path);
-        } else {
-            log_debug("Skipping %s: file is empty.", file_full_path);
+    if (cs->binary == -1) {
+        cs->binary = is_binary((const void *)buf, buf_len);
+        if (cs->binary && !opts.search_binary_files) {
+            log_debug("File %s is binary. Skipping...", cs->path);
+            return -1;
         }
-        goto cleanup;
     }
 
-#ifdef _WIN32
-    {
-        HANDLE hmmap = CreateFileMapping(
-            (HANDLE)_get_osfhandle(fd), 0, PAGE_READONLY, 0, f_len, NULL);
-        buf = (char *)MapViewOfFile(hmmap, FILE_SHARE_READ, 0, 0, f_len);
-        if (hmmap != NULL)
-            CloseHandle(hmmap);
+    /* Search whole lines only */
+    if (!eof) {
+        for (chunk_len = buf_len; chunk_len > 0 && buf[chunk_len - 1] != '\n'; chunk_len--) {
+        }
+        if (chunk_len == 0) {
+            /* No complete line yet. The caller has to give us more. */
+            return 0;
+        }
+        consumed = chunk_len;
+        lines = 0;
     }
-    if (buf == NULL) {
-        FormatMessageA(
-            FORMAT_MESSAGE_ALLOCATE_BUFFER |
-                FORMAT_MESSAGE_FROM_SYSTEM |
-                FORMAT_MESSAGE_IGNORE_INSERTS,
-            NULL, GetLastError(), 0, (void *)&buf, 0, NULL);
-        log_err("File %s failed to load: %s.", file_full_path, buf);
-        LocalFree((void *)buf);
-        goto cleanup;
+
+    if (opts.max_matches_per_file > 0) {
+        max_matches = opts.max_matches_per_file - cs->matches_len;
     }
-#else
 
-    if (opts.mmap) {
-        buf = mmap(0, f_len, PROT_READ, MAP_PRIVATE, fd, 0);
-        if (buf == MAP_FAILED) {
-            log_err("File %s failed to load: %s.", file_full_path, strerror(errno));
-            goto cleanup;
+    if (cs->overlap > 0 && !eof && !opts.invert_match) {
+        /* Leave the lines at the end for the next chunk, unless a match that
+         * starts before them runs into them */
+        size_t cut = chunk_len > cs->overlap ? chunk_len - cs->overlap : 0;
+        size_t i;
+        while (cut > 0 && buf[cut - 1] != '\n') {
+            cut--;
         }
-#if HAVE_MADVISE
-        madvise(buf, f_len, MADV_SEQUENTIAL);
-#elif HAVE_POSIX_FADVISE
-        posix_fadvise(fd, 0, f_len, POSIX_MADV_SEQUENTIAL);
-#endif
-    } else {
-        buf = ag_malloc(f_len);
-
-        ssize_t bytes_read = 0;
-
-        if (!opts.search_binary_files) {
-            bytes_read += read(fd, buf, ag_min(f_len, 512));
-            // Optimization: If skipping binary files, don't read the whole buffer before checking if binary or not.
-            if (is_binary(buf, f_len)) {
-                log_debug("File %s is binary. Skipping...", file_full_path);
-                goto cleanup;
+        /* The next chunk may find matches past max_matches here again */
+        matches_len = find_matches(buf, chunk_len, cs->path, &matches, &matches_size, 0);
+        for (i = 0; i < matches_len && matches[i].start < cut; i++) {
+            if (matches[i].end > cut) {
+                for (cut = matches[i].end; cut < chunk_len && buf[cut - 1] != '\n'; cut++) {
+                }
+            }
+        }
+        matches_len = i;
+        if (max_matches > 0 && matches_len >= max_matches) {
+            matches_len = max_matches;
+            log_err("Too many matches in %s. Skipping the rest of this file.", cs->path);
+        }
+        if (cut == 0) {
+            /* No line short enough to leave. The caller has to give us more. */
+            if (matches_size > 0) {
+                free(matches);
             }
+            return 0;
+        }
+        chunk_len = cut;
+        consumed = cut;
+    } else {
+        matches_len = find_matches(buf, chunk_len, cs->path, &matches, &matches_size, max_matches);
+    }
+    lines += count_newlines(buf, chunk_len);
+    cs->matches_len += matches_len;
+    if (opts.invert_match && matches_len > 0) {
+        /* An inverted match that runs into the next chunk is still one match */
+        if (cs->inverted_match_open && matches[0].start == 0) {
+            cs->matches_len--;
         }
+        cs->inverted_match_open = matches[matches_len - 1].end + 1 >= chunk_len;
+    }
+    cs->bytes += consumed;
 
-        while (bytes_read < f_len) {
-            bytes_read += read(fd, buf + bytes_read, f_len);
+    if ((matches_len > 0 || passthrough) && !opts.print_nonmatching_files && !opts.print_filename_only && !cs->binary) {
+        chunk_print_start(cs);
+        if (passthrough) {
+            chunk_print_passthrough(cs, buf, chunk_len, matches, matches_len);
+            lines_printed = lines;
+        } else {
+            ctx->line = cs->line;
+            ctx->prev_line_offset = 0;
+            ctx->line_preceding_current_match_offset = 0;
+            ctx->last_printed_match = 0;
+            ctx->more_to_come = !eof;
+            print_file_matches(ctx, cs->path, buf, chunk_len, matches, matches_len);
+            lines_printed = ctx->line - cs->line;
         }
-        if (bytes_read != f_len) {
-            die("File %s read(): expected to read %u bytes but read %u", file_full_path, f_len, bytes_read);
+        chunk_print_end(cs);
+        if (matches_len > 0) {
+            opts.match_found = 1;
         }
     }
-#endif
 
-    if (opts.search_zip_files) {
-        ag_compression_type zip_type = is_zipped(buf, f_len);
-        if (zip_type != AG_NO_COMPRESSION) {
-#if HAVE_FOPENCOOKIE
-            log_debug("%s is a compressed file. stream searching", file_full_path);
-            fp = decompress_open(fd, "r", zip_type);
-            matches_count = search_stream(fp, file_full_path);
-            fclose(fp);
-#else
-            int _buf_len = (int)f_len;
-            char *_buf = decompress(zip_type, buf, f_len, file_full_path, &_buf_len);
-            if (_buf == NULL || _buf_len == 0) {
-                log_err("Cannot decompress zipped file %s", file_full_path);
-                goto cleanup;
-            }
-            matches_count = search_buf(ctx, _buf, _buf_len, file_full_path);
-            free(_buf);
-#endif
-            goto cleanup;
+    /* print_file_matches() stops once it's past the last match's context.
+     * Account for the lines it didn't look at. */
+    if (lines_printed < lines) {
+        if (ctx->lines_since_last_match < INT_MAX) {
+            ctx->lines_since_last_match = ag_min(INT_MAX, ctx->lines_since_last_match + (lines - lines_printed));
         }
+        chunk_context_append(ctx, buf, eof ? chunk_len : chunk_len - 1, lines - lines_printed);
     }
+    cs->line += lines;
+    ctx->line = cs->line;
 
-    matches_count = search_buf(ctx, buf, f_len, file_full_path);
+    if (matches_size > 0) {
+        free(matches);
+    }
 
-cleanup:
+    if (max_matches > 0 && matches_len >= max_matches) {
+        return -1;
+    }
+    return (ssize_t)consumed;
+}
 
-    if (opts.print_nonmatching_files && matches_count == 0) {
-        pthread_mutex_lock(&print_mtx);
-        print_path(file_full_path, opts.path_sep);
-        pthread_mutex_unlock(&print_mtx);
-        opts.match_found = 1;
+/* Prints whatever is left to print for the file and releases print_mtx.
+ * Returns: -1 if skipped, otherwise # of matches */
+ssize_t chunk_search_finish(chunk_search_t *cs) {
+    size_t matches_len = cs->matches_len;
+
+    if (cs->binary == 1 && !opts.search_binary_files) {
+        if (cs->holding_print_mtx) {
+            pthread_mutex_unlock(&print_mtx);
+        }
+        return -1;
     }
 
-    print_cleanup_context(ctx);
+    if (opts.stats) {
+        pthread_mutex_lock(&stats_mtx);
+        stats.total_bytes += cs->bytes;
+        stats.total_files++;
+        stats.total_matches += matches_len;
+        if (matches_len > 0) {
+            stats.total_file_matches++;
+        }
+        pthread_mutex_unlock(&stats_mtx);
+    }
 
-    if (buf != NULL) {
-#ifdef _WIN32
-        UnmapViewOfFile(buf);
-#else
-        if (opts.mmap) {
-            if (buf != MAP_FAILED) {
-                munmap(buf, f_len);
+    if (cs->out) {
+        pthread_mutex_lock(&print_mtx);
+        chunk_print_held(cs);
+        cs->holding_print_mtx = TRUE;
+    }
+
+    if (!opts.print_nonmatching_files && (matches_len > 0 || opts.print_all_paths)) {
+        if (!cs->holding_print_mtx) {
+            pthread_mutex_lock(&print_mtx);
+            cs->holding_print_mtx = TRUE;
+        }
+        if (opts.print_filename_only) {
+            if (opts.print_count) {
+                print_path_count(cs->path, opts.path_sep, matches_len);
+            } else {
+                print_path(cs->path, opts.path_sep);
             }
-        } else {
-            free(buf);
+        } else if (matches_len == 0) {
+            /* --print-all-files: just the heading */
+            print_file_matches(cs->ctx, cs->path, "", 0, NULL, 0);
+        } else if (cs->binary == 1) {
+            print_binary_file_matches(cs->path);
         }
-#endif
+        opts.match_found = 1;
+    } else {
+        log_debug("No match in %s", cs->path);
     }
-    if (fd != -1) {
-        close(fd);
+
+    if (cs->holding_print_mtx) {
+        pthread_mutex_unlock(&print_mtx);
+        cs->holding_print_mtx = FALSE;
     }
+
+    return (ssize_t)matches_len;
 }
 
-void *search_file_worker(void *i) {
-    work_queue_t *queue_item;
-    int worker_id = *(int *)i;
+/* Decompresses a big file in its own thread, one block ahead of the
+ * search. Each block is handed over full, except the last. */
+typedef struct {
+    FILE *stream;
+    char *blocks[2];
+    size_t blocks_len[2];
+    int blocks_full[2];
+    int stop;  /* The search doesn't want any more */
+    int error; /* errno of a failed read, or 0 */
+    double decompress_time;
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;
+} stream_decoder_t;
+
+/* Extra threads for decompressing a big file get the cores that workers and
+ * other decoders leave idle, which is mostly once the queue runs dry. Returns
+ * how many of wanted the caller may start, maybe 0. */
+static int decoder_threads_acquire(int wanted) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int idle;
+
+    if (opts.max_active_workers > 0 && opts.max_active_workers < cores) {
+        cores = opts.max_active_workers;
+    }
+    pthread_mutex_lock(&work_queue_mtx);
+    idle = (int)cores - busy_workers - decoder_threads;
+    if (wanted > idle) {
+        wanted = idle > 0 ? idle : 0;
+    }
+    decoder_threads += wanted;
+    pthread_mutex_unlock(&work_queue_mtx);
+    return wanted;
+}
 
-    log_debug("Worker %i started", worker_id);
-    while (TRUE) {
+static void decoder_threads_release(int threads) {
+    if (threads > 0) {
         pthread_mutex_lock(&work_queue_mtx);
+        decoder_threads -= threads;
+        pthread_mutex_unlock(&work_queue_mtx);
+    }
+}
+
+static void *stream_decoder_thread(void *arg) {
+    stream_decoder_t *dec = arg;
+    int i = 0;
+    size_t bytes_read;
+    double start;
+
+    do {
+        pthread_mutex_lock(&dec->mtx);
+        while (dec->blocks_full[i] && !dec->stop) {
+            pthread_cond_wait(&dec->cond, &dec->mtx);
+        }
+        if (dec->stop) {
+            pthread_mutex_unlock(&dec->mtx);
+            break;
+        }
+        pthread_mutex_unlock(&dec->mtx);
+
+        start = now_seconds();
+        bytes_read = fread(dec->blocks[i], 1, STREAM_BLOCK_SIZE, dec->stream);
+        dec->decompress_time += now_seconds() - start;
+
+        pthread_mutex_lock(&dec->mtx);
+        if (bytes_read < STREAM_BLOCK_SIZE && ferror(dec->stream)) {
+            dec->error = errno ? errno : EIO;
+        }
+        dec->blocks_len[i] = bytes_read;
+        dec->blocks_full[i] = TRUE;
+        pthread_cond_signal(&dec->cond);
+        pthread_mutex_unlock(&dec->mtx);
+        i = !i;
+    } while (bytes_read == STREAM_BLOCK_SIZE);
+
+    return NULL;
+}
+
+/* Searches a stream a block of whole lines at a time, carrying the partial
+ * last line of each block over to the next. If pipelined, another thread
+ * decompresses the next block while this one is searched. head is anything
+ * already read from the stream.
+ * Returns: -1 if skipped, otherwise # of matches */
+static ssize_t search_stream_blocks(print_context_t *ctx, FILE *stream, const char *path, int pipelined,
+                                    const char *head, const size_t head_len) {
+    chunk_search_t cs;
+    stream_decoder_t dec;
+    pthread_t decoder;
+    size_t buf_size = ag_max(STREAM_BLOCK_SIZE, head_len);
+    size_t buf_len = head_len; /* Bytes in buf we haven't consumed */
+    char *buf = ag_malloc(buf_size);
+    double decompress_time = 0;
+    double search_time = 0;
+    double start;
+    ssize_t consumed;
+    int error = 0;
+    int eof = FALSE;
+    int i = 0;
+
+    if (head_len > 0) {
+        memcpy(buf, head, head_len);
+    }
+    chunk_search_init(&cs, ctx, path);
+    cs.overlap = chunk_overlap();
+
+    if (pipelined) {
+        memset(&dec, 0, sizeof(dec));
+        dec.stream = stream;
+        dec.blocks[0] = ag_malloc(STREAM_BLOCK_SIZE);
+        dec.blocks[1] = ag_malloc(STREAM_BLOCK_SIZE);
+        pthread_mutex_init(&dec.mtx, NULL);
+        pthread_cond_init(&dec.cond, NULL);
+        if (pthread_create(&decoder, NULL, &stream_decoder_thread, &dec) != 0) {
+            log_debug("Couldn't start a decoder thread for %s. Decompressing in this one.", path);
+            pthread_mutex_destroy(&dec.mtx);
+            pthread_cond_destroy(&dec.cond);
+            free(dec.blocks[0]);
+            free(dec.blocks[1]);
+            pipelined = FALSE;
+        }
+    }
+
+    while (!eof) {
+        if (pipelined) {
+            size_t block_len;
+            pthread_mutex_lock(&dec.mtx);
+            while (!dec.blocks_full[i]) {
+                pthread_cond_wait(&dec.cond, &dec.mtx);
+            }
+            block_len = dec.blocks_len[i];
+            if (buf_len + block_len > buf_size) {
+                buf_size = buf_len + block_len;
+                buf = ag_realloc(buf, buf_size);
+            }
+            memcpy(buf + buf_len, dec.blocks[i], block_len);
+            buf_len += block_len;
+            eof = block_len < STREAM_BLOCK_SIZE;
+            error = dec.error;
+            dec.blocks_full[i] = FALSE;
+            pthread_cond_signal(&dec.cond);
+            pthread_mutex_unlock(&dec.mtx);
+            i = !i;
+        } else {
+            size_t bytes_read;
+            if (buf_len == buf_size) {
+                /* A line longer than the buffer */
+                buf_size *= 2;
+                buf = ag_realloc(buf, buf_size);
+            }
+            start = now_seconds();
+            bytes_read = fread(buf + buf_len, 1, buf_size - buf_len, stream);
+            decompress_time += now_seconds() - start;
+            buf_len += bytes_read;
+            if (buf_len < buf_size) {
+                error = ferror(stream) ? errno : 0;
+                eof = TRUE;
+            }
+        }
+        if (eof && error) {
+            log_err("Skipping the rest of %s: Error reading file: %s", path, strerror(error));
+        }
+
+        start = now_seconds();
+        consumed = chunk_search_feed(&cs, buf, buf_len, eof);
+        search_time += now_seconds() - start;
+        if (consumed < 0) {
+            break;
+        }
+        memmove(buf, buf + consumed, buf_len - consumed);
+        buf_len -= consumed;
+    }
+    free(buf);
+
+    if (pipelined) {
+        pthread_mutex_lock(&dec.mtx);
+        dec.stop = TRUE;
+        pthread_cond_signal(&dec.cond);
+        pthread_mutex_unlock(&dec.mtx);
+        pthread_join(decoder, NULL);
+        decompress_time = dec.decompress_time;
+        pthread_mutex_destroy(&dec.mtx);
+        pthread_cond_destroy(&dec.cond);
+        free(dec.blocks[0]);
+        free(dec.blocks[1]);
+    }
+
+    if (opts.stats) {
+        pthread_mutex_lock(&stats_mtx);
+        stats.total_decompressed_files++;
+        stats.decompress_time += decompress_time;
+        stats.decompressed_search_time += search_time;
+        pthread_mutex_unlock(&stats_mtx);
+    }
+
+    return chunk_search_finish(&cs);
+}
+
+static void enqueue_item(work_queue_t *queue_item) {
+    queue_item->next = NULL;
+    /* A worker can free the item as soon as it's in the queue */
+    log_debug("%s added to work queue", queue_item->path);
+    pthread_mutex_lock(&work_queue_mtx);
+    if (work_queue_tail == NULL) {
+        work_queue = queue_item;
+    } else {
+        work_queue_tail->next = queue_item;
+    }
+    work_queue_tail = queue_item;
+    pthread_cond_signal(&files_ready);
+    pthread_mutex_unlock(&work_queue_mtx);
+}
+
+static void enqueue_work(char *path, trigram_scope_t *scope) {
+    work_queue_t *queue_item = ag_malloc(sizeof(work_queue_t));
+    queue_item->path = path;
+    queue_item->index_scope = scope;
+    queue_item->zip_member = NULL;
+    enqueue_item(queue_item);
+}
+
+static void enqueue_zip_member(char *path, zip_member_t *member) {
+    work_queue_t *queue_item = ag_malloc(sizeof(work_queue_t));
+    queue_item->path = path;
+    queue_item->index_scope = NULL;
+    queue_item->zip_member = member;
+    enqueue_item(queue_item);
+}
+
+/* For --files-without-matches */
+static void print_if_nonmatching(const char *path, const ssize_t matches_count) {
+    if (opts.print_nonmatching_files && matches_count == 0) {
+        pthread_mutex_lock(&print_mtx);
+        print_path(path, opts.path_sep);
+        pthread_mutex_unlock(&print_mtx);
+        opts.match_found = 1;
+    }
+}
+
+#if HAVE_FOPENCOOKIE
+/* Searches each file in a tar archive on its own, as archive:member */
+static void search_tar(FILE *stream, const char *path, const char *head) {
+    tar_reader_t *tar = tar_open(stream, path, head);
+    print_context_t *ctx;
+    const char *name;
+    char *member_path;
+    FILE *member;
+    ssize_t matches_count;
+
+    while ((name = tar_next(tar)) != NULL) {
+        ag_asprintf(&member_path, "%s:%s", path, name);
+        member = tar_member_open(tar);
+        if (member == NULL) {
+            log_err("Skipping %s: Error opening tar member: %s", member_path, strerror(errno));
+            free(member_path);
+            break;
+        }
+        ctx = print_init_context();
+        matches_count = search_stream_blocks(ctx, member, member_path, FALSE, NULL, 0);
+        print_if_nonmatching(member_path, matches_count);
+        print_cleanup_context(ctx);
+        fclose(member);
+        free(member_path);
+    }
+    tar_close(tar);
+}
+
+/* Searches a decompressed stream, or the files in it if it's a tar archive.
+ * Returns: -1 if skipped or an archive, otherwise # of matches */
+static ssize_t search_decompressed(print_context_t *ctx, FILE *stream, const char *path, int pipelined) {
+    char head[TAR_BLOCK_SIZE];
+    size_t head_len = fread(head, 1, sizeof(head), stream);
+
+    if (is_tar_header(head, head_len)) {
+        log_debug("%s is a tar archive", path);
+        search_tar(stream, path, head);
+        return -1;
+    }
+    return search_stream_blocks(ctx, stream, path, pipelined, head, head_len);
+}
+#endif
+
+/* Queues each file in a zip archive to be searched on its own, by whichever
+ * worker is free */
+static void search_zip(const char *buf, const size_t buf_len, const char *path) {
+    zip_member_t **members;
+    size_t members_len;
+    char *member_path;
+    size_t i;
+
+    members = zip_members(buf, buf_len, path, &members_len);
+    for (i = 0; i < members_len; i++) {
+        ag_asprintf(&member_path, "%s:%s", path, members[i]->name);
+        enqueue_zip_member(member_path, members[i]);
+    }
+    free(members);
+}
+
+static void search_zip_member(const char *path, const zip_member_t *member) {
+    print_context_t *ctx;
+    ssize_t matches_count;
+    size_t len;
+    char *buf;
+
+    buf = zip_member_read(member, &len);
+    if (buf == NULL) {
+        return;
+    }
+    ctx = print_init_context();
+    matches_count = search_buf(ctx, buf, len, path);
+    print_if_nonmatching(path, matches_count);
+    print_cleanup_context(ctx);
+    free(buf);
+}
+
+/* Whether there's input waiting to be read from fd */
+static int stream_has_input(int fd) {
+#ifdef _WIN32
+    (void)fd;
+    return FALSE;
+#else
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    return poll(&pfd, 1, 0) > 0;
+#endif
+}
+
+/* Searches input that comes in as it's written, like stdin or a named pipe,
+ * a block of whole lines at a time. While more is waiting, it's read until
+ * the buffer is full, so cat huge.log | ag searches big blocks. Once the
+ * writer falls behind, whatever has come in is searched and printed right
+ * away, so tail -F | ag doesn't hold back matches. Multiline queries are the
+ * exception: the overlap is kept back until more comes in or the stream ends.
+ * Return value: -1 if skipped, otherwise # of matches */
+ssize_t search_stream(FILE *stream, const char *path) {
+    chunk_search_t cs;
+    print_context_t *ctx = print_init_context();
+    int fd = fileno(stream);
+    size_t buf_size = STREAM_BLOCK_SIZE;
+    size_t buf_len = 0; /* Bytes in buf we haven't consumed */
+    char *buf = ag_malloc(buf_size);
+    ssize_t bytes_read;
+    ssize_t consumed;
+    ssize_t matches_count;
+    int eof = FALSE;
+    int idle;
+
+    chunk_search_init(&cs, ctx, path);
+    cs.overlap = chunk_overlap();
+    while (!eof) {
+        if (buf_len == buf_size) {
+            /* A line longer than the buffer */
+            buf_size *= 2;
+            buf = ag_realloc(buf, buf_size);
+        }
+        bytes_read = read(fd, buf + buf_len, buf_size - buf_len);
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read < 0) {
+            log_err("Skipping the rest of %s: Error reading file: %s", *path ? path : "stdin", strerror(errno));
+            eof = TRUE;
+        } else if (bytes_read == 0) {
+            eof = TRUE;
+        } else {
+            buf_len += bytes_read;
+            if (buf_len < buf_size && stream_has_input(fd)) {
+                continue;
+            }
+        }
+        idle = !eof && buf_len < buf_size;
+
+        consumed = chunk_search_feed(&cs, buf, buf_len, eof);
+        if (consumed < 0) {
+            break;
+        }
+        memmove(buf, buf + consumed, buf_len - consumed);
+        buf_len -= consumed;
+        if (idle && consumed > 0) {
+            /* Don't sit on what's been found while waiting for more */
+            fflush(out_fd);
+        }
+    }
+    free(buf);
+
+    matches_count = chunk_search_finish(&cs);
+    print_cleanup_context(ctx);
+    return matches_count;
+}
+
+#ifndef _WIN32
+/* Tell the kernel we're done with part of a file so it doesn't push other
+ * processes' pages out of the page cache to keep ours around. */
+static void drop_file_pages(int fd, off_t offset, off_t len) {
+#if HAVE_POSIX_FADVISE
+    posix_fadvise(fd, offset, len, POSIX_FADV_DONTNEED);
+#else
+    (void)fd;
+    (void)offset;
+    (void)len;
+#endif
+}
+
+/* Search a big file one window at a time. --low-cache releases the pages
+ * behind the scan, and --max-read-rate is charged for each window as it's
+ * read. Returns: -1 if skipped, otherwise # of matches */
+static ssize_t search_file_windows(print_context_t *ctx, int fd, const off_t f_len, const char *file_full_path) {
+    chunk_search_t cs;
+    size_t window = LOW_CACHE_WINDOW;
+    off_t pos = 0;     /* Offset of the first byte we haven't searched */
+    off_t charged = 0; /* Bytes charged to --max-read-rate so far */
+    ssize_t consumed = 0;
+
+    chunk_search_init(&cs, ctx, file_full_path);
+    cs.overlap = chunk_overlap();
+
+    if (opts.mmap && !opts.direct_io) {
+        const off_t page_mask = ~((off_t)getpagesize() - 1);
+
+        while (pos < f_len) {
+            off_t map_off = pos & page_mask;
+            size_t map_len = ag_min(window, f_len - map_off);
+            int eof = map_off + (off_t)map_len == f_len;
+            char *map;
+            /* The start of the window may have been read already */
+            if (map_off + (off_t)map_len > charged) {
+                throttle_read(map_off + map_len - charged);
+                charged = map_off + map_len;
+            }
+            map = mmap(0, map_len, PROT_READ, MAP_PRIVATE, fd, map_off);
+            if (map == MAP_FAILED) {
+                log_err("File %s failed to load: %s.", file_full_path, strerror(errno));
+                break;
+            }
+#if HAVE_MADVISE
+            madvise(map, map_len, MADV_SEQUENTIAL);
+#endif
+            consumed = chunk_search_feed(&cs, map + (pos - map_off), map_len - (pos - map_off), eof);
+#if HAVE_MADVISE
+            if (opts.low_cache) {
+                madvise(map, map_len, MADV_DONTNEED);
+            }
+#endif
+            munmap(map, map_len);
+            if (consumed < 0) {
+                break;
+            }
+            if (consumed == 0 && !eof) {
+                /* A line longer than the window. Map more next time. */
+                window *= 2;
+                continue;
+            }
+            pos += consumed;
+            if (opts.low_cache && (pos & page_mask) > map_off) {
+                drop_file_pages(fd, map_off, (pos & page_mask) - map_off);
+            }
+        }
+    } else {
+        char *io_buf = NULL;
+        char *buf;
+        size_t buf_len = 0; /* Bytes in buf we haven't consumed */
+        size_t buf_size = window;
+        int direct = FALSE;
+        int eof = FALSE;
+
+#ifdef O_DIRECT
+        if (opts.direct_io) {
+            int flags = fcntl(fd, F_GETFL);
+            if (posix_memalign((void **)&io_buf, DIRECT_IO_ALIGN, window) != 0) {
+                die("Memory allocation failed.");
+            }
+            if (flags != -1 && fcntl(fd, F_SETFL, flags | O_DIRECT) == 0) {
+                direct = TRUE;
+            } else {
+                log_debug("O_DIRECT not supported for %s: %s", file_full_path, strerror(errno));
+            }
+        }
+#endif
+        buf = ag_malloc(buf_size);
+
+        while (!eof) {
+            ssize_t bytes_read;
+            if (buf_len + window > buf_size) {
+                buf_size = buf_len + window;
+                buf = ag_realloc(buf, buf_size);
+            }
+            if (direct) {
+                /* Reads have to go to an aligned buffer, in aligned sizes */
+                bytes_read = read(fd, io_buf, window);
+                if (bytes_read > 0) {
+                    memcpy(buf + buf_len, io_buf, bytes_read);
+                }
+            } else {
+                bytes_read = read(fd, buf + buf_len, window);
+            }
+            if (bytes_read < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                log_err("Skipping the rest of %s: Error reading file: %s", file_full_path, strerror(errno));
+                break;
+            }
+            throttle_read(bytes_read);
+            if (opts.low_cache && !direct && bytes_read > 0) {
+                drop_file_pages(fd, pos + buf_len, bytes_read);
+            }
+            buf_len += bytes_read;
+            eof = bytes_read == 0 || pos + (off_t)buf_len >= f_len;
+
+            consumed = chunk_search_feed(&cs, buf, buf_len, eof);
+            if (consumed < 0) {
+                break;
+            }
+            /* Carry the partial last line over to the next read */
+            memmove(buf, buf + consumed, buf_len - consumed);
+            buf_len -= consumed;
+            pos += consumed;
+        }
+        free(buf);
+        free(io_buf);
+    }
+
+    return chunk_search_finish(&cs);
+}
+#endif
+
+void search_file(const char *file_full_path) {
+    int fd = -1;
+    off_t f_len = 0;
+    char *buf = NULL;
+    struct stat statbuf;
+    int rv = 0;
+    int matches_count = -1;
+    FILE *fp = NULL;
+    print_context_t *ctx = NULL;
+    result_cache_hit_t *hit = NULL;
+
+    rv = stat(file_full_path, &statbuf);
+    if (rv != 0) {
+        log_err("Skipping %s: Error fstat()ing file.", file_full_path);
+        goto cleanup;
+    }
+
+#ifdef __unix__
+    if (opts.stdout_inode != 0 && opts.stdout_inode == statbuf.st_ino) {
+        log_debug("Skipping %s: stdout is redirected to it", file_full_path);
+        goto cleanup;
+    }
+#endif
+
+    // handling only regular files and FIFOs
+    if (!S_ISREG(statbuf.st_mode) && !S_ISFIFO(statbuf.st_mode)) {
+        log_err("Skipping %s: Mode %u is not a file.", file_full_path, statbuf.st_mode);
+        goto cleanup;
+    }
+
+    if (opts.binary_cache && !opts.search_binary_files && binary_cache_lookup(&statbuf)) {
+        log_debug("Skipping %s: binary cache says it's binary.", file_full_path);
+        goto cleanup;
+    }
+
+    fd = open(file_full_path, O_RDONLY);
+    if (fd < 0) {
+        /* XXXX: strerror is not thread-safe */
+        log_err("Skipping %s: Error opening file: %s", file_full_path, strerror(errno));
+        goto cleanup;
+    }
+
+    // repeating stat check with file handle to prevent TOCTOU issue
+    rv = fstat(fd, &statbuf);
+    if (rv != 0) {
+        log_err("Skipping %s: Error fstat()ing file.", file_full_path);
+        goto cleanup;
+    }
+
+#ifdef __unix__
+    if (opts.stdout_inode != 0 && opts.stdout_inode == statbuf.st_ino) {
+        log_debug("Skipping %s: stdout is redirected to it", file_full_path);
+        goto cleanup;
+    }
+#endif
+
+    // handling only regular files and FIFOs
+    if (!S_ISREG(statbuf.st_mode) && !S_ISFIFO(statbuf.st_mode)) {
+        log_err("Skipping %s: Mode %u is not a file.", file_full_path, statbuf.st_mode);
+        goto cleanup;
+    }
+
+    ctx = print_init_context();
+
+    if (statbuf.st_mode & S_IFIFO) {
+        log_debug("%s is a named pipe. stream searching", file_full_path);
+        fp = fdopen(fd, "r");
+        matches_count = search_stream(fp, file_full_path);
+        fclose(fp);
+        goto cleanup;
+    }
+
+    f_len = statbuf.st_size;
+
+    if (f_len == 0) {
+        if (opts.query[0] == '.' && opts.query_len == 1 && !opts.literal && opts.search_all_files) {
+            matches_count = search_buf(ctx, buf, f_len, file_full_path);
+        } else {
+            log_debug("Skipping %s: file is empty.", file_full_path);
+        }
+        goto cleanup;
+    }
+
+    if (opts.result_cache) {
+        hit = result_cache_lookup(&statbuf);
+    }
+    if (hit) {
+        log_debug("Using matches in %s from the result cache", file_full_path);
+        if (hit->state == RESULT_CACHE_SKIPPED) {
+            log_debug("File %s is binary. Skipping...", file_full_path);
+            goto cleanup;
+        }
+        /* Only printing lines needs the file itself */
+        if (hit->state == RESULT_CACHE_BINARY || opts.print_filename_only ||
+            (hit->matches_len == 0 && !opts.print_all_paths)) {
+            report_matches(ctx, file_full_path, NULL, f_len, hit->matches, hit->matches_len, hit->state == RESULT_CACHE_BINARY);
+            matches_count = (ssize_t)hit->matches_len;
+            goto cleanup;
+        }
+    }
+
+#ifndef _WIN32
+    if ((opts.low_cache || opts.max_read_rate > 0) && f_len > LOW_CACHE_WINDOW) {
+        ag_compression_type zip_type = AG_NO_COMPRESSION;
+        if (opts.search_zip_files) {
+            char magic[6];
+            ssize_t magic_len = pread(fd, magic, sizeof(magic), 0);
+            zip_type = is_zipped(magic, magic_len > 0 ? magic_len : 0);
+        }
+        if (zip_type == AG_NO_COMPRESSION) {
+            matches_count = search_file_windows(ctx, fd, f_len, file_full_path);
+            if (matches_count == -1 && opts.binary_cache) {
+                binary_cache_add(&statbuf);
+            }
+            goto cleanup;
+        }
+    }
+#endif
+
+    throttle_read(f_len);
+
+#ifdef _WIN32
+    {
+        HANDLE hmmap = CreateFileMapping(
+            (HANDLE)_get_osfhandle(fd), 0, PAGE_READONLY, 0, f_len, NULL);
+        buf = (char *)MapViewOfFile(hmmap, FILE_SHARE_READ, 0, 0, f_len);
+        if (hmmap != NULL)
+            CloseHandle(hmmap);
+    }
+    if (buf == NULL) {
+        FormatMessageA(
+            FORMAT_MESSAGE_ALLOCATE_BUFFER |
+                FORMAT_MESSAGE_FROM_SYSTEM |
+                FORMAT_MESSAGE_IGNORE_INSERTS,
+            NULL, GetLastError(), 0, (void *)&buf, 0, NULL);
+        log_err("File %s failed to load: %s.", file_full_path, buf);
+        LocalFree((void *)buf);
+        goto cleanup;
+    }
+#else
+
+    if (opts.mmap) {
+        buf = mmap(0, f_len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (buf == MAP_FAILED) {
+            log_err("File %s failed to load: %s.", file_full_path, strerror(errno));
+            goto cleanup;
+        }
+#if HAVE_MADVISE
+        madvise(buf, f_len, MADV_SEQUENTIAL);
+#elif HAVE_POSIX_FADVISE
+        posix_fadvise(fd, 0, f_len, POSIX_MADV_SEQUENTIAL);
+#endif
+    } else {
+        buf = ag_malloc(f_len);
+
+        ssize_t bytes_read = 0;
+
+        // Archives and compressed files look binary until they're opened up
+        if (!opts.search_binary_files && !opts.search_zip_files) {
+            size_t sample_len = ag_min(f_len, opts.binary_sample);
+            while ((size_t)bytes_read < sample_len) {
+                ssize_t n = read(fd, buf + bytes_read, sample_len - bytes_read);
+                if (n <= 0) {
+                    break;
+                }
+                bytes_read += n;
+            }
+            // Optimization: If skipping binary files, don't read the whole buffer before checking if binary or not.
+            if (is_binary(buf, bytes_read)) {
+                log_debug("File %s is binary. Skipping...", file_full_path);
+                if (opts.binary_cache) {
+                    binary_cache_add(&statbuf);
+                }
+                if (opts.result_cache) {
+                    result_cache_add(&statbuf, RESULT_CACHE_SKIPPED, NULL, 0);
+                }
+                goto cleanup;
+            }
+        }
+
+        while (bytes_read < f_len) {
+            bytes_read += read(fd, buf + bytes_read, f_len);
+        }
+        if (bytes_read != f_len) {
+            die("File %s read(): expected to read %u bytes but read %u", file_full_path, f_len, bytes_read);
+        }
+    }
+#endif
+
+    if (opts.search_zip_files) {
+        ag_compression_type zip_type = is_zipped(buf, f_len);
+        if (zip_type == AG_ZIP) {
+            search_zip(buf, f_len, file_full_path);
+            goto cleanup;
+        }
+#if HAVE_FOPENCOOKIE
+        if (zip_type == AG_NO_COMPRESSION && f_len > TAR_BLOCK_SIZE && is_tar_header(buf, f_len)) {
+            log_debug("%s is a tar archive", file_full_path);
+            fp = fmemopen(buf + TAR_BLOCK_SIZE, f_len - TAR_BLOCK_SIZE, "r");
+            if (fp != NULL) {
+                search_tar(fp, file_full_path, buf);
+                fclose(fp);
+                goto cleanup;
+            }
+        }
+#endif
+        if (zip_type != AG_NO_COMPRESSION) {
+            /* Extra threads only pay off for big files. Without one to
+             * spare, a decoder would only take turns with the search. */
+            int threads = 0;
+            if (f_len >= PIPELINE_MIN_SIZE) {
+                threads = decoder_threads_acquire(zip_type == AG_GZIP ? GZIP_MAX_THREADS : zip_type == AG_XZ ? XZ_MAX_THREADS : 1);
+            }
+#if HAVE_FOPENCOOKIE
+            int indexed = FALSE;
+            const struct stat *index_statbuf = NULL;
+#ifdef HAVE_ZLIB_H
+            gzip_index_t *index = NULL;
+#endif
+            log_debug("%s is a compressed file. stream searching", file_full_path);
+            fp = NULL;
+#ifdef HAVE_ZLIB_H
+            if (zip_type == AG_GZIP && opts.gzip_index && f_len >= GZIP_INDEX_MIN_SIZE) {
+                index = gzip_index_load(&statbuf);
+                indexed = index != NULL;
+                /* A single member gets indexed as it's read */
+                index_statbuf = indexed ? NULL : &statbuf;
+            }
+            if (zip_type == AG_GZIP && threads > 0) {
+                fp = gzip_members_open(buf, f_len, file_full_path, threads, index);
+            } else {
+                gzip_index_free(index);
+            }
+#endif
+            if (fp != NULL) {
+                if (indexed) {
+                    log_debug("Inflating %s from its gzip index with %i threads", file_full_path, threads);
+                } else {
+                    log_debug("Inflating gzip members of %s with %i threads", file_full_path, threads);
+                }
+                matches_count = search_decompressed(ctx, fp, file_full_path, FALSE);
+            } else {
+                /* One thread decompresses ahead of the search. For .xz, it
+                 * hands blocks to liblzma's threads. */
+                if (zip_type != AG_XZ && threads > 1) {
+                    decoder_threads_release(threads - 1);
+                    threads = 1;
+                }
+                if (zip_type == AG_XZ && threads > 1) {
+                    log_debug("Decoding %s with %i liblzma threads", file_full_path, threads);
+                }
+                fp = decompress_open(fd, "r", zip_type, threads, index_statbuf);
+                if (fp != NULL) {
+                    matches_count = search_decompressed(ctx, fp, file_full_path, threads > 0);
+                } else {
+                    log_err("Cannot decompress zipped file %s", file_full_path);
+                }
+            }
+            if (fp != NULL) {
+                fclose(fp);
+            }
+            decoder_threads_release(threads);
+#else
+            int _buf_len = (int)f_len;
+            char *_buf = decompress(zip_type, buf, f_len, file_full_path, &_buf_len, threads + 1);
+            decoder_threads_release(threads);
+            if (_buf == NULL || _buf_len == 0) {
+                log_err("Cannot decompress zipped file %s", file_full_path);
+                goto cleanup;
+            }
+            matches_count = search_buf(ctx, _buf, _buf_len, file_full_path);
+            free(_buf);
+#endif
+            goto cleanup;
+        }
+    }
+
+    if (hit) {
+        report_matches(ctx, file_full_path, buf, f_len, hit->matches, hit->matches_len, hit->matches_len > 0 ? 0 : -1);
+        matches_count = (ssize_t)hit->matches_len;
+        goto cleanup;
+    }
+
+    matches_count = search_file_buf(ctx, buf, f_len, file_full_path, opts.result_cache ? &statbuf : NULL);
+    if (matches_count == -1 && opts.binary_cache) {
+        binary_cache_add(&statbuf);
+    }
+
+cleanup:
+
+    print_if_nonmatching(file_full_path, matches_count);
+
+    print_cleanup_context(ctx);
+    result_cache_free_hit(hit);
+
+    if (buf != NULL) {
+#ifdef _WIN32
+        UnmapViewOfFile(buf);
+#else
+        if (opts.mmap) {
+            if (buf != MAP_FAILED) {
+                munmap(buf, f_len);
+            }
+        } else {
+            free(buf);
+        }
+#endif
+    }
+    if (fd != -1) {
+#ifndef _WIN32
+        if (opts.low_cache) {
+            drop_file_pages(fd, 0, 0);
+        }
+#endif
+        close(fd);
+    }
+}
+
+void *search_file_worker(void *i) {
+    work_queue_t *queue_item;
+    int worker_id = *(int *)i;
+    unsigned char *trigrams_seen = NULL;
+    int searching = FALSE;
+
+    log_debug("Worker %i started", worker_id);
+    while (TRUE) {
+        pthread_mutex_lock(&work_queue_mtx);
+        if (searching) {
+            busy_workers--;
+            searching = FALSE;
+            if (busy_workers == 0 && done_adding_files) {
+                pthread_cond_broadcast(&files_ready);
+            }
+        }
         while (work_queue == NULL) {
-            if (done_adding_files) {
+            /* Workers still searching can queue the members of a zip file */
+            if (done_adding_files && busy_workers == 0) {
                 pthread_mutex_unlock(&work_queue_mtx);
+                free(trigrams_seen);
                 log_debug("Worker %i finished.", worker_id);
                 pthread_exit(NULL);
             }
@@ -477,9 +1534,22 @@ void *search_file_worker(void *i) {
         if (work_queue == NULL) {
             work_queue_tail = NULL;
         }
+        busy_workers++;
+        searching = TRUE;
         pthread_mutex_unlock(&work_queue_mtx);
 
-        search_file(queue_item->path);
+        throttle_worker_acquire();
+        if (opts.build_index) {
+            trigram_index_build_add(queue_item->index_scope, queue_item->path, &trigrams_seen);
+        } else if (queue_item->zip_member) {
+            search_zip_member(queue_item->path, queue_item->zip_member);
+            zip_member_free(queue_item->zip_member);
+        } else if (queue_item->index_scope && trigram_index_skip(queue_item->index_scope, queue_item->path)) {
+            log_debug("Skipping %s: the index says it can't match", queue_item->path);
+        } else {
+            search_file(queue_item->path);
+        }
+        throttle_worker_release();
         free(queue_item->path);
         free(queue_item);
     }
@@ -487,6 +1557,97 @@ void *search_file_worker(void *i) {
     return NULL;
 }
 
+/* Physical offset of the first extent of a file. Falls back to the inode
+ * number if the filesystem can't tell us. */
+static uint64_t layout_key(const char *path, ino_t ino) {
+#ifdef HAVE_LINUX_FIEMAP_H
+    union {
+        struct fiemap fm;
+        char buf[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+    } req;
+    uint64_t key = 0;
+    int fd;
+
+    if (opts.layout_order != LAYOUT_ORDER_EXTENT || fiemap_unsupported) {
+        return (uint64_t)ino;
+    }
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return (uint64_t)ino;
+    }
+    memset(&req, 0, sizeof(req));
+    req.fm.fm_start = 0;
+    req.fm.fm_length = FIEMAP_MAX_OFFSET;
+    req.fm.fm_extent_count = 1;
+    if (ioctl(fd, FS_IOC_FIEMAP, &req.fm) == 0) {
+        /* Empty and inline files have no extents. Sort them first. */
+        if (req.fm.fm_mapped_extents > 0) {
+            key = req.fm.fm_extents[0].fe_physical;
+        }
+    } else {
+        log_debug("FIEMAP not supported for %s: %s. Falling back to inode order.", path, strerror(errno));
+        fiemap_unsupported = TRUE;
+        key = (uint64_t)ino;
+    }
+    close(fd);
+    return key;
+#else
+    (void)path;
+    return (uint64_t)ino;
+#endif
+}
+
+static int layout_entry_cmp(const void *a, const void *b) {
+    const layout_entry_t *x = a;
+    const layout_entry_t *y = b;
+    if (x->key < y->key) {
+        return -1;
+    }
+    return x->key > y->key;
+}
+
+/* Sort the pending batch by on-disk location and hand it to the workers. */
+void flush_queued_files(void) {
+    size_t i;
+
+    if (layout_batch_len == 0) {
+        return;
+    }
+    log_debug("Sorting %lu queued files by layout", layout_batch_len);
+    qsort(layout_batch, layout_batch_len, sizeof(layout_entry_t), layout_entry_cmp);
+    for (i = 0; i < layout_batch_len; i++) {
+        enqueue_work(layout_batch[i].path, layout_batch[i].index_scope);
+    }
+    free(layout_batch);
+    layout_batch = NULL;
+    layout_batch_len = 0;
+}
+
+/* Takes ownership of path. Only the thread walking directories calls this. */
+void queue_file(char *path, ino_t ino) {
+    if (walk_file_hook) {
+        walk_file_hook(path, ino);
+        return;
+    }
+    if (opts.layout_order == LAYOUT_ORDER_NONE) {
+        enqueue_work(path, index_scope);
+        return;
+    }
+
+    if (layout_batch == NULL) {
+        layout_batch = ag_malloc(opts.layout_window * sizeof(layout_entry_t));
+    }
+    layout_batch[layout_batch_len].key = layout_key(path, ino);
+    layout_batch[layout_batch_len].path = path;
+    layout_batch[layout_batch_len].index_scope = index_scope;
+    layout_batch_len++;
+
+    if (layout_batch_len >= opts.layout_window) {
+        flush_queued_files();
+    }
+}
+
 static int check_symloop_enter(const char *path, dirkey_t *outkey) {
 #if defined(_WIN32) || defined(__VMS)
     return SYMLOOP_OK;
@@ -542,20 +1703,156 @@ static int check_symloop_leave(dirkey_t *dirkey) {
 #endif
 }
 
+/* Where a directory's files are in .git/index, for --git-index */
+typedef struct {
+    const git_index_t *index;
+    size_t start; /* The directory's entries are [start, end) */
+    size_t end;
+    size_t prefix_len; /* Length of the directory's path in the index, with its slash */
+    int ignored;       /* Matches an ignore pattern, so only its tracked files count */
+} git_index_dir_t;
+
+/* A file or directory directly in a tracked directory */
+typedef struct {
+    const char *name;
+    size_t name_len;
+    int is_dir;
+    git_index_dir_t dir;
+} git_index_child_t;
+
+static void search_git_dir(ignores *ig, const char *base_path, const char *path, const int depth,
+                           dev_t original_dev, const git_index_dir_t *tracked);
+
+static void init_scandir_baton(scandir_baton_t *scandir_baton, ignores *ig, const char *base_path, const char *path) {
+    size_t base_path_len = 0;
+    const char *path_start = path;
+    size_t i;
+
+    /* path_start is the part of path that isn't in base_path
+     * base_path will have a trailing '/' because we put it there in parse_options
+     */
+    base_path_len = base_path ? strlen(base_path) : 0;
+    for (i = 0; (i < base_path_len) && (path[i]) && (base_path[i] == path[i]); i++) {
+        path_start = path + i + 1;
+    }
+    log_debug("search_dir: path is '%s', base_path is '%s', path_start is '%s'", path, base_path, path_start);
+
+    scandir_baton->ig = ig;
+    scandir_baton->base_path = base_path;
+    scandir_baton->base_path_len = base_path_len;
+    scandir_baton->path_start = path_start;
+}
+
+/* Queues a file, unless -G rules it out or -g just wants its name printed.
+ * Takes ownership of dir_full_path. */
+static void search_dir_file(char *dir_full_path, ino_t ino) {
+    if (opts.file_search_regex) {
+        regmatch_t pmatch[1];
+        int rc = tre_regnexec(opts.file_search_regex, dir_full_path, strlen(dir_full_path),
+                              1, pmatch, 0);
+        if (rc > 0) { /* no match */
+            log_debug("Skipping %s due to file_search_regex.", dir_full_path);
+            free(dir_full_path);
+            return;
+        } else if (opts.match_files) {
+            log_debug("match_files: file_search_regex matched for %s.", dir_full_path);
+            pthread_mutex_lock(&print_mtx);
+            print_path(dir_full_path, opts.path_sep);
+            pthread_mutex_unlock(&print_mtx);
+            opts.match_found = 1;
+            free(dir_full_path);
+            return;
+        }
+    }
+
+    queue_file(dir_full_path, ino);
+}
+
+void search_walked_file(char *path, ino_t ino) {
+    const char *filename = strrchr(path, '/');
+
+    filename = filename ? filename + 1 : path;
+    if (opts.file_type_extensions && !has_lang_extension(filename, opts.file_type_extensions, opts.file_type_extensions_len)) {
+        log_debug("%s ignored because it isn't one of the file types searched", path);
+        free(path);
+        return;
+    }
+    search_dir_file(path, ino);
+}
+
+/* Searches an entry of path's listing that got past the filters. If it's a
+ * directory, tracked says where its files are in .git/index, or is NULL to
+ * walk it. */
+static void search_dir_entry(ignores *ig, const char *base_path, const char *path, const int depth,
+                             dev_t original_dev, const struct dirent *dir, const git_index_dir_t *tracked) {
+    char *dir_full_path = NULL;
+
+    ag_asprintf(&dir_full_path, "%s/%s", path, dir->d_name);
+#if !(defined(_WIN32) || defined(__VMS))
+    if (opts.one_dev) {
+        struct stat s;
+        if (lstat(dir_full_path, &s) != 0) {
+            log_err("Failed to get device information for %s. Skipping...", dir->d_name);
+            goto cleanup;
+        }
+        if (s.st_dev != original_dev) {
+            log_debug("File %s crosses a device boundary (is probably a mount point.) Skipping...", dir->d_name);
+            goto cleanup;
+        }
+    }
+#endif
+
+    /* If a link points to a directory then we need to treat it as a directory. */
+    if (!opts.follow_symlinks && is_symlink(path, dir)) {
+        log_debug("File %s ignored becaused it's a symlink", dir->d_name);
+        goto cleanup;
+    }
+
+    if (!is_directory(path, dir)) {
+        search_dir_file(dir_full_path, dir->d_ino);
+        return;
+    } else if (opts.recurse_dirs) {
+        if (depth < opts.max_search_depth || opts.max_search_depth == -1) {
+            log_debug("Searching dir %s", dir_full_path);
+            ignores *child_ig;
+#ifdef HAVE_DIRENT_DNAMLEN
+            child_ig = init_ignore(ig, dir->d_name, dir->d_namlen);
+#else
+            child_ig = init_ignore(ig, dir->d_name, strlen(dir->d_name));
+#endif
+            if (tracked) {
+                search_git_dir(child_ig, base_path, dir_full_path, depth + 1, original_dev, tracked);
+            } else {
+                search_dir(child_ig, base_path, dir_full_path, depth + 1, original_dev);
+            }
+            cleanup_ignore(child_ig);
+        } else {
+            if (opts.max_search_depth == DEFAULT_MAX_SEARCH_DEPTH) {
+                /*
+                 * If the user didn't intentionally specify a particular depth,
+                 * this is a warning...
+                 */
+                log_err("Skipping %s. Use the --depth option to search deeper.", dir_full_path);
+            } else {
+                /* ... if they did, let's settle for debug. */
+                log_debug("Skipping %s. Use the --depth option to search deeper.", dir_full_path);
+            }
+        }
+    }
+
+cleanup:
+    free(dir_full_path);
+}
+
 /* TODO: Append matches to some data structure instead of just printing them out.
  * Then ag can have sweet summaries of matches/files scanned/time/etc.
  */
 void search_dir(ignores *ig, const char *base_path, const char *path, const int depth,
                 dev_t original_dev) {
     struct dirent **dir_list = NULL;
-    struct dirent *dir = NULL;
     scandir_baton_t scandir_baton;
+    walk_cache_dir_t cached_dir;
     int results = 0;
-    size_t base_path_len = 0;
-    const char *path_start = path;
-
-    char *dir_full_path = NULL;
-    const char *ignore_file = NULL;
     int i;
 
     int symres;
@@ -567,37 +1864,53 @@ void search_dir(ignores *ig, const char *base_path, const char *path, const int
         return;
     }
 
-    /* find .*ignore files to load ignore patterns from */
-    for (i = 0; opts.skip_vcs_ignores ? (i == 0) : (ignore_pattern_files[i] != NULL); i++) {
-        ignore_file = ignore_pattern_files[i];
-        ag_asprintf(&dir_full_path, "%s/%s", path, ignore_file);
-        load_ignore_patterns(ig, dir_full_path);
-        free(dir_full_path);
-        dir_full_path = NULL;
+    init_scandir_baton(&scandir_baton, ig, base_path, path);
+    if (walk_dir_hook) {
+        /* Before listing it, so nothing that changes after is missed */
+        walk_dir_hook(path);
     }
 
-    /* path_start is the part of path that isn't in base_path
-     * base_path will have a trailing '/' because we put it there in parse_options
-     */
-    base_path_len = base_path ? strlen(base_path) : 0;
-    for (i = 0; ((size_t)i < base_path_len) && (path[i]) && (base_path[i] == path[i]); i++) {
-        path_start = path + i + 1;
+    results = -1;
+    if (opts.walk_cache) {
+        results = walk_cache_replay(&cached_dir, ig, base_path, path, depth, &scandir_baton, &dir_list);
+    }
+    if (results < 0) {
+        /* List everything first, so the .*ignore files that are actually there
+         * can be loaded before the listing is filtered */
+        results = ag_scandir(path, &dir_list, NULL, NULL);
+        if (results > 0) {
+            unsigned int ignore_files = listed_ignore_files(dir_list, results);
+            int filtered = 0;
+            if (opts.walk_cache) {
+                walk_cache_stat_ignore_files(&cached_dir, path, ignore_files);
+            }
+            load_ignore_files(ig, path, ignore_files);
+            /* The ones that are filtered out go to the end */
+            for (i = 0; i < results; i++) {
+                if (filename_filter(path, dir_list[i], &scandir_baton)) {
+                    struct dirent *kept = dir_list[i];
+                    dir_list[i] = dir_list[filtered];
+                    dir_list[filtered++] = kept;
+                }
+            }
+            if (opts.walk_cache) {
+                walk_cache_add(&cached_dir, ig, dir_list, filtered, results);
+            }
+            for (i = filtered; i < results; i++) {
+                free(dir_list[i]);
+            }
+            results = filtered;
+        } else if (results == 0 && opts.walk_cache) {
+            walk_cache_add(&cached_dir, ig, dir_list, 0, 0);
+        }
     }
-    log_debug("search_dir: path is '%s', base_path is '%s', path_start is '%s'", path, base_path, path_start);
-
-    scandir_baton.ig = ig;
-    scandir_baton.base_path = base_path;
-    scandir_baton.base_path_len = base_path_len;
-    scandir_baton.path_start = path_start;
-
-    results = ag_scandir(path, &dir_list, &filename_filter, &scandir_baton);
     if (results == 0) {
         log_debug("No results found in directory %s", path);
         goto search_dir_cleanup;
     } else if (results == -1) {
         if (errno == ENOTDIR) {
             /* Not a directory. Probably a file. */
-            if (depth == 0 && opts.paths_len == 1) {
+            if (depth == 0 && opts.paths_len == 1 && !(opts.search_zip_files && is_archive_name(path))) {
                 /* If we're only searching one file, don't print the filename header at the top. */
                 if (opts.print_path == PATH_PRINT_DEFAULT || opts.print_path == PATH_PRINT_DEFAULT_EACH_LINE) {
                     opts.print_path = PATH_PRINT_NOTHING;
@@ -607,109 +1920,274 @@ void search_dir(ignores *ig, const char *base_path, const char *path, const int
                     opts.print_line_numbers = FALSE;
                 }
             }
+            /* Searched on this thread rather than by a worker */
+            pthread_mutex_lock(&work_queue_mtx);
+            busy_workers++;
+            pthread_mutex_unlock(&work_queue_mtx);
             search_file(path);
+            pthread_mutex_lock(&work_queue_mtx);
+            busy_workers--;
+            pthread_mutex_unlock(&work_queue_mtx);
         } else {
             log_err("Error opening directory %s: %s", path, strerror(errno));
         }
         goto search_dir_cleanup;
     }
 
-    int offset_vector[3];
-    int rc = 0;
-    work_queue_t *queue_item;
-
     for (i = 0; i < results; i++) {
-        queue_item = NULL;
-        dir = dir_list[i];
-        ag_asprintf(&dir_full_path, "%s/%s", path, dir->d_name);
-#if !(defined(_WIN32) || defined(__VMS))
-        if (opts.one_dev) {
-            struct stat s;
-            if (lstat(dir_full_path, &s) != 0) {
-                log_err("Failed to get device information for %s. Skipping...", dir->d_name);
-                goto cleanup;
+        search_dir_entry(ig, base_path, path, depth, original_dev, dir_list[i], NULL);
+        free(dir_list[i]);
+    }
+
+search_dir_cleanup:
+    check_symloop_leave(&current_dirkey);
+    free(dir_list);
+    dir_list = NULL;
+}
+
+void search_dir_name(ignores *ig, const char *base_path, const char *path, const int depth,
+                     dev_t original_dev, const char *name) {
+    struct dirent **dir_list = NULL;
+    scandir_baton_t scandir_baton;
+    dirkey_t current_dirkey;
+    int results;
+    int i;
+
+    if (check_symloop_enter(path, &current_dirkey) == SYMLOOP_LOOP) {
+        return;
+    }
+    init_scandir_baton(&scandir_baton, ig, base_path, path);
+    results = ag_scandir(path, &dir_list, NULL, NULL);
+    if (results < 0) {
+        log_debug("Error opening directory %s: %s", path, strerror(errno));
+    } else {
+        load_listed_ignore_files(ig, path, dir_list, results);
+        for (i = 0; i < results; i++) {
+            if (strcmp(dir_list[i]->d_name, name) == 0 && filename_filter(path, dir_list[i], &scandir_baton)) {
+                search_dir_entry(ig, base_path, path, depth, original_dev, dir_list[i], NULL);
             }
-            if (s.st_dev != original_dev) {
-                log_debug("File %s crosses a device boundary (is probably a mount point.) Skipping...", dir->d_name);
-                goto cleanup;
+            free(dir_list[i]);
+        }
+    }
+    check_symloop_leave(&current_dirkey);
+    free(dir_list);
+}
+
+static int git_index_child_cmp(const void *a, const void *b) {
+    const git_index_child_t *x = (const git_index_child_t *)a;
+    const git_index_child_t *y = (const git_index_child_t *)b;
+    int rc = memcmp(x->name, y->name, x->name_len < y->name_len ? x->name_len : y->name_len);
+    if (rc != 0) {
+        return rc;
+    }
+    return (x->name_len > y->name_len) - (x->name_len < y->name_len);
+}
+
+/* Splits a tracked directory's entries into its files and subdirectories,
+ * sorted by name */
+static git_index_child_t *git_index_children(const git_index_dir_t *tracked, size_t *children_len) {
+    const git_index_entry_t *entries = tracked->index->entries;
+    git_index_child_t *children = NULL;
+    size_t children_cap = 0;
+    size_t k = tracked->start;
+
+    *children_len = 0;
+    while (k < tracked->end) {
+        const char *name = entries[k].path + tracked->prefix_len;
+        size_t name_len = strcspn(name, "/");
+        size_t j = k + 1;
+        git_index_child_t *child;
+
+        if (name[name_len] == '/') {
+            while (j < tracked->end && strncmp(entries[j].path + tracked->prefix_len, name, name_len + 1) == 0) {
+                j++;
+            }
+        } else {
+            /* Conflicted files have an entry per stage */
+            while (j < tracked->end && strcmp(entries[j].path, entries[k].path) == 0) {
+                j++;
+            }
+            /* Submodules are walked like untracked directories */
+            if (!git_index_in_work_tree(&entries[k]) || (entries[k].mode & S_IFMT) == GIT_INDEX_MODE_GITLINK) {
+                k = j;
+                continue;
             }
         }
-#endif
 
-        /* If a link points to a directory then we need to treat it as a directory. */
-        if (!opts.follow_symlinks && is_symlink(path, dir)) {
-            log_debug("File %s ignored becaused it's a symlink", dir->d_name);
-            goto cleanup;
+        if (*children_len == children_cap) {
+            children_cap = children_cap ? children_cap * 2 : 16;
+            children = ag_realloc(children, children_cap * sizeof(git_index_child_t));
         }
+        child = &children[(*children_len)++];
+        child->name = name;
+        child->name_len = name_len;
+        child->is_dir = name[name_len] == '/';
+        child->dir.index = tracked->index;
+        child->dir.start = k;
+        child->dir.end = j;
+        child->dir.prefix_len = tracked->prefix_len + name_len + 1;
+        child->dir.ignored = FALSE;
+        k = j;
+    }
 
-        if (!is_directory(path, dir)) {
-            if (opts.file_search_regex) {
-                regmatch_t pmatch[1];
-                rc = tre_regnexec(opts.file_search_regex, dir_full_path, strlen(dir_full_path),
-                                  1, pmatch, 0);
-                if (rc > 0) { /* no match */
-                    log_debug("Skipping %s due to file_search_regex.", dir_full_path);
-                    goto cleanup;
-                } else if (opts.match_files) {
-                    log_debug("match_files: file_search_regex matched for %s.", dir_full_path);
-                    pthread_mutex_lock(&print_mtx);
-                    print_path(dir_full_path, opts.path_sep);
-                    pthread_mutex_unlock(&print_mtx);
-                    opts.match_found = 1;
-                    goto cleanup;
-                }
-            }
+    qsort(children, *children_len, sizeof(git_index_child_t), git_index_child_cmp);
+    return children;
+}
 
-            queue_item = ag_malloc(sizeof(work_queue_t));
-            queue_item->path = dir_full_path;
-            queue_item->next = NULL;
-            pthread_mutex_lock(&work_queue_mtx);
-            if (work_queue_tail == NULL) {
-                work_queue = queue_item;
-            } else {
-                work_queue_tail->next = queue_item;
-            }
-            work_queue_tail = queue_item;
-            pthread_cond_signal(&files_ready);
-            pthread_mutex_unlock(&work_queue_mtx);
-            log_debug("%s added to work queue", dir_full_path);
-        } else if (opts.recurse_dirs) {
-            if (depth < opts.max_search_depth || opts.max_search_depth == -1) {
-                log_debug("Searching dir %s", dir_full_path);
-                ignores *child_ig;
-#ifdef HAVE_DIRENT_DNAMLEN
-                child_ig = init_ignore(ig, dir->d_name, dir->d_namlen);
-#else
-                child_ig = init_ignore(ig, dir->d_name, strlen(dir->d_name));
-#endif
-                search_dir(child_ig, base_path, dir_full_path, depth + 1,
-                           original_dev);
-                cleanup_ignore(child_ig);
-            } else {
-                if (opts.max_search_depth == DEFAULT_MAX_SEARCH_DEPTH) {
-                    /*
-                     * If the user didn't intentionally specify a particular depth,
-                     * this is a warning...
-                     */
-                    log_err("Skipping %s. Use the --depth option to search deeper.", dir_full_path);
-                } else {
-                    /* ... if they did, let's settle for debug. */
-                    log_debug("Skipping %s. Use the --depth option to search deeper.", dir_full_path);
+/* Like search_dir, but the files git tracks skip the ignore patterns. Only
+ * the rest of the listing goes through filename_filter. */
+static void search_git_dir(ignores *ig, const char *base_path, const char *path, const int depth,
+                           dev_t original_dev, const git_index_dir_t *tracked) {
+    struct dirent **dir_list = NULL;
+    scandir_baton_t scandir_baton;
+    git_index_child_t *children;
+    size_t children_len;
+    int results;
+    int i;
+
+    results = ag_scandir(path, &dir_list, NULL, NULL);
+    if (results == -1) {
+        log_err("Error opening directory %s: %s", path, strerror(errno));
+        return;
+    }
+    load_listed_ignore_files(ig, path, dir_list, results);
+    init_scandir_baton(&scandir_baton, ig, base_path, path);
+    children = git_index_children(tracked, &children_len);
+
+    for (i = 0; i < results; i++) {
+        struct dirent *dir = dir_list[i];
+        git_index_child_t key;
+        git_index_child_t *child;
+
+        key.name = dir->d_name;
+        key.name_len = strlen(dir->d_name);
+        child = bsearch(&key, children, children_len, sizeof(git_index_child_t), git_index_child_cmp);
+        if (child && child->is_dir == is_directory(path, dir)) {
+            if (filename_filter_basic(path, dir)) {
+                if (child->is_dir) {
+                    child->dir.ignored = tracked->ignored || !filename_filter(path, dir, &scandir_baton);
                 }
+                search_dir_entry(ig, base_path, path, depth, original_dev, dir, child->is_dir ? &child->dir : NULL);
             }
+        } else if (!tracked->ignored && filename_filter(path, dir, &scandir_baton)) {
+            search_dir_entry(ig, base_path, path, depth, original_dev, dir, NULL);
         }
-
-    cleanup:
         free(dir);
-        dir = NULL;
-        if (queue_item == NULL) {
-            free(dir_full_path);
-            dir_full_path = NULL;
-        }
     }
 
-search_dir_cleanup:
-    check_symloop_leave(&current_dirkey);
+    free(children);
     free(dir_list);
-    dir_list = NULL;
+}
+
+/* Checks a tracked file's path for --git-changed the way the walk would have
+ * checked each directory on the way to it */
+static int git_changed_wanted(const char *rel_path) {
+    const char *filename = rel_path;
+    const char *p;
+    int depth = 0;
+
+    for (p = rel_path; *p; p++) {
+        if (*p == '/') {
+            depth++;
+            filename = p + 1;
+        } else if (*p == '.' && (p == rel_path || p[-1] == '/') && !opts.search_hidden_files) {
+            return FALSE;
+        }
+    }
+    if (depth > 0 && (!opts.recurse_dirs || (opts.max_search_depth != -1 && depth > opts.max_search_depth))) {
+        return FALSE;
+    }
+    if (!opts.search_binary_files && is_binary_extension(filename)) {
+        return FALSE;
+    }
+    if (opts.file_type_extensions && !has_lang_extension(filename, opts.file_type_extensions, opts.file_type_extensions_len)) {
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* --git-changed: only the tracked files whose stat data doesn't match the index */
+static void search_git_changed(const char *path, const git_index_dir_t *tracked) {
+    const git_index_entry_t *entries = tracked->index->entries;
+    char *file_full_path;
+    struct stat statbuf;
+    size_t k;
+
+    for (k = tracked->start; k < tracked->end; k++) {
+        const git_index_entry_t *entry = &entries[k];
+        if (!git_index_in_work_tree(entry) || (entry->mode & S_IFMT) == GIT_INDEX_MODE_GITLINK) {
+            continue;
+        }
+        if (k > tracked->start && strcmp(entry->path, entries[k - 1].path) == 0) {
+            continue;
+        }
+        if (!git_changed_wanted(entry->path + tracked->prefix_len)) {
+            continue;
+        }
+        ag_asprintf(&file_full_path, "%s/%s", path, entry->path + tracked->prefix_len);
+        if (lstat(file_full_path, &statbuf) != 0 || !git_index_entry_changed(tracked->index, entry, &statbuf) ||
+            (S_ISLNK(statbuf.st_mode) && !opts.follow_symlinks)) {
+            free(file_full_path);
+            continue;
+        }
+        log_debug("%s differs from the git index", file_full_path);
+        search_dir_file(file_full_path, statbuf.st_ino);
+    }
+}
+
+int search_git_index(ignores *ig, const char *base_path, const char *path, dev_t original_dev) {
+    char *git_dir;
+    char *work_tree = NULL;
+    char *index_path;
+    char *prefix;
+    const char *rel;
+    git_index_t *index;
+    git_index_dir_t tracked;
+    struct stat statbuf;
+
+    /* git would use GIT_WORK_TREE or the current directory as the work tree
+     * then. Not worth it. */
+    if (base_path == NULL || getenv("GIT_DIR") || stat(path, &statbuf) != 0 || !S_ISDIR(statbuf.st_mode)) {
+        return FALSE;
+    }
+    git_dir = git_find_dir(base_path, &work_tree);
+    if (git_dir == NULL) {
+        log_debug("%s isn't in a git repository. Walking it instead.", path);
+        return FALSE;
+    }
+    ag_asprintf(&index_path, "%s/index", git_dir);
+    index = git_index_load(index_path);
+    free(index_path);
+    free(git_dir);
+    if (index == NULL) {
+        free(work_tree);
+        return FALSE;
+    }
+
+    /* base_path is path's real path, so it starts with the work tree */
+    rel = base_path + strlen(work_tree);
+    while (*rel == '/') {
+        rel++;
+    }
+    if (*rel && rel[strlen(rel) - 1] != '/') {
+        ag_asprintf(&prefix, "%s/", rel);
+    } else {
+        prefix = ag_strdup(rel);
+    }
+    tracked.index = index;
+    tracked.prefix_len = strlen(prefix);
+    tracked.ignored = FALSE;
+    git_index_find_prefix(index, prefix, tracked.prefix_len, &tracked.start, &tracked.end);
+    log_debug("%lu files in the git index are under %s", (unsigned long)(tracked.end - tracked.start), path);
+
+    if (opts.git_changed) {
+        search_git_changed(path, &tracked);
+    } else {
+        search_git_dir(ig, base_path, path, 0, original_dev, &tracked);
+    }
+
+    free(prefix);
+    free(work_tree);
+    git_index_free(index);
+    return TRUE;
 }
@@ -12,6 +12,7 @@
 #ifdef _WIN32
 #include <windows.h>
 #else
+#include <poll.h>
 #include <sys/mman.h>
 #endif
 #include <sys/stat.h>
@@ -23,14 +24,32 @@
 #include <pthread.h>
 #endif
 
+#include "archive.h"
 #include "decompress.h"
 #include "ignore.h"
 #include "log.h"
 #include "options.h"
 #include "print.h"
+#include "throttle.h"
+#include "trigram_index.h"
 #include "uthash.h"
 #include "util.h"
 
+/* --low-cache searches files bigger than this one window at a time */
+#define LOW_CACHE_WINDOW (8 * 1024 * 1024)
+/* The end of each window or block is searched again with the next one, so
+ * multiline matches up to this long can cross them */
+#define LOW_CACHE_OVERLAP (256 * 1024)
+/* A file searched in chunks has its output held back until it's done, up to
+ * this much. Past that, other workers wait for it. */
+#define CHUNK_OUTPUT_MAX (4 * 1024 * 1024)
+/* How much of a decompressed file is searched at a time */
+#define STREAM_BLOCK_SIZE (1024 * 1024)
+/* Compressed files at least this big get a thread to decompress them */
+#define PIPELINE_MIN_SIZE (1024 * 1024)
+/* Buffer alignment for O_DIRECT reads */
+#define DIRECT_IO_ALIGN 4096
+
 extern size_t alpha_skip_lookup[256];
 extern size_t *find_skip_lookup;
 
@@ -42,6 +61,8 @@ extern uint8_t h_table[H_SIZE];
 
 struct work_queue_t {
     char *path;
+    trigram_scope_t *index_scope;
+    zip_member_t *zip_member; /* If it's a file in a zip archive */
     struct work_queue_t *next;
 };
 typedef struct work_queue_t work_queue_t;
@@ -52,6 +73,9 @@ extern int done_adding_files;
 extern pthread_cond_t files_ready;
 extern pthread_mutex_t stats_mtx;
 extern pthread_mutex_t work_queue_mtx;
+/* Files queued from now on are checked against this index, or added to it
+ * with --build-index. NULL if there isn't one. */
+extern trigram_scope_t *index_scope;
 
 
 /* For symlink loop detection */
@@ -71,13 +95,52 @@ typedef struct {
 
 extern symdir_t *symhash;
 
+/* --server walks trees to remember them instead of searching them. While
+ * these are set, search_dir passes them each directory before listing it and
+ * each file it would have queued. The file hook takes ownership of path. */
+extern void (*walk_dir_hook)(const char *path);
+extern void (*walk_file_hook)(char *path, ino_t ino);
+
+/* State for searching a file in chunks of whole lines, for files that are
+ * too big to hold in memory at once or that arrive as a stream. */
+typedef struct {
+    print_context_t *ctx;
+    const char *path;
+    size_t line;        /* Line number of the first line of the next chunk */
+    size_t matches_len; /* Matches found so far */
+    size_t bytes;       /* Bytes searched so far */
+    int binary;         /* 1 = yes, 0 = no, -1 = don't know yet */
+    int holding_print_mtx;
+    int inverted_match_open; /* The last chunk ended inside an inverted match */
+    size_t overlap;          /* Bytes at the end of a chunk to search again with the next */
+    FILE *out;               /* Output held back until the file is done, or NULL */
+    char *out_buf;
+    size_t out_len;
+} chunk_search_t;
+
 ssize_t search_buf(print_context_t *ctx, char *buf, const size_t buf_len,
                    const char *dir_full_path);
+void chunk_search_init(chunk_search_t *cs, print_context_t *ctx, const char *path);
+ssize_t chunk_search_feed(chunk_search_t *cs, char *buf, const size_t buf_len, const int eof);
+ssize_t chunk_search_finish(chunk_search_t *cs);
 ssize_t search_stream(FILE *stream, const char *path);
 void search_file(const char *file_full_path);
 
 void *search_file_worker(void *i);
 
+void queue_file(char *path, ino_t ino);
+/* Queues a file an earlier walk found, checking the options that walk didn't
+ * have to: file types, -G and -g. Takes ownership of path. */
+void search_walked_file(char *path, ino_t ino);
+void flush_queued_files(void);
+
 void search_dir(ignores *ig, const char *base_path, const char *path, const int depth, dev_t original_dev);
+/* search_dir for just the entry of path called name, if the filters let it
+ * through. ig gets the ignore files in path's listing, like search_dir. */
+void search_dir_name(ignores *ig, const char *base_path, const char *path, const int depth,
+                     dev_t original_dev, const char *name);
+/* --git-index and --git-changed. Returns FALSE if path isn't in a git
+ * repository whose index we can read, and should be walked instead. */
+int search_git_index(ignores *ig, const char *base_path, const char *path, dev_t original_dev);
 
 #endif
@@ -0,0 +1,1096 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "config.h"
+
+#ifdef HAVE_SYS_INOTIFY_H
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#endif
+
+#include "ignore.h"
+#include "ignore_cache.h"
+#include "log.h"
+#include "options.h"
+#include "scandir.h"
+#include "search.h"
+#include "server.h"
+#include "uthash.h"
+#include "util.h"
+#include "walk_cache.h"
+
+#ifdef HAVE_SYS_INOTIFY_H
+
+extern char **environ;
+
+#define SERVER_MAGIC 0x61677331 /* "ags1" */
+#define SERVER_MAX_REQUEST (64 * 1024 * 1024)
+/* Changes are applied once things have been quiet this long, or before the
+ * next search, whichever comes first */
+#define SERVER_SETTLE_MS 100
+/* A client that connects and doesn't send its request gets dropped */
+#define SERVER_REQUEST_TIMEOUT 5
+
+/* Sent with the client's stdin, stdout and stderr. len bytes of strings
+ * follow: the working directory, argc arguments, then envc variables. */
+typedef struct {
+    uint32_t magic;
+    uint32_t argc;
+    uint32_t envc;
+    uint32_t len;
+} server_request_t;
+
+typedef struct {
+    char *path;
+    ino_t ino;
+} server_file_t;
+
+typedef struct {
+    char *root;      /* Real path */
+    size_t root_len;
+    char *base_path; /* root with a trailing slash, like parse_options makes */
+    dev_t dev;
+    server_file_t *files; /* Sorted by path */
+    size_t files_len;
+    int watch_failed; /* Changes could be missed, so searches walk instead */
+} server_tree_t;
+
+typedef struct {
+    server_tree_t *tree;
+    char *path;
+} server_path_t;
+
+/* A watched directory. Symlinks can put a directory in more than one place. */
+typedef struct {
+    int wd;
+    server_path_t *paths;
+    size_t paths_len;
+    UT_hash_handle hh;
+} server_dir_t;
+
+/* A search running in a child */
+typedef struct {
+    pid_t pid;
+    int fd; /* -1 once the client hangs up */
+} server_conn_t;
+
+static server_tree_t *trees = NULL;
+static size_t trees_len = 0;
+/* The server's options, to compare each search's with */
+static char *server_walk_key = NULL;
+/* In a child, running a search for a client */
+static int serving = FALSE;
+
+static int inotify_fd = -1;
+static server_dir_t *dirs = NULL;
+static server_path_t *dirty = NULL;
+static size_t dirty_len = 0;
+
+/* What the walk in progress found */
+static server_tree_t *walking_tree = NULL;
+static server_file_t *walked = NULL;
+static size_t walked_len = 0;
+static size_t walked_cap = 0;
+
+static server_conn_t *conns = NULL;
+static size_t conns_len = 0;
+static int sigchld_pipe[2] = { -1, -1 };
+
+/* Everything about the options that changes which files a walk finds.
+ * Returns NULL if a search can't use the server's lists at all. */
+static char *walk_key(void) {
+    char *ignore_key;
+    char *key;
+
+    if (opts.git_index || opts.ackmate_dir_filter) {
+        return NULL;
+    }
+    ignore_key = ignore_state_key(root_ignores);
+    ag_asprintf(&key, "%d %d %d %d %d %d %d %d %d %d\n%s",
+                (int)opts.search_hidden_files, (int)opts.search_all_files, (int)opts.skip_vcs_ignores,
+                (int)opts.search_binary_files, (int)opts.search_zip_files, (int)opts.follow_symlinks,
+                (int)opts.recurse_dirs, opts.max_search_depth, (int)opts.one_dev, (int)opts.path_to_ignore,
+                ignore_key);
+    free(ignore_key);
+    return key;
+}
+
+/* Is path dir, or something in it? */
+static int path_under(const char *path, const char *dir, size_t dir_len) {
+    return strncmp(path, dir, dir_len) == 0 && (path[dir_len] == '\0' || path[dir_len] == '/');
+}
+
+/* Like strcmp, but with '/' before every other character, so everything in
+ * a directory sorts right after it */
+static int path_cmp(const char *a, const char *b) {
+    unsigned char ca;
+    unsigned char cb;
+
+    for (; *a && *a == *b; a++, b++) {
+    }
+    ca = *a == '/' ? 1 : (unsigned char)*a;
+    cb = *b == '/' ? 1 : (unsigned char)*b;
+    return ca - cb;
+}
+
+static int file_cmp(const void *a, const void *b) {
+    return strcmp(((const server_file_t *)a)->path, ((const server_file_t *)b)->path);
+}
+
+static int dirty_cmp(const void *a, const void *b) {
+    const server_path_t *x = a;
+    const server_path_t *y = b;
+    if (x->tree != y->tree) {
+        return x->tree < y->tree ? -1 : 1;
+    }
+    return path_cmp(x->path, y->path);
+}
+
+static void watch_dir(const char *path) {
+    server_dir_t *dir;
+    size_t i;
+    uint32_t mask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ONLYDIR;
+    int wd;
+
+    if (!opts.follow_symlinks) {
+        mask |= IN_DONT_FOLLOW;
+    }
+    wd = inotify_add_watch(inotify_fd, path, mask);
+    if (wd < 0) {
+        if (!walking_tree->watch_failed) {
+            log_err("Can't watch %s: %s. Searches of %s will walk it.", path, strerror(errno), walking_tree->root);
+        }
+        walking_tree->watch_failed = TRUE;
+        return;
+    }
+
+    HASH_FIND_INT(dirs, &wd, dir);
+    if (dir == NULL) {
+        dir = ag_calloc(1, sizeof(server_dir_t));
+        dir->wd = wd;
+        HASH_ADD_INT(dirs, wd, dir);
+    }
+    for (i = 0; i < dir->paths_len; i++) {
+        if (dir->paths[i].tree == walking_tree && strcmp(dir->paths[i].path, path) == 0) {
+            return;
+        }
+    }
+    dir->paths = ag_realloc(dir->paths, (dir->paths_len + 1) * sizeof(server_path_t));
+    dir->paths[dir->paths_len].tree = walking_tree;
+    dir->paths[dir->paths_len].path = ag_strdup(path);
+    dir->paths_len++;
+}
+
+static void collect_file(char *path, ino_t ino) {
+    if (walked_len == walked_cap) {
+        walked_cap = walked_cap ? walked_cap * 2 : 1024;
+        walked = ag_realloc(walked, walked_cap * sizeof(server_file_t));
+    }
+    walked[walked_len].path = path;
+    walked[walked_len].ino = ino;
+    walked_len++;
+}
+
+/* Forgets the watches on dir and the directories in it */
+static void unwatch_dirs(const server_tree_t *tree, const char *path) {
+    size_t path_len = strlen(path);
+    server_dir_t *dir;
+    server_dir_t *tmp;
+
+    HASH_ITER(hh, dirs, dir, tmp) {
+        size_t i;
+        size_t kept = 0;
+        for (i = 0; i < dir->paths_len; i++) {
+            if (dir->paths[i].tree == tree && path_under(dir->paths[i].path, path, path_len)) {
+                free(dir->paths[i].path);
+            } else {
+                dir->paths[kept++] = dir->paths[i];
+            }
+        }
+        dir->paths_len = kept;
+        if (kept == 0) {
+            inotify_rm_watch(inotify_fd, dir->wd);
+            HASH_DEL(dirs, dir);
+            free(dir->paths);
+            free(dir);
+        }
+    }
+}
+
+/* First file whose path sorts after key, or after everything starting
+ * with it if prefix is set */
+static size_t find_file(const server_tree_t *tree, const char *key, size_t key_len, int prefix) {
+    size_t lo = 0;
+    size_t hi = tree->files_len;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int cmp = prefix ? strncmp(tree->files[mid].path, key, key_len) : strcmp(tree->files[mid].path, key);
+        if (cmp <= 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static void remove_files(server_tree_t *tree, size_t start, size_t end) {
+    size_t i;
+    for (i = start; i < end; i++) {
+        free(tree->files[i].path);
+    }
+    memmove(tree->files + start, tree->files + end, (tree->files_len - end) * sizeof(server_file_t));
+    tree->files_len -= end - start;
+}
+
+/* Forgets path, or everything in it if it's a directory */
+static void forget_path(server_tree_t *tree, const char *path) {
+    char *prefix;
+    size_t prefix_len;
+    size_t start;
+    size_t end;
+
+    end = find_file(tree, path, 0, FALSE);
+    if (end > 0 && strcmp(tree->files[end - 1].path, path) == 0) {
+        remove_files(tree, end - 1, end);
+    }
+
+    /* Paths in a directory don't sort together with a '/' in their way, but
+     * they do as strings that start with it */
+    ag_asprintf(&prefix, "%s/", path);
+    prefix_len = strlen(prefix);
+    end = find_file(tree, prefix, prefix_len, TRUE);
+    start = end;
+    while (start > 0 && strncmp(tree->files[start - 1].path, prefix, prefix_len) == 0) {
+        start--;
+    }
+    remove_files(tree, start, end);
+    free(prefix);
+}
+
+static void add_walked_files(server_tree_t *tree) {
+    server_file_t *merged;
+    size_t i = 0;
+    size_t j = 0;
+    size_t k = 0;
+
+    if (walked_len == 0) {
+        return;
+    }
+    qsort(walked, walked_len, sizeof(server_file_t), file_cmp);
+    merged = ag_malloc((tree->files_len + walked_len) * sizeof(server_file_t));
+    while (i < tree->files_len || j < walked_len) {
+        if (j == walked_len || (i < tree->files_len && strcmp(tree->files[i].path, walked[j].path) < 0)) {
+            merged[k++] = tree->files[i++];
+        } else {
+            merged[k++] = walked[j++];
+        }
+    }
+    free(tree->files);
+    tree->files = merged;
+    tree->files_len = k;
+    walked_len = 0;
+}
+
+/* search_dir loads these before filtering a directory's listing */
+static void load_dir_ignores(ignores *ig, const char *path) {
+    struct dirent **dir_list = NULL;
+    int results;
+    int i;
+
+    results = ag_scandir(path, &dir_list, NULL, NULL);
+    if (results > 0) {
+        load_listed_ignore_files(ig, path, dir_list, results);
+    }
+    for (i = 0; i < results; i++) {
+        free(dir_list[i]);
+    }
+    free(dir_list);
+}
+
+/* Walks path again, with the ignore patterns the whole walk would have had
+ * by the time it got there */
+static void rewalk(server_tree_t *tree, const char *path) {
+    const char *rel = path + tree->root_len;
+    ignores **chain;
+    size_t chain_len = 0;
+    char *dir;
+    int depth = 0;
+
+    log_debug("Walking %s again", path);
+    forget_path(tree, path);
+    unwatch_dirs(tree, path);
+
+    chain = ag_malloc((strlen(rel) + 1) * sizeof(ignores *));
+    chain[chain_len++] = init_ignore(root_ignores, "", 0);
+    dir = ag_strdup(tree->root);
+    walking_tree = tree;
+    if (*rel == '\0') {
+        search_dir(chain[0], tree->base_path, dir, 0, tree->dev);
+    } else {
+        const char *name = strrchr(rel, '/') + 1;
+        const char *p = rel + 1;
+        while (p < name) {
+            size_t len = strcspn(p, "/");
+            char *child;
+            load_dir_ignores(chain[chain_len - 1], dir);
+            chain[chain_len] = init_ignore(chain[chain_len - 1], p, len);
+            chain_len++;
+            ag_asprintf(&child, "%s/%.*s", dir, (int)len, p);
+            free(dir);
+            dir = child;
+            depth++;
+            p += len + 1;
+        }
+        search_dir_name(chain[chain_len - 1], tree->base_path, dir, depth, tree->dev, name);
+    }
+    while (chain_len > 0) {
+        cleanup_ignore(chain[--chain_len]);
+    }
+    free(chain);
+    free(dir);
+    walking_tree = NULL;
+    add_walked_files(tree);
+}
+
+static void mark_dirty(server_tree_t *tree, const char *path) {
+    dirty = ag_realloc(dirty, (dirty_len + 1) * sizeof(server_path_t));
+    dirty[dirty_len].tree = tree;
+    dirty[dirty_len].path = ag_strdup(path);
+    dirty_len++;
+}
+
+static void apply_changes(void) {
+    const server_path_t *last = NULL;
+    size_t i;
+
+    if (dirty_len == 0) {
+        return;
+    }
+    qsort(dirty, dirty_len, sizeof(server_path_t), dirty_cmp);
+    for (i = 0; i < dirty_len; i++) {
+        /* Walking a directory again takes care of everything in it */
+        if (last == NULL || last->tree != dirty[i].tree || !path_under(dirty[i].path, last->path, strlen(last->path))) {
+            rewalk(dirty[i].tree, dirty[i].path);
+            last = &dirty[i];
+        }
+    }
+    for (i = 0; i < dirty_len; i++) {
+        free(dirty[i].path);
+    }
+    dirty_len = 0;
+}
+
+/* Do changes to this file change the patterns for its directory? */
+static int is_ignore_file_name(const char *name) {
+    size_t i;
+
+    /* Where .git/info/exclude is looked for */
+    if (strcmp(name, ".git") == 0) {
+        return TRUE;
+    }
+    for (i = 0; ignore_pattern_files[i] != NULL; i++) {
+        if (strcmp(name, ignore_pattern_files[i]) == 0) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static void read_events(void) {
+    char buf[65536] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *event;
+    server_dir_t *dir;
+    ssize_t len;
+    char *p;
+    size_t i;
+
+    while ((len = read(inotify_fd, buf, sizeof(buf))) > 0) {
+        for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + event->len) {
+            event = (const struct inotify_event *)p;
+            if (event->mask & IN_Q_OVERFLOW) {
+                log_debug("Missed some changes. Walking everything again.");
+                for (i = 0; i < trees_len; i++) {
+                    mark_dirty(&trees[i], trees[i].root);
+                }
+                continue;
+            }
+            HASH_FIND_INT(dirs, &event->wd, dir);
+            if (dir == NULL) {
+                continue;
+            }
+            if (event->mask & IN_IGNORED) {
+                /* Gone. Its parent has been told. */
+                for (i = 0; i < dir->paths_len; i++) {
+                    free(dir->paths[i].path);
+                }
+                HASH_DEL(dirs, dir);
+                free(dir->paths);
+                free(dir);
+                continue;
+            }
+            if (event->len == 0) {
+                continue;
+            }
+            for (i = 0; i < dir->paths_len; i++) {
+                if (is_ignore_file_name(event->name)) {
+                    mark_dirty(dir->paths[i].tree, dir->paths[i].path);
+                } else if (!(event->mask & IN_CLOSE_WRITE)) {
+                    char *path;
+                    ag_asprintf(&path, "%s/%s", dir->paths[i].path, event->name);
+                    mark_dirty(dir->paths[i].tree, path);
+                    free(path);
+                }
+            }
+        }
+    }
+}
+
+static int read_all(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int server_connect(const char *path) {
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int server_listen(const char *path) {
+    struct sockaddr_un addr;
+    struct stat statbuf;
+    char *dir;
+    char *slash;
+    mode_t old_umask;
+    int fd;
+    int rc;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        log_err("Socket path %s is too long.", path);
+        return -1;
+    }
+    dir = ag_strdup(path);
+    slash = strrchr(dir, '/');
+    if (slash && slash != dir) {
+        *slash = '\0';
+        ag_mkdir_p(dir);
+    }
+    free(dir);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        log_err("Can't create a socket: %s", strerror(errno));
+        return -1;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    /* Only this user can connect */
+    old_umask = umask(077);
+    rc = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    if (rc != 0 && errno == EADDRINUSE) {
+        int other = server_connect(path);
+        if (other >= 0) {
+            close(other);
+            umask(old_umask);
+            close(fd);
+            log_err("ag --server is already running on %s.", path);
+            return -1;
+        }
+        /* Left behind by a server that's gone. Anything else at path
+         * isn't ours to remove. */
+        if (lstat(path, &statbuf) != 0 || !S_ISSOCK(statbuf.st_mode)) {
+            umask(old_umask);
+            close(fd);
+            log_err("Can't listen on %s: it exists and isn't a socket.", path);
+            return -1;
+        }
+        unlink(path);
+        rc = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    }
+    umask(old_umask);
+    if (rc != 0 || listen(fd, 16) != 0) {
+        log_err("Can't listen on %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void handle_sigchld(int sig) {
+    int saved_errno = errno;
+    char c = 0;
+    (void)sig;
+    if (write(sigchld_pipe[1], &c, 1) < 0) {
+        /* The pipe is full, so the loop will look anyway */
+    }
+    errno = saved_errno;
+}
+
+static void reap_children(void) {
+    pid_t pid;
+    int status;
+    size_t i;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (i = 0; i < conns_len; i++) {
+            if (conns[i].pid == pid) {
+                break;
+            }
+        }
+        if (i == conns_len) {
+            continue;
+        }
+        if (conns[i].fd >= 0) {
+            int32_t code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+            write_all(conns[i].fd, &code, sizeof(code));
+            close(conns[i].fd);
+        }
+        conns[i] = conns[--conns_len];
+    }
+}
+
+/* Runs the search in this process, as the client would have */
+static void run_child(int fd, int listen_fd, const int fds[3], char *cwd, char **argv, size_t argc, char **env,
+                      int (*run_search)(int argc, char **argv)) {
+    int tmp_fds[3];
+    size_t i;
+
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGPIPE, SIG_DFL);
+    close(fd);
+    close(listen_fd);
+    close(inotify_fd);
+    close(sigchld_pipe[0]);
+    close(sigchld_pipe[1]);
+    for (i = 0; i < conns_len; i++) {
+        if (conns[i].fd >= 0) {
+            close(conns[i].fd);
+        }
+    }
+
+    /* Out of the way first, in case one of them is 0, 1 or 2 */
+    for (i = 0; i < 3; i++) {
+        tmp_fds[i] = fcntl(fds[i], F_DUPFD, 3);
+        close(fds[i]);
+    }
+    for (i = 0; i < 3; i++) {
+        if (tmp_fds[i] < 0 || dup2(tmp_fds[i], i) < 0) {
+            _exit(1);
+        }
+        close(tmp_fds[i]);
+    }
+
+    environ = env;
+    if (chdir(cwd) != 0) {
+        log_err("Can't change to %s: %s", cwd, strerror(errno));
+        exit(1);
+    }
+
+    walk_dir_hook = NULL;
+    walk_file_hook = NULL;
+    cleanup_binary_extensions();
+    ignore_cache_cleanup();
+    walk_cache_cleanup();
+    serving = TRUE;
+    exit(run_search(argc, argv));
+}
+
+static void serve(int listen_fd, int (*run_search)(int argc, char **argv)) {
+    server_request_t req;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+    } control;
+    struct timeval timeout = { SERVER_REQUEST_TIMEOUT, 0 };
+    int fds[3] = { -1, -1, -1 };
+    char *payload = NULL;
+    char **strs = NULL;
+    size_t strs_len = 0;
+    size_t i;
+    ssize_t n;
+    pid_t pid;
+    int fd;
+
+    fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) {
+        return;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &req;
+    iov.iov_len = sizeof(req);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    n = recvmsg(fd, &msg, 0);
+    cmsg = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+        cmsg->cmsg_len == CMSG_LEN(3 * sizeof(int))) {
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    }
+    if (fds[0] < 0 || (n < (ssize_t)sizeof(req) && read_all(fd, (char *)&req + n, sizeof(req) - n) != 0) ||
+        req.magic != SERVER_MAGIC || req.len > SERVER_MAX_REQUEST || req.argc == 0 ||
+        req.argc > req.len || req.envc > req.len) {
+        log_debug("Bad request from a client");
+        goto cleanup;
+    }
+
+    payload = ag_malloc(req.len + 1);
+    if (read_all(fd, payload, req.len) != 0) {
+        log_debug("Client went away before sending its request");
+        goto cleanup;
+    }
+    payload[req.len] = '\0';
+    /* cwd, argv and environ, each ending in a NULL */
+    strs = ag_malloc((req.argc + req.envc + 3) * sizeof(char *));
+    for (i = 0; i < req.len; i += strlen(payload + i) + 1) {
+        if (strs_len == req.argc + req.envc + 2) {
+            break;
+        }
+        strs[strs_len++] = payload + i;
+        if (strs_len == req.argc + 1) {
+            strs[strs_len++] = NULL;
+        }
+    }
+    if (strs_len != req.argc + req.envc + 2 || i != req.len) {
+        log_debug("Bad request from a client");
+        goto cleanup;
+    }
+    strs[strs_len] = NULL;
+
+    read_events();
+    apply_changes();
+
+    fflush(stdout);
+    fflush(stderr);
+    pid = fork();
+    if (pid < 0) {
+        log_err("fork: %s", strerror(errno));
+        goto cleanup;
+    }
+    if (pid == 0) {
+        run_child(fd, listen_fd, fds, strs[0], strs + 1, req.argc, strs + req.argc + 2, run_search);
+    }
+    conns = ag_realloc(conns, (conns_len + 1) * sizeof(server_conn_t));
+    conns[conns_len].pid = pid;
+    conns[conns_len].fd = fd;
+    conns_len++;
+    fd = -1;
+
+cleanup:
+    for (i = 0; i < 3; i++) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(strs);
+    free(payload);
+}
+
+int server_run(char **base_paths, char **paths, int (*run_search)(int argc, char **argv)) {
+    struct sigaction sa;
+    struct pollfd *pfds = NULL;
+    size_t files_len = 0;
+    int listen_fd;
+    int i;
+    size_t j;
+
+    if (opts.file_search_regex || opts.file_type_extensions) {
+        log_err("--server keeps every file. Give -G, -g and file types to --client.");
+        return 1;
+    }
+    server_walk_key = walk_key();
+    if (server_walk_key == NULL) {
+        log_err("--server can't be used with --git-index or --ackmate-dir-filter.");
+        return 1;
+    }
+    if (opts.socket_path == NULL) {
+        log_err("Nowhere to put the server's socket. Use --socket.");
+        return 1;
+    }
+
+    for (i = 0; paths[i] != NULL; i++) {
+        server_tree_t *tree;
+        struct stat s;
+        size_t root_len;
+
+        if (base_paths[i] == NULL || stat(paths[i], &s) != 0 || !S_ISDIR(s.st_mode)) {
+            log_err("%s isn't a directory. --server only takes directories.", paths[i]);
+            return 1;
+        }
+        root_len = strlen(base_paths[i]);
+        if (root_len > 1 && base_paths[i][root_len - 1] == '/') {
+            root_len--;
+        }
+        for (j = 0; j < trees_len; j++) {
+            if (trees[j].root_len == root_len && strncmp(trees[j].root, base_paths[i], root_len) == 0) {
+                break;
+            }
+        }
+        if (j < trees_len) {
+            continue;
+        }
+        trees = ag_realloc(trees, (trees_len + 1) * sizeof(server_tree_t));
+        tree = &trees[trees_len++];
+        memset(tree, 0, sizeof(server_tree_t));
+        tree->root = ag_malloc(root_len + 1);
+        memcpy(tree->root, base_paths[i], root_len);
+        tree->root[root_len] = '\0';
+        tree->root_len = root_len;
+        ag_asprintf(&tree->base_path, "%s%s", tree->root, root_len > 1 ? "/" : "");
+        if (opts.one_dev && lstat(tree->root, &s) == 0) {
+            tree->dev = s.st_dev;
+        }
+    }
+
+    listen_fd = server_listen(opts.socket_path);
+    if (listen_fd < 0) {
+        return 1;
+    }
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0) {
+        log_err("inotify_init1: %s", strerror(errno));
+        return 1;
+    }
+    if (pipe(sigchld_pipe) != 0) {
+        log_err("pipe: %s", strerror(errno));
+        return 1;
+    }
+    for (i = 0; i < 2; i++) {
+        fcntl(sigchld_pipe[i], F_SETFL, O_NONBLOCK);
+        fcntl(sigchld_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_sigchld;
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &sa, NULL);
+    /* Clients that hang up shouldn't take the server with them */
+    signal(SIGPIPE, SIG_IGN);
+
+    walk_dir_hook = watch_dir;
+    walk_file_hook = collect_file;
+    for (j = 0; j < trees_len; j++) {
+        mark_dirty(&trees[j], trees[j].root);
+    }
+    apply_changes();
+    for (j = 0; j < trees_len; j++) {
+        files_len += trees[j].files_len;
+    }
+    ignore_cache_save();
+    walk_cache_save();
+    log_debug("Listening on %s with %lu files in %lu paths", opts.socket_path, (unsigned long)files_len,
+              (unsigned long)trees_len);
+
+    for (;;) {
+        int rc;
+
+        pfds = ag_realloc(pfds, (3 + conns_len) * sizeof(struct pollfd));
+        pfds[0].fd = listen_fd;
+        pfds[1].fd = inotify_fd;
+        pfds[2].fd = sigchld_pipe[0];
+        for (j = 0; j < conns_len; j++) {
+            pfds[3 + j].fd = conns[j].fd;
+        }
+        for (j = 0; j < 3 + conns_len; j++) {
+            pfds[j].events = POLLIN;
+            pfds[j].revents = 0;
+        }
+
+        rc = poll(pfds, 3 + conns_len, dirty_len ? SERVER_SETTLE_MS : -1);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_err("poll: %s", strerror(errno));
+            return 1;
+        }
+        if (rc == 0) {
+            apply_changes();
+            continue;
+        }
+
+        /* Clients send nothing after the request, so this is a hang up */
+        for (j = 0; j < conns_len; j++) {
+            if (conns[j].fd >= 0 && pfds[3 + j].revents) {
+                log_debug("Client for search %d hung up", (int)conns[j].pid);
+                kill(conns[j].pid, SIGTERM);
+                close(conns[j].fd);
+                conns[j].fd = -1;
+            }
+        }
+        if (pfds[2].revents) {
+            char buf[64];
+            while (read(sigchld_pipe[0], buf, sizeof(buf)) > 0) {
+            }
+            reap_children();
+        }
+        if (pfds[1].revents) {
+            read_events();
+        }
+        if (pfds[0].revents) {
+            serve(listen_fd, run_search);
+        }
+    }
+}
+
+int server_query(int argc, char **argv) {
+    const char *socket_arg = NULL;
+    const char *cache_dir_arg = NULL;
+    int client = FALSE;
+    server_request_t req;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+    } control;
+    int fds[3] = { 0, 1, 2 };
+    char *socket_path = NULL;
+    char *payload;
+    char *cwd;
+    size_t len;
+    size_t envc;
+    int32_t code;
+    int fd;
+    int i;
+
+    /* Everything else is left for the server's parse_options */
+    for (i = 1; i < argc && strcmp(argv[i], "--") != 0; i++) {
+        if (strcmp(argv[i], "--client") == 0) {
+            client = TRUE;
+        } else if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc) {
+            socket_arg = argv[i + 1];
+        } else if (strncmp(argv[i], "--socket=", 9) == 0) {
+            socket_arg = argv[i] + 9;
+        } else if (strcmp(argv[i], "--cache-dir") == 0 && i + 1 < argc) {
+            cache_dir_arg = argv[i + 1];
+        } else if (strncmp(argv[i], "--cache-dir=", 12) == 0) {
+            cache_dir_arg = argv[i] + 12;
+        }
+    }
+    if (!client) {
+        return -1;
+    }
+
+    if (socket_arg) {
+        socket_path = ag_strdup(socket_arg);
+    } else if (cache_dir_arg) {
+        ag_asprintf(&socket_path, "%s/server.sock", cache_dir_arg);
+    } else {
+        char *cache_dir = default_cache_dir();
+        if (cache_dir) {
+            ag_asprintf(&socket_path, "%s/server.sock", cache_dir);
+            free(cache_dir);
+        }
+    }
+    fd = socket_path ? server_connect(socket_path) : -1;
+    free(socket_path);
+    if (fd < 0) {
+        return -1;
+    }
+    cwd = getcwd(NULL, 0);
+    if (cwd == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    len = strlen(cwd) + 1;
+    for (i = 0; i < argc; i++) {
+        len += strlen(argv[i]) + 1;
+    }
+    for (envc = 0; environ[envc] != NULL; envc++) {
+        len += strlen(environ[envc]) + 1;
+    }
+    payload = ag_malloc(len);
+    len = 0;
+    memcpy(payload, cwd, strlen(cwd) + 1);
+    len += strlen(cwd) + 1;
+    for (i = 0; i < argc; i++) {
+        memcpy(payload + len, argv[i], strlen(argv[i]) + 1);
+        len += strlen(argv[i]) + 1;
+    }
+    for (envc = 0; environ[envc] != NULL; envc++) {
+        memcpy(payload + len, environ[envc], strlen(environ[envc]) + 1);
+        len += strlen(environ[envc]) + 1;
+    }
+    free(cwd);
+
+    req.magic = SERVER_MAGIC;
+    req.argc = argc;
+    req.envc = envc;
+    req.len = len;
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    iov.iov_base = &req;
+    iov.iov_len = sizeof(req);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    /* If this fails nothing has been searched yet, so search here */
+    if (sendmsg(fd, &msg, 0) != (ssize_t)sizeof(req)) {
+        free(payload);
+        close(fd);
+        return -1;
+    }
+    if (write_all(fd, payload, len) != 0 || read_all(fd, &code, sizeof(code)) != 0) {
+        log_err("Lost the connection to ag --server.");
+        free(payload);
+        close(fd);
+        return 1;
+    }
+    free(payload);
+    close(fd);
+
+    /* The search was killed by a signal. Go the same way. */
+    if (code > 128 && code < 128 + NSIG) {
+        signal(code - 128, SIG_DFL);
+        raise(code - 128);
+    }
+    return code;
+}
+
+int server_search_tree(const char *base_path, const char *path) {
+    static int key_checked = FALSE;
+    static int key_matches = FALSE;
+    const server_tree_t *tree = NULL;
+    size_t base_path_len;
+    size_t i;
+
+    if (!serving || base_path == NULL) {
+        return FALSE;
+    }
+    if (!key_checked) {
+        char *key = walk_key();
+        key_matches = key && strcmp(key, server_walk_key) == 0;
+        if (!key_matches) {
+            log_debug("This search doesn't filter files like the server does. Walking instead.");
+        }
+        free(key);
+        key_checked = TRUE;
+    }
+    if (!key_matches) {
+        return FALSE;
+    }
+
+    base_path_len = strlen(base_path);
+    if (base_path_len > 1 && base_path[base_path_len - 1] == '/') {
+        base_path_len--;
+    }
+    for (i = 0; i < trees_len; i++) {
+        if (trees[i].root_len == base_path_len && strncmp(trees[i].root, base_path, base_path_len) == 0) {
+            tree = &trees[i];
+            break;
+        }
+    }
+    if (tree == NULL || tree->watch_failed) {
+        return FALSE;
+    }
+
+    log_debug("Searching the server's %lu files in %s", (unsigned long)tree->files_len, path);
+    for (i = 0; i < tree->files_len; i++) {
+        char *file_path;
+        ag_asprintf(&file_path, "%s%s", path, tree->files[i].path + tree->root_len);
+        search_walked_file(file_path, tree->files[i].ino);
+    }
+    return TRUE;
+}
+
+#else
+
+int server_run(char **base_paths, char **paths, int (*run_search)(int argc, char **argv)) {
+    (void)base_paths;
+    (void)paths;
+    (void)run_search;
+    log_err("This ag was built without inotify, so --server isn't supported.");
+    return 1;
+}
+
+int server_query(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+    return -1;
+}
+
+int server_search_tree(const char *base_path, const char *path) {
+    (void)base_path;
+    (void)path;
+    return FALSE;
+}
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+/* ag --server keeps the file lists of its paths in memory, and inotify
+ * watches on their directories to keep them current. ag --client sends it
+ * its arguments, environment, working directory and stdin/stdout/stderr.
+ * The server forks for each search, and the child runs it like ag would
+ * have, writing straight to the client's stdout. */
+
+/* Only returns if the server couldn't start. Each search calls run_search
+ * in a child with the client's arguments. */
+int server_run(char **base_paths, char **paths, int (*run_search)(int argc, char **argv));
+
+/* If argv has --client, hands the search to the server and returns its exit
+ * code. Returns -1 to search here instead. */
+int server_query(int argc, char **argv);
+
+/* In a child of the server, queues the files the server has for path, if
+ * it walked path with the same options. Returns FALSE to walk it instead. */
+int server_search_tree(const char *base_path, const char *path);
+
+#endif
@@ -0,0 +1,121 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#ifndef _WIN32
+#include <sched.h>
+#include <sys/resource.h>
+#endif
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "config.h"
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include "log.h"
+#include "options.h"
+#include "throttle.h"
+#include "util.h"
+
+/* Not in glibc's headers. From linux/ioprio.h */
+#define AG_IOPRIO_CLASS_IDLE 3
+#define AG_IOPRIO_CLASS_SHIFT 13
+#define AG_IOPRIO_WHO_PROCESS 1
+
+static pthread_mutex_t throttle_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t worker_slot_free = PTHREAD_COND_INITIALIZER;
+static int active_workers = 0;
+
+/* Token bucket for --max-read-rate. Tokens are bytes. */
+static double read_tokens = 0;
+static double read_tokens_updated = 0;
+
+/* Lowest CPU and I/O priority for this thread. Threads created afterwards
+ * inherit both, so call this before starting the workers. */
+void throttle_background(void) {
+#if defined(SCHED_IDLE) && defined(HAVE_PTHREAD_H)
+    struct sched_param param;
+    int rv;
+    memset(&param, 0, sizeof(param));
+    rv = pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+    if (rv != 0) {
+        log_debug("Couldn't switch to SCHED_IDLE: %s", strerror(rv));
+    } else {
+        log_debug("Switched to SCHED_IDLE");
+    }
+#elif !defined(_WIN32)
+    if (setpriority(PRIO_PROCESS, 0, 19) != 0) {
+        log_debug("Couldn't lower priority: %s", strerror(errno));
+    }
+#endif
+
+#if defined(__linux__) && defined(SYS_ioprio_set)
+    if (syscall(SYS_ioprio_set, AG_IOPRIO_WHO_PROCESS, 0, AG_IOPRIO_CLASS_IDLE << AG_IOPRIO_CLASS_SHIFT) != 0) {
+        log_debug("Couldn't switch to the idle I/O class: %s", strerror(errno));
+    } else {
+        log_debug("Switched to the idle I/O class");
+    }
+#endif
+}
+
+/* Blocks until fewer than --max-active-workers workers are searching. */
+void throttle_worker_acquire(void) {
+    if (opts.max_active_workers <= 0) {
+        return;
+    }
+    pthread_mutex_lock(&throttle_mtx);
+    while (active_workers >= opts.max_active_workers) {
+        pthread_cond_wait(&worker_slot_free, &throttle_mtx);
+    }
+    active_workers++;
+    pthread_mutex_unlock(&throttle_mtx);
+}
+
+void throttle_worker_release(void) {
+    if (opts.max_active_workers <= 0) {
+        return;
+    }
+    pthread_mutex_lock(&throttle_mtx);
+    active_workers--;
+    pthread_cond_signal(&worker_slot_free);
+    pthread_mutex_unlock(&throttle_mtx);
+}
+
+/* Call before reading bytes from disk. Sleeps as long as it takes to stay
+ * under --max-read-rate. The bucket holds up to a second's worth of reads,
+ * and big reads go into debt instead of waiting for a bucket that never
+ * gets that full. */
+void throttle_read(size_t bytes) {
+    double rate = (double)opts.max_read_rate;
+    double now;
+    double wait = 0;
+
+    if (opts.max_read_rate == 0 || bytes == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&throttle_mtx);
+    now = now_seconds();
+    if (read_tokens_updated == 0) {
+        read_tokens = rate;
+    } else {
+        read_tokens += (now - read_tokens_updated) * rate;
+        if (read_tokens > rate) {
+            read_tokens = rate;
+        }
+    }
+    read_tokens_updated = now;
+    read_tokens -= (double)bytes;
+    if (read_tokens < 0) {
+        wait = -read_tokens / rate;
+    }
+    pthread_mutex_unlock(&throttle_mtx);
+
+    if (wait > 0) {
+        log_debug("Read rate limit: sleeping %f seconds", wait);
+        usleep((useconds_t)(wait * 1e6));
+    }
+}
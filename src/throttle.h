@@ -0,0 +1,13 @@
+#ifndef THROTTLE_H
+#define THROTTLE_H
+
+#include <stddef.h>
+
+void throttle_background(void);
+
+void throttle_worker_acquire(void);
+void throttle_worker_release(void);
+
+void throttle_read(size_t bytes);
+
+#endif
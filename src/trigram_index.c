@@ -0,0 +1,1252 @@
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+#include "config.h"
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include "log.h"
+#include "options.h"
+#include "trigram_index.h"
+#include "util.h"
+
+/* For each trigram, the files that contain it. A search works out which
+ * trigrams any match has to contain and only reads the indexed files that
+ * have all of them. Files that changed since they were indexed, or that
+ * aren't in the index, are searched as usual, so the results are the same
+ * as without the index.
+ *
+ * Trigrams are case folded (ASCII only), so one index serves both case
+ * sensitive and insensitive searches.
+ *
+ * The file is laid out to be mmapped and used as is: a header, the file
+ * table sorted by path, the trigram table sorted by trigram, the posting
+ * lists (file numbers as delta varints) and then the paths. Numbers are in
+ * the native byte order. */
+
+#define TRIGRAM_INDEX_MAGIC "agtri01"
+#define TRIGRAM_INDEX_BYTE_ORDER 0x01020304
+#define TRIGRAM_INDEX_BINARY 1 /* No trigrams were stored. Always searched. */
+#define TRIGRAM_COUNT (1 << 24)
+#define TRIGRAM_READ_CHUNK (256 * 1024)
+#define TRIGRAM_QUERY_MAX_DEPTH 64
+
+typedef struct {
+    char magic[8];
+    uint32_t byte_order;
+    uint32_t reserved;
+    uint64_t files_len;
+    uint64_t trigrams_len;
+    uint64_t postings_len; /* Bytes */
+    uint64_t names_len;    /* Bytes */
+} trigram_index_header_t;
+
+typedef struct {
+    uint64_t name; /* Offset into the paths */
+    uint64_t size;
+    int64_t mtime;
+    uint32_t mtime_nsec;
+    uint32_t flags;
+} trigram_index_file_t;
+
+typedef struct {
+    uint32_t trigram;
+    uint32_t files_len;
+    uint64_t postings; /* Offset into the posting lists */
+} trigram_index_trigram_t;
+
+typedef struct {
+    char *buf;
+    size_t buf_len;
+    const trigram_index_header_t *header;
+    const trigram_index_file_t *files;
+    const trigram_index_trigram_t *trigrams;
+    const unsigned char *postings;
+    const char *names;
+    struct stat statbuf; /* Of the index, to spot files changed while it was built */
+} trigram_index_t;
+
+/* A file found by --build-index */
+typedef struct {
+    char *name;
+    trigram_index_file_t record;
+    unsigned char *trigrams; /* Sorted, as delta varints */
+    size_t trigrams_len;     /* Bytes */
+    int64_t old_id;          /* Its number in the old index if it's unchanged, else -1 */
+} trigram_build_file_t;
+
+struct trigram_scope {
+    char *path; /* As given on the command line */
+    size_t path_len;
+    char *prefix; /* Where path is, relative to the index's directory */
+    char *index_path;
+    trigram_index_t *index;    /* For --build-index, the old one, if there was one */
+    unsigned char *candidates; /* Indexed files that might match */
+    trigram_build_file_t *files;
+    size_t files_len;
+    size_t files_size;
+    int building;
+    pthread_mutex_t files_mtx;
+};
+
+typedef enum {
+    QUERY_ALL, /* Any file could match */
+    QUERY_TRIGRAM,
+    QUERY_AND,
+    QUERY_OR
+} query_op_t;
+
+typedef struct trigram_query {
+    query_op_t op;
+    uint32_t trigram;
+    struct trigram_query **subs;
+    size_t subs_len;
+} trigram_query_t;
+
+typedef struct {
+    const unsigned char *p;
+    const unsigned char *end;
+    int icase;
+    int failed;
+} query_parser_t;
+
+/* NULL if the index can't help this search */
+static trigram_query_t *query = NULL;
+
+static unsigned char fold(unsigned char c) {
+    return (c >= 'A' && c <= 'Z') ? (unsigned char)(c + ('a' - 'A')) : c;
+}
+
+static size_t put_varint(unsigned char *out, uint64_t val) {
+    size_t len = 0;
+    while (val >= 0x80) {
+        out[len++] = (unsigned char)(val | 0x80);
+        val >>= 7;
+    }
+    out[len++] = (unsigned char)val;
+    return len;
+}
+
+static int get_varint(const unsigned char **p, const unsigned char *end, uint64_t *val) {
+    uint64_t v = 0;
+    int shift = 0;
+
+    while (*p < end && shift < 64) {
+        unsigned char c = *(*p)++;
+        v |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            *val = v;
+            return 0;
+        }
+        shift += 7;
+    }
+    return -1;
+}
+
+static uint32_t stat_mtime_nsec(const struct stat *statbuf) {
+#ifdef HAVE_STAT_MTIM
+    return (uint32_t)statbuf->st_mtim.tv_nsec;
+#else
+    (void)statbuf;
+    return 0;
+#endif
+}
+
+/* Also FALSE if the file changed in the same tick the index was written,
+ * since it could have changed again after it was read */
+static int file_unchanged(const trigram_index_t *index, const trigram_index_file_t *file, const struct stat *statbuf) {
+    int64_t index_mtime = (int64_t)index->statbuf.st_mtime;
+    uint32_t index_nsec = stat_mtime_nsec(&index->statbuf);
+
+    if (!S_ISREG(statbuf->st_mode) || file->size != (uint64_t)statbuf->st_size ||
+        file->mtime != (int64_t)statbuf->st_mtime || file->mtime_nsec != stat_mtime_nsec(statbuf)) {
+        return FALSE;
+    }
+    return file->mtime < index_mtime || (file->mtime == index_mtime && file->mtime_nsec < index_nsec);
+}
+
+/* Index loading */
+
+static void index_free(trigram_index_t *index) {
+    if (index == NULL) {
+        return;
+    }
+#ifdef _WIN32
+    free(index->buf);
+#else
+    munmap(index->buf, index->buf_len);
+#endif
+    free(index);
+}
+
+static int index_valid(const trigram_index_t *index) {
+    const trigram_index_header_t *h = index->header;
+    size_t len = index->buf_len;
+    uint64_t i;
+
+    if (len < sizeof(*h) || memcmp(h->magic, TRIGRAM_INDEX_MAGIC, sizeof(h->magic)) != 0 ||
+        h->byte_order != TRIGRAM_INDEX_BYTE_ORDER) {
+        return FALSE;
+    }
+    if (h->files_len > len / sizeof(trigram_index_file_t) || h->trigrams_len > len / sizeof(trigram_index_trigram_t) ||
+        h->postings_len > len || h->names_len > len ||
+        sizeof(*h) + h->files_len * sizeof(trigram_index_file_t) + h->trigrams_len * sizeof(trigram_index_trigram_t) +
+                h->postings_len + h->names_len !=
+            len) {
+        return FALSE;
+    }
+    if (h->names_len > 0 && index->names[h->names_len - 1] != '\0') {
+        return FALSE;
+    }
+    for (i = 0; i < h->files_len; i++) {
+        if (index->files[i].name >= h->names_len) {
+            return FALSE;
+        }
+    }
+    /* Lookups are binary searches, and a trigram that can't be found would
+     * rule files out */
+    for (i = 0; i < h->trigrams_len; i++) {
+        if ((i > 0 && index->trigrams[i].trigram <= index->trigrams[i - 1].trigram) ||
+            index->trigrams[i].postings > h->postings_len) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static trigram_index_t *index_load(const char *path) {
+    trigram_index_t *index;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        if (errno != ENOENT) {
+            log_debug("Couldn't open index %s: %s", path, strerror(errno));
+        }
+        return NULL;
+    }
+    index = ag_calloc(1, sizeof(trigram_index_t));
+    if (fstat(fd, &index->statbuf) != 0 || !S_ISREG(index->statbuf.st_mode) ||
+        index->statbuf.st_size < (off_t)sizeof(trigram_index_header_t)) {
+        log_debug("%s isn't an index", path);
+        close(fd);
+        free(index);
+        return NULL;
+    }
+    index->buf_len = index->statbuf.st_size;
+#ifdef _WIN32
+    {
+        size_t bytes_read = 0;
+        index->buf = ag_malloc(index->buf_len);
+        while (bytes_read < index->buf_len) {
+            ssize_t n = read(fd, index->buf + bytes_read, index->buf_len - bytes_read);
+            if (n <= 0) {
+                break;
+            }
+            bytes_read += n;
+        }
+        if (bytes_read != index->buf_len) {
+            log_debug("Couldn't read index %s", path);
+            close(fd);
+            free(index->buf);
+            free(index);
+            return NULL;
+        }
+    }
+#else
+    index->buf = mmap(0, index->buf_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (index->buf == MAP_FAILED) {
+        log_debug("Couldn't map index %s: %s", path, strerror(errno));
+        close(fd);
+        free(index);
+        return NULL;
+    }
+#endif
+    close(fd);
+
+    index->header = (const trigram_index_header_t *)index->buf;
+    if (index->buf_len >= sizeof(trigram_index_header_t) &&
+        index->header->files_len <= index->buf_len / sizeof(trigram_index_file_t) &&
+        index->header->trigrams_len <= index->buf_len / sizeof(trigram_index_trigram_t)) {
+        index->files = (const trigram_index_file_t *)(index->buf + sizeof(trigram_index_header_t));
+        index->trigrams = (const trigram_index_trigram_t *)(index->files + index->header->files_len);
+        index->postings = (const unsigned char *)(index->trigrams + index->header->trigrams_len);
+        index->names = (const char *)(index->postings + index->header->postings_len);
+    }
+    if (index->files == NULL || !index_valid(index)) {
+        log_debug("%s isn't an index this version of ag can read", path);
+        index_free(index);
+        return NULL;
+    }
+    log_debug("Loaded index %s: %lu files, %lu trigrams", path, (unsigned long)index->header->files_len,
+              (unsigned long)index->header->trigrams_len);
+    return index;
+}
+
+/* Returns the file's number, or -1 */
+static int64_t index_find_file(const trigram_index_t *index, const char *name) {
+    uint64_t lo = 0;
+    uint64_t hi = index->header->files_len;
+
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        int rc = strcmp(name, index->names + index->files[mid].name);
+        if (rc == 0) {
+            return (int64_t)mid;
+        }
+        if (rc < 0) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return -1;
+}
+
+static const trigram_index_trigram_t *index_find_trigram(const trigram_index_t *index, uint32_t trigram) {
+    uint64_t lo = 0;
+    uint64_t hi = index->header->trigrams_len;
+
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (index->trigrams[mid].trigram == trigram) {
+            return &index->trigrams[mid];
+        }
+        if (index->trigrams[mid].trigram > trigram) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return NULL;
+}
+
+/* Calls fn for each file containing the trigram, in order. Returns -1 if the
+ * posting list is corrupt. */
+static int index_each_file(const trigram_index_t *index, const trigram_index_trigram_t *trigram,
+                           void (*fn)(uint64_t id, void *baton), void *baton) {
+    const unsigned char *p = index->postings + trigram->postings;
+    const unsigned char *end = index->postings + index->header->postings_len;
+    uint64_t id = 0;
+    uint32_t i;
+
+    for (i = 0; i < trigram->files_len; i++) {
+        uint64_t delta;
+        if (get_varint(&p, end, &delta) != 0 || (i > 0 && delta == 0) || delta >= index->header->files_len - id) {
+            return -1;
+        }
+        id += delta;
+        fn(id, baton);
+    }
+    return 0;
+}
+
+/* Query parsing */
+
+static trigram_query_t *query_new(query_op_t op) {
+    trigram_query_t *q = ag_calloc(1, sizeof(trigram_query_t));
+    q->op = op;
+    return q;
+}
+
+static void query_free(trigram_query_t *q) {
+    size_t i;
+
+    if (q == NULL) {
+        return;
+    }
+    for (i = 0; i < q->subs_len; i++) {
+        query_free(q->subs[i]);
+    }
+    free(q->subs);
+    free(q);
+}
+
+static void query_add(trigram_query_t *parent, trigram_query_t *child) {
+    parent->subs = ag_realloc(parent->subs, (parent->subs_len + 1) * sizeof(trigram_query_t *));
+    parent->subs[parent->subs_len++] = child;
+}
+
+/* ANDs that don't need anything match anything. So do ORs where one side
+ * matches anything. */
+static trigram_query_t *query_simplify(trigram_query_t *q) {
+    size_t i;
+    size_t kept = 0;
+
+    if (q->op != QUERY_AND && q->op != QUERY_OR) {
+        return q;
+    }
+    for (i = 0; i < q->subs_len; i++) {
+        if (q->subs[i]->op != QUERY_ALL) {
+            q->subs[kept++] = q->subs[i];
+        } else if (q->op == QUERY_OR) {
+            query_free(q);
+            return query_new(QUERY_ALL);
+        } else {
+            query_free(q->subs[i]);
+        }
+    }
+    q->subs_len = kept;
+    if (kept == 0) {
+        query_free(q);
+        return query_new(QUERY_ALL);
+    }
+    if (kept == 1) {
+        trigram_query_t *only = q->subs[0];
+        q->subs_len = 0;
+        query_free(q);
+        return only;
+    }
+    return q;
+}
+
+/* Every trigram of a run of literal bytes has to be in the file */
+static void query_add_run(trigram_query_t *and, const unsigned char *run, size_t run_len, int icase) {
+    size_t i;
+
+    for (i = 0; i + 3 <= run_len; i++) {
+        trigram_query_t *t;
+        /* Case folding in other locales isn't limited to ASCII */
+        if (icase && (run[i] >= 0x80 || run[i + 1] >= 0x80 || run[i + 2] >= 0x80)) {
+            continue;
+        }
+        t = query_new(QUERY_TRIGRAM);
+        t->trigram = ((uint32_t)fold(run[i]) << 16) | ((uint32_t)fold(run[i + 1]) << 8) | fold(run[i + 2]);
+        query_add(and, t);
+    }
+}
+
+static void skip_bracket(query_parser_t *qp) {
+    qp->p++;
+    if (qp->p < qp->end && *qp->p == '^') {
+        qp->p++;
+    }
+    /* A ] right at the start is part of the set */
+    if (qp->p < qp->end && *qp->p == ']') {
+        qp->p++;
+    }
+    while (qp->p < qp->end && *qp->p != ']') {
+        if (*qp->p == '[' && qp->p + 1 < qp->end && (qp->p[1] == ':' || qp->p[1] == '=' || qp->p[1] == '.')) {
+            unsigned char delim = qp->p[1];
+            qp->p += 2;
+            while (qp->p + 1 < qp->end && !(qp->p[0] == delim && qp->p[1] == ']')) {
+                qp->p++;
+            }
+            if (qp->p + 1 >= qp->end) {
+                qp->failed = TRUE;
+                return;
+            }
+            qp->p += 2;
+        } else {
+            qp->p++;
+        }
+    }
+    if (qp->p >= qp->end) {
+        qp->failed = TRUE;
+        return;
+    }
+    qp->p++;
+}
+
+/* Reads *, +, ? and {m,n} after an atom */
+static void parse_repetition(query_parser_t *qp, int *optional, int *repeated) {
+    while (qp->p < qp->end) {
+        if (*qp->p == '*') {
+            *optional = *repeated = TRUE;
+        } else if (*qp->p == '+') {
+            *repeated = TRUE;
+        } else if (*qp->p == '?') {
+            *optional = TRUE;
+        } else if (*qp->p == '{') {
+            unsigned long min = 0;
+            unsigned long max = 0;
+            int has_min = FALSE;
+            int has_max = FALSE;
+            int comma = FALSE;
+            qp->p++;
+            while (qp->p < qp->end && isdigit(*qp->p)) {
+                min = min * 10 + (*qp->p++ - '0');
+                has_min = TRUE;
+            }
+            if (qp->p < qp->end && *qp->p == ',') {
+                comma = TRUE;
+                qp->p++;
+                while (qp->p < qp->end && isdigit(*qp->p)) {
+                    max = max * 10 + (*qp->p++ - '0');
+                    has_max = TRUE;
+                }
+            }
+            /* TRE's approximate matching settings go in braces too */
+            if (qp->p >= qp->end || *qp->p != '}') {
+                qp->failed = TRUE;
+                return;
+            }
+            if (!has_min || min == 0) {
+                *optional = TRUE;
+            }
+            if (comma ? (!has_max || max > 1) : min > 1) {
+                *repeated = TRUE;
+            }
+        } else {
+            return;
+        }
+        qp->p++;
+    }
+}
+
+static trigram_query_t *parse_alternation(query_parser_t *qp, int depth);
+
+static trigram_query_t *parse_branch(query_parser_t *qp, int depth) {
+    trigram_query_t *and = query_new(QUERY_AND);
+    unsigned char *run = ag_malloc(qp->end - qp->p + 1);
+    size_t run_len = 0;
+
+    while (qp->p < qp->end && *qp->p != '|' && *qp->p != ')') {
+        const unsigned char *atom = qp->p;
+        size_t atom_len = 0;
+        trigram_query_t *group = NULL;
+        int optional = FALSE;
+        int repeated = FALSE;
+
+        switch (*qp->p) {
+            case '(':
+                qp->p++;
+                if (qp->end - qp->p >= 2 && qp->p[0] == '?' && qp->p[1] == ':') {
+                    qp->p += 2;
+                } else if (qp->p < qp->end && qp->p[0] == '?') {
+                    /* Flags like (?i) change what the rest means */
+                    qp->failed = TRUE;
+                    break;
+                }
+                group = parse_alternation(qp, depth + 1);
+                if (group != NULL && (qp->p >= qp->end || *qp->p != ')')) {
+                    qp->failed = TRUE;
+                } else {
+                    qp->p++;
+                }
+                break;
+            case '[':
+                skip_bracket(qp);
+                break;
+            case '\\':
+                qp->p++;
+                if (qp->p >= qp->end || *qp->p == 'Q') {
+                    qp->failed = TRUE;
+                } else if (*qp->p == 'x') {
+                    qp->p++;
+                    if (qp->p < qp->end && *qp->p == '{') {
+                        while (qp->p < qp->end && *qp->p != '}') {
+                            qp->p++;
+                        }
+                        if (qp->p >= qp->end) {
+                            qp->failed = TRUE;
+                            break;
+                        }
+                        qp->p++;
+                    } else {
+                        while (qp->p < qp->end && qp->p - atom < 4 && isxdigit(*qp->p)) {
+                            qp->p++;
+                        }
+                    }
+                } else if (isalnum(*qp->p) || *qp->p == '<' || *qp->p == '>' || *qp->p >= 0x80) {
+                    /* Classes, assertions, backreferences */
+                    qp->p++;
+                } else {
+                    atom = qp->p++;
+                    atom_len = 1;
+                }
+                break;
+            case '*':
+            case '+':
+            case '?':
+            case '{':
+                /* Nothing to repeat */
+                qp->failed = TRUE;
+                break;
+            case '.':
+            case '^':
+            case '$':
+                qp->p++;
+                break;
+            default:
+                atom_len = 1;
+                /* Repetition applies to a whole multibyte character */
+                if (*qp->p++ >= 0x80) {
+                    while (qp->p < qp->end && *qp->p >= 0x80) {
+                        qp->p++;
+                        atom_len++;
+                    }
+                }
+                break;
+        }
+        if (!qp->failed) {
+            parse_repetition(qp, &optional, &repeated);
+        }
+        if (qp->failed) {
+            query_free(group);
+            break;
+        }
+
+        if (atom_len > 0 && !(qp->icase && *atom >= 0x80)) {
+            if (optional) {
+                query_add_run(and, run, run_len, qp->icase);
+                run_len = 0;
+            } else {
+                memcpy(run + run_len, atom, atom_len);
+                run_len += atom_len;
+                if (repeated) {
+                    /* The last repetition still comes before what follows */
+                    query_add_run(and, run, run_len, qp->icase);
+                    memcpy(run, atom, atom_len);
+                    run_len = atom_len;
+                }
+            }
+        } else {
+            query_add_run(and, run, run_len, qp->icase);
+            run_len = 0;
+            if (group != NULL && !optional) {
+                query_add(and, group);
+            } else {
+                query_free(group);
+            }
+        }
+    }
+    query_add_run(and, run, run_len, qp->icase);
+    free(run);
+
+    if (qp->failed) {
+        query_free(and);
+        return NULL;
+    }
+    return query_simplify(and);
+}
+
+static trigram_query_t *parse_alternation(query_parser_t *qp, int depth) {
+    trigram_query_t *or;
+
+    if (depth > TRIGRAM_QUERY_MAX_DEPTH) {
+        qp->failed = TRUE;
+        return NULL;
+    }
+    or = query_new(QUERY_OR);
+    while (TRUE) {
+        trigram_query_t *branch = parse_branch(qp, depth);
+        if (branch == NULL) {
+            query_free(or);
+            return NULL;
+        }
+        query_add(or, branch);
+        if (qp->p >= qp->end || *qp->p != '|') {
+            break;
+        }
+        qp->p++;
+    }
+    return query_simplify(or);
+}
+
+void trigram_query_init(void) {
+    trigram_query_t *q;
+    int icase = opts.casing == CASE_INSENSITIVE;
+
+    query_free(query);
+    query = NULL;
+    if (!opts.use_index || opts.build_index || opts.match_files) {
+        return;
+    }
+    /* These print or search files that don't match */
+    if (opts.invert_match || opts.print_nonmatching_files || opts.print_all_paths || opts.search_zip_files) {
+        log_debug("Not using an index for this search");
+        return;
+    }
+
+    if (opts.literal) {
+        q = query_new(QUERY_AND);
+        query_add_run(q, (const unsigned char *)opts.query, opts.query_len, icase);
+        q = query_simplify(q);
+    } else {
+        query_parser_t qp;
+        qp.p = (const unsigned char *)opts.query;
+        qp.end = qp.p + opts.query_len;
+        qp.icase = icase;
+        qp.failed = FALSE;
+        q = parse_alternation(&qp, 0);
+        if (q != NULL && qp.p != qp.end) {
+            query_free(q);
+            q = NULL;
+        }
+        if (q == NULL) {
+            log_debug("Couldn't work out which trigrams %s needs", opts.query);
+            return;
+        }
+    }
+    if (q->op == QUERY_ALL) {
+        log_debug("%s doesn't need any trigrams. Not using an index.", opts.query);
+        query_free(q);
+        return;
+    }
+    query = q;
+}
+
+void trigram_query_cleanup(void) {
+    query_free(query);
+    query = NULL;
+}
+
+/* Searching */
+
+static void mark_file(uint64_t id, void *baton) {
+    ((unsigned char *)baton)[id] = 1;
+}
+
+static void query_eval(const trigram_index_t *index, const trigram_query_t *q, unsigned char *out) {
+    size_t files_len = index->header->files_len;
+    unsigned char *tmp;
+    size_t i;
+    size_t j;
+
+    switch (q->op) {
+        case QUERY_ALL:
+            memset(out, 1, files_len);
+            break;
+        case QUERY_TRIGRAM: {
+            const trigram_index_trigram_t *trigram = index_find_trigram(index, q->trigram);
+            memset(out, 0, files_len);
+            if (trigram != NULL && index_each_file(index, trigram, mark_file, out) != 0) {
+                log_debug("Corrupt posting list. Not using the index for this trigram.");
+                memset(out, 1, files_len);
+            }
+            break;
+        }
+        case QUERY_AND:
+        case QUERY_OR:
+            tmp = ag_malloc(files_len + 1);
+            query_eval(index, q->subs[0], out);
+            for (i = 1; i < q->subs_len; i++) {
+                query_eval(index, q->subs[i], tmp);
+                for (j = 0; j < files_len; j++) {
+                    out[j] = q->op == QUERY_AND ? (out[j] & tmp[j]) : (out[j] | tmp[j]);
+                }
+            }
+            free(tmp);
+            break;
+    }
+}
+
+/* base_path with a / on the end. It doesn't always have one. */
+static char *dir_path(const char *base_path) {
+    size_t len = strlen(base_path);
+    char *dir;
+
+    if (len > 0 && base_path[len - 1] == '/') {
+        return ag_strdup(base_path);
+    }
+    ag_asprintf(&dir, "%s/", base_path);
+    return dir;
+}
+
+/* dir is base_path or one of its parents */
+static trigram_scope_t *scope_new(const char *path, const char *base_path, const char *index_dir) {
+    trigram_scope_t *scope = ag_calloc(1, sizeof(trigram_scope_t));
+    scope->path = ag_strdup(path);
+    scope->path_len = strlen(path);
+    scope->prefix = ag_strdup(base_path + strlen(index_dir));
+    ag_asprintf(&scope->index_path, "%s%s", index_dir, TRIGRAM_INDEX_NAME);
+    return scope;
+}
+
+/* The path the index knows a queued file by */
+static char *scope_relative_path(const trigram_scope_t *scope, const char *path) {
+    const char *rest;
+    char *name;
+
+    if (strncmp(path, scope->path, scope->path_len) != 0) {
+        return NULL;
+    }
+    rest = path + scope->path_len;
+    while (*rest == '/') {
+        rest++;
+    }
+    ag_asprintf(&name, "%s%s", scope->prefix, rest);
+    return name;
+}
+
+trigram_scope_t *trigram_index_open(const char *path, const char *base_path) {
+    trigram_scope_t *scope;
+    trigram_index_t *index = NULL;
+    struct stat statbuf;
+    char *base_dir;
+    char *dir;
+    char *index_path;
+    size_t i;
+    size_t candidates_len = 0;
+
+    if (query == NULL || base_path == NULL || stat(path, &statbuf) != 0 || !S_ISDIR(statbuf.st_mode)) {
+        return NULL;
+    }
+
+    base_dir = dir_path(base_path);
+    dir = ag_strdup(base_dir);
+    while (*dir) {
+        size_t dir_len;
+        ag_asprintf(&index_path, "%s%s", dir, TRIGRAM_INDEX_NAME);
+        index = index_load(index_path);
+        free(index_path);
+        if (index != NULL) {
+            break;
+        }
+        dir_len = strlen(dir);
+        dir[--dir_len] = '\0';
+        while (dir_len > 0 && dir[dir_len - 1] != '/') {
+            dir[--dir_len] = '\0';
+        }
+    }
+    if (index == NULL) {
+        free(dir);
+        free(base_dir);
+        return NULL;
+    }
+
+    scope = scope_new(path, base_dir, dir);
+    free(dir);
+    free(base_dir);
+    scope->index = index;
+    scope->candidates = ag_malloc(index->header->files_len + 1);
+    query_eval(index, query, scope->candidates);
+    for (i = 0; i < index->header->files_len; i++) {
+        candidates_len += scope->candidates[i];
+    }
+    log_debug("Index %s: %lu of %lu files might match", scope->index_path, (unsigned long)candidates_len,
+              (unsigned long)index->header->files_len);
+    return scope;
+}
+
+int trigram_index_skip(const trigram_scope_t *scope, const char *path) {
+    const trigram_index_file_t *file;
+    struct stat statbuf;
+    char *name;
+    int64_t id;
+
+    name = scope_relative_path(scope, path);
+    if (name == NULL) {
+        return FALSE;
+    }
+    id = index_find_file(scope->index, name);
+    free(name);
+    if (id < 0 || scope->candidates[id]) {
+        return FALSE;
+    }
+    file = &scope->index->files[id];
+    if (file->flags & TRIGRAM_INDEX_BINARY) {
+        return FALSE;
+    }
+    if (stat(path, &statbuf) != 0 || !file_unchanged(scope->index, file, &statbuf)) {
+        log_debug("%s changed since it was indexed", path);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* Building */
+
+trigram_scope_t *trigram_index_build_start(const char *path, const char *base_path) {
+    trigram_scope_t *scope;
+    struct stat statbuf;
+    char *dir;
+
+    if (base_path == NULL || stat(path, &statbuf) != 0 || !S_ISDIR(statbuf.st_mode)) {
+        log_err("Can't index %s: it isn't a directory", path);
+        return NULL;
+    }
+    dir = dir_path(base_path);
+    scope = scope_new(path, dir, dir);
+    free(dir);
+    scope->index = index_load(scope->index_path);
+    scope->building = TRUE;
+    if (pthread_mutex_init(&scope->files_mtx, NULL)) {
+        die("pthread_mutex_init failed!");
+    }
+    return scope;
+}
+
+static ssize_t read_chunk(int fd, unsigned char *buf, size_t len) {
+    size_t bytes_read = 0;
+
+    while (bytes_read < len) {
+        ssize_t n = read(fd, buf + bytes_read, len - bytes_read);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        bytes_read += n;
+    }
+    return (ssize_t)bytes_read;
+}
+
+static int uint32_cmp(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Returns -1 if the file couldn't be read */
+static int read_trigrams(trigram_build_file_t *file, int fd, unsigned char *seen) {
+    unsigned char *buf = ag_malloc(TRIGRAM_READ_CHUNK);
+    uint32_t *trigrams = NULL;
+    size_t trigrams_len = 0;
+    size_t trigrams_size = 0;
+    uint32_t trigram = 0;
+    size_t bytes = 0;
+    ssize_t len;
+    size_t i;
+    unsigned char *out;
+    uint32_t prev = 0;
+
+    while ((len = read_chunk(fd, buf, TRIGRAM_READ_CHUNK)) > 0) {
+        if (bytes == 0 && is_binary(buf, ag_min((size_t)len, opts.binary_sample))) {
+            file->record.flags |= TRIGRAM_INDEX_BINARY;
+            break;
+        }
+        for (i = 0; i < (size_t)len; i++) {
+            trigram = ((trigram << 8) | fold(buf[i])) & (TRIGRAM_COUNT - 1);
+            if (++bytes < 3 || (seen[trigram >> 3] & (1 << (trigram & 7)))) {
+                continue;
+            }
+            seen[trigram >> 3] |= 1 << (trigram & 7);
+            if (trigrams_len == trigrams_size) {
+                trigrams_size = trigrams_size ? trigrams_size * 2 : 1024;
+                trigrams = ag_realloc(trigrams, trigrams_size * sizeof(uint32_t));
+            }
+            trigrams[trigrams_len++] = trigram;
+        }
+    }
+    free(buf);
+
+    /* seen has to be clear for the next file */
+    for (i = 0; i < trigrams_len; i++) {
+        seen[trigrams[i] >> 3] = 0;
+    }
+    if (len < 0) {
+        free(trigrams);
+        return -1;
+    }
+
+    qsort(trigrams, trigrams_len, sizeof(uint32_t), uint32_cmp);
+    out = file->trigrams = ag_malloc(trigrams_len * 4 + 1);
+    for (i = 0; i < trigrams_len; i++) {
+        out += put_varint(out, trigrams[i] - prev);
+        prev = trigrams[i];
+    }
+    file->trigrams_len = out - file->trigrams;
+    free(trigrams);
+    return 0;
+}
+
+void trigram_index_build_add(trigram_scope_t *scope, const char *path, unsigned char **seen) {
+    trigram_build_file_t file;
+    struct stat statbuf;
+    size_t index_name_len = strlen(TRIGRAM_INDEX_NAME);
+    int fd;
+
+    memset(&file, 0, sizeof(file));
+    file.old_id = -1;
+    file.name = scope_relative_path(scope, path);
+    if (file.name == NULL) {
+        return;
+    }
+    /* The index itself, or one being written */
+    if (strncmp(file.name, TRIGRAM_INDEX_NAME, index_name_len) == 0 &&
+        (file.name[index_name_len] == '\0' || file.name[index_name_len] == '.')) {
+        free(file.name);
+        return;
+    }
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        log_err("Skipping %s: Error opening file: %s", path, strerror(errno));
+        free(file.name);
+        return;
+    }
+    /* Taken before reading, so changes made while it's read show up later */
+    if (fstat(fd, &statbuf) != 0 || !S_ISREG(statbuf.st_mode)) {
+        close(fd);
+        free(file.name);
+        return;
+    }
+    file.record.size = (uint64_t)statbuf.st_size;
+    file.record.mtime = (int64_t)statbuf.st_mtime;
+    file.record.mtime_nsec = stat_mtime_nsec(&statbuf);
+
+    if (scope->index != NULL) {
+        int64_t id = index_find_file(scope->index, file.name);
+        if (id >= 0 && file_unchanged(scope->index, &scope->index->files[id], &statbuf)) {
+            file.old_id = id;
+            file.record.flags = scope->index->files[id].flags;
+        }
+    }
+    if (file.old_id < 0) {
+        if (*seen == NULL) {
+            *seen = ag_calloc(TRIGRAM_COUNT / 8, 1);
+        }
+        if (read_trigrams(&file, fd, *seen) != 0) {
+            log_err("Skipping %s: Error reading file: %s", path, strerror(errno));
+            close(fd);
+            free(file.name);
+            return;
+        }
+    }
+    close(fd);
+
+    pthread_mutex_lock(&scope->files_mtx);
+    if (scope->files_len == scope->files_size) {
+        scope->files_size = scope->files_size ? scope->files_size * 2 : 1024;
+        scope->files = ag_realloc(scope->files, scope->files_size * sizeof(trigram_build_file_t));
+    }
+    scope->files[scope->files_len++] = file;
+    pthread_mutex_unlock(&scope->files_mtx);
+}
+
+static int build_file_cmp(const void *a, const void *b) {
+    return strcmp(((const trigram_build_file_t *)a)->name, ((const trigram_build_file_t *)b)->name);
+}
+
+typedef struct {
+    uint32_t *slots; /* Trigram to the number of files with it, and then to its slot */
+    uint32_t trigram;
+    uint32_t *old_to_new;
+    uint32_t *ids;
+    size_t *cursors;
+} build_baton_t;
+
+static void count_old_file(uint64_t id, void *baton) {
+    build_baton_t *b = baton;
+    if (b->old_to_new[id] != UINT32_MAX) {
+        b->slots[b->trigram]++;
+    }
+}
+
+static void fill_old_file(uint64_t id, void *baton) {
+    build_baton_t *b = baton;
+    if (b->old_to_new[id] != UINT32_MAX) {
+        b->ids[b->cursors[b->slots[b->trigram]]++] = b->old_to_new[id];
+    }
+}
+
+/* Calls fn for each trigram of a new file */
+static void each_new_trigram(const trigram_build_file_t *file, void (*fn)(uint32_t trigram, uint32_t id, build_baton_t *b),
+                             uint32_t id, build_baton_t *b) {
+    const unsigned char *p = file->trigrams;
+    const unsigned char *end = file->trigrams + file->trigrams_len;
+    uint64_t trigram = 0;
+    uint64_t delta;
+
+    while (p < end && get_varint(&p, end, &delta) == 0) {
+        trigram += delta;
+        fn((uint32_t)trigram, id, b);
+    }
+}
+
+static void count_new_trigram(uint32_t trigram, uint32_t id, build_baton_t *b) {
+    (void)id;
+    b->slots[trigram]++;
+}
+
+static void fill_new_trigram(uint32_t trigram, uint32_t id, build_baton_t *b) {
+    b->ids[b->cursors[b->slots[trigram]]++] = id;
+}
+
+static int write_index(const trigram_scope_t *scope, const trigram_index_header_t *header,
+                       const trigram_index_trigram_t *trigrams, const unsigned char *postings) {
+    FILE *fp;
+    char *tmp_path;
+    uint64_t name = 0;
+    size_t i;
+    int rc = 0;
+
+    ag_asprintf(&tmp_path, "%s.%lu", scope->index_path, (unsigned long)getpid());
+    fp = fopen(tmp_path, "wb");
+    if (fp == NULL) {
+        log_err("Couldn't write index %s: %s", tmp_path, strerror(errno));
+        free(tmp_path);
+        return -1;
+    }
+    fwrite(header, sizeof(*header), 1, fp);
+    for (i = 0; i < scope->files_len; i++) {
+        trigram_index_file_t record = scope->files[i].record;
+        record.name = name;
+        fwrite(&record, sizeof(record), 1, fp);
+        name += strlen(scope->files[i].name) + 1;
+    }
+    fwrite(trigrams, sizeof(trigram_index_trigram_t), header->trigrams_len, fp);
+    fwrite(postings, 1, header->postings_len, fp);
+    for (i = 0; i < scope->files_len; i++) {
+        fwrite(scope->files[i].name, strlen(scope->files[i].name) + 1, 1, fp);
+    }
+
+    if (ferror(fp) || fclose(fp) != 0 || rename(tmp_path, scope->index_path) != 0) {
+        log_err("Couldn't write index %s: %s", scope->index_path, strerror(errno));
+        unlink(tmp_path);
+        rc = -1;
+    }
+    free(tmp_path);
+    return rc;
+}
+
+int trigram_index_build_finish(trigram_scope_t *scope) {
+    trigram_index_header_t header;
+    build_baton_t b;
+    trigram_index_trigram_t *trigrams;
+    size_t *starts;
+    size_t trigrams_len = 0;
+    size_t total = 0;
+    size_t reused = 0;
+    unsigned char *postings;
+    size_t postings_len = 0;
+    size_t i;
+    size_t j;
+    uint32_t t;
+    int rc;
+
+    qsort(scope->files, scope->files_len, sizeof(trigram_build_file_t), build_file_cmp);
+
+    memset(&b, 0, sizeof(b));
+    b.slots = ag_calloc(TRIGRAM_COUNT, sizeof(uint32_t));
+    if (scope->index != NULL) {
+        b.old_to_new = ag_malloc((scope->index->header->files_len + 1) * sizeof(uint32_t));
+        memset(b.old_to_new, 0xff, (scope->index->header->files_len + 1) * sizeof(uint32_t));
+    }
+    for (i = 0; i < scope->files_len; i++) {
+        if (scope->files[i].old_id >= 0) {
+            b.old_to_new[scope->files[i].old_id] = (uint32_t)i;
+            reused++;
+        } else {
+            each_new_trigram(&scope->files[i], count_new_trigram, (uint32_t)i, &b);
+        }
+    }
+    if (reused > 0) {
+        for (i = 0; i < scope->index->header->trigrams_len; i++) {
+            b.trigram = scope->index->trigrams[i].trigram;
+            if (index_each_file(scope->index, &scope->index->trigrams[i], count_old_file, &b) != 0) {
+                /* The counts are off now. Start over without it. */
+                log_err("Index %s is corrupt. Rebuild it from scratch.", scope->index_path);
+                free(b.slots);
+                free(b.old_to_new);
+                return -1;
+            }
+        }
+    }
+
+    /* Number the trigrams that are used and lay out their posting lists */
+    for (t = 0; t < TRIGRAM_COUNT; t++) {
+        trigrams_len += b.slots[t] > 0;
+    }
+    trigrams = ag_calloc(trigrams_len + 1, sizeof(trigram_index_trigram_t));
+    starts = ag_malloc((trigrams_len + 1) * sizeof(size_t));
+    b.cursors = ag_malloc((trigrams_len + 1) * sizeof(size_t));
+    for (t = 0, j = 0; t < TRIGRAM_COUNT; t++) {
+        if (b.slots[t] == 0) {
+            continue;
+        }
+        trigrams[j].trigram = t;
+        trigrams[j].files_len = b.slots[t];
+        starts[j] = b.cursors[j] = total;
+        total += b.slots[t];
+        b.slots[t] = (uint32_t)j++;
+    }
+    starts[trigrams_len] = total;
+
+    b.ids = ag_malloc((total + 1) * sizeof(uint32_t));
+    for (i = 0; i < scope->files_len; i++) {
+        if (scope->files[i].old_id < 0) {
+            each_new_trigram(&scope->files[i], fill_new_trigram, (uint32_t)i, &b);
+        }
+    }
+    if (reused > 0) {
+        for (i = 0; i < scope->index->header->trigrams_len; i++) {
+            b.trigram = scope->index->trigrams[i].trigram;
+            index_each_file(scope->index, &scope->index->trigrams[i], fill_old_file, &b);
+        }
+    }
+
+    /* Old and new files were added separately, so a list can be two sorted runs */
+    postings = ag_malloc(total * 5 + 1);
+    for (j = 0; j < trigrams_len; j++) {
+        uint32_t *ids = b.ids + starts[j];
+        size_t ids_len = starts[j + 1] - starts[j];
+        uint32_t prev = 0;
+        for (i = 1; i < ids_len; i++) {
+            if (ids[i] < ids[i - 1]) {
+                qsort(ids, ids_len, sizeof(uint32_t), uint32_cmp);
+                break;
+            }
+        }
+        trigrams[j].postings = postings_len;
+        for (i = 0; i < ids_len; i++) {
+            postings_len += put_varint(postings + postings_len, ids[i] - prev);
+            prev = ids[i];
+        }
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRIGRAM_INDEX_MAGIC, sizeof(header.magic));
+    header.byte_order = TRIGRAM_INDEX_BYTE_ORDER;
+    header.files_len = scope->files_len;
+    header.trigrams_len = trigrams_len;
+    header.postings_len = postings_len;
+    for (i = 0; i < scope->files_len; i++) {
+        header.names_len += strlen(scope->files[i].name) + 1;
+    }
+    rc = write_index(scope, &header, trigrams, postings);
+    if (rc == 0) {
+        log_debug("Indexed %lu files in %s (%lu unchanged), %lu trigrams", (unsigned long)scope->files_len,
+                  scope->path, (unsigned long)reused, (unsigned long)trigrams_len);
+    }
+
+    free(postings);
+    free(b.ids);
+    free(b.cursors);
+    free(starts);
+    free(trigrams);
+    free(b.old_to_new);
+    free(b.slots);
+    return rc;
+}
+
+void trigram_index_close(trigram_scope_t *scope) {
+    size_t i;
+
+    if (scope == NULL) {
+        return;
+    }
+    for (i = 0; i < scope->files_len; i++) {
+        free(scope->files[i].name);
+        free(scope->files[i].trigrams);
+    }
+    if (scope->building) {
+        pthread_mutex_destroy(&scope->files_mtx);
+    }
+    free(scope->files);
+    free(scope->candidates);
+    index_free(scope->index);
+    free(scope->index_path);
+    free(scope->prefix);
+    free(scope->path);
+    free(scope);
+}
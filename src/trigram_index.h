@@ -0,0 +1,37 @@
+#ifndef TRIGRAM_INDEX_H
+#define TRIGRAM_INDEX_H
+
+#include <stddef.h>
+
+/* --build-index writes this in the directory it indexes. Searches use the
+ * closest one at or above each path. */
+#define TRIGRAM_INDEX_NAME ".ag_index"
+
+/* An index for one of the paths being searched or indexed. Files queued for
+ * that path carry a pointer to it. */
+typedef struct trigram_scope trigram_scope_t;
+
+/* Works out which trigrams a file needs to contain to match opts.query.
+ * Call once the query is final, before opening any scopes. */
+void trigram_query_init(void);
+void trigram_query_cleanup(void);
+
+/* Returns NULL if there's no index for path, or it can't rule out any files
+ * for this search */
+trigram_scope_t *trigram_index_open(const char *path, const char *base_path);
+
+/* Is path in the index, unchanged since it was indexed, and missing some
+ * trigram the query needs? Files the index doesn't know about aren't
+ * skipped. */
+int trigram_index_skip(const trigram_scope_t *scope, const char *path);
+
+/* --build-index. Files in the old index that didn't change are copied
+ * from it instead of being read again. */
+trigram_scope_t *trigram_index_build_start(const char *path, const char *base_path);
+/* seen is scratch space kept by the caller between files. Free it when done. */
+void trigram_index_build_add(trigram_scope_t *scope, const char *path, unsigned char **seen);
+int trigram_index_build_finish(trigram_scope_t *scope);
+
+void trigram_index_close(trigram_scope_t *scope);
+
+#endif
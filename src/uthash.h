@@ -185,7 +185,7 @@ typedef unsigned char uint8_t;
     do {                                                                                    \
         unsigned _ha_bkt;                                                                   \
         (add)->hh.next = NULL;                                                              \
-        (add)->hh.key = (char *)(keyptr);                                                   \
+        (add)->hh.key = (const void *)(keyptr);                                             \
         (add)->hh.keylen = (unsigned)(keylen_in);                                           \
         if (!(head)) {                                                                      \
             head = (add);                                                                   \
@@ -439,7 +439,7 @@ typedef unsigned char uint8_t;
 #define HASH_JEN(key, keylen, num_bkts, hashv, bkt)                                                                              \
     do {                                                                                                                         \
         unsigned _hj_i, _hj_j, _hj_k;                                                                                            \
-        unsigned char *_hj_key = (unsigned char *)(key);                                                                         \
+        const unsigned char *_hj_key = (const unsigned char *)(key);                                                             \
         hashv = 0xfeedbeef;                                                                                                      \
         _hj_i = _hj_j = 0x9e3779b9;                                                                                              \
         _hj_k = (unsigned)(keylen);                                                                                              \
@@ -963,7 +963,7 @@ typedef struct UT_hash_handle {
     void *next;                     /* next element in app order      */
     struct UT_hash_handle *hh_prev; /* previous hh in bucket order    */
     struct UT_hash_handle *hh_next; /* next hh in bucket order        */
-    void *key;                      /* ptr to enclosing struct's key  */
+    const void *key;                /* ptr to enclosing struct's key  */
     unsigned keylen;                /* enclosing struct's key len     */
     unsigned hashv;                 /* result of hash-fcn(key)        */
 } UT_hash_handle;
@@ -1,13 +1,20 @@
 #include <ctype.h>
+#include <errno.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
 
 #include "config.h"
 #include "util.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #ifdef _WIN32
 #include <windows.h>
 #define flockfile(x)
@@ -143,6 +150,18 @@ void generate_find_skip(const char *find, const size_t f_len, size_t **skip_look
     }
 }
 
+double now_seconds(void) {
+#if defined(CLOCK_MONOTONIC) && !defined(_WIN32)
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+    }
+#endif
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
 size_t ag_max(size_t a, size_t b) {
     if (b > a) {
         return b;
@@ -323,10 +342,39 @@ void compile_study(regex_t **re, char *q, int pcre_opts) {
     }
 }
 
+/* Skips bytes that is_binary() doesn't care about: \a through \r and
+ * 32 through 127. Returns the offset of the first byte that needs a closer
+ * look, or len if there isn't one. */
+static size_t skip_plain_bytes(const unsigned char *buf, const size_t len) {
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i printable_min = _mm_set1_epi8(31);
+    const __m128i control_min = _mm_set1_epi8(6);
+    const __m128i control_max = _mm_set1_epi8(15);
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+        /* Compares are signed, so bytes above 127 fail both of these */
+        __m128i printable = _mm_cmpgt_epi8(v, printable_min);
+        __m128i control = _mm_and_si128(_mm_cmpgt_epi8(v, control_min), _mm_cmplt_epi8(v, control_max));
+        if (_mm_movemask_epi8(_mm_or_si128(printable, control)) != 0xFFFF) {
+            /* The scalar loop finds which byte it was */
+            break;
+        }
+    }
+#endif
+    for (; i < len; i++) {
+        if ((buf[i] < 7 || buf[i] > 14) && (buf[i] < 32 || buf[i] > 127)) {
+            break;
+        }
+    }
+    return i;
+}
+
 /* This function is very hot. It's called on every file. */
 int is_binary(const void *buf, const size_t buf_len) {
     size_t suspicious_bytes = 0;
-    size_t total_bytes = buf_len > 512 ? 512 : buf_len;
+    size_t total_bytes = buf_len > opts.binary_sample ? opts.binary_sample : buf_len;
     const unsigned char *buf_c = buf;
     size_t i;
 
@@ -346,31 +394,34 @@ int is_binary(const void *buf, const size_t buf_len) {
     }
 
     for (i = 0; i < total_bytes; i++) {
+        i += skip_plain_bytes(buf_c + i, total_bytes - i);
+        if (i == total_bytes) {
+            break;
+        }
         if (buf_c[i] == '\0') {
             /* NULL char. It's binary */
             return 1;
-        } else if ((buf_c[i] < 7 || buf_c[i] > 14) && (buf_c[i] < 32 || buf_c[i] > 127)) {
-            /* UTF-8 detection */
-            if (buf_c[i] > 193 && buf_c[i] < 224 && i + 1 < total_bytes) {
-                i++;
-                if (buf_c[i] > 127 && buf_c[i] < 192) {
-                    continue;
-                }
-            } else if (buf_c[i] > 223 && buf_c[i] < 240 && i + 2 < total_bytes) {
-                i++;
-                if (buf_c[i] > 127 && buf_c[i] < 192 && buf_c[i + 1] > 127 && buf_c[i + 1] < 192) {
-                    i++;
-                    continue;
-                }
+        }
+        /* UTF-8 detection */
+        if (buf_c[i] > 193 && buf_c[i] < 224 && i + 1 < total_bytes) {
+            i++;
+            if (buf_c[i] > 127 && buf_c[i] < 192) {
+                continue;
             }
-            suspicious_bytes++;
-            /* Disk IO is so slow that it's worthwhile to do this calculation after every suspicious byte. */
-            /* This is true even on a 1.6Ghz Atom with an Intel 320 SSD. */
-            /* Read at least 32 bytes before making a decision */
-            if (i >= 32 && (suspicious_bytes * 100) / total_bytes > 10) {
-                return 1;
+        } else if (buf_c[i] > 223 && buf_c[i] < 240 && i + 2 < total_bytes) {
+            i++;
+            if (buf_c[i] > 127 && buf_c[i] < 192 && buf_c[i + 1] > 127 && buf_c[i + 1] < 192) {
+                i++;
+                continue;
             }
         }
+        suspicious_bytes++;
+        /* Disk IO is so slow that it's worthwhile to do this calculation after every suspicious byte. */
+        /* This is true even on a 1.6Ghz Atom with an Intel 320 SSD. */
+        /* Read at least 32 bytes before making a decision */
+        if (i >= 32 && (suspicious_bytes * 100) / total_bytes > 10) {
+            return 1;
+        }
     }
     if ((suspicious_bytes * 100) / total_bytes > 10) {
         return 1;
@@ -379,6 +430,36 @@ int is_binary(const void *buf, const size_t buf_len) {
     return 0;
 }
 
+/* Counts the newlines in buf. Streamed input is searched a block at a time,
+ * and every block's lines have to be counted. */
+size_t count_newlines(const char *buf, const size_t len) {
+    size_t count = 0;
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i zero = _mm_setzero_si128();
+
+    while (i + 16 <= len) {
+        /* Each byte of acc counts the newlines in its lane. Sum them before
+         * they can overflow. */
+        size_t rounds = ag_min((len - i) / 16, 255);
+        __m128i acc = _mm_setzero_si128();
+        for (; rounds > 0; rounds--, i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+            acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(v, newline));
+        }
+        acc = _mm_sad_epu8(acc, zero);
+        count += (size_t)_mm_cvtsi128_si32(acc) + (size_t)_mm_extract_epi16(acc, 4);
+    }
+#endif
+    for (; i < len; i++) {
+        if (buf[i] == '\n') {
+            count++;
+        }
+    }
+    return count;
+}
+
 int is_regex(const char *query) {
     char regex_chars[] = {
         '$',
@@ -531,6 +612,40 @@ int is_named_pipe(const char *path, const struct dirent *d) {
         ;
 }
 
+/* Creates dir and any missing parents. Returns 0 on success. */
+int ag_mkdir_p(const char *dir) {
+    char *path;
+    char *p;
+    char c;
+    int rv = 0;
+
+    if (dir[0] == '\0') {
+        return -1;
+    }
+    path = ag_strdup(dir);
+    for (p = path + 1;; p++) {
+        if (*p != '/' && *p != '\0') {
+            continue;
+        }
+        c = *p;
+        *p = '\0';
+#ifdef _WIN32
+        rv = mkdir(path);
+#else
+        rv = mkdir(path, 0755);
+#endif
+        if (rv != 0 && errno == EEXIST) {
+            rv = 0;
+        }
+        *p = c;
+        if (c == '\0' || rv != 0) {
+            break;
+        }
+    }
+    free(path);
+    return rv;
+}
+
 void ag_asprintf(char **ret, const char *fmt, ...) {
     va_list args;
     va_start(args, fmt);
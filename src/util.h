@@ -52,6 +52,9 @@ typedef struct {
     size_t total_files;
     size_t total_matches;
     size_t total_file_matches;
+    size_t total_decompressed_files;
+    double decompress_time; /* Seconds spent decompressing files */
+    double decompressed_search_time; /* and searching what came out */
     struct timeval time_start;
     struct timeval time_end;
 } ag_stats;
@@ -73,6 +76,9 @@ size_t suffix_len(const char *s, const size_t s_len, const size_t pos, const int
 void generate_find_skip(const char *find, const size_t f_len, size_t **skip_lookup, const int case_sensitive);
 void generate_hash(const char *find, const size_t f_len, uint8_t *H, const int case_sensitive);
 
+/* For measuring how long things take, not telling the time */
+double now_seconds(void);
+
 /* max is already defined on spec-violating compilers such as MinGW */
 size_t ag_max(size_t a, size_t b);
 size_t ag_min(size_t a, size_t b);
@@ -87,6 +93,7 @@ void compile_study(regex_t **re, char *q, const int pcre_opts);
 
 
 int is_binary(const void *buf, const size_t buf_len);
+size_t count_newlines(const char *buf, const size_t len);
 int is_regex(const char *query);
 int is_fnmatch(const char *filename);
 int binary_search(const char *needle, char **haystack, int start, int end);
@@ -102,6 +109,8 @@ int is_named_pipe(const char *path, const struct dirent *d);
 
 void die(const char *fmt, ...);
 
+int ag_mkdir_p(const char *dir);
+
 void ag_asprintf(char **ret, const char *fmt, ...);
 
 ssize_t buf_getline(char **line, char *buf, const size_t buf_len, const size_t buf_offset);
@@ -0,0 +1,434 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+
+#include "cache_file.h"
+#include "log.h"
+#include "options.h"
+#include "util.h"
+#include "uthash.h"
+#include "walk_cache.h"
+
+/* Directory listings with the ignore patterns already applied, so unchanged
+ * directories don't have to be listed and filtered again. Directories are
+ * identified by device and inode, and their mtime changes whenever an entry
+ * is added, removed or renamed.
+ *
+ * Whether an entry is ignored also depends on the ignore files above it and
+ * on the directory's path, so each directory has a context: a hash of its
+ * parent's context, its name and its own ignore files. An entry is only used
+ * if it was made in the same context. */
+
+#define WALK_CACHE_MAGIC "agwlk01"
+
+/* Symlinks and entries of unknown type go through filename_filter again on
+ * replay, since what they point to can change without the directory
+ * changing. They're cached even if they were filtered out. */
+#define WALK_CACHE_RECHECK 1
+
+typedef struct {
+    char magic[8];
+    uint64_t entries_len;
+} walk_cache_header_t;
+
+/* On disk, each entry is this followed by its data. For each directory
+ * entry, the data has its inode (8 bytes), type, flags and NUL-terminated
+ * name. */
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime;
+    int64_t mtime_nsec;
+    uint64_t context;
+    uint64_t ignore_sig;
+    uint64_t ignore_files;
+    uint64_t entries_len;
+    uint64_t data_len;
+} walk_cache_record_t;
+
+/* dev and ino, the start of the record */
+#define WALK_CACHE_KEY_LEN (2 * sizeof(uint64_t))
+
+typedef struct {
+    walk_cache_record_t record;
+    char *data;
+    int used; /* Replayed or added in this run */
+    UT_hash_handle hh;
+} walk_cache_entry_t;
+
+static walk_cache_entry_t *walk_cache = NULL;
+static size_t walk_cache_len = 0;
+static int walk_cache_dirty = FALSE;
+static char *walk_cache_path = NULL;
+/* Directories changed in the same second the cache was saved could have
+ * changed again after they were listed. They aren't trusted. */
+static int64_t walk_cache_mtime = 0;
+static uint64_t walk_cache_root_context = 0;
+
+/* FNV-1a */
+static uint64_t hash_bytes(uint64_t h, const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static uint64_t hash_str(uint64_t h, const char *s) {
+    return hash_bytes(h, s, strlen(s) + 1);
+}
+
+static uint64_t options_context(void) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    char *ignore_key;
+    char *key;
+    size_t i;
+
+    ignore_key = ignore_state_key(root_ignores);
+    ag_asprintf(&key, "%d %d %d %d %d %d %d\n%s",
+                (int)opts.search_hidden_files, (int)opts.search_all_files, (int)opts.skip_vcs_ignores,
+                (int)opts.search_binary_files, (int)opts.search_zip_files, (int)opts.follow_symlinks,
+                (int)opts.path_to_ignore, ignore_key);
+    h = hash_str(h, key);
+    free(key);
+    free(ignore_key);
+    for (i = 0; i < opts.file_type_extensions_len; i++) {
+        h = hash_str(h, opts.file_type_extensions[i]);
+    }
+    return h;
+}
+
+static void free_entry(walk_cache_entry_t *entry) {
+    free(entry->data);
+    free(entry);
+}
+
+/* Takes ownership of entry->data */
+static void add_entry(walk_cache_entry_t *entry) {
+    walk_cache_entry_t *old = NULL;
+
+    HASH_FIND(hh, walk_cache, &entry->record, WALK_CACHE_KEY_LEN, old);
+    if (old) {
+        HASH_DELETE(hh, walk_cache, old);
+        free_entry(old);
+        walk_cache_len--;
+    }
+    HASH_ADD(hh, walk_cache, record, WALK_CACHE_KEY_LEN, entry);
+    walk_cache_len++;
+}
+
+static void set_stat(walk_cache_record_t *record, const struct stat *statbuf) {
+    record->dev = (uint64_t)statbuf->st_dev;
+    record->ino = (uint64_t)statbuf->st_ino;
+    record->mtime = (int64_t)statbuf->st_mtime;
+#ifdef HAVE_STAT_MTIM
+    record->mtime_nsec = (int64_t)statbuf->st_mtim.tv_nsec;
+#else
+    record->mtime_nsec = 0;
+#endif
+}
+
+/* The ignore files in path, as they are now. A file that's edited in place
+ * doesn't change the directory's mtime. */
+static uint64_t ignore_files_sig(const char *path, unsigned int ignore_files) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    walk_cache_record_t record;
+    struct stat statbuf;
+    char *file_path;
+    int j;
+
+    for (j = 0; ignore_pattern_files[j] != NULL; j++) {
+        if (!(ignore_files & (1u << j))) {
+            continue;
+        }
+        memset(&record, 0, sizeof(record));
+        ag_asprintf(&file_path, "%s/%s", path, ignore_pattern_files[j]);
+        if (stat(file_path, &statbuf) == 0) {
+            set_stat(&record, &statbuf);
+            record.data_len = (uint64_t)statbuf.st_size;
+        }
+        free(file_path);
+        h = hash_bytes(h, &record, sizeof(record));
+    }
+    return h;
+}
+
+static uint64_t dir_context(const walk_cache_dir_t *dir) {
+    uint64_t h = dir->context;
+    h = hash_bytes(h, &dir->ignore_files, sizeof(dir->ignore_files));
+    h = hash_bytes(h, &dir->ignore_sig, sizeof(dir->ignore_sig));
+    return h ? h : 1;
+}
+
+void walk_cache_load(const char *path) {
+    cache_file_t cf;
+    walk_cache_header_t header;
+    walk_cache_record_t record;
+    walk_cache_entry_t *entry;
+    uint64_t i;
+
+    walk_cache_path = ag_strdup(path);
+    walk_cache_root_context = options_context();
+
+    if (!cache_file_open(&cf, "walk cache", path, WALK_CACHE_MAGIC, &header, sizeof(header))) {
+        return;
+    }
+    walk_cache_mtime = (int64_t)cf.statbuf.st_mtime;
+    for (i = 0; i < header.entries_len; i++) {
+        if (!cache_file_read(&cf, &record, sizeof(record))) {
+            log_debug("Walk cache %s is truncated", path);
+            break;
+        }
+        entry = ag_malloc(sizeof(walk_cache_entry_t));
+        entry->record = record;
+        entry->data = cache_file_read_data(&cf, record.data_len);
+        entry->used = FALSE;
+        if (entry->data == NULL) {
+            log_debug("Walk cache %s is truncated", path);
+            free_entry(entry);
+            break;
+        }
+        add_entry(entry);
+    }
+    cache_file_close(&cf);
+    log_debug("Loaded %lu entries from walk cache %s", (unsigned long)walk_cache_len, path);
+}
+
+void walk_cache_save(void) {
+    cache_file_t cf;
+    walk_cache_header_t header;
+    walk_cache_entry_t *entry;
+    int keep_unused;
+
+    if (walk_cache_path == NULL || !walk_cache_dirty) {
+        return;
+    }
+    if (!cache_file_create(&cf, "walk cache", walk_cache_path)) {
+        return;
+    }
+    keep_unused = cache_keep_unused(walk_cache_len, WALK_CACHE_MAX_ENTRIES);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, WALK_CACHE_MAGIC, sizeof(header.magic));
+    for (entry = walk_cache; entry != NULL; entry = entry->hh.next) {
+        if (keep_unused || entry->used) {
+            header.entries_len++;
+        }
+    }
+    fwrite(&header, sizeof(header), 1, cf.fp);
+    for (entry = walk_cache; entry != NULL; entry = entry->hh.next) {
+        if (keep_unused || entry->used) {
+            fwrite(&entry->record, sizeof(entry->record), 1, cf.fp);
+            fwrite(entry->data, 1, entry->record.data_len, cf.fp);
+        }
+    }
+
+    if (cache_file_commit(&cf)) {
+        log_debug("Saved %lu entries to walk cache %s", (unsigned long)header.entries_len, walk_cache_path);
+    }
+}
+
+void walk_cache_cleanup(void) {
+    walk_cache_entry_t *entry;
+    walk_cache_entry_t *tmp;
+
+    HASH_ITER(hh, walk_cache, entry, tmp) {
+        HASH_DELETE(hh, walk_cache, entry);
+        free_entry(entry);
+    }
+    walk_cache_len = 0;
+    walk_cache_dirty = FALSE;
+    free(walk_cache_path);
+    walk_cache_path = NULL;
+}
+
+static void free_dir_list(struct dirent **dir_list, int dir_list_len) {
+    int i;
+    for (i = 0; i < dir_list_len; i++) {
+        free(dir_list[i]);
+    }
+    free(dir_list);
+}
+
+/* Returns -1 if the data doesn't parse */
+static int entry_dir_list(const walk_cache_entry_t *entry, struct dirent ***dir_list, unsigned char **flags) {
+    const char *p = entry->data;
+    const char *end = entry->data + entry->record.data_len;
+    struct dirent **list;
+    uint64_t i;
+
+    if (entry->record.entries_len > entry->record.data_len) {
+        return -1;
+    }
+    list = ag_malloc((entry->record.entries_len + 1) * sizeof(struct dirent *));
+    *flags = ag_malloc(entry->record.entries_len + 1);
+    for (i = 0; i < entry->record.entries_len; i++) {
+        struct dirent *d;
+        uint64_t ino;
+        size_t name_len;
+        size_t size;
+
+        if (end - p < (ptrdiff_t)(sizeof(ino) + 3)) {
+            break;
+        }
+        name_len = strnlen(p + sizeof(ino) + 2, end - p - sizeof(ino) - 2);
+        if (p + sizeof(ino) + 2 + name_len == end || name_len == 0) {
+            break;
+        }
+        size = offsetof(struct dirent, d_name) + name_len + 1;
+        d = ag_calloc(1, size > sizeof(struct dirent) ? size : sizeof(struct dirent));
+        memcpy(&ino, p, sizeof(ino));
+        d->d_ino = (ino_t)ino;
+#ifdef HAVE_DIRENT_DTYPE
+        d->d_type = (unsigned char)p[sizeof(ino)];
+#endif
+#ifdef HAVE_DIRENT_DNAMLEN
+        d->d_namlen = name_len;
+#endif
+        (*flags)[i] = (unsigned char)p[sizeof(ino) + 1];
+        memcpy(d->d_name, p + sizeof(ino) + 2, name_len + 1);
+        list[i] = d;
+        p += sizeof(ino) + 2 + name_len + 1;
+    }
+    if (i != entry->record.entries_len) {
+        free_dir_list(list, (int)i);
+        free(*flags);
+        return -1;
+    }
+    *dir_list = list;
+    return (int)i;
+}
+
+int walk_cache_replay(walk_cache_dir_t *dir, ignores *ig, const char *base_path, const char *path, int depth,
+                      void *baton, struct dirent ***dir_list) {
+    walk_cache_record_t record;
+    walk_cache_entry_t *entry = NULL;
+    struct dirent **list;
+    unsigned char *flags;
+    int list_len;
+    int filtered = 0;
+    int i;
+
+    memset(dir, 0, sizeof(walk_cache_dir_t));
+    if (walk_cache_path == NULL) {
+        return -1;
+    }
+    if (depth == 0) {
+        dir->context = hash_str(hash_str(walk_cache_root_context, base_path ? base_path : ""), path);
+    } else if (ig->walk_context) {
+        dir->context = hash_str(ig->walk_context, ig->dirname);
+    }
+    /* Until the directory's ignore files are known */
+    ig->walk_context = 0;
+    if (dir->context == 0 || stat(path, &dir->statbuf) != 0 || !S_ISDIR(dir->statbuf.st_mode)) {
+        dir->context = 0;
+        return -1;
+    }
+
+    set_stat(&record, &dir->statbuf);
+    HASH_FIND(hh, walk_cache, &record, WALK_CACHE_KEY_LEN, entry);
+    if (entry == NULL || entry->record.mtime != record.mtime || entry->record.mtime_nsec != record.mtime_nsec ||
+        entry->record.mtime >= walk_cache_mtime || entry->record.context != dir->context) {
+        return -1;
+    }
+    dir->ignore_files = (unsigned int)entry->record.ignore_files;
+    dir->ignore_sig = ignore_files_sig(path, dir->ignore_files);
+    if (dir->ignore_sig != entry->record.ignore_sig) {
+        return -1;
+    }
+    list_len = entry_dir_list(entry, &list, &flags);
+    if (list_len < 0) {
+        return -1;
+    }
+
+    log_debug("Listing %s from the walk cache", path);
+    load_ignore_files(ig, path, dir->ignore_files);
+    ig->walk_context = dir_context(dir);
+    for (i = 0; i < list_len; i++) {
+        if (!(flags[i] & WALK_CACHE_RECHECK) || filename_filter(path, list[i], baton)) {
+            list[filtered++] = list[i];
+        } else {
+            free(list[i]);
+        }
+    }
+    free(flags);
+    entry->used = TRUE;
+    *dir_list = list;
+    return filtered;
+}
+
+void walk_cache_stat_ignore_files(walk_cache_dir_t *dir, const char *path, unsigned int ignore_files) {
+    if (dir->context == 0) {
+        return;
+    }
+    dir->ignore_files = ignore_files;
+    dir->ignore_sig = ignore_files_sig(path, ignore_files);
+}
+
+static int needs_recheck(const struct dirent *d) {
+#ifdef HAVE_DIRENT_DTYPE
+    return d->d_type == DT_LNK || d->d_type == DT_UNKNOWN;
+#else
+    (void)d;
+    return TRUE;
+#endif
+}
+
+void walk_cache_add(const walk_cache_dir_t *dir, ignores *ig, struct dirent **dir_list, int filtered_len, int dir_list_len) {
+    walk_cache_entry_t *entry;
+    size_t data_len = 0;
+    char *p;
+    int i;
+
+    if (dir->context == 0) {
+        return;
+    }
+    ig->walk_context = dir_context(dir);
+
+    for (i = 0; i < dir_list_len; i++) {
+        if (i < filtered_len || needs_recheck(dir_list[i])) {
+            data_len += sizeof(uint64_t) + 2 + strlen(dir_list[i]->d_name) + 1;
+        }
+    }
+
+    entry = ag_calloc(1, sizeof(walk_cache_entry_t));
+    entry->data = ag_malloc(data_len + 1);
+    entry->used = TRUE;
+    set_stat(&entry->record, &dir->statbuf);
+    entry->record.context = dir->context;
+    entry->record.ignore_files = dir->ignore_files;
+    entry->record.ignore_sig = dir->ignore_sig;
+    entry->record.data_len = data_len;
+
+    p = entry->data;
+    for (i = 0; i < dir_list_len; i++) {
+        uint64_t ino = (uint64_t)dir_list[i]->d_ino;
+        size_t name_len;
+        if (i >= filtered_len && !needs_recheck(dir_list[i])) {
+            continue;
+        }
+        memcpy(p, &ino, sizeof(ino));
+        p += sizeof(ino);
+#ifdef HAVE_DIRENT_DTYPE
+        *p++ = (char)dir_list[i]->d_type;
+#else
+        *p++ = 0;
+#endif
+        *p++ = needs_recheck(dir_list[i]) ? WALK_CACHE_RECHECK : 0;
+        name_len = strlen(dir_list[i]->d_name) + 1;
+        memcpy(p, dir_list[i]->d_name, name_len);
+        p += name_len;
+        entry->record.entries_len++;
+    }
+    *p = '\0';
+
+    add_entry(entry);
+    walk_cache_dirty = TRUE;
+}
@@ -0,0 +1,38 @@
+#ifndef WALK_CACHE_H
+#define WALK_CACHE_H
+
+#include <dirent.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "ignore.h"
+
+/* See cache_keep_unused() */
+#define WALK_CACHE_MAX_ENTRIES (64 * 1024)
+
+/* What search_dir knows about a directory before it lists it. The listing
+ * is only added to the cache with the stat from before it was taken. */
+typedef struct {
+    uint64_t context; /* 0 if the cache can't be used for this directory */
+    struct stat statbuf;
+    unsigned int ignore_files;
+    uint64_t ignore_sig;
+} walk_cache_dir_t;
+
+void walk_cache_load(const char *path);
+void walk_cache_save(void);
+void walk_cache_cleanup(void);
+
+/* If path hasn't changed since it was cached, loads its ignore files into ig
+ * and points *dir_list at its filtered listing. Otherwise returns -1, and
+ * path has to be listed. Not thread-safe. */
+int walk_cache_replay(walk_cache_dir_t *dir, ignores *ig, const char *base_path, const char *path, int depth,
+                      void *baton, struct dirent ***dir_list);
+/* Call before loading the ignore files found in the listing */
+void walk_cache_stat_ignore_files(walk_cache_dir_t *dir, const char *path, unsigned int ignore_files);
+/* dir_list has the filtered_len entries that were kept, then the ones that
+ * were filtered out */
+void walk_cache_add(const walk_cache_dir_t *dir, ignores *ig, struct dirent **dir_list, int filtered_len, int dir_list_len);
+
+#endif
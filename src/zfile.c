@@ -16,6 +16,7 @@ typedef _off64_t off64_t;
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "config.h"
 
@@ -28,8 +29,16 @@ typedef _off64_t off64_t;
 #ifdef HAVE_LZMA_H
 #include <lzma.h>
 #endif
+#ifdef HAVE_ZSTD_H
+#include <zstd.h>
+#endif
+#ifdef HAVE_BZLIB_H
+#include <bzlib.h>
+#endif
 
+#include "cache_file.h"
 #include "decompress.h"
+#include "util.h"
 
 #if HAVE_FOPENCOOKIE
 
@@ -58,24 +67,423 @@ struct zfile {
     uint32_t outbuf_start;
 
     ag_compression_type ctype;
+    int threads; // For .xz files
+
+#ifdef HAVE_ZLIB_H
+    gzip_index_t *index;        // Being built as a gzip file is read
+    struct stat index_statbuf;  // Of the file it's for
+    uint64_t index_member_end;  // Where the first member ended, or 0
+#endif
 
     union {
         z_stream gz;
         lzma_stream lzma;
+#ifdef HAVE_ZSTD_H
+        struct {
+            ZSTD_DStream *ds;
+            ZSTD_inBuffer in;
+            ZSTD_outBuffer out;
+        } zstd;
+#endif
+#ifdef HAVE_BZLIB_H
+        bz_stream bz;
+#endif
     } stream;
 
     uint8_t inbuf[32 * KB];
     uint8_t outbuf[256 * KB];
+    bool stream_end; // Decoder is done, outbuf may still have output
+    bool frame_done; // Decoder finished a frame, more may follow in the input
     bool eof;
 };
 
-#define CAVAIL_IN(c) ((c)->ctype == AG_GZIP ? (c)->stream.gz.avail_in : (c)->stream.lzma.avail_in)
-#define CNEXT_OUT(c) ((c)->ctype == AG_GZIP ? (c)->stream.gz.next_out : (c)->stream.lzma.next_out)
+#ifdef HAVE_ZLIB_H
+/*
+ * A gzip file is one deflate stream that can only be inflated from the
+ * start. Like zlib's zran example, the index keeps checkpoints between
+ * deflate blocks every GZIP_INDEX_SPAN of output, with the window each one
+ * needs, so the file can be inflated from several places at once. It's
+ * built the first time a file is read, and kept in the --cache-dir under
+ * the file's device and inode.
+ */
+
+#define GZIP_INDEX_MAGIC "aggzi01"
+
+typedef struct {
+    char magic[8];
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime;
+    int64_t mtime_nsec;
+    int64_t size;
+    uint64_t out_len;
+    uint64_t checkpoints_len;
+} gzip_index_header_t;
+
+static char *
+gzip_index_path(const struct stat *statbuf) {
+    char *path;
+
+    if (opts.cache_dir == NULL) {
+        return NULL;
+    }
+    ag_asprintf(&path, "%s/gzip/%llx-%llx", opts.cache_dir,
+                (unsigned long long)statbuf->st_dev, (unsigned long long)statbuf->st_ino);
+    return path;
+}
+
+static void
+gzip_index_header_init(gzip_index_header_t *header, const struct stat *statbuf) {
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, GZIP_INDEX_MAGIC, sizeof(header->magic));
+    header->dev = (uint64_t)statbuf->st_dev;
+    header->ino = (uint64_t)statbuf->st_ino;
+    header->mtime = (int64_t)statbuf->st_mtime;
+#ifdef HAVE_STAT_MTIM
+    header->mtime_nsec = (int64_t)statbuf->st_mtim.tv_nsec;
+#endif
+    header->size = (int64_t)statbuf->st_size;
+}
+
+void
+gzip_index_free(gzip_index_t *index) {
+    if (index == NULL) {
+        return;
+    }
+    free(index->checkpoints);
+    free(index);
+}
+
+gzip_index_t *
+gzip_index_load(const struct stat *statbuf) {
+    gzip_index_header_t header;
+    gzip_index_header_t expected;
+    gzip_index_t *index = NULL;
+    cache_file_t cf;
+    char *path;
+    size_t i;
+
+    path = gzip_index_path(statbuf);
+    if (path == NULL) {
+        return NULL;
+    }
+    if (!cache_file_open(&cf, "gzip index", path, GZIP_INDEX_MAGIC, &header, sizeof(header))) {
+        free(path);
+        return NULL;
+    }
+
+    gzip_index_header_init(&expected, statbuf);
+    if (header.dev != expected.dev || header.ino != expected.ino || header.mtime != expected.mtime ||
+        header.mtime_nsec != expected.mtime_nsec || header.size != expected.size) {
+        log_debug("Ignoring gzip index %s: the file changed since it was made", path);
+        goto out;
+    }
+    if (header.checkpoints_len == 0 || header.checkpoints_len > header.out_len / GZIP_INDEX_SPAN ||
+        header.checkpoints_len > cf.left / sizeof(gzip_checkpoint_t)) {
+        log_debug("Ignoring gzip index %s: bad header", path);
+        goto out;
+    }
+
+    index = ag_calloc(1, sizeof(gzip_index_t));
+    index->out_len = header.out_len;
+    index->checkpoints_len = header.checkpoints_len;
+    index->checkpoints = ag_malloc(index->checkpoints_len * sizeof(gzip_checkpoint_t));
+    if (!cache_file_read(&cf, index->checkpoints, index->checkpoints_len * sizeof(gzip_checkpoint_t))) {
+        log_debug("Ignoring gzip index %s: it's truncated", path);
+        gzip_index_free(index);
+        index = NULL;
+        goto out;
+    }
+    for (i = 0; i < index->checkpoints_len; i++) {
+        const gzip_checkpoint_t *cp = &index->checkpoints[i];
+        const gzip_checkpoint_t *prev = i > 0 ? &index->checkpoints[i - 1] : NULL;
+        if (cp->in == 0 || cp->in > (uint64_t)header.size || cp->bits > 7 || cp->window_len > GZIP_WINDOW_SIZE ||
+            cp->out >= index->out_len || (prev && (cp->out <= prev->out || cp->in <= prev->in))) {
+            log_debug("Ignoring gzip index %s: bad checkpoint %lu", path, (unsigned long)i);
+            gzip_index_free(index);
+            index = NULL;
+            goto out;
+        }
+    }
+    log_debug("Loaded gzip index %s: %lu checkpoints", path, (unsigned long)index->checkpoints_len);
+
+out:
+    cache_file_close(&cf);
+    free(path);
+    return index;
+}
+
+static void
+gzip_index_save(const gzip_index_t *index, const struct stat *statbuf) {
+    gzip_index_header_t header;
+    cache_file_t cf;
+    char *path;
+
+    path = gzip_index_path(statbuf);
+    if (path == NULL) {
+        return;
+    }
+    if (!cache_file_create(&cf, "gzip index", path)) {
+        free(path);
+        return;
+    }
+
+    gzip_index_header_init(&header, statbuf);
+    header.out_len = index->out_len;
+    header.checkpoints_len = index->checkpoints_len;
+    fwrite(&header, sizeof(header), 1, cf.fp);
+    fwrite(index->checkpoints, sizeof(gzip_checkpoint_t), index->checkpoints_len, cf.fp);
+
+    if (cache_file_commit(&cf)) {
+        log_debug("Saved gzip index %s: %lu checkpoints", path, (unsigned long)index->checkpoints_len);
+    }
+    free(path);
+}
+
+/*
+ * Called after each inflate() while indexing, which stops between deflate
+ * blocks. Adds a checkpoint if it's been long enough since the last one.
+ */
+static void
+zfile_gzip_checkpoint(struct zfile *cookie, int ret) {
+    z_stream *stream = &cookie->stream.gz;
+    gzip_index_t *index = cookie->index;
+    gzip_checkpoint_t *cp;
+    uint64_t last_out;
+    uInt window_len;
+
+    if (ret == Z_STREAM_END) {
+        index->out_len = stream->total_out;
+        cookie->index_member_end = stream->total_in;
+        return;
+    }
+    /* Bit 7 means it stopped at the end of a block, bit 6 that it's the last one */
+    if (!(stream->data_type & 128) || (stream->data_type & 64)) {
+        return;
+    }
+    last_out = index->checkpoints_len > 0 ? index->checkpoints[index->checkpoints_len - 1].out : 0;
+    if (stream->total_out - last_out < GZIP_INDEX_SPAN) {
+        return;
+    }
+
+    index->checkpoints = ag_realloc(index->checkpoints, (index->checkpoints_len + 1) * sizeof(gzip_checkpoint_t));
+    cp = &index->checkpoints[index->checkpoints_len++];
+    memset(cp, 0, sizeof(*cp));
+    cp->out = stream->total_out;
+    cp->in = stream->total_in;
+    cp->bits = stream->data_type & 7;
+    window_len = GZIP_WINDOW_SIZE;
+    inflateGetDictionary(stream, cp->window, &window_len);
+    cp->window_len = window_len;
+}
+
+/*
+ * Saves the index if the whole file was read, and it's a single member
+ * worth indexing.
+ */
+static void
+zfile_gzip_index_finish(struct zfile *cookie) {
+    unsigned char magic[2];
+    gzip_index_t *index = cookie->index;
+
+    if (cookie->index_member_end == 0) {
+        log_debug("Not saving a gzip index: the file wasn't read to the end");
+    } else if (cookie->index_member_end < (uint64_t)cookie->index_statbuf.st_size &&
+               pread(fileno(cookie->in), magic, 2, cookie->index_member_end) == 2 &&
+               magic[0] == 0x1F && magic[1] == 0x8B) {
+        log_debug("Not saving a gzip index: the file has several members");
+    } else if (index->checkpoints_len == 0) {
+        log_debug("Not saving a gzip index: the file is too small");
+    } else {
+        gzip_index_save(index, &cookie->index_statbuf);
+    }
+    gzip_index_free(index);
+    cookie->index = NULL;
+}
+#endif
+
+static size_t
+zfile_avail_in(const struct zfile *cookie) {
+    switch (cookie->ctype) {
+#ifdef HAVE_ZSTD_H
+        case AG_ZSTD:
+            return cookie->stream.zstd.in.size - cookie->stream.zstd.in.pos;
+#endif
+#ifdef HAVE_BZLIB_H
+        case AG_BZIP2:
+            return cookie->stream.bz.avail_in;
+#endif
+        case AG_XZ:
+            return cookie->stream.lzma.avail_in;
+        default:
+            return cookie->stream.gz.avail_in;
+    }
+}
+
+static uint8_t *
+zfile_next_out(const struct zfile *cookie) {
+    switch (cookie->ctype) {
+#ifdef HAVE_ZSTD_H
+        case AG_ZSTD:
+            return (uint8_t *)cookie->stream.zstd.out.dst + cookie->stream.zstd.out.pos;
+#endif
+#ifdef HAVE_BZLIB_H
+        case AG_BZIP2:
+            return (uint8_t *)cookie->stream.bz.next_out;
+#endif
+        case AG_XZ:
+            return (uint8_t *)cookie->stream.lzma.next_out;
+        default:
+            return (uint8_t *)cookie->stream.gz.next_out;
+    }
+}
+
+static void
+zfile_set_in(struct zfile *cookie, size_t nb) {
+    switch (cookie->ctype) {
+#ifdef HAVE_ZSTD_H
+        case AG_ZSTD:
+            cookie->stream.zstd.in.src = cookie->inbuf;
+            cookie->stream.zstd.in.size = nb;
+            cookie->stream.zstd.in.pos = 0;
+            break;
+#endif
+#ifdef HAVE_BZLIB_H
+        case AG_BZIP2:
+            cookie->stream.bz.next_in = (char *)cookie->inbuf;
+            cookie->stream.bz.avail_in = nb;
+            break;
+#endif
+        case AG_XZ:
+            cookie->stream.lzma.next_in = cookie->inbuf;
+            cookie->stream.lzma.avail_in = nb;
+            break;
+        default:
+            cookie->stream.gz.next_in = cookie->inbuf;
+            cookie->stream.gz.avail_in = nb;
+            break;
+    }
+}
+
+static void
+zfile_reset_out(struct zfile *cookie) {
+    switch (cookie->ctype) {
+#ifdef HAVE_ZSTD_H
+        case AG_ZSTD:
+            cookie->stream.zstd.out.dst = cookie->outbuf;
+            cookie->stream.zstd.out.size = sizeof cookie->outbuf;
+            cookie->stream.zstd.out.pos = 0;
+            break;
+#endif
+#ifdef HAVE_BZLIB_H
+        case AG_BZIP2:
+            cookie->stream.bz.next_out = (char *)cookie->outbuf;
+            cookie->stream.bz.avail_out = sizeof cookie->outbuf;
+            break;
+#endif
+        case AG_XZ:
+            cookie->stream.lzma.next_out = cookie->outbuf;
+            cookie->stream.lzma.avail_out = sizeof cookie->outbuf;
+            break;
+        default:
+            cookie->stream.gz.next_out = cookie->outbuf;
+            cookie->stream.gz.avail_out = sizeof cookie->outbuf;
+            break;
+    }
+    cookie->outbuf_start = 0;
+}
+
+/*
+ * Decode as much of the input as fits in outbuf.  Returns 0, or -1 on
+ * error.
+ */
+static int
+zfile_decode(struct zfile *cookie) {
+    int ret;
+    lzma_ret lzret;
+#ifdef HAVE_ZSTD_H
+    size_t zret;
+#endif
+
+    switch (cookie->ctype) {
+        case AG_GZIP:
+            /* Another member can follow. Like gzip, ignore anything else. */
+            if (cookie->frame_done && cookie->stream.gz.avail_in > 0 &&
+                cookie->stream.gz.next_in[0] != 0x1F) {
+                cookie->stream_end = true;
+                break;
+            }
+            /* Indexing stops at each block to see if it's time for a checkpoint */
+            ret = inflate(&cookie->stream.gz, cookie->index != NULL ? Z_BLOCK : Z_NO_FLUSH);
+            if (ret != Z_OK && ret != Z_STREAM_END) {
+                log_err("Found mem/data error while decompressing zlib stream: %s", zError(ret));
+                return -1;
+            }
+            if (cookie->index != NULL && !cookie->frame_done && cookie->index_member_end == 0) {
+                zfile_gzip_checkpoint(cookie, ret);
+            }
+            cookie->frame_done = ret == Z_STREAM_END;
+            if (cookie->frame_done) {
+                inflateReset(&cookie->stream.gz);
+            }
+            break;
+        case AG_XZ:
+            lzret = lzma_code(&cookie->stream.lzma, LZMA_RUN);
+            if (lzret != LZMA_OK && lzret != LZMA_STREAM_END) {
+                log_err("Found mem/data error while decompressing xz/lzma stream: %d", lzret);
+                return -1;
+            }
+            cookie->stream_end = lzret == LZMA_STREAM_END;
+            break;
+#ifdef HAVE_ZSTD_H
+        case AG_ZSTD:
+            /* Goes straight on to the next frame if there is one */
+            zret = ZSTD_decompressStream(cookie->stream.zstd.ds, &cookie->stream.zstd.out, &cookie->stream.zstd.in);
+            if (ZSTD_isError(zret)) {
+                log_err("Found data error while decompressing zstd stream: %s", ZSTD_getErrorName(zret));
+                return -1;
+            }
+            cookie->frame_done = zret == 0;
+            break;
+#endif
+#ifdef HAVE_BZLIB_H
+        case AG_BZIP2:
+            ret = BZ2_bzDecompress(&cookie->stream.bz);
+            if (ret != BZ_OK && ret != BZ_STREAM_END) {
+                log_err("Found data error while decompressing bzip2 stream: %d", ret);
+                return -1;
+            }
+            cookie->frame_done = ret == BZ_STREAM_END;
+            if (cookie->frame_done) {
+                /* pbzip2 and cat write several streams to a file */
+                char *next_in = cookie->stream.bz.next_in;
+                unsigned int avail_in = cookie->stream.bz.avail_in;
+                char *next_out = cookie->stream.bz.next_out;
+                unsigned int avail_out = cookie->stream.bz.avail_out;
+                BZ2_bzDecompressEnd(&cookie->stream.bz);
+                memset(&cookie->stream.bz, 0, sizeof cookie->stream.bz);
+                if (BZ2_bzDecompressInit(&cookie->stream.bz, 0, 0) != BZ_OK) {
+                    log_err("Unable to initialize bzip2");
+                    return -1;
+                }
+                cookie->stream.bz.next_in = next_in;
+                cookie->stream.bz.avail_in = avail_in;
+                cookie->stream.bz.next_out = next_out;
+                cookie->stream.bz.avail_out = avail_out;
+            }
+            break;
+#endif
+        default:
+            return -1;
+    }
+    return 0;
+}
 
 static int
 zfile_cookie_init(struct zfile *cookie) {
 #ifdef HAVE_LZMA_H
     lzma_ret lzrc;
+    size_t nb;
 #endif
     int rc;
 
@@ -97,21 +505,52 @@ zfile_cookie_init(struct zfile *cookie) {
             cookie->stream.gz.avail_in = 0;
             cookie->stream.gz.next_out = cookie->outbuf;
             cookie->stream.gz.avail_out = sizeof cookie->outbuf;
+            if (cookie->index != NULL) {
+                /* Rewound. Start over. */
+                cookie->index->checkpoints_len = 0;
+                cookie->index_member_end = 0;
+            }
             break;
 #endif
 #ifdef HAVE_LZMA_H
         case AG_XZ:
             cookie->stream.lzma = (lzma_stream)LZMA_STREAM_INIT;
-            lzrc = lzma_auto_decoder(&cookie->stream.lzma, -1, 0);
+            /* The decoder depends on whether it's .xz or .lzma */
+            nb = fread(cookie->inbuf, 1, sizeof cookie->inbuf, cookie->in);
+            lzrc = decompress_lzma_init(&cookie->stream.lzma, cookie->inbuf, nb, cookie->threads);
             if (lzrc != LZMA_OK) {
-                log_err("Unable to initialize lzma_auto_decoder: %d", lzrc);
+                log_err("Unable to initialize lzma decoder: %d", lzrc);
                 return EIO;
             }
-            cookie->stream.lzma.next_in = NULL;
-            cookie->stream.lzma.avail_in = 0;
+            cookie->stream.lzma.next_in = cookie->inbuf;
+            cookie->stream.lzma.avail_in = nb;
             cookie->stream.lzma.next_out = cookie->outbuf;
             cookie->stream.lzma.avail_out = sizeof cookie->outbuf;
             break;
+#endif
+#ifdef HAVE_ZSTD_H
+        case AG_ZSTD:
+            memset(&cookie->stream.zstd, 0, sizeof cookie->stream.zstd);
+            cookie->stream.zstd.ds = ZSTD_createDStream();
+            if (cookie->stream.zstd.ds == NULL) {
+                log_err("Unable to initialize zstd");
+                return EIO;
+            }
+            cookie->stream.zstd.out.dst = cookie->outbuf;
+            cookie->stream.zstd.out.size = sizeof cookie->outbuf;
+            break;
+#endif
+#ifdef HAVE_BZLIB_H
+        case AG_BZIP2:
+            memset(&cookie->stream.bz, 0, sizeof cookie->stream.bz);
+            rc = BZ2_bzDecompressInit(&cookie->stream.bz, 0, 0);
+            if (rc != BZ_OK) {
+                log_err("Unable to initialize bzip2: %d", rc);
+                return EIO;
+            }
+            cookie->stream.bz.next_out = (char *)cookie->outbuf;
+            cookie->stream.bz.avail_out = sizeof cookie->outbuf;
+            break;
 #endif
         default:
             log_err("Unsupported compression type: %d", cookie->ctype);
@@ -120,6 +559,8 @@ zfile_cookie_init(struct zfile *cookie) {
 
 
     cookie->outbuf_start = 0;
+    cookie->stream_end = false;
+    cookie->frame_done = false;
     cookie->eof = false;
     return 0;
 }
@@ -136,6 +577,16 @@ zfile_cookie_cleanup(struct zfile *cookie) {
         case AG_XZ:
             lzma_end(&cookie->stream.lzma);
             break;
+#endif
+#ifdef HAVE_ZSTD_H
+        case AG_ZSTD:
+            ZSTD_freeDStream(cookie->stream.zstd.ds);
+            break;
+#endif
+#ifdef HAVE_BZLIB_H
+        case AG_BZIP2:
+            BZ2_bzDecompressEnd(&cookie->stream.bz);
+            break;
 #endif
         default:
             /* Compiler false positive - unreachable. */
@@ -148,7 +599,7 @@ zfile_cookie_cleanup(struct zfile *cookie) {
  * read-only stream.
  */
 FILE *
-decompress_open(int fd, const char *mode, ag_compression_type ctype) {
+decompress_open(int fd, const char *mode, ag_compression_type ctype, int threads, const struct stat *index_statbuf) {
     struct zfile *cookie;
     FILE *res, *in;
     int error;
@@ -179,6 +630,15 @@ decompress_open(int fd, const char *mode, ag_compression_type ctype) {
     cookie->logic_offset = 0;
     cookie->decode_offset = 0;
     cookie->ctype = ctype;
+    cookie->threads = threads;
+#ifdef HAVE_ZLIB_H
+    cookie->index = NULL;
+    cookie->index_member_end = 0;
+    if (index_statbuf != NULL && ctype == AG_GZIP && opts.cache_dir != NULL) {
+        cookie->index = ag_calloc(1, sizeof(gzip_index_t));
+        cookie->index_statbuf = *index_statbuf;
+    }
+#endif
 
     error = zfile_cookie_init(cookie);
     if (error != 0) {
@@ -192,8 +652,12 @@ out:
     if (res == NULL) {
         if (in != NULL)
             fclose(in);
-        if (cookie != NULL)
+        if (cookie != NULL) {
+#ifdef HAVE_ZLIB_H
+            gzip_index_free(cookie->index);
+#endif
             free(cookie);
+        }
     }
     return res;
 }
@@ -207,8 +671,6 @@ zfile_read(void *cookie_, char *buf, size_t size) {
     struct zfile *cookie = cookie_;
     size_t nb, ignorebytes;
     ssize_t total = 0;
-    lzma_ret lzret;
-    int ret;
 
     assert(size <= SSIZE_MAX);
 
@@ -218,9 +680,6 @@ zfile_read(void *cookie_, char *buf, size_t size) {
     if (cookie->eof)
         return 0;
 
-    ret = Z_OK;
-    lzret = LZMA_OK;
-
     ignorebytes = cookie->logic_offset - cookie->decode_offset;
     assert(ignorebytes == 0);
 
@@ -228,9 +687,9 @@ zfile_read(void *cookie_, char *buf, size_t size) {
         size_t inflated;
 
         /* Drain output buffer first */
-        while (CNEXT_OUT(cookie) >
+        while (zfile_next_out(cookie) >
                &cookie->outbuf[cookie->outbuf_start]) {
-            size_t left = CNEXT_OUT(cookie) -
+            size_t left = zfile_next_out(cookie) -
                           &cookie->outbuf[cookie->outbuf_start];
             size_t ignoreskip = min(ignorebytes, left);
             size_t toread;
@@ -269,17 +728,16 @@ zfile_read(void *cookie_, char *buf, size_t size) {
 		 * If we have not satisfied read, the output buffer must be
 		 * empty.
 		 */
-        assert(cookie->stream.gz.next_out ==
+        assert(zfile_next_out(cookie) ==
                &cookie->outbuf[cookie->outbuf_start]);
 
-        if ((cookie->ctype == AG_XZ && lzret == LZMA_STREAM_END) ||
-            (cookie->ctype == AG_GZIP && ret == Z_STREAM_END)) {
+        if (cookie->stream_end) {
             cookie->eof = true;
             break;
         }
 
         /* Read more input if empty */
-        if (CAVAIL_IN(cookie) == 0) {
+        if (zfile_avail_in(cookie) == 0) {
             nb = fread(cookie->inbuf, 1, sizeof cookie->inbuf,
                        cookie->in);
             if (ferror(cookie->in)) {
@@ -287,42 +745,24 @@ zfile_read(void *cookie_, char *buf, size_t size) {
                 exit(1);
             }
             if (nb == 0 && feof(cookie->in)) {
+                /* Formats that allow several frames end at any of them */
+                if (cookie->frame_done) {
+                    cookie->eof = true;
+                    break;
+                }
                 warn("truncated file");
                 exit(1);
             }
-            if (cookie->ctype == AG_XZ) {
-                cookie->stream.lzma.avail_in = nb;
-                cookie->stream.lzma.next_in = cookie->inbuf;
-            } else {
-                cookie->stream.gz.avail_in = nb;
-                cookie->stream.gz.next_in = cookie->inbuf;
-            }
+            zfile_set_in(cookie, nb);
         }
 
         /* Reset stream state to beginning of output buffer */
-        if (cookie->ctype == AG_XZ) {
-            cookie->stream.lzma.next_out = cookie->outbuf;
-            cookie->stream.lzma.avail_out = sizeof cookie->outbuf;
-        } else {
-            cookie->stream.gz.next_out = cookie->outbuf;
-            cookie->stream.gz.avail_out = sizeof cookie->outbuf;
-        }
-        cookie->outbuf_start = 0;
+        zfile_reset_out(cookie);
 
-        if (cookie->ctype == AG_GZIP) {
-            ret = inflate(&cookie->stream.gz, Z_NO_FLUSH);
-            if (ret != Z_OK && ret != Z_STREAM_END) {
-                log_err("Found mem/data error while decompressing zlib stream: %s", zError(ret));
-                return -1;
-            }
-        } else {
-            lzret = lzma_code(&cookie->stream.lzma, LZMA_RUN);
-            if (lzret != LZMA_OK && lzret != LZMA_STREAM_END) {
-                log_err("Found mem/data error while decompressing xz/lzma stream: %d", lzret);
-                return -1;
-            }
+        if (zfile_decode(cookie) != 0) {
+            return -1;
         }
-        inflated = CNEXT_OUT(cookie) - &cookie->outbuf[0];
+        inflated = zfile_next_out(cookie) - &cookie->outbuf[0];
         cookie->actual_len += inflated;
     } while (!ferror(cookie->in) && size > 0);
 
@@ -393,6 +833,11 @@ static int
 zfile_close(void *cookie_) {
     struct zfile *cookie = cookie_;
 
+#ifdef HAVE_ZLIB_H
+    if (cookie->index != NULL) {
+        zfile_gzip_index_finish(cookie);
+    }
+#endif
     zfile_cookie_cleanup(cookie);
     fclose(cookie->in);
     free(cookie);
@@ -0,0 +1,19 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ printf 'foo\nbar\n' > ./a.txt
+  $ printf 'foo\n' > ./b.txt
+
+Throttling doesn't change results:
+
+  $ ag --background --max-read-rate 1M --max-active-workers 1 foo | sort
+  a.txt:1:foo
+  b.txt:1:foo
+  $ ag --max-read-rate 64K --nommap -c foo a.txt
+  1
+
+Bad rates are rejected:
+
+  $ ag --max-read-rate 10X foo
+  ERR: Invalid read rate 10X. Use a number of bytes, optionally ending in K, M or G.
+  [1]
@@ -0,0 +1,39 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ printf 'hello\n' > ./a.txt
+  $ printf 'hello\n' > ./b.PNG
+  $ printf 'hello\n' > ./c.o
+  $ printf 'hello\0\n' > ./d.dump
+
+Files with binary extensions aren't searched:
+
+  $ ag hello
+  a.txt:1:hello
+
+The list can be changed:
+
+  $ ag --text-ext png,o hello | sort
+  a.txt:1:hello
+  b.PNG:1:hello
+  c.o:1:hello
+  $ ag --binary-ext txt hello
+  [1]
+
+Named files and --search-binary ignore the list:
+
+  $ ag hello c.o
+  1:hello
+  $ ag --search-binary hello | sort
+  Binary file d.dump matches.
+  a.txt:1:hello
+  b.PNG:1:hello
+  c.o:1:hello
+
+The binary cache remembers d.dump:
+
+  $ ag --binary-cache --cache-dir ./cache hello
+  a.txt:1:hello
+  $ test -s ./cache/binary
+  $ ag -D --binary-cache --cache-dir ./cache hello 2>&1 | grep "binary cache says"
+  DEBUG: Skipping ./d.dump: binary cache says it's binary.
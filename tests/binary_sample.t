@@ -0,0 +1,17 @@
+Setup. A file that only looks binary after its first 512 bytes:
+
+  $ . $TESTDIR/setup.sh
+  $ awk 'BEGIN { for (i = 0; i < 20; i++) print "text header line number " i }' > ./gen.dat
+  $ printf 'needle\0\0\0\0\0\0\0\0\n' >> ./gen.dat
+
+The default sample sees only the header:
+
+  $ ag -c needle gen.dat
+  1
+
+A bigger sample finds the NUL bytes, with mmap or read:
+
+  $ ag -c --binary-sample 4096 needle gen.dat
+  [1]
+  $ ag -c --nommap --binary-sample 4096 needle gen.dat
+  [1]
@@ -19,8 +19,7 @@ Count stream matches:
   $ printf 'blah blah blah\n' | ag --count blah
   3
 
-Count stream matches per line (not very useful since it does not print zero):
+Count stream matches over the whole stream:
 
   $ cat blah.txt | ag --count blah
-  1
-  1
+  2
@@ -13,3 +13,9 @@ Match only top file type:
   $ TEST_FILETYPE_OPTION=`ag --list-file-types | grep -E '^[ \t]+--.+' | head -n 1 | awk '{ print $1 }'`
   $ ag --nofilename $TEST_FILETYPE_OPTION 'This is filetype test' $TEST_FILETYPE_DIR
   This is filetype test1.
+
+File types and -g both apply:
+
+  $ printf "This is filetype test3.\n" > $TEST_FILETYPE_DIR/other.$TEST_FILETYPE_EXT1
+  $ ag $TEST_FILETYPE_OPTION -g other $TEST_FILETYPE_DIR
+  filetype_test/other.* (glob)
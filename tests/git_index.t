@@ -0,0 +1,27 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ export HOME=$PWD GIT_CONFIG_NOSYSTEM=1
+  $ git init -q .
+  $ printf '*.log\n' > .gitignore
+  $ printf 'hello\n' > tracked.txt
+  $ printf 'hello\n' > forced.log
+  $ printf 'hello\n' > ignored.log
+  $ touch -t 202001010000 .gitignore tracked.txt forced.log
+  $ git add .gitignore tracked.txt && git add -f forced.log
+  $ printf 'hello\n' > untracked.txt
+
+Tracked files are searched even if they're ignored:
+
+  $ ag --git-index -l hello | sort
+  forced.log
+  tracked.txt
+  untracked.txt
+
+Only tracked files that were modified:
+
+  $ ag --git-changed -l hello
+  [1]
+  $ printf 'hello again\n' > tracked.txt
+  $ ag --git-changed hello
+  tracked.txt:1:hello again
@@ -0,0 +1,31 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ printf 'hello\n' > ./a.txt
+  $ printf 'hello\n' > ./b.log
+  $ printf 'hello\n' > ./c.tmp
+  $ printf '*.log\n*.log\n' > ./.ignore
+
+Repeated patterns are only added once:
+
+  $ ag -D hello 2>&1 | grep -c "added ignore pattern \*.log"
+  1
+
+The ignore cache remembers the parsed .ignore:
+
+  $ ag --ignore-cache --cache-dir ./cache hello | sort
+  a.txt:1:hello
+  c.tmp:1:hello
+  $ test -s ./cache/ignore
+  $ ag -D --ignore-cache --cache-dir ./cache hello 2>&1 | grep "from the ignore cache"
+  DEBUG: Loading ignore file ./.ignore from the ignore cache.
+  $ ag --ignore-cache --cache-dir ./cache hello | sort
+  a.txt:1:hello
+  c.tmp:1:hello
+
+Changing the file invalidates it:
+
+  $ printf '*.tmp\n' > ./.ignore
+  $ ag --ignore-cache --cache-dir ./cache hello | sort
+  a.txt:1:hello
+  b.log:1:hello
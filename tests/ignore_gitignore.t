@@ -10,3 +10,12 @@ Test that the ignore pattern got picked up:
   $ ag --debug . | grep PATTERN_MARKER
   DEBUG: added ignore pattern PATTERN_MARKER to root ignores
 
+
+The repository's config and included files are read too:
+
+  $ mkdir -p repo/.git
+  $ printf '[include]\n\tpath = ../excludes.inc\n' > repo/.git/config
+  $ printf '[core]\n\texcludesFile = "~/repo ignore"\n' > repo/excludes.inc
+  $ printf 'REPO_MARKER\n' > 'repo ignore'
+  $ cd repo && ag --debug . | grep MARKER
+  DEBUG: added ignore pattern REPO_MARKER to root ignores
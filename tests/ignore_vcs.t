@@ -17,3 +17,12 @@ Ignore .gitignore patterns but not .ignore patterns:
   $ ag -U whatever . | sort
   always.txt:1:whatever1
   git.txt:1:whatever2
+
+Obey .git/info/exclude at the root of a repository:
+
+  $ mkdir -p ./repo/.git/info ./repo/sub
+  $ printf 'whatever4\n' > ./repo/excluded.txt
+  $ printf 'whatever5\n' > ./repo/sub/kept.txt
+  $ printf 'excluded.txt\n' > ./repo/.git/info/exclude
+  $ ag whatever repo
+  repo/sub/kept.txt:1:whatever5
@@ -0,0 +1,24 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ printf 'foo\n' > ./a.txt
+  $ printf 'foo\n' > ./b.txt
+  $ printf 'bar\n' > ./c.txt
+
+Sorting by inode still searches every file:
+
+  $ ag --layout-order inode foo . | sort
+  a.txt:1:foo
+  b.txt:1:foo
+
+A tiny window flushes files as they're found:
+
+  $ ag --layout-order extent --layout-window 1 foo . | sort
+  a.txt:1:foo
+  b.txt:1:foo
+
+Unknown orders are rejected:
+
+  $ ag --layout-order random foo .
+  ERR: Unknown layout order random. Use inode, extent or none.
+  [1]
@@ -0,0 +1,36 @@
+Setup. Make a file bigger than one --low-cache window, with matches on
+both sides of the window boundaries:
+
+  $ . $TESTDIR/setup.sh
+  $ awk 'BEGIN { for (i = 1; i <= 600000; i++) { if (i % 65536 == 0) print "hello " i; else print "abcdefghijklmnopqrstuvwxyz0123" } }' > ./big.txt
+  $ ag -C 2 hello big.txt > ./expected.txt
+  $ wc -l < ./expected.txt
+  \s*53 (re)
+
+Windowed mmap gives the same results:
+
+  $ ag --low-cache -C 2 hello big.txt | diff ./expected.txt -
+
+So do windowed reads:
+
+  $ ag --low-cache --nommap -C 2 hello big.txt | diff ./expected.txt -
+  $ ag --direct-io -C 2 hello big.txt | diff ./expected.txt -
+
+Counts and inverted matches carry over between windows:
+
+  $ ag --low-cache --count hello big.txt
+  9
+  $ ag --low-cache --count -v hello big.txt
+  10
+
+Multiline matches can cross a window boundary:
+
+  $ awk 'BEGIN { for (i = 1; i <= 300000; i++) { if (i == 270600) print "foo"; else if (i == 270601) print "yyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyy"; else if (i == 270602) print "bar"; else print "abcdefghijklmnopqrstuvwxyz0123" } }' > ./cross.txt
+  $ ag --low-cache --numbers 'foo\n.*\nbar' cross.txt
+  270600:foo
+  270601:yyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyy
+  270602:bar
+  $ ag --low-cache --nommap --numbers 'foo\n.*\nbar' cross.txt
+  270600:foo
+  270601:yyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyy
+  270602:bar
@@ -0,0 +1,50 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ mkdir -p ./cache
+  $ printf 'foo\nbar\nfoo bar\n' > ./a.txt
+  $ printf 'bar\n' > ./b.txt
+  $ touch -d '1 hour ago' ./a.txt ./b.txt
+
+Unchanged files use the matches from the result cache:
+
+  $ ag --result-cache --cache-dir ./cache foo | sort
+  a.txt:1:foo
+  a.txt:3:foo bar
+  $ test -s ./cache/results
+  $ ag -D --result-cache --cache-dir ./cache foo 2>&1 | grep "from the result cache" | sort
+  DEBUG: Using matches in ./a.txt from the result cache
+  DEBUG: Using matches in ./b.txt from the result cache
+  $ ag --result-cache --cache-dir ./cache foo | sort
+  a.txt:1:foo
+  a.txt:3:foo bar
+  $ ag --result-cache --cache-dir ./cache -c foo
+  a.txt:2
+  $ ag --result-cache --cache-dir ./cache -L foo
+  b.txt
+
+Other queries don't use the same entries:
+
+  $ ag -D --result-cache --cache-dir ./cache -w fo 2>&1 | grep -c "from the result cache"
+  0
+  [1]
+  $ ag --result-cache --cache-dir ./cache -w fo
+  [1]
+
+Editing a file changes its size and mtime:
+
+  $ printf 'foo\n' >> ./b.txt
+  $ touch -d '1 hour ago' ./b.txt
+  $ ag --result-cache --cache-dir ./cache foo | sort
+  a.txt:1:foo
+  a.txt:3:foo bar
+  b.txt:2:foo
+
+Files changed in the last second aren't cached:
+
+  $ printf 'foo\n' > ./c.txt
+  $ ag --result-cache --cache-dir ./cache foo c.txt
+  1:foo
+  $ ag -D --result-cache --cache-dir ./cache foo c.txt 2>&1 | grep -c "from the result cache"
+  0
+  [1]
@@ -0,0 +1,66 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  > if ! command -v zip > /dev/null; then
+  > echo "No zip. Skipping test."
+  > exit 80
+  > fi
+  $ mkdir -p src/a_directory_with_a_name_long_enough/to_push_the_path_of_the_file_in_it/over_the_tar_limit
+  $ printf 'hello one\nnope\n' > src/one.txt
+  $ printf 'nothing\n' > src/none.txt
+  $ printf 'nope\nhello deep\n' > src/a_directory_with_a_name_long_enough/to_push_the_path_of_the_file_in_it/over_the_tar_limit/deep.txt
+  $ (cd src && zip -q -r ../files.zip one.txt none.txt a_directory_with_a_name_long_enough)
+  $ (cd src && tar cf ../files.tar one.txt none.txt a_directory_with_a_name_long_enough)
+  $ gzip -c files.tar > ./files.tar.gz
+  $ xz -c files.tar > ./files.tar.xz
+
+Matches in a zip archive are printed with the member they're in:
+
+  $ ag -z hello files.zip | sort
+  files.zip:a_directory_with_a_name_long_enough/to_push_the_path_of_the_file_in_it/over_the_tar_limit/deep.txt:2:hello deep
+  files.zip:one.txt:1:hello one
+  $ ag -z -l hello files.zip | sort
+  files.zip:a_directory_with_a_name_long_enough/to_push_the_path_of_the_file_in_it/over_the_tar_limit/deep.txt
+  files.zip:one.txt
+  $ ag -z -L hello files.zip
+  files.zip:none.txt
+  $ ag -z -c hello files.zip | sort
+  files.zip:a_directory_with_a_name_long_enough/to_push_the_path_of_the_file_in_it/over_the_tar_limit/deep.txt:1
+  files.zip:one.txt:1
+
+Tar members are searched in order, compressed or not:
+
+  $ ag -z hello files.tar
+  files.tar:one.txt:1:hello one
+  files.tar:a_directory_with_a_name_long_enough/to_push_the_path_of_the_file_in_it/over_the_tar_limit/deep.txt:2:hello deep
+  $ ag -z hello files.tar.gz
+  files.tar.gz:one.txt:1:hello one
+  files.tar.gz:a_directory_with_a_name_long_enough/to_push_the_path_of_the_file_in_it/over_the_tar_limit/deep.txt:2:hello deep
+  $ ag -z hello files.tar.xz
+  files.tar.xz:one.txt:1:hello one
+  files.tar.xz:a_directory_with_a_name_long_enough/to_push_the_path_of_the_file_in_it/over_the_tar_limit/deep.txt:2:hello deep
+
+Archives are found when searching a directory too:
+
+  $ ag -z -l 'hello one' . | sort
+  files.tar.gz:one.txt
+  files.tar.xz:one.txt
+  files.tar:one.txt
+  files.zip:one.txt
+  src/one.txt
+
+Without -z, archives are binary:
+
+  $ ag -l 'hello one' .
+  src/one.txt
+
+A member whose size in the zip directory can't be right is skipped before
+anything is allocated for it:
+
+  $ cp files.zip bad.zip
+  $ off=$(grep -obUaP 'PK\x01\x02' bad.zip | head -1 | cut -d: -f1)
+  $ printf '\377\377\377\177' | dd of=bad.zip bs=1 seek=$((off + 24)) conv=notrunc 2> /dev/null
+  $ ag -z hello bad.zip 2>&1 > /dev/null
+  ERR: Skipping bad.zip:one.txt: Bad zip member size
+  $ ag -z -l hello bad.zip 2> /dev/null
+  bad.zip:a_directory_with_a_name_long_enough/to_push_the_path_of_the_file_in_it/over_the_tar_limit/deep.txt
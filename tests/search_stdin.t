@@ -7,3 +7,16 @@ Feed blah.txt from stdin:
 
   $ ag 'blah' < ./blah.txt
   blah.txt:1:blah
+
+Match across lines of piped input:
+
+  $ alias ag="$TESTDIR/../ag --noaffinity --nocolor --workers=1"
+  $ printf 'foo\nbar\nbaz\n' | ag 'bar\nbaz'
+  bar
+  baz
+
+And across separate writes:
+
+  $ (printf 'foo\nbar\n'; sleep 0.3; printf 'baz\nqux\n') | ag 'bar\nbaz'
+  bar
+  baz
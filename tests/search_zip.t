@@ -0,0 +1,85 @@
+Setup. Make a compressed file bigger than one block, with matches on both
+sides of the block boundaries:
+
+  $ . $TESTDIR/setup.sh
+  $ awk 'BEGIN { for (i = 1; i <= 100000; i++) { if (i % 16384 == 0) print "hello " i; else print "abcdefghijklmnopqrstuvwxyz0123" } }' > ./big.txt
+  $ ag -C 2 hello big.txt > ./expected.txt
+  $ gzip -c big.txt > ./big.txt.gz
+  $ xz -c big.txt > ./big.txt.xz
+
+Compressed files are searched like the file they hold:
+
+  $ ag -z -C 2 hello big.txt.gz | diff ./expected.txt -
+  $ ag -z -C 2 hello big.txt.xz | diff ./expected.txt -
+
+Counts and inverted matches carry over between blocks:
+
+  $ ag -z --count hello big.txt.gz
+  6
+  $ ag -z --count -v hello big.txt.gz
+  7
+
+Multiline matches are found inside a block:
+
+  $ printf 'foo\nbar\n' | gzip -c > ./small.gz
+  $ ag -z 'foo\nbar' small.gz
+  1:foo
+  2:bar
+
+And across blocks, here with "foo" at the end of the first 1MB and "bar" at the
+start of the next:
+
+  $ awk 'BEGIN { for (i = 1; i <= 37449; i++) print "abcdefghijklmnopqrstuvwxyz0"; print "foo"; print "bar" }' | gzip -c > ./split.gz
+  $ ag -z 'foo\nbar' split.gz
+  37450:foo
+  37451:bar
+
+--stats shows decompressing and searching separately:
+
+  $ ag -z --stats hello big.txt.gz | grep "compressed files"
+  1 compressed files: .* seconds decompressing, .* seconds searching (re)
+
+bzip2 files, including several streams in a row:
+
+  $ bzip2 -c big.txt > ./big.txt.bz2
+  $ ag -z -C 2 hello big.txt.bz2 | diff ./expected.txt -
+  $ cat ./big.txt.bz2 ./big.txt.bz2 > ./twice.bz2
+  $ ag -z --count hello twice.bz2
+  12
+
+Text that happens to start like a bzip2 header isn't taken for one:
+
+  $ printf 'BZh1 hello\n' > ./notbzip2.txt
+  $ ag -z hello notbzip2.txt
+  1:BZh1 hello
+
+Several gzip members in a row, as cat, pigz --independent and bgzip write
+them, are all searched, with line numbers running on across them:
+
+  $ awk 'BEGIN { srand(1); for (i = 1; i <= 200000; i++) print i, rand(), rand(), rand() }' > ./members.txt
+  $ ag 12345 members.txt > ./expected_members.txt
+  $ split -l 30000 members.txt part.
+  $ for f in part.*; do gzip -c $f; done > ./members.gz
+  $ ag -z 12345 members.gz | diff ./expected_members.txt -
+  $ printf 'trailing garbage' >> ./members.gz
+  $ ag -z 12345 members.gz | diff ./expected_members.txt -
+
+So are xz files made of several blocks:
+
+  $ xz -T2 --block-size=100KiB -c members.txt > ./members.xz
+  $ ag -z 12345 members.xz | diff ./expected_members.txt -
+
+--gzip-index indexes a single member the first time it's searched, and
+later searches use the index:
+
+  $ gzip -c members.txt > ./single.gz
+  $ ag -z --gzip-index --cache-dir ./cache 12345 single.gz | diff ./expected_members.txt -
+  $ ag -z --gzip-index --cache-dir ./cache --debug 12345 single.gz | grep "gzip index"
+  DEBUG: Loaded gzip index ./cache/gzip/.*: 1 checkpoints (re)
+  $ ag -z --gzip-index --cache-dir ./cache 12345 single.gz | diff ./expected_members.txt -
+
+Files with several members aren't indexed:
+
+  $ ag -z --gzip-index --cache-dir ./cache --debug 12345 members.gz | grep "gzip index"
+  DEBUG: No gzip index at ./cache/gzip/.* (re)
+  DEBUG: Not saving a gzip index: the file has several members
@@ -0,0 +1,20 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  > if ! command -v zstd > /dev/null; then
+  > echo "No zstd. Skipping test."
+  > exit 80
+  > fi
+  $ awk 'BEGIN { for (i = 1; i <= 100000; i++) { if (i % 16384 == 0) print "hello " i; else print "abcdefghijklmnopqrstuvwxyz0123" } }' > ./big.txt
+  $ ag -C 2 hello big.txt > ./expected.txt
+  $ zstd -q -c big.txt > ./big.txt.zst
+
+zstd files are searched like the file they hold:
+
+  $ ag -z -C 2 hello big.txt.zst | diff ./expected.txt -
+
+Including several frames in a row:
+
+  $ cat ./big.txt.zst ./big.txt.zst > ./twice.zst
+  $ ag -z --count hello twice.zst
+  12
@@ -0,0 +1,51 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ mkdir sub
+  $ printf 'foo\n' > a.txt
+  $ printf 'foo\n' > sub/b.txt
+  $ printf 'sub\n' > .ignore
+  $ SOCK=$(mktemp -d)/ag.sock
+  $ ag --server --socket $SOCK . &
+  $ while [ ! -S $SOCK ]; do sleep 0.1; done
+
+Searches go through the server:
+
+  $ ag --client --socket $SOCK --debug foo | grep "server's"
+  DEBUG: Searching the server's 1 files in .
+  $ ag --client --socket $SOCK foo
+  a.txt:1:foo
+  $ ag --client --socket $SOCK zzz
+  [1]
+
+It sees new files and changed ignore files:
+
+  $ printf 'foo\n' > c.txt
+  $ rm .ignore
+  $ ag --client --socket $SOCK foo | sort
+  a.txt:1:foo
+  c.txt:1:foo
+  sub/b.txt:1:foo
+
+Searches with different ignore rules walk instead:
+
+  $ ag --client --socket $SOCK --ignore c.txt --debug foo | grep "Walking instead"
+  DEBUG: This search doesn't filter files like the server does. Walking instead.
+
+Without a server, ag searches by itself:
+
+  $ kill $! && wait $! 2>/dev/null
+  [143]
+  $ ag --client --socket $SOCK foo | sort
+  a.txt:1:foo
+  c.txt:1:foo
+  sub/b.txt:1:foo
+
+It won't replace a file that isn't a socket:
+
+  $ printf 'keep\n' > keep.txt
+  $ ag --server --socket ./keep.txt . 2>&1
+  ERR: Can't listen on ./keep.txt: it exists and isn't a socket.
+  [1]
+  $ cat keep.txt
+  keep
@@ -0,0 +1,27 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ printf 'foo bar\n' > a.txt
+  $ printf 'nothing here\n' > b.txt
+  $ touch -t 202001010000 a.txt b.txt
+  $ ag --build-index
+  $ ls -A
+  .ag_index
+  a.txt
+  b.txt
+
+Files without the trigrams a match needs aren't searched:
+
+  $ ag foo
+  a.txt:1:foo bar
+  $ ag --debug 'fo+ ba|zzz' | grep "the index says"
+  DEBUG: Skipping ./b.txt: the index says it can't match
+  $ ag --noindex --debug foo | grep "the index says"
+  [1]
+
+Files that changed since they were indexed are searched again:
+
+  $ printf 'foo\n' >> b.txt
+  $ ag foo | sort
+  a.txt:1:foo bar
+  b.txt:2:foo
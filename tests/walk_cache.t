@@ -0,0 +1,63 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ mkdir -p ./sub ./cache
+  $ printf 'hello\n' > ./a.txt
+  $ printf 'hello\n' > ./sub/b.txt
+  $ printf 'hello\n' > ./sub/c.log
+  $ printf '*.log\n' > ./sub/.ignore
+  $ touch -d '1 hour ago' . ./sub
+
+Unchanged directories are replayed from the walk cache:
+
+  $ ag --walk-cache --cache-dir ./cache hello | sort
+  a.txt:1:hello
+  sub/b.txt:1:hello
+  $ test -s ./cache/walk
+  $ ag -D --walk-cache --cache-dir ./cache hello 2>&1 | grep "from the walk cache" | sort
+  DEBUG: Listing . from the walk cache
+  DEBUG: Listing ./sub from the walk cache
+  $ ag --walk-cache --cache-dir ./cache hello | sort
+  a.txt:1:hello
+  sub/b.txt:1:hello
+
+A new file changes the directory's mtime:
+
+  $ printf 'hello\n' > ./sub/d.txt
+  $ ag -D --walk-cache --cache-dir ./cache hello 2>&1 | grep "from the walk cache"
+  DEBUG: Listing . from the walk cache
+  $ ag --walk-cache --cache-dir ./cache hello | sort
+  a.txt:1:hello
+  sub/b.txt:1:hello
+  sub/d.txt:1:hello
+
+Editing an ignore file doesn't, but it's noticed anyway:
+
+  $ touch -d '1 hour ago' ./sub
+  $ ag --walk-cache --cache-dir ./cache hello > /dev/null
+  $ printf '*.txt\n' > ./sub/.ignore
+  $ ag --walk-cache --cache-dir ./cache hello | sort
+  a.txt:1:hello
+  sub/c.log:1:hello
+
+Other options filter differently, so they don't use the same entries:
+
+  $ ag -D --walk-cache --cache-dir ./cache -u hello 2>&1 | grep -c "from the walk cache"
+  0
+  [1]
+  $ ag --walk-cache --cache-dir ./cache -u hello | sort
+  a.txt:1:hello
+  sub/b.txt:1:hello
+  sub/c.log:1:hello
+  sub/d.txt:1:hello
+
+Neither does -z, which searches compressed files that are otherwise
+skipped as binary:
+
+  $ mkdir ./z
+  $ printf 'hello\n' | gzip -c > ./z/b.gz
+  $ touch -d '1 hour ago' ./z
+  $ ag --walk-cache --cache-dir ./cache hello z
+  [1]
+  $ ag --walk-cache --cache-dir ./cache -z hello z
+  z/b.gz:1:hello